@@ -27,6 +27,7 @@
 #include "absl/flags/flag.h"
 #include "absl/memory/memory.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
 #include "arm_app/arm_config.h"
 #include "arm_app/heatmap_view.h"
 #include "image_processor/image_utils.h"
@@ -88,6 +89,13 @@ void HeatmapView::LoadHeatmap(Heatmap* heatmap) {
     }
   }
 
+  {
+    absl::MutexLock unused_lock(&frame_mutex_);
+    loaded_frame_id_ = heatmap->frame_id();
+    loaded_capture_time_ =
+        absl::FromUnixMicros(heatmap->capture_timestamp_microseconds());
+  }
+
   // Notify Qt to redraw this widget.
   update();
 }
@@ -133,6 +141,15 @@ void HeatmapView::paintEvent(QPaintEvent* event) {
       }
     }
   }
+
+  // The paint is the last step the app sees. The display shows it at its next
+  // refresh, which adds up to a refresh period to the measured latency.
+  absl::MutexLock unused_lock(&frame_mutex_);
+  if (loaded_frame_id_ > 0) {
+    frame_latencies_.AddPresentedFrame(loaded_frame_id_, loaded_capture_time_,
+                                       absl::Now());
+    loaded_frame_id_ = 0;
+  }
 }
 
 void HeatmapView::CreateContourPolygons(const Heatmap& heatmap) {
@@ -17,14 +17,17 @@
 
 
 #include <QWidget>
+#include <cstdint>
 #include <memory>
 #include <vector>
 
 #include "opencv2/core.hpp"
 #include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
 #include "image_processor/inferer.h"
 #include "microdisplay_server/heatmap.pb.h"
 #include "microdisplay_server/heatmap_util.h"
+#include "microdisplay_server/inference_timings.h"
 
 namespace arm_app {
 
@@ -73,6 +76,13 @@ class HeatmapView : public QWidget {
   int heatmap_line_width_;
 
   microdisplay_server::HeatmapUtil heatmap_util_;
+
+  // Frame of the last loaded heatmap, until it is painted, and its capture
+  // time. The latencies are only used by the paint.
+  absl::Mutex frame_mutex_;
+  int64_t loaded_frame_id_ ABSL_GUARDED_BY(frame_mutex_) = 0;
+  absl::Time loaded_capture_time_ ABSL_GUARDED_BY(frame_mutex_);
+  microdisplay_server::FrameLatencies frame_latencies_;
 };
 
 }  // namespace arm_app
@@ -119,9 +119,11 @@ void Previewer::Start() {
   show();
 
   thread_ = std::make_unique<std::thread>([this]() {
+    // Frame shared with the inferer, which the preview and heatmap images are
+    // views of, and the copy of its input image the overlays are drawn on.
+    std::shared_ptr<const image_processor::InputOutputBuffers> frame;
     cv::Mat preview;
-    cv::Mat heatmap;
-    cv::Mat output_tensor;
+    cv::Mat preview_with_overlay;
     while (!to_exit_.load()) {
       if (!provider_) {
         LOG(WARNING) << "Preview provider not assigned";
@@ -133,20 +135,31 @@ void Previewer::Start() {
         // Since this preview update procedure runs in a separate thread,
         // another thread may be using the preview image for redraw
         // (e.g. when the windows is resized). Note that `preview_image_` and
-        // `preview` share data, so this lock must be held before `preview` is
-        // updated by the preview provider.
+        // `heatmap_image_` share data with `frame`, so these locks must be
+        // held before `frame` is updated by the preview provider.
         absl::MutexLock unused_preview_lock(&preview_image_mutex_);
         absl::MutexLock unused_heatmap_lock(&heatmap_image_mutex_);
-        tensorflow::Status result =
-            provider_(&preview, &heatmap, &output_tensor);
+        tensorflow::Status result = provider_(&frame);
         if (!result.ok()) {
           LOG(WARNING) << "Error on preview provider: " << result;
           std::this_thread::sleep_for(std::chrono::seconds(1));
           continue;
         }
+        const cv::Mat& heatmap = *frame->heatmap;
+        const cv::Mat& output_tensor = *frame->output_tensor;
+        // The frame is never written, so the overlays are drawn on a copy.
+        const bool display_inference = display_inference_;
+        const bool display_calibration_target = display_calibration_target_;
+        if (display_inference || display_calibration_target) {
+          frame->input_image->copyTo(preview_with_overlay);
+          preview = preview_with_overlay;
+        } else {
+          preview = *frame->input_image;
+        }
         {
           absl::MutexLock unused_snapshot_lock(&snapshot_mutex_);
-          RenderPreview(heatmap, output_tensor, display_inference_, &preview);
+          RenderPreview(heatmap, output_tensor, display_inference,
+                        display_calibration_target, &preview);
           take_snapshot_ = false;
         }
         preview_image_ =
@@ -163,6 +176,9 @@ void Previewer::Start() {
                 heatmap.ptr(), heatmap.cols, heatmap.rows, heatmap.step,
                 QImage::Format_Grayscale8);
           }
+        } else {
+          // The image may be a view of a frame the inferer reuses.
+          heatmap_image_.reset();
         }
       }
       counter_++;
@@ -290,7 +306,9 @@ void Previewer::RenderPreviewHeatmapContour(const cv::Mat& heatmap,
 
 void Previewer::RenderPreview(const cv::Mat& heatmap,
                               const cv::Mat& output_tensor,
-                              bool display_inference, cv::Mat* preview_image) {
+                              bool display_inference,
+                              bool display_calibration_target,
+                              cv::Mat* preview_image) {
   if (take_snapshot_) {
     std::string input_filename =
         absl::StrCat(snapshot_file_prefix_, "_", kInputFilename);
@@ -303,7 +321,7 @@ void Previewer::RenderPreview(const cv::Mat& heatmap,
     cv::imwrite(heatmap_filename, heatmap);
     StoreTensorAsJson(output_tensor_filename, output_tensor);
   }
-  if (display_calibration_target_) {
+  if (display_calibration_target) {
     image_processor::RenderCalibrationTarget(preview_image);
   } else if (display_inference) {
     RenderPreviewHeatmapContour(heatmap, output_tensor, preview_image);
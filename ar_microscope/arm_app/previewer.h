@@ -32,10 +32,9 @@
 
 namespace arm_app {
 
-// Function to provide the preview image in RGB format and the heatmap and
-// output tensor.
-using PreviewProvider =
-    std::function<tensorflow::Status(cv::Mat*, cv::Mat*, cv::Mat*)>;
+// Function to provide the frame of the preview image in RGB format and the
+// heatmap and output tensor.
+using PreviewProvider = image_processor::PreviewProvider;
 
 class Previewer : public QWidget {
  public:
@@ -70,7 +69,8 @@ class Previewer : public QWidget {
   // the preview window. A snapshot is taken of the various images if the
   // previewer is in snapshot mode.
   void RenderPreview(const cv::Mat& heatmap, const cv::Mat& output_tensor,
-                     bool display_inference, cv::Mat* preview_image);
+                     bool display_inference, bool display_calibration_target,
+                     cv::Mat* preview_image);
 
   // Renders the the heatmap contour on the preview image.
   void RenderPreviewHeatmapContour(const cv::Mat& heatmap,
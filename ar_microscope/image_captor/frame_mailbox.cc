@@ -0,0 +1,44 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_captor/frame_mailbox.h"
+
+namespace image_captor {
+
+FrameMailbox::FrameMailbox(int height, int width, int type) {
+  for (cv::Mat& buffer : buffers_) {
+    buffer.create(height, width, type);
+  }
+}
+
+bool FrameMailbox::Publish() {
+  // Release the written frame to the consumer, and acquire the buffer it has
+  // last released to the slot.
+  const uint32_t previous =
+      slot_.exchange(write_index_ | kNewFrame, std::memory_order_acq_rel);
+  write_index_ = previous & kIndexMask;
+  return !(previous & kNewFrame);
+}
+
+cv::Mat* FrameMailbox::TakeLatest() {
+  if (!HasNewFrame()) {
+    return nullptr;
+  }
+  const uint32_t previous =
+      slot_.exchange(read_index_, std::memory_order_acq_rel);
+  read_index_ = previous & kIndexMask;
+  return &buffers_[read_index_];
+}
+
+}  // namespace image_captor
@@ -0,0 +1,108 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#ifndef AR_MICROSCOPE_IMAGE_CAPTOR_FRAME_MAILBOX_H_
+#define AR_MICROSCOPE_IMAGE_CAPTOR_FRAME_MAILBOX_H_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#include "opencv2/core.hpp"
+#include "absl/time/time.h"
+#include "image_processor/debayer.h"
+
+namespace image_captor {
+
+// Identity and timing of a captured frame, which follow the frame through the
+// pipeline, so that its latency can be measured where it is displayed.
+struct FrameInfo {
+  // Sequence number of the frame, from 1 for the first frame of the captor.
+  // Gaps are frames that were captured but not returned.
+  int64_t id = 0;
+  // Time the device returned the frame. The exposure ended before it.
+  absl::Time capture_time = absl::InfinitePast();
+  // Exposure time of the frame, or -1 if unknown.
+  int exposure_time_microseconds = -1;
+  // Step of the exposure bracket the frame was captured for, or -1.
+  int bracket_step = -1;
+  // Time the capture waited for the device to return the frame, and time the
+  // frame took to debayer.
+  absl::Duration capture_wait = absl::ZeroDuration();
+  absl::Duration debayer_duration = absl::ZeroDuration();
+  // Per-channel statistics of the debayered frame, with no pixels if they
+  // were not gathered.
+  image_processor::ChannelStatistics channel_statistics;
+};
+
+// Single-slot mailbox that hands the latest frame from a producer thread to a
+// consumer thread without locks or copies. It owns three frame buffers: the
+// one the producer writes, the one in the slot, and the one the consumer
+// reads. Publishing swaps the written buffer into the slot, replacing the
+// frame there if it was not taken, so the consumer always gets the newest
+// frame and the producer never waits for it.
+//
+// One thread may call GetWriteBuffer and Publish, and one other thread
+// HasNewFrame and TakeLatest.
+class FrameMailbox {
+ public:
+  // Allocates the buffers for frames of the size and OpenCV type.
+  FrameMailbox(int height, int width, int type);
+
+  FrameMailbox(const FrameMailbox&) = delete;
+  FrameMailbox& operator=(const FrameMailbox&) = delete;
+
+  // Returns the buffer of the next frame. It stays owned by the producer until
+  // Publish.
+  cv::Mat* GetWriteBuffer() { return &buffers_[write_index_]; }
+
+  // Returns the info of the next frame, which is published with it.
+  FrameInfo* GetWriteInfo() { return &infos_[write_index_]; }
+
+  // Puts the written frame in the slot. Returns false if it replaced a frame
+  // that was not taken.
+  bool Publish();
+
+  // Returns whether a frame was published since the last TakeLatest.
+  bool HasNewFrame() const {
+    return slot_.load(std::memory_order_acquire) & kNewFrame;
+  }
+
+  // Takes the frame of the slot, if it is new, and returns it. Otherwise
+  // returns nullptr. The frame stays valid until the next call. The consumer
+  // may swap the buffer of the frame for another one, which the producer
+  // writes a later frame into, so that frames need not be copied out.
+  cv::Mat* TakeLatest();
+
+  // Returns the info of the frame returned by the last TakeLatest.
+  const FrameInfo& GetTakenInfo() const { return infos_[read_index_]; }
+
+ private:
+  // Flag of the slot value, set while the frame in the slot is not taken.
+  static constexpr uint32_t kNewFrame = 1 << 8;
+  static constexpr uint32_t kIndexMask = kNewFrame - 1;
+
+  std::array<cv::Mat, 3> buffers_;
+  std::array<FrameInfo, 3> infos_;
+  // Owned by the producer.
+  uint32_t write_index_ = 0;
+  // Owned by the consumer.
+  uint32_t read_index_ = 1;
+  // Index of the buffer in the slot, with kNewFrame.
+  std::atomic<uint32_t> slot_ = {2};
+};
+
+}  // namespace image_captor
+
+#endif  // AR_MICROSCOPE_IMAGE_CAPTOR_FRAME_MAILBOX_H_
@@ -0,0 +1,94 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_captor/frame_mailbox.h"
+
+#include <cstdint>
+#include <thread>  // NOLINT
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "opencv2/core.hpp"
+
+namespace {
+
+using image_captor::FrameMailbox;
+
+using ::testing::Eq;
+using ::testing::Gt;
+using ::testing::IsNull;
+using ::testing::NotNull;
+
+// Writes the frame number to every pixel of the write buffer, and publishes
+// it.
+bool PublishFrame(int frame, FrameMailbox* mailbox) {
+  mailbox->GetWriteBuffer()->setTo(cv::Scalar(frame));
+  mailbox->GetWriteInfo()->id = frame;
+  return mailbox->Publish();
+}
+
+TEST(FrameMailboxTest, TakesLatestFrame) {
+  FrameMailbox mailbox(4, 6, CV_32SC1);
+  EXPECT_FALSE(mailbox.HasNewFrame());
+  EXPECT_THAT(mailbox.TakeLatest(), IsNull());
+
+  EXPECT_TRUE(PublishFrame(1, &mailbox));
+  EXPECT_TRUE(mailbox.HasNewFrame());
+  const cv::Mat* frame = mailbox.TakeLatest();
+  ASSERT_THAT(frame, NotNull());
+  EXPECT_THAT(frame->rows, Eq(4));
+  EXPECT_THAT(frame->cols, Eq(6));
+  EXPECT_THAT(frame->at<int32_t>(3, 5), Eq(1));
+  EXPECT_THAT(mailbox.GetTakenInfo().id, Eq(1));
+  EXPECT_FALSE(mailbox.HasNewFrame());
+  EXPECT_THAT(mailbox.TakeLatest(), IsNull());
+
+  // Frame 2 is replaced before it is taken.
+  EXPECT_TRUE(PublishFrame(2, &mailbox));
+  EXPECT_FALSE(PublishFrame(3, &mailbox));
+  // The taken frame is not written while it is held.
+  EXPECT_THAT(frame->at<int32_t>(0, 0), Eq(1));
+  frame = mailbox.TakeLatest();
+  ASSERT_THAT(frame, NotNull());
+  EXPECT_THAT(frame->at<int32_t>(0, 0), Eq(3));
+  EXPECT_THAT(mailbox.GetTakenInfo().id, Eq(3));
+}
+
+TEST(FrameMailboxTest, ConcurrentFrames) {
+  constexpr int kNumFrames = 20000;
+  FrameMailbox mailbox(16, 16, CV_32SC1);
+  std::thread producer([&mailbox]() {
+    for (int i = 1; i <= kNumFrames; i++) {
+      PublishFrame(i, &mailbox);
+    }
+  });
+  int last_frame = 0;
+  while (last_frame < kNumFrames) {
+    const cv::Mat* frame = mailbox.TakeLatest();
+    if (!frame) continue;
+    // Frames are whole, and newer than the last one.
+    const int32_t number = frame->at<int32_t>(0, 0);
+    ASSERT_THAT(number, Gt(last_frame));
+    for (int y = 0; y < frame->rows; y++) {
+      for (int x = 0; x < frame->cols; x++) {
+        ASSERT_THAT(frame->at<int32_t>(y, x), Eq(number));
+      }
+    }
+    ASSERT_THAT(mailbox.GetTakenInfo().id, Eq(number));
+    last_frame = number;
+  }
+  producer.join();
+}
+
+}  // namespace
@@ -14,12 +14,32 @@
 // =============================================================================
 #include "image_captor/image_captor.h"
 
+#include <chrono>
+#include <memory>
+#include <utility>
+
+#include "absl/flags/flag.h"
+#include "absl/time/clock.h"
 #include "tensorflow/core/lib/core/errors.h"
 #include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/platform/logging.h"
+
+ABSL_FLAG(bool, auto_white_balance, false,
+          "Adjusts the white balance gains of the debayer from the statistics "
+          "of each image. The initial gains are the device defaults.");
 
 namespace image_captor {
 
+ImageCaptor::ImageCaptor()
+    : auto_white_balance_(absl::GetFlag(FLAGS_auto_white_balance)) {
+  debayer_.SetCollectStatistics(auto_white_balance_);
+}
+
 ImageCaptor::~ImageCaptor() {
+  // The derived captor is already destroyed, so the capture thread would use
+  // it after free.
+  CHECK(capture_thread_ == nullptr)
+      << "The asynchronous capture must be stopped by the derived captor.";
   tensorflow::Status status = Finalize();
   if (!status.ok()) {
     LOG(ERROR) << "Image captor finalize error: " << status;
@@ -28,16 +48,62 @@ ImageCaptor::~ImageCaptor() {
 
 tensorflow::Status ImageCaptor::GetImage(
     bool is_rgb, cv::Mat* output, std::function<void()> on_image_captured) {
+  tensorflow::Status status =
+      capture_thread_
+          ? GetAsyncImage(is_rgb, output, std::move(on_image_captured))
+          : CaptureAndDebayer(is_rgb, output, &last_frame_info_,
+                              std::move(on_image_captured));
+  if (!status.ok() || last_frame_info_.bracket_step >= 0) {
+    absl::MutexLock unused_lock(&bracket_mutex_);
+    // Errors cancel the bracket, as its frames may be lost.
+    if (!status.ok() ||
+        last_frame_info_.bracket_step + 1 ==
+            static_cast<int>(bracket_exposure_times_.size())) {
+      bracket_exposure_times_.clear();
+      bracket_step_ = 0;
+    }
+  }
+  return status;
+}
+
+tensorflow::Status ImageCaptor::CaptureAndDebayer(
+    bool is_rgb, cv::Mat* output, FrameInfo* frame_info,
+    std::function<void()> on_image_captured) {
+  PreparedBracketStep prepared_step;
+  TF_RETURN_IF_ERROR(PrepareBracketFrame(&prepared_step));
   uint8_t* raw_image;
+  const absl::Time wait_start_time = absl::Now();
   TF_RETURN_IF_ERROR(CaptureImage(&raw_image));
+  frame_info->id = ++num_captured_frames_;
+  frame_info->capture_time = absl::Now();
+  frame_info->capture_wait = frame_info->capture_time - wait_start_time;
+  TagCapturedFrame(prepared_step, frame_info);
+  if (recorder_) {
+    RecordImage(raw_image, frame_info->exposure_time_microseconds);
+  }
 
   if (on_image_captured) {
     on_image_captured();
   }
 
-  cv::Mat bayer_image(GetSensorHeight(), GetSensorWidth(), GetOpenCvPixelType(),
-                      raw_image);
-  tensorflow::Status status = debayer_.HalfDebayer(bayer_image, is_rgb, output);
+  const absl::Time debayer_start_time = absl::Now();
+  cv::Mat bayer_image;
+  image_processor::BayerPacking packing;
+  tensorflow::Status status =
+      ReadOutBayerImage(raw_image, &bayer_image, &packing);
+  if (status.ok()) {
+    debayer_.SetBayerPacking(packing);
+    status = debayer_.Convert(bayer_image, GetBayerPattern(), debayer_mode_,
+                              is_rgb, output);
+  }
+  frame_info->channel_statistics = image_processor::ChannelStatistics();
+  if (status.ok() && debayer_.IsCollectingStatistics()) {
+    frame_info->channel_statistics = debayer_.GetStatistics();
+  }
+  if (status.ok() && auto_white_balance_) {
+    UpdateWhiteBalance(frame_info->channel_statistics);
+  }
+  frame_info->debayer_duration = absl::Now() - debayer_start_time;
 
   tensorflow::Status release_result = ReleaseImage();
   if (!release_result.ok()) {
@@ -47,6 +113,341 @@ tensorflow::Status ImageCaptor::GetImage(
   return status;
 }
 
+tensorflow::Status ImageCaptor::GetBayerImage(cv::Mat* output) {
+  if (capture_thread_) {
+    return tensorflow::errors::FailedPrecondition(
+        "Bayer images are not available with the asynchronous capture.");
+  }
+  uint8_t* raw_image;
+  TF_RETURN_IF_ERROR(CaptureImage(&raw_image));
+  cv::Mat bayer_image;
+  image_processor::BayerPacking packing;
+  tensorflow::Status status =
+      ReadOutBayerImage(raw_image, &bayer_image, &packing);
+  if (status.ok()) {
+    debayer_.SetBayerPacking(packing);
+    status = debayer_.UnpackBayerImage(bayer_image, output);
+  }
+  tensorflow::Status release_result = ReleaseImage();
+  if (!release_result.ok()) {
+    return release_result;
+  }
+  return status;
+}
+
+cv::Mat ImageCaptor::WrapBayerImage(uint8_t* raw_image) {
+  const image_processor::BayerPacking packing = GetBayerPacking();
+  const cv::Size size = GetBayerSize(hardware_readout_mode_);
+  if (packing == image_processor::BayerPacking::NONE) {
+    return cv::Mat(size.height, size.width, GetOpenCvPixelType(), raw_image);
+  }
+  // Rows of packed pixel groups.
+  return cv::Mat(size.height,
+                 size.width / image_processor::GetPackedGroupPixels(packing) *
+                     image_processor::GetPackedGroupBytes(packing),
+                 CV_8UC1, raw_image);
+}
+
+tensorflow::Status ImageCaptor::ReadOutBayerImage(
+    uint8_t* raw_image, cv::Mat* bayer_image,
+    image_processor::BayerPacking* packing) {
+  *bayer_image = WrapBayerImage(raw_image);
+  *packing = GetBayerPacking();
+  if (software_readout_mode_ == ReadoutMode()) {
+    return tensorflow::Status();
+  }
+  if (*packing != image_processor::BayerPacking::NONE) {
+    debayer_.SetBayerPacking(*packing);
+    TF_RETURN_IF_ERROR(
+        debayer_.UnpackBayerImage(*bayer_image, &unpacked_image_));
+    *bayer_image = unpacked_image_;
+    *packing = image_processor::BayerPacking::NONE;
+  }
+  if (software_readout_mode_.roi.area() > 0) {
+    *bayer_image = (*bayer_image)(software_readout_mode_.roi);
+  }
+  if (software_readout_mode_.subsampling != Subsampling::NONE) {
+    TF_RETURN_IF_ERROR(SubsampleBayerImage(
+        *bayer_image, software_readout_mode_.subsampling,
+        software_readout_mode_.factor, &subsampled_image_));
+    *bayer_image = subsampled_image_;
+  }
+  return tensorflow::Status();
+}
+
+tensorflow::Status ImageCaptor::SetReadoutMode(const ReadoutMode& mode) {
+  if (capture_thread_) {
+    return tensorflow::errors::FailedPrecondition(
+        "Cannot change the readout during the asynchronous capture.");
+  }
+  TF_RETURN_IF_ERROR(
+      CheckReadoutMode(mode, GetSensorWidth(), GetSensorHeight()));
+  const ReadoutCapabilities capabilities = GetReadoutCapabilities();
+  ReadoutMode hardware_mode;
+  ReadoutMode software_mode;
+  if (mode.subsampling != Subsampling::NONE) {
+    ReadoutMode* subsampling_mode =
+        capabilities.SupportsSubsampling(mode.subsampling, mode.factor)
+            ? &hardware_mode
+            : &software_mode;
+    subsampling_mode->subsampling = mode.subsampling;
+    subsampling_mode->factor = mode.factor;
+  }
+  if (capabilities.roi) {
+    hardware_mode.roi = mode.roi;
+  } else if (mode.roi.area() > 0) {
+    // The window is aligned to the subsampling, so it can be taken after the
+    // subsampling of the device.
+    const int factor = hardware_mode.factor;
+    software_mode.roi =
+        cv::Rect(mode.roi.x / factor, mode.roi.y / factor,
+                 mode.roi.width / factor, mode.roi.height / factor);
+  }
+  if (hardware_mode != hardware_readout_mode_) {
+    if (recorder_) {
+      return tensorflow::errors::FailedPrecondition(
+          "Cannot change the readout of the device while recording.");
+    }
+    TF_RETURN_IF_ERROR(SetHardwareReadoutMode(hardware_mode));
+    hardware_readout_mode_ = hardware_mode;
+  }
+  software_readout_mode_ = software_mode;
+  readout_mode_ = mode;
+  return tensorflow::Status();
+}
+
+tensorflow::Status ImageCaptor::StartRecording(const std::string& path,
+                                              int64_t max_frames,
+                                              int num_buffers) {
+  if (recorder_) {
+    return tensorflow::errors::FailedPrecondition("Already recording.");
+  }
+  if (capture_thread_) {
+    return tensorflow::errors::FailedPrecondition(
+        "Cannot start recording during the asynchronous capture.");
+  }
+  // The frames are recorded as captured, before the software readout.
+  const cv::Size size = GetBayerSize(hardware_readout_mode_);
+  return RawRecorder::Create(
+      path,
+      MakeRawRecordingHeader(size.width, size.height, GetBytesPerPixel(),
+                             GetBayerPacking(), GetBayerPattern()),
+      max_frames, num_buffers, &recorder_);
+}
+
+tensorflow::Status ImageCaptor::StopRecording() {
+  if (!recorder_) {
+    return tensorflow::errors::FailedPrecondition("Not recording.");
+  }
+  if (capture_thread_) {
+    return tensorflow::errors::FailedPrecondition(
+        "Cannot stop recording during the asynchronous capture.");
+  }
+  tensorflow::Status status = recorder_->Close();
+  recorder_.reset();
+  return status;
+}
+
+void ImageCaptor::RecordImage(const uint8_t* raw_image,
+                              int exposure_time_microseconds) {
+  RawFrameHeader frame_header = {};
+  frame_header.timestamp_microseconds =
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count();
+  frame_header.exposure_time_microseconds = exposure_time_microseconds;
+  recorder_->AddFrame(raw_image, frame_header);
+}
+
+tensorflow::Status ImageCaptor::StartExposureBracket(
+    std::vector<int> exposure_times) {
+  for (const int exposure_time : exposure_times) {
+    if (exposure_time <= 0) {
+      return tensorflow::errors::InvalidArgument(
+          "Invalid exposure time of the bracket.");
+    }
+  }
+  if (exposure_times.empty()) {
+    return tensorflow::errors::InvalidArgument("Empty exposure bracket.");
+  }
+  absl::MutexLock unused_lock(&bracket_mutex_);
+  if (!bracket_exposure_times_.empty()) {
+    return tensorflow::errors::FailedPrecondition(
+        "Exposure bracket already started.");
+  }
+  bracket_exposure_times_ = std::move(exposure_times);
+  num_brackets_++;
+  bracket_step_ = 0;
+  bracket_exposure_set_ = false;
+  return tensorflow::Status();
+}
+
+bool ImageCaptor::IsBracketingExposure() const {
+  absl::MutexLock unused_lock(&bracket_mutex_);
+  return !bracket_exposure_times_.empty();
+}
+
+tensorflow::Status ImageCaptor::PrepareBracketFrame(
+    PreparedBracketStep* prepared_step) {
+  absl::MutexLock unused_lock(&bracket_mutex_);
+  if (bracket_step_ == static_cast<int>(bracket_exposure_times_.size())) {
+    return tensorflow::Status();
+  }
+  if (!bracket_exposure_set_) {
+    const tensorflow::Status status =
+        SetExposureTime(bracket_exposure_times_[bracket_step_]);
+    if (!status.ok()) {
+      bracket_exposure_times_.clear();
+      bracket_step_ = 0;
+      return status;
+    }
+    bracket_exposure_set_ = true;
+    bracket_latency_frames_ = GetExposureLatencyFrames();
+  }
+  prepared_step->bracket = num_brackets_;
+  prepared_step->step = bracket_step_;
+  return tensorflow::Status();
+}
+
+void ImageCaptor::TagCapturedFrame(const PreparedBracketStep& prepared_step,
+                                   FrameInfo* frame_info) {
+  frame_info->bracket_step = -1;
+  absl::MutexLock unused_lock(&bracket_mutex_);
+  if (prepared_step.step < 0 || prepared_step.bracket != num_brackets_ ||
+      prepared_step.step != bracket_step_) {
+    // No exposure of the bracket was set before the capture, so the frame has
+    // the exposure of the device.
+    frame_info->exposure_time_microseconds = GetExposureTimeInMicroseconds();
+    return;
+  }
+  if (bracket_latency_frames_ > 0) {
+    // The frame may have any exposure between the previous and the new one.
+    bracket_latency_frames_--;
+    frame_info->exposure_time_microseconds = -1;
+    return;
+  }
+  frame_info->bracket_step = bracket_step_;
+  frame_info->exposure_time_microseconds =
+      bracket_exposure_times_[bracket_step_];
+  bracket_exposure_set_ = false;
+  bracket_step_++;
+}
+
+tensorflow::Status ImageCaptor::StartAsyncCapture(bool is_rgb) {
+  if (capture_thread_) {
+    return tensorflow::errors::FailedPrecondition(
+        "Asynchronous capture already started.");
+  }
+  mailbox_ = std::make_unique<FrameMailbox>(GetImageHeight(), GetImageWidth(),
+                                            CV_8UC3);
+  async_is_rgb_ = is_rgb;
+  num_dropped_async_images_.store(0);
+  StartCaptureThread();
+  return tensorflow::Status();
+}
+
+void ImageCaptor::StopAsyncCapture() {
+  if (!capture_thread_) {
+    return;
+  }
+  {
+    absl::MutexLock unused_lock(&async_mutex_);
+    stop_async_capture_.store(true);
+    async_image_taken_.Signal();
+  }
+  capture_thread_->join();
+  capture_thread_.reset();
+  mailbox_.reset();
+  {
+    // The frames of the bracket in the mailbox are lost.
+    absl::MutexLock unused_lock(&bracket_mutex_);
+    bracket_exposure_times_.clear();
+    bracket_step_ = 0;
+  }
+  absl::MutexLock unused_lock(&async_mutex_);
+  async_status_ = tensorflow::Status();
+}
+
+void ImageCaptor::StartCaptureThread() {
+  stop_async_capture_.store(false);
+  capture_thread_ = std::make_unique<std::thread>([this]() { CaptureLoop(); });
+}
+
+void ImageCaptor::CaptureLoop() {
+  while (!stop_async_capture_.load()) {
+    tensorflow::Status status =
+        CaptureAndDebayer(async_is_rgb_, mailbox_->GetWriteBuffer(),
+                          mailbox_->GetWriteInfo(), /*on_image_captured=*/{});
+    const bool is_bracket_frame = mailbox_->GetWriteInfo()->bracket_step >= 0;
+    if (status.ok() && !mailbox_->Publish()) {
+      num_dropped_async_images_++;
+    }
+    // The mailbox is not guarded by the lock, which only keeps the wake up
+    // from slipping in between the check and the wait of GetAsyncImage.
+    absl::MutexLock unused_lock(&async_mutex_);
+    async_image_ready_.Signal();
+    if (!status.ok()) {
+      async_status_ = status;
+      return;
+    }
+    // Every frame of a bracket is returned, so the next capture waits for
+    // the frame to be taken.
+    while (is_bracket_frame && mailbox_->HasNewFrame() &&
+           !stop_async_capture_.load()) {
+      async_image_taken_.Wait(&async_mutex_);
+    }
+  }
+}
+
+tensorflow::Status ImageCaptor::GetAsyncImage(
+    bool is_rgb, cv::Mat* output, std::function<void()> on_image_captured) {
+  if (is_rgb != async_is_rgb_) {
+    return tensorflow::errors::InvalidArgument(
+        "Asynchronous capture started with the other color order.");
+  }
+  tensorflow::Status status;
+  {
+    absl::MutexLock unused_lock(&async_mutex_);
+    while (!IsAsyncImageReady()) {
+      async_image_ready_.Wait(&async_mutex_);
+    }
+    // The images captured before the error are returned first.
+    if (!mailbox_->HasNewFrame()) {
+      std::swap(status, async_status_);
+    }
+  }
+  if (!status.ok()) {
+    // The capture is retried by the next call, as without the asynchronous
+    // capture.
+    capture_thread_->join();
+    StartCaptureThread();
+    return status;
+  }
+
+  cv::Mat* image = mailbox_->TakeLatest();
+  {
+    absl::MutexLock unused_lock(&async_mutex_);
+    async_image_taken_.Signal();
+  }
+  if (on_image_captured) {
+    on_image_captured();
+  }
+  // The capture thread debayers into the buffer of output once the mailbox
+  // hands it out again.
+  std::swap(*image, *output);
+  last_frame_info_ = mailbox_->GetTakenInfo();
+  return tensorflow::Status();
+}
+
+void ImageCaptor::UpdateWhiteBalance(
+    const image_processor::ChannelStatistics& statistics) {
+  double red_gain, green_gain, blue_gain;
+  debayer_.GetRgbGains(&red_gain, &green_gain, &blue_gain);
+  if (white_balance_controller_.Update(statistics, &red_gain, &blue_gain)) {
+    debayer_.SetRgbGains(red_gain, green_gain, blue_gain);
+  }
+}
+
 int ImageCaptor::GetOpenCvPixelType() {
   switch (GetBytesPerPixel()) {
     case 1:
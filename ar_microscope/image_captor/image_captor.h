@@ -15,10 +15,23 @@
 #ifndef AR_MICROSCOPE_IMAGE_CAPTOR_IMAGE_CAPTOR_H_
 #define AR_MICROSCOPE_IMAGE_CAPTOR_IMAGE_CAPTOR_H_
 
+#include <atomic>
+#include <cstdint>
 #include <functional>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
 
 #include "opencv2/core.hpp"
+#include "absl/synchronization/mutex.h"
+#include "image_captor/frame_mailbox.h"
+#include "image_captor/raw_recorder.h"
+#include "image_captor/readout_mode.h"
+#include "image_captor/white_balance_controller.h"
 #include "image_processor/debayer.h"
+#include "image_processor/defect_map.h"
+#include "image_processor/flat_field.h"
 #include "tensorflow/core/lib/core/status.h"
 #include "tensorflow/core/platform/errors.h"
 
@@ -34,7 +47,13 @@ class ImageCaptor {
 
   // Captures image from the device, and copy to output. It allocates
   // memory for cv::Mat if necessary. If is_rgb is true, the output image
-  // is in RGB format (with each color 8-bit), otherwise BGR.
+  // is in RGB format (with each color 8-bit), otherwise BGR. With the
+  // asynchronous capture, this returns the newest image of the capture
+  // thread instead, waiting for one if none was captured since the last call.
+  // The image is not copied: output is swapped with the buffer the image was
+  // debayered into, and the capture thread debayers a later image into the
+  // previous buffer of output. That buffer must stay allocated until the
+  // capture stops, and the caller must not use it anymore.
   // Args:
   //   is_rgb:  Boolean to indicate whether the output format if RGB or BGR.
   //   output: The output image.
@@ -44,14 +63,156 @@ class ImageCaptor {
       bool is_rgb, cv::Mat* output,
       std::function<void()> on_image_captured = [] {});
 
+  // Returns the identity and timing of the image of the last GetImage.
+  const FrameInfo& GetLastFrameInfo() const { return last_frame_info_; }
+
+  // Captures the raw Bayer image from the device, and copies it to output,
+  // without any correction. Packed images are unpacked to 16-bit pixels. This
+  // is used for calibration, and is not available with the asynchronous
+  // capture.
+  tensorflow::Status GetBayerImage(cv::Mat* output);
+
+  // Starts recording the raw Bayer images captured by GetImage, with their
+  // capture time and exposure, to a file that can be replayed by
+  // ReplayCaptor. Recording never holds up capture: while the disk falls
+  // behind, or once max_frames frames are recorded, frames are dropped.
+  //
+  // Args:
+  //   path: Path of the recording.
+  //   max_frames: Number of frames the file is preallocated for.
+  //   num_buffers: Number of frames that may wait to be written.
+  tensorflow::Status StartRecording(const std::string& path,
+                                    int64_t max_frames, int num_buffers);
+
+  // Finishes the recording started by StartRecording.
+  tensorflow::Status StopRecording();
+
+  // Starts capturing and debayering the images on a dedicated thread, so
+  // that capture overlaps with the processing of the previous image by the
+  // caller of GetImage. The images go through a FrameMailbox, and images the
+  // caller is too busy to take are dropped. The debayer mode, flat-field,
+  // field of view and recording must not be changed while the thread runs,
+  // and it must be stopped before the derived captor is destroyed, which is
+  // done at the start of its destructor.
+  //
+  // Args:
+  //   is_rgb: Output format of the images, as the argument of GetImage.
+  tensorflow::Status StartAsyncCapture(bool is_rgb);
+
+  // Stops the thread started by StartAsyncCapture, if any. Must not be called
+  // while GetImage waits.
+  void StopAsyncCapture();
+
+  bool IsAsyncCaptureRunning() const { return capture_thread_ != nullptr; }
+
+  // Captures one frame at each of the exposure times, in order, for the
+  // following calls of GetImage. The frames are tagged with the step of the
+  // bracket and their exposure time in their FrameInfo, and the frames
+  // captured while an exposure is not applied yet are tagged with an unknown
+  // exposure. The asynchronous capture does not drop the frames of the
+  // bracket. The exposure is left at the last step, and auto-exposure off.
+  // May be called from any thread.
+  tensorflow::Status StartExposureBracket(std::vector<int> exposure_times);
+
+  // Returns whether the last frame of the exposure bracket is not returned by
+  // GetImage yet. Errors of GetImage and StopAsyncCapture cancel the bracket.
+  bool IsBracketingExposure() const;
+
+  // Returns the number of images of the asynchronous capture replaced by a
+  // newer image before GetImage took them.
+  int64_t GetNumDroppedAsyncImages() const {
+    return num_dropped_async_images_.load();
+  }
+
+  // Returns the number of frames the device captured but dropped before
+  // CaptureImage because the caller was too slow, or 0 if unknown. Must not
+  // be called during the asynchronous capture.
+  virtual int64_t GetNumDroppedFrames() const { return 0; }
+
   // Returns height and width of the sensor, which is equal to the dimension
-  // of the Bayer pattern image.
+  // of the Bayer pattern image of the whole sensor at full resolution.
   virtual int GetSensorHeight() = 0;
   virtual int GetSensorWidth() = 0;
+  // Returns height and width of the Bayer pattern image of the readout mode.
+  int GetBayerHeight() { return GetBayerSize(readout_mode_).height; }
+  int GetBayerWidth() { return GetBayerSize(readout_mode_).width; }
   // Returns height and width of the RGB image. By default, it's the half
-  // size of the sensor because we assume HalfDebayer.
-  virtual int GetImageHeight() { return GetSensorHeight() / 2; }
-  virtual int GetImageWidth() { return GetSensorWidth() / 2; }
+  // size of the Bayer image because we assume HalfDebayer, and the size of
+  // the Bayer image with the full resolution debayer modes.
+  virtual int GetImageHeight() {
+    return debayer_mode_ == image_processor::DebayerMode::HALF
+               ? GetBayerHeight() / 2
+               : GetBayerHeight();
+  }
+  virtual int GetImageWidth() {
+    return debayer_mode_ == image_processor::DebayerMode::HALF
+               ? GetBayerWidth() / 2
+               : GetBayerWidth();
+  }
+
+  // Returns the readout the device supports in hardware. By default, none.
+  virtual ReadoutCapabilities GetReadoutCapabilities() {
+    return ReadoutCapabilities();
+  }
+
+  // Sets the readout mode of the Bayer images. The parts of the mode the
+  // device does not support are emulated in software, which saves the
+  // debayer of the unused pixels but not their capture. This changes the
+  // image dimension, so it should be called between frames, and not during
+  // the asynchronous capture.
+  tensorflow::Status SetReadoutMode(const ReadoutMode& mode);
+
+  const ReadoutMode& GetReadoutMode() const { return readout_mode_; }
+
+  // Sets how GetImage turns the Bayer image into the RGB image. This changes
+  // the image dimension, so it should be called between frames.
+  void SetDebayerMode(image_processor::DebayerMode mode) {
+    debayer_mode_ = mode;
+  }
+
+  // Sets the flat-field calibration of the current objective, or nullptr for
+  // none. It must match the Bayer image of the readout mode. This should be
+  // called between frames.
+  void SetFlatField(
+      std::shared_ptr<const image_processor::FlatField> flat_field) {
+    debayer_.SetFlatField(std::move(flat_field));
+  }
+
+  // Sets the defect pixel map of the sensor, or nullptr for none. It must
+  // match the Bayer image of the readout mode. This should be called between
+  // frames.
+  void SetDefectMap(
+      std::shared_ptr<const image_processor::DefectMap> defect_map) {
+    debayer_.SetDefectMap(std::move(defect_map));
+  }
+
+  // Sets the circular field of view of the RGB image, or nullptr for the whole
+  // image. Pixels outside it are not debayered. It must match the image
+  // dimension of the debayer mode. This should be called between frames.
+  void SetFieldOfView(
+      std::shared_ptr<const image_processor::FieldOfView> field_of_view) {
+    debayer_.SetFieldOfView(std::move(field_of_view));
+  }
+
+  // Enables gathering per-channel statistics of the debayered images. They
+  // are always gathered with --auto_white_balance, and returned in the
+  // FrameInfo of each image.
+  void SetCollectStatistics(bool collect) {
+    debayer_.SetCollectStatistics(collect || auto_white_balance_);
+  }
+
+
+  // Returns the color filter layout of the sensor.
+  virtual image_processor::BayerPattern GetBayerPattern() {
+    return image_processor::BayerPattern::RGGB;
+  }
+
+  // Returns how the Bayer pixels of the captured images are packed. Packed
+  // images are unpacked row by row during debayer, which saves the capture
+  // bandwidth of the unused bits of 16-bit pixels.
+  virtual image_processor::BayerPacking GetBayerPacking() {
+    return image_processor::BayerPacking::NONE;
+  }
 
   virtual bool SupportsAutoExposure() { return false; }
 
@@ -77,18 +238,139 @@ class ImageCaptor {
 
   virtual tensorflow::Status ReleaseImage() { return tensorflow::Status(); }
 
-  // Returns bytes per single Bayer pattern pixel.
+  // Returns bytes per single Bayer pattern pixel. With packed images, this is
+  // the size of the unpacked pixel.
   virtual int GetBytesPerPixel() = 0;
 
   // Pixel type for Bayer image.
   virtual int GetOpenCvPixelType();
 
+  // Returns the number of frames the device still captures with the previous
+  // exposure time after SetExposureTime returns.
+  virtual int GetExposureLatencyFrames() { return 2; }
+
   virtual tensorflow::Status SetRgbGains(double red_gain, double green_gain,
                                          double blue_gain) {
     return tensorflow::Status();
   }
 
+  // Sets the readout mode of the device, which is only given the parts of
+  // GetReadoutCapabilities. CaptureImage then returns images of the size of
+  // the mode.
+  virtual tensorflow::Status SetHardwareReadoutMode(const ReadoutMode& mode) {
+    return mode == ReadoutMode()
+               ? tensorflow::Status()
+               : tensorflow::errors::Unimplemented(
+                     "Readout mode not supported.");
+  }
+
+  ImageCaptor();
+
+  // Wraps the captured image, in the layout of GetBayerPacking.
+  cv::Mat WrapBayerImage(uint8_t* raw_image);
+
+  // Returns the size of the Bayer image of the sensor in the readout mode.
+  cv::Size GetBayerSize(const ReadoutMode& mode) {
+    return GetReadoutSize(mode, GetSensorWidth(), GetSensorHeight());
+  }
+
   image_processor::Debayer debayer_;
+
+  image_processor::DebayerMode debayer_mode_ =
+      image_processor::DebayerMode::HALF;
+
+ private:
+  // Updates the debayer gains from the statistics of the last image.
+  void UpdateWhiteBalance(const image_processor::ChannelStatistics& statistics);
+
+  // Queues the captured image with its tagged exposure time, or -1 if
+  // unknown, for recording.
+  void RecordImage(const uint8_t* raw_image, int exposure_time_microseconds);
+
+  // Step of an exposure bracket whose exposure was set before a capture
+  // started, or step -1 if none.
+  struct PreparedBracketStep {
+    int64_t bracket = 0;
+    int step = -1;
+  };
+
+  // Applies the exposure of the next step of the bracket, if needed, before
+  // a capture, and returns the step the capture is prepared for.
+  tensorflow::Status PrepareBracketFrame(PreparedBracketStep* prepared_step);
+
+  // Fills the exposure and the bracket step of a captured frame. Only a frame
+  // prepared for the current step of the bracket may be tagged with it, since
+  // a bracket started during the capture of a frame did not set its exposure.
+  void TagCapturedFrame(const PreparedBracketStep& prepared_step,
+                        FrameInfo* frame_info);
+
+  // Returns the Bayer image of the readout mode from the captured image,
+  // with the readout the device does not support applied. The image may be
+  // unpacked to do so.
+  tensorflow::Status ReadOutBayerImage(uint8_t* raw_image, cv::Mat* bayer_image,
+                                       image_processor::BayerPacking* packing);
+
+  // Captures and debayers an image, which GetImage does without the
+  // asynchronous capture, and fills the info of the frame.
+  tensorflow::Status CaptureAndDebayer(bool is_rgb, cv::Mat* output,
+                                       FrameInfo* frame_info,
+                                       std::function<void()> on_image_captured);
+
+  // Returns the newest image of the capture thread.
+  tensorflow::Status GetAsyncImage(bool is_rgb, cv::Mat* output,
+                                   std::function<void()> on_image_captured);
+
+  void StartCaptureThread();
+
+  // Captures images into the mailbox until stopped or until an error.
+  void CaptureLoop();
+
+  bool IsAsyncImageReady() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(async_mutex_) {
+    return mailbox_->HasNewFrame() || !async_status_.ok();
+  }
+
+  const bool auto_white_balance_;
+  WhiteBalanceController white_balance_controller_;
+
+  std::unique_ptr<RawRecorder> recorder_;
+
+  // Number of frames captured by CaptureAndDebayer, and the info of the
+  // frame returned by GetImage.
+  int64_t num_captured_frames_ = 0;
+  FrameInfo last_frame_info_;
+
+  // Exposure bracket, with the number of brackets started, the step being
+  // captured, whether its exposure is set, and the number of frames prepared
+  // for the step until it is applied. The steps are all captured when
+  // bracket_step_ is the number of steps.
+  mutable absl::Mutex bracket_mutex_;
+  int64_t num_brackets_ ABSL_GUARDED_BY(bracket_mutex_) = 0;
+  std::vector<int> bracket_exposure_times_ ABSL_GUARDED_BY(bracket_mutex_);
+  int bracket_step_ ABSL_GUARDED_BY(bracket_mutex_) = 0;
+  bool bracket_exposure_set_ ABSL_GUARDED_BY(bracket_mutex_) = false;
+  int bracket_latency_frames_ ABSL_GUARDED_BY(bracket_mutex_) = 0;
+
+  ReadoutMode readout_mode_;
+  // Parts of the readout mode done by the device.
+  ReadoutMode hardware_readout_mode_;
+  // Parts of the readout mode done in software, in the order of the
+  // ReadoutMode fields, with the window in captured image pixels.
+  ReadoutMode software_readout_mode_;
+  // Buffers of the software readout.
+  cv::Mat unpacked_image_;
+  cv::Mat subsampled_image_;
+
+  // Asynchronous capture.
+  std::unique_ptr<FrameMailbox> mailbox_;
+  std::unique_ptr<std::thread> capture_thread_;
+  bool async_is_rgb_ = true;
+  std::atomic_bool stop_async_capture_ = {false};
+  std::atomic<int64_t> num_dropped_async_images_ = {0};
+  absl::Mutex async_mutex_;
+  absl::CondVar async_image_ready_;
+  absl::CondVar async_image_taken_;
+  // Error that stopped the capture thread.
+  tensorflow::Status async_status_ ABSL_GUARDED_BY(async_mutex_);
 };
 
 }  // namespace image_captor
@@ -17,9 +17,13 @@
 #include "image_captor/jenoptik_captor.h"
 #endif
 #include "absl/flags/flag.h"
+#include "image_captor/replay_captor.h"
+#include "image_captor/v4l2_captor.h"
 
 ABSL_FLAG(std::string, capture_device, "jenoptik",
-          "Image capture device type. ");
+          "Image capture device type: jenoptik, v4l2 for the Video4Linux2 "
+          "camera of --v4l2_device, or replay to replay the raw recording of "
+          "--replay_file.");
 
 namespace image_captor {
 
@@ -27,6 +31,14 @@ namespace image_captor {
 ImageCaptor* ImageCaptorFactory::Create() {
   std::string device = absl::GetFlag(FLAGS_capture_device);
   LOG(INFO) << "Device type: " << device;
+  constexpr char kDeviceReplay[] = "replay";
+  if (device == kDeviceReplay) {
+    return new ReplayCaptor();
+  }
+  constexpr char kDeviceV4l2[] = "v4l2";
+  if (device == kDeviceV4l2) {
+    return new V4l2Captor();
+  }
 #ifdef CAMERA_JENOPTIK
   constexpr char kDeviceJenoptik[] = "jenoptik";
   if (device == kDeviceJenoptik) {
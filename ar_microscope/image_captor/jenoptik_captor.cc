@@ -40,6 +40,9 @@ constexpr int kExposureLimits[] = {51, 1000000};  // Microseconds.
 // Multiplicative factor. Dependent on camera.
 constexpr double kGainLimits[] = {1.0, 10.0};
 
+// Number of image modes probed for binning.
+constexpr int kMaxImageModes = 16;
+
 tensorflow::Status JenoptikErrorToStatus(error_t error,
                                          const char* error_message) {
   if (IS_OK(error)) {
@@ -132,6 +135,7 @@ tensorflow::Status JenoptikCaptor::Initialize() {
   width_ = dimensions[0];
   height_ = dimensions[1];
   LOG(INFO) << "Captured image size " << width_ << " x " << height_;
+  TF_RETURN_IF_ERROR(FindBinningImageModes());
 
   // Set white balance.
   TF_RETURN_IF_ERROR(SetRgbGains(absl::GetFlag(FLAGS_white_balance_red),
@@ -151,6 +155,67 @@ tensorflow::Status JenoptikCaptor::Initialize() {
   return JenoptikErrorToStatus(error, "Failed to start image capture");
 }
 
+tensorflow::Status JenoptikCaptor::FindBinningImageModes() {
+  TF_RETURN_IF_ERROR(JenoptikErrorToStatus(
+      DijSDK_GetIntParameter(camera_handle_, ParameterIdImageMode,
+                             &full_image_mode_),
+      "Failed to obtain image mode"));
+  // The modes whose size divides the size of the full mode bin the sensor by
+  // the quotient.
+  for (int image_mode = 0; image_mode < kMaxImageModes; image_mode++) {
+    if (image_mode == full_image_mode_) continue;
+    if (!IS_OK(DijSDK_SetIntParameter(camera_handle_, ParameterIdImageMode,
+                                      image_mode))) {
+      break;
+    }
+    int dimensions[2];
+    if (!IS_OK(DijSDK_GetIntParameter(camera_handle_, ParameterIdImageModeSize,
+                                      dimensions, 2)) ||
+        dimensions[0] <= 0 || width_ % dimensions[0] != 0) {
+      continue;
+    }
+    const int factor = width_ / dimensions[0];
+    if (factor > 1 && dimensions[1] * factor == height_ &&
+        binning_image_modes_.count(factor) == 0) {
+      LOG(INFO) << "Image mode " << image_mode << " bins by " << factor;
+      binning_image_modes_[factor] = image_mode;
+    }
+  }
+  return JenoptikErrorToStatus(
+      DijSDK_SetIntParameter(camera_handle_, ParameterIdImageMode,
+                             full_image_mode_),
+      "Failed to restore image mode");
+}
+
+ReadoutCapabilities JenoptikCaptor::GetReadoutCapabilities() {
+  ReadoutCapabilities capabilities;
+  for (const auto& binning_image_mode : binning_image_modes_) {
+    capabilities.binning_factors.push_back(binning_image_mode.first);
+  }
+  return capabilities;
+}
+
+tensorflow::Status JenoptikCaptor::SetHardwareReadoutMode(
+    const ReadoutMode& mode) {
+  int image_mode = full_image_mode_;
+  if (mode.subsampling == Subsampling::BINNING &&
+      binning_image_modes_.count(mode.factor) > 0) {
+    image_mode = binning_image_modes_[mode.factor];
+  } else if (mode != ReadoutMode()) {
+    return tensorflow::errors::Unimplemented("Readout mode not supported.");
+  }
+  // The image mode can only change while the acquisition is stopped.
+  TF_RETURN_IF_ERROR(JenoptikErrorToStatus(
+      DijSDK_AbortAcquisition(camera_handle_), "Failed to stop image capture"));
+  const tensorflow::Status status = JenoptikErrorToStatus(
+      DijSDK_SetIntParameter(camera_handle_, ParameterIdImageMode, image_mode),
+      "Failed to set image mode");
+  TF_RETURN_IF_ERROR(JenoptikErrorToStatus(
+      DijSDK_StartAcquisition(camera_handle_, DijSDK_EAcqModeLive),
+      "Failed to start image capture"));
+  return status;
+}
+
 tensorflow::Status JenoptikCaptor::Finalize() {
   error_t error = DijSDK_AbortAcquisition(camera_handle_);
   tensorflow::Status status =
@@ -15,6 +15,8 @@
 #ifndef AR_MICROSCOPE_IMAGE_CAPTOR_JENOPTIK_CAPTOR_H_
 #define AR_MICROSCOPE_IMAGE_CAPTOR_JENOPTIK_CAPTOR_H_
 
+#include <map>
+
 #include "jenoptik/include/dijsdk.h"
 #include "jenoptik/include/dijsdkerror.h"
 #include "image_captor/image_captor.h"
@@ -24,6 +26,8 @@ namespace image_captor {
 
 class JenoptikCaptor : public ImageCaptor {
  public:
+  ~JenoptikCaptor() override { StopAsyncCapture(); }
+
   tensorflow::Status Initialize() override;
   tensorflow::Status Finalize() override;
 
@@ -39,6 +43,10 @@ class JenoptikCaptor : public ImageCaptor {
 
   tensorflow::Status SetExposureTime(int microseconds) override;
 
+  // The camera bins with its image modes. Windows and decimation are
+  // emulated.
+  ReadoutCapabilities GetReadoutCapabilities() override;
+
  protected:
   tensorflow::Status CaptureImage(uint8_t** image) override;
   tensorflow::Status ReleaseImage() override;
@@ -48,12 +56,21 @@ class JenoptikCaptor : public ImageCaptor {
   tensorflow::Status SetRgbGains(double red_gain, double green_gain,
                                  double blue_gain) override;
 
+  tensorflow::Status SetHardwareReadoutMode(const ReadoutMode& mode) override;
+
  private:
+  // Finds the image modes that bin the sensor, from the sizes of the modes.
+  tensorflow::Status FindBinningImageModes();
+
   int width_;
   int height_;
   DijSDK_Handle camera_handle_;
   DijSDK_Handle image_handle_;
   bool auto_exposure_initialized_ = false;
+  // Image mode that reads out the whole sensor, and the image modes of the
+  // binning factors.
+  int full_image_mode_ = 0;
+  std::map<int, int> binning_image_modes_;
 };
 
 }  // namespace image_captor
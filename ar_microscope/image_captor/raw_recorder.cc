@@ -0,0 +1,224 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_captor/raw_recorder.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "absl/strings/str_format.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/platform/logging.h"
+
+namespace image_captor {
+namespace {
+
+// Writes the buffer at the offset of the file, retrying partial writes.
+tensorflow::Status WriteAll(int fd, const uint8_t* buffer, size_t size,
+                            size_t offset) {
+  while (size > 0) {
+    const ssize_t written = pwrite(fd, buffer, size, offset);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return tensorflow::errors::Internal(
+          absl::StrFormat("Failed to write raw recording: %s",
+                          strerror(errno)));
+    }
+    buffer += written;
+    size -= written;
+    offset += written;
+  }
+  return tensorflow::Status();
+}
+
+// Writes the header block of the recording of num_frames frames.
+tensorflow::Status WriteHeader(int fd, RawRecordingHeader header,
+                               int64_t num_frames) {
+  header.num_frames = num_frames;
+  uint8_t* block = static_cast<uint8_t*>(
+      aligned_alloc(kRawRecordingAlignment, kRawRecordingAlignment));
+  memset(block, 0, kRawRecordingAlignment);
+  memcpy(block, &header, sizeof(header));
+  tensorflow::Status status = WriteAll(fd, block, kRawRecordingAlignment, 0);
+  free(block);
+  return status;
+}
+
+}  // namespace
+
+tensorflow::Status RawRecorder::Create(const std::string& path,
+                                       const RawRecordingHeader& header,
+                                       int64_t max_frames, int num_buffers,
+                                       std::unique_ptr<RawRecorder>* recorder) {
+  TF_RETURN_IF_ERROR(CheckRawRecordingHeader(header, kRawRecordingAlignment));
+  if (max_frames <= 0 || num_buffers <= 0) {
+    return tensorflow::errors::InvalidArgument(
+        "Raw recording needs room for frames and buffers.");
+  }
+  constexpr int kFlags = O_WRONLY | O_CREAT | O_TRUNC;
+  int fd = open(path.c_str(), kFlags | O_DIRECT, 0644);
+  if (fd < 0 && errno == EINVAL) {
+    // Some file systems, e.g. tmpfs, don't support direct I/O.
+    LOG(WARNING) << "No direct I/O for " << path << ", writing through the "
+                 << "page cache.";
+    fd = open(path.c_str(), kFlags, 0644);
+  }
+  if (fd < 0) {
+    return tensorflow::errors::Internal(absl::StrFormat(
+        "Failed to create raw recording %s: %s", path, strerror(errno)));
+  }
+  // Allocate the whole file up front, so that appending the records doesn't
+  // update the file system metadata.
+  const int error =
+      posix_fallocate(fd, 0, GetRawRecordOffset(header, max_frames));
+  if (error != 0) {
+    LOG(WARNING) << "Failed to preallocate raw recording " << path << ": "
+                 << strerror(error);
+  }
+  // A recording that is not closed is seen as empty.
+  tensorflow::Status status = WriteHeader(fd, header, 0);
+  if (!status.ok()) {
+    close(fd);
+    return status;
+  }
+  recorder->reset(
+      new RawRecorder(fd, path, header, max_frames, num_buffers));
+  return tensorflow::Status();
+}
+
+RawRecorder::RawRecorder(int fd, const std::string& path,
+                         const RawRecordingHeader& header, int64_t max_frames,
+                         int num_buffers)
+    : fd_(fd), path_(path), header_(header), max_frames_(max_frames) {
+  for (int i = 0; i < num_buffers; i++) {
+    RecordBuffer buffer(static_cast<uint8_t*>(
+        aligned_alloc(kRawRecordingAlignment, header_.record_bytes)));
+    // The padding of the records is written as zeros.
+    memset(buffer.get(), 0, header_.record_bytes);
+    free_buffers_.push_back(std::move(buffer));
+  }
+  writer_ = std::make_unique<std::thread>([this]() { WriterLoop(); });
+}
+
+RawRecorder::~RawRecorder() {
+  if (!closed_) {
+    tensorflow::Status status = Close();
+    if (!status.ok()) {
+      LOG(ERROR) << "Raw recorder close error: " << status;
+    }
+  }
+}
+
+bool RawRecorder::AddFrame(const uint8_t* frame, RawFrameHeader frame_header) {
+  RecordBuffer record;
+  {
+    absl::MutexLock unused_lock(&mutex_);
+    frame_header.frame_id = num_added_frames_++;
+    if (closing_ || free_buffers_.empty() || num_records_ >= max_frames_) {
+      num_dropped_frames_++;
+      return false;
+    }
+    record = std::move(free_buffers_.back());
+    free_buffers_.pop_back();
+    num_records_++;
+  }
+  // Copy outside of the lock, so that the writer is never held up.
+  memcpy(record.get(), &frame_header, sizeof(frame_header));
+  memcpy(record.get() + sizeof(frame_header), frame, header_.frame_bytes);
+  absl::MutexLock unused_lock(&mutex_);
+  queued_records_.push_back(std::move(record));
+  record_queued_.Signal();
+  return true;
+}
+
+void RawRecorder::WriterLoop() {
+  absl::MutexLock unused_lock(&mutex_);
+  while (true) {
+    while (!closing_ && queued_records_.empty()) {
+      record_queued_.Wait(&mutex_);
+    }
+    if (queued_records_.empty()) return;
+    RecordBuffer record = std::move(queued_records_.front());
+    queued_records_.pop_front();
+    const size_t offset = GetRawRecordOffset(header_, num_written_frames_);
+    tensorflow::Status status = write_status_;
+    mutex_.Unlock();
+    if (status.ok()) {
+      status = WriteAll(fd_, record.get(), header_.record_bytes, offset);
+    }
+    mutex_.Lock();
+    if (status.ok()) {
+      num_written_frames_++;
+    } else {
+      // Frames after a failed write are dropped.
+      write_status_ = status;
+      num_dropped_frames_++;
+    }
+    free_buffers_.push_back(std::move(record));
+  }
+}
+
+tensorflow::Status RawRecorder::Close() {
+  if (closed_) {
+    return tensorflow::errors::FailedPrecondition(
+        "Raw recorder is already closed.");
+  }
+  closed_ = true;
+  {
+    absl::MutexLock unused_lock(&mutex_);
+    closing_ = true;
+    record_queued_.Signal();
+  }
+  writer_->join();
+
+  tensorflow::Status status;
+  int64_t num_frames;
+  int64_t num_dropped_frames;
+  {
+    absl::MutexLock unused_lock(&mutex_);
+    status = write_status_;
+    num_frames = num_written_frames_;
+    num_dropped_frames = num_dropped_frames_;
+  }
+  if (status.ok()) status = WriteHeader(fd_, header_, num_frames);
+  // Release the preallocated space of the frames that were not recorded.
+  if (status.ok() &&
+      ftruncate(fd_, GetRawRecordOffset(header_, num_frames)) != 0) {
+    status = tensorflow::errors::Internal(absl::StrFormat(
+        "Failed to truncate raw recording: %s", strerror(errno)));
+  }
+  if (status.ok() && fsync(fd_) != 0) {
+    status = tensorflow::errors::Internal(absl::StrFormat(
+        "Failed to sync raw recording: %s", strerror(errno)));
+  }
+  close(fd_);
+  LOG(INFO) << "Recorded " << num_frames << " frames to " << path_
+            << ", dropped " << num_dropped_frames;
+  return status;
+}
+
+int64_t RawRecorder::GetNumWrittenFrames() const {
+  absl::MutexLock unused_lock(&mutex_);
+  return num_written_frames_;
+}
+
+int64_t RawRecorder::GetNumDroppedFrames() const {
+  absl::MutexLock unused_lock(&mutex_);
+  return num_dropped_frames_;
+}
+
+}  // namespace image_captor
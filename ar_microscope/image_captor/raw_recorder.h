@@ -0,0 +1,114 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#ifndef AR_MICROSCOPE_IMAGE_CAPTOR_RAW_RECORDER_H_
+#define AR_MICROSCOPE_IMAGE_CAPTOR_RAW_RECORDER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "absl/synchronization/mutex.h"
+#include "image_captor/raw_recording.h"
+#include "tensorflow/core/lib/core/status.h"
+
+namespace image_captor {
+
+// Writes raw Bayer frames to a recording, see raw_recording.h, from the
+// capture path. Frames are copied into a few aligned record buffers, and a
+// writer thread appends the records to the preallocated file with direct
+// I/O, so that the page cache is not filled with frames that are never read
+// again. Adding a frame never waits for the disk: when every buffer is
+// waiting to be written, or the file is full, the frame is dropped and
+// counted.
+class RawRecorder {
+ public:
+  ~RawRecorder();
+
+  RawRecorder(const RawRecorder&) = delete;
+  RawRecorder& operator=(const RawRecorder&) = delete;
+
+  // Creates the recording file of frames of the layout of the header, with
+  // room for max_frames frames, and starts the writer thread.
+  //
+  // Args:
+  //   path: Path of the recording. An existing file is replaced.
+  //   header: Layout of the frames, see MakeRawRecordingHeader.
+  //   max_frames: Number of frames the file is preallocated for.
+  //   num_buffers: Number of frames that may wait to be written.
+  //   recorder: The created recorder.
+  static tensorflow::Status Create(const std::string& path,
+                                   const RawRecordingHeader& header,
+                                   int64_t max_frames, int num_buffers,
+                                   std::unique_ptr<RawRecorder>* recorder);
+
+  // Queues the frame, of header.frame_bytes bytes, for writing. The frame is
+  // copied, so it may be released when this returns. The frame id of the
+  // frame header is set to the number of frames added before it, so that the
+  // dropped frames are seen as gaps. Returns false if the frame is dropped.
+  // Must be called from a single thread.
+  bool AddFrame(const uint8_t* frame, RawFrameHeader frame_header);
+
+  // Writes the queued frames and the final header, and closes the file.
+  // Called by the destructor if needed.
+  tensorflow::Status Close();
+
+  int64_t GetNumWrittenFrames() const;
+  int64_t GetNumDroppedFrames() const;
+
+ private:
+  // Record buffer, aligned for direct I/O.
+  struct FreeDeleter {
+    void operator()(uint8_t* buffer) const { free(buffer); }
+  };
+  using RecordBuffer = std::unique_ptr<uint8_t, FreeDeleter>;
+
+  RawRecorder(int fd, const std::string& path,
+              const RawRecordingHeader& header, int64_t max_frames,
+              int num_buffers);
+
+  // Writes the queued records until the recorder is closed.
+  void WriterLoop();
+
+  const int fd_;
+  const std::string path_;
+  const RawRecordingHeader header_;
+  const int64_t max_frames_;
+
+  std::unique_ptr<std::thread> writer_;
+
+  mutable absl::Mutex mutex_;
+  absl::CondVar record_queued_;
+  // Buffers ready for the next frames.
+  std::vector<RecordBuffer> free_buffers_ ABSL_GUARDED_BY(mutex_);
+  // Records waiting to be written, in the order of the file.
+  std::deque<RecordBuffer> queued_records_ ABSL_GUARDED_BY(mutex_);
+  // Number of records given a place in the file.
+  int64_t num_records_ ABSL_GUARDED_BY(mutex_) = 0;
+  int64_t num_written_frames_ ABSL_GUARDED_BY(mutex_) = 0;
+  int64_t num_added_frames_ ABSL_GUARDED_BY(mutex_) = 0;
+  int64_t num_dropped_frames_ ABSL_GUARDED_BY(mutex_) = 0;
+  tensorflow::Status write_status_ ABSL_GUARDED_BY(mutex_);
+  bool closing_ ABSL_GUARDED_BY(mutex_) = false;
+  bool closed_ = false;
+};
+
+}  // namespace image_captor
+
+#endif  // AR_MICROSCOPE_IMAGE_CAPTOR_RAW_RECORDER_H_
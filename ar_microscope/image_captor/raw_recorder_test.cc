@@ -0,0 +1,190 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_captor/raw_recorder.h"
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "opencv2/core.hpp"
+#include "absl/flags/flag.h"
+#include "image_captor/raw_recording.h"
+#include "image_captor/replay_captor.h"
+#include "tensorflow/core/lib/core/status.h"
+
+extern absl::Flag<std::string> FLAGS_replay_file;
+extern absl::Flag<bool> FLAGS_replay_realtime;
+extern absl::Flag<bool> FLAGS_replay_loop;
+
+namespace {
+
+using image_captor::MakeRawRecordingHeader;
+using image_captor::RawFrameHeader;
+using image_captor::RawRecorder;
+using image_captor::RawRecordingHeader;
+using image_captor::ReplayCaptor;
+using image_processor::BayerPacking;
+using image_processor::BayerPattern;
+
+using ::testing::Eq;
+
+constexpr int kWidth = 36;
+constexpr int kHeight = 6;
+
+std::string GetTestPath(const std::string& name) {
+  return ::testing::TempDir() + "/" + name;
+}
+
+std::vector<uint8_t> MakeFrame(const RawRecordingHeader& header, int seed) {
+  std::mt19937 generator(seed);
+  std::uniform_int_distribution<int> distribution(0, 0xff);
+  std::vector<uint8_t> frame(header.frame_bytes);
+  for (uint8_t& value : frame) value = distribution(generator);
+  return frame;
+}
+
+void StartReplay(const std::string& path, ReplayCaptor* captor) {
+  absl::SetFlag(&FLAGS_replay_file, path);
+  absl::SetFlag(&FLAGS_replay_realtime, false);
+  absl::SetFlag(&FLAGS_replay_loop, false);
+  ASSERT_TRUE(captor->Initialize().ok());
+}
+
+// Returns the raw frame of the Bayer image captured from the replay.
+std::vector<uint8_t> GetFrame(ReplayCaptor* captor) {
+  cv::Mat bayer;
+  EXPECT_TRUE(captor->GetBayerImage(&bayer).ok());
+  std::vector<uint8_t> frame(bayer.total() * bayer.elemSize());
+  for (int y = 0; y < bayer.rows; y++) {
+    memcpy(frame.data() + y * bayer.cols * bayer.elemSize(), bayer.ptr(y),
+           bayer.cols * bayer.elemSize());
+  }
+  return frame;
+}
+
+TEST(RawRecorderTest, RecordsFrames) {
+  const RawRecordingHeader header = MakeRawRecordingHeader(
+      kWidth, kHeight, 2, BayerPacking::NONE, BayerPattern::BGGR);
+  const std::string path = GetTestPath("recorded.raw");
+  std::unique_ptr<RawRecorder> recorder;
+  ASSERT_TRUE(RawRecorder::Create(path, header, 10, 4, &recorder).ok());
+  std::vector<std::vector<uint8_t>> frames;
+  for (int i = 0; i < 3; i++) {
+    frames.push_back(MakeFrame(header, i));
+    RawFrameHeader frame_header = {};
+    frame_header.timestamp_microseconds = 1000 * i;
+    frame_header.exposure_time_microseconds = 500 + i;
+    ASSERT_TRUE(recorder->AddFrame(frames.back().data(), frame_header));
+  }
+  ASSERT_TRUE(recorder->Close().ok());
+  EXPECT_THAT(recorder->GetNumWrittenFrames(), Eq(3));
+  EXPECT_THAT(recorder->GetNumDroppedFrames(), Eq(0));
+
+  ReplayCaptor captor;
+  StartReplay(path, &captor);
+  EXPECT_THAT(captor.GetBayerPattern(), Eq(BayerPattern::BGGR));
+  for (int i = 0; i < 3; i++) {
+    EXPECT_THAT(GetFrame(&captor), Eq(frames[i]));
+    EXPECT_THAT(captor.GetLastFrameHeader()->frame_id, Eq(i));
+    EXPECT_THAT(captor.GetLastFrameHeader()->timestamp_microseconds,
+                Eq(1000 * i));
+    EXPECT_THAT(captor.GetExposureTimeInMicroseconds(), Eq(500 + i));
+  }
+  cv::Mat bayer;
+  EXPECT_FALSE(captor.GetBayerImage(&bayer).ok());
+}
+
+TEST(RawRecorderTest, DropsFramesWhenFull) {
+  const RawRecordingHeader header = MakeRawRecordingHeader(
+      kWidth, kHeight, 1, BayerPacking::NONE, BayerPattern::RGGB);
+  const std::string path = GetTestPath("full.raw");
+  std::unique_ptr<RawRecorder> recorder;
+  ASSERT_TRUE(RawRecorder::Create(path, header, 2, 1, &recorder).ok());
+  const std::vector<uint8_t> frame = MakeFrame(header, 0);
+  int num_added = 0;
+  for (int i = 0; i < 20; i++) {
+    num_added += recorder->AddFrame(frame.data(), RawFrameHeader());
+  }
+  ASSERT_TRUE(recorder->Close().ok());
+  // Frames are dropped while the single buffer is being written.
+  EXPECT_THAT(recorder->GetNumWrittenFrames(), Eq(num_added));
+  EXPECT_LE(num_added, 2);
+  EXPECT_THAT(recorder->GetNumDroppedFrames(), Eq(20 - num_added));
+
+  ReplayCaptor captor;
+  StartReplay(path, &captor);
+  for (int i = 0; i < num_added; i++) {
+    EXPECT_THAT(GetFrame(&captor), Eq(frame));
+  }
+  cv::Mat bayer;
+  EXPECT_FALSE(captor.GetBayerImage(&bayer).ok());
+}
+
+TEST(RawRecorderTest, RecordsCapturedImages) {
+  // Record the replay of a packed recording.
+  const RawRecordingHeader header = MakeRawRecordingHeader(
+      kWidth, kHeight, 2, BayerPacking::RAW10, BayerPattern::GBRG);
+  const std::string source_path = GetTestPath("source.raw");
+  std::vector<std::vector<uint8_t>> frames;
+  {
+    std::unique_ptr<RawRecorder> recorder;
+    ASSERT_TRUE(
+        RawRecorder::Create(source_path, header, 4, 4, &recorder).ok());
+    for (int i = 0; i < 4; i++) {
+      frames.push_back(MakeFrame(header, i));
+      RawFrameHeader frame_header = {};
+      frame_header.exposure_time_microseconds = 100 * i;
+      ASSERT_TRUE(recorder->AddFrame(frames.back().data(), frame_header));
+    }
+  }
+
+  const std::string path = GetTestPath("captured.raw");
+  {
+    ReplayCaptor captor;
+    StartReplay(source_path, &captor);
+    ASSERT_TRUE(captor.StartRecording(path, 10, 4).ok());
+    cv::Mat rgb;
+    for (int i = 0; i < 4; i++) {
+      ASSERT_TRUE(captor.GetImage(true, &rgb).ok());
+    }
+    ASSERT_TRUE(captor.StopRecording().ok());
+  }
+
+  ReplayCaptor captor;
+  StartReplay(path, &captor);
+  EXPECT_THAT(captor.GetBayerPacking(), Eq(BayerPacking::RAW10));
+  EXPECT_THAT(captor.GetBayerPattern(), Eq(BayerPattern::GBRG));
+  cv::Mat bayer;
+  int64_t last_timestamp = 0;
+  for (int i = 0; i < 4; i++) {
+    // The replayed frames are unpacked, so compare with the source replay.
+    ASSERT_TRUE(captor.GetBayerImage(&bayer).ok());
+    const RawFrameHeader& frame_header = *captor.GetLastFrameHeader();
+    EXPECT_THAT(frame_header.exposure_time_microseconds, Eq(100 * i));
+    EXPECT_GE(frame_header.timestamp_microseconds, last_timestamp);
+    last_timestamp = frame_header.timestamp_microseconds;
+    const uint8_t* record = reinterpret_cast<const uint8_t*>(&frame_header);
+    EXPECT_THAT(memcmp(record + sizeof(RawFrameHeader), frames[i].data(),
+                       frames[i].size()),
+                Eq(0));
+  }
+}
+
+}  // namespace
@@ -0,0 +1,99 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_captor/raw_recording.h"
+
+#include <cstring>
+
+#include "absl/strings/str_format.h"
+#include "image_processor/debayer_kernels.h"
+#include "tensorflow/core/lib/core/errors.h"
+
+namespace image_captor {
+namespace {
+
+constexpr char kMagic[8] = {'A', 'R', 'M', 'R', 'A', 'W', '\0', '\0'};
+constexpr uint32_t kVersion = 1;
+
+static_assert(sizeof(RawRecordingHeader) <= kRawRecordingAlignment,
+              "The header must fit before the first record.");
+static_assert(sizeof(RawFrameHeader) == 64,
+              "The frames must start at the same offset on every platform.");
+
+// Returns the size of a frame of the layout.
+uint64_t GetFrameBytes(uint64_t width, uint64_t height,
+                       uint64_t bytes_per_pixel,
+                       image_processor::BayerPacking packing) {
+  if (packing == image_processor::BayerPacking::NONE) {
+    return width * height * bytes_per_pixel;
+  }
+  return width / image_processor::GetPackedGroupPixels(packing) *
+         image_processor::GetPackedGroupBytes(packing) * height;
+}
+
+}  // namespace
+
+RawRecordingHeader MakeRawRecordingHeader(
+    int width, int height, int bytes_per_pixel,
+    image_processor::BayerPacking packing,
+    image_processor::BayerPattern pattern) {
+  RawRecordingHeader header = {};
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.width = width;
+  header.height = height;
+  header.bytes_per_pixel = bytes_per_pixel;
+  header.packing = static_cast<uint32_t>(packing);
+  header.pattern = static_cast<uint32_t>(pattern);
+  header.frame_bytes = GetFrameBytes(width, height, bytes_per_pixel, packing);
+  header.record_bytes = (sizeof(RawFrameHeader) + header.frame_bytes +
+                         kRawRecordingAlignment - 1) /
+                        kRawRecordingAlignment * kRawRecordingAlignment;
+  return header;
+}
+
+tensorflow::Status CheckRawRecordingHeader(const RawRecordingHeader& header,
+                                           size_t file_size) {
+  const auto packing =
+      static_cast<image_processor::BayerPacking>(header.packing);
+  const bool valid_packing =
+      packing == image_processor::BayerPacking::NONE ||
+      ((packing == image_processor::BayerPacking::RAW10 ||
+        packing == image_processor::BayerPacking::RAW12) &&
+       header.bytes_per_pixel == 2 &&
+       header.width % image_processor::GetPackedGroupPixels(packing) == 0);
+  if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      header.version != kVersion || header.width == 0 || header.height == 0 ||
+      (header.bytes_per_pixel != 1 && header.bytes_per_pixel != 2) ||
+      !valid_packing ||
+      header.pattern > static_cast<uint32_t>(
+                           image_processor::BayerPattern::GBRG) ||
+      header.frame_bytes != GetFrameBytes(header.width, header.height,
+                                          header.bytes_per_pixel, packing) ||
+      header.record_bytes < sizeof(RawFrameHeader) + header.frame_bytes ||
+      header.record_bytes % kRawRecordingAlignment != 0) {
+    return tensorflow::errors::InvalidArgument(
+        "Invalid raw recording header.");
+  }
+  if (file_size < kRawRecordingAlignment ||
+      (file_size - kRawRecordingAlignment) / header.record_bytes <
+          header.num_frames) {
+    return tensorflow::errors::InvalidArgument(absl::StrFormat(
+        "Raw recording of %d frames is truncated to %d bytes.",
+        header.num_frames, file_size));
+  }
+  return tensorflow::Status();
+}
+
+}  // namespace image_captor
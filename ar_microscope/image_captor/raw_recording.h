@@ -0,0 +1,88 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+// Recordings of the raw Bayer frames of a sensor, for replay without the
+// camera. A recording is a single file, which is memory-mapped for replay so
+// that the frames are served without a copy:
+//   RawRecordingHeader, padded to kRawRecordingAlignment bytes.
+//   num_frames records of record_bytes each, a multiple of
+//   kRawRecordingAlignment:
+//     RawFrameHeader, 64 bytes.
+//     Frame, frame_bytes in the layout of the packing.
+//     Padding.
+// Records are aligned so that they can be written with direct I/O.
+// All values are little-endian.
+
+#ifndef AR_MICROSCOPE_IMAGE_CAPTOR_RAW_RECORDING_H_
+#define AR_MICROSCOPE_IMAGE_CAPTOR_RAW_RECORDING_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "image_processor/debayer.h"
+#include "tensorflow/core/lib/core/status.h"
+
+namespace image_captor {
+
+// Alignment of the records in the file.
+constexpr size_t kRawRecordingAlignment = 4096;
+
+struct RawRecordingHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  // Bytes per unpacked Bayer pixel, 1 or 2.
+  uint32_t bytes_per_pixel;
+  // image_processor::BayerPacking of the frames.
+  uint32_t packing;
+  // image_processor::BayerPattern of the sensor.
+  uint32_t pattern;
+  uint64_t frame_bytes;
+  uint64_t record_bytes;
+  uint64_t num_frames;
+};
+
+struct RawFrameHeader {
+  // Capture time of the frame, from an arbitrary origin.
+  int64_t timestamp_microseconds;
+  // Index of the frame in the capture. Gaps are frames dropped while
+  // recording.
+  int64_t frame_id;
+  // Exposure time of the frame, or -1 if unknown.
+  int32_t exposure_time_microseconds;
+  uint32_t reserved[11];
+};
+
+// Returns the header of a recording of frames of the given layout, without
+// frames.
+RawRecordingHeader MakeRawRecordingHeader(
+    int width, int height, int bytes_per_pixel,
+    image_processor::BayerPacking packing,
+    image_processor::BayerPattern pattern);
+
+// Returns an error if the header is not valid, or does not fit in a file of
+// the given size.
+tensorflow::Status CheckRawRecordingHeader(const RawRecordingHeader& header,
+                                           size_t file_size);
+
+// Returns the offset of the record of the frame in the file.
+inline size_t GetRawRecordOffset(const RawRecordingHeader& header,
+                                 size_t frame) {
+  return kRawRecordingAlignment + frame * header.record_bytes;
+}
+
+}  // namespace image_captor
+
+#endif  // AR_MICROSCOPE_IMAGE_CAPTOR_RAW_RECORDING_H_
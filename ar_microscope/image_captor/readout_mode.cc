@@ -0,0 +1,178 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_captor/readout_mode.h"
+
+#include <algorithm>
+#include <cstdint>
+
+#include "absl/strings/str_format.h"
+#include "tensorflow/core/lib/core/errors.h"
+
+namespace image_captor {
+namespace {
+
+// Subsamples a Bayer image of T pixels. Row y of the output is made of the
+// rows of the same parity of Bayer tile rows y / 2 * factor and after, and
+// likewise for the columns.
+template <typename T>
+void SubsampleBayerImage(const cv::Mat& input, Subsampling subsampling,
+                         int factor, cv::Mat* output) {
+  const int width = output->cols;
+  // Input column of the first pixel of each output column.
+  std::vector<int> columns(width);
+  for (int x = 0; x < width; x++) {
+    columns[x] = x / 2 * factor * 2 + x % 2;
+  }
+  std::vector<uint32_t> sums(width);
+  const uint32_t num_pixels = factor * factor;
+  for (int y = 0; y < output->rows; y++) {
+    const int input_y = y / 2 * factor * 2 + y % 2;
+    T* output_row = output->ptr<T>(y);
+    if (subsampling == Subsampling::DECIMATION) {
+      const T* input_row = input.ptr<T>(input_y);
+      for (int x = 0; x < width; x++) {
+        output_row[x] = input_row[columns[x]];
+      }
+      continue;
+    }
+    std::fill(sums.begin(), sums.end(), 0);
+    for (int i = 0; i < factor; i++) {
+      const T* input_row = input.ptr<T>(input_y + 2 * i);
+      for (int x = 0; x < width; x++) {
+        const T* tile = input_row + columns[x];
+        for (int j = 0; j < factor; j++) {
+          sums[x] += tile[2 * j];
+        }
+      }
+    }
+    for (int x = 0; x < width; x++) {
+      output_row[x] = (sums[x] + num_pixels / 2) / num_pixels;
+    }
+  }
+}
+
+}  // namespace
+
+bool operator==(const ReadoutMode& a, const ReadoutMode& b) {
+  return a.roi == b.roi && a.subsampling == b.subsampling &&
+         (a.subsampling == Subsampling::NONE || a.factor == b.factor);
+}
+
+bool ReadoutCapabilities::SupportsSubsampling(Subsampling subsampling,
+                                              int factor) const {
+  const std::vector<int>* factors;
+  switch (subsampling) {
+    case Subsampling::BINNING:
+      factors = &binning_factors;
+      break;
+    case Subsampling::DECIMATION:
+      factors = &decimation_factors;
+      break;
+    default:
+      return true;
+  }
+  return std::find(factors->begin(), factors->end(), factor) != factors->end();
+}
+
+tensorflow::Status CheckReadoutMode(const ReadoutMode& mode, int sensor_width,
+                                    int sensor_height) {
+  const int factor = mode.subsampling == Subsampling::NONE ? 1 : mode.factor;
+  if (factor < 1) {
+    return tensorflow::errors::InvalidArgument(
+        absl::StrFormat("Invalid subsampling factor %d.", factor));
+  }
+  const cv::Rect roi = mode.roi.area() > 0
+                           ? mode.roi
+                           : cv::Rect(0, 0, sensor_width, sensor_height);
+  const int alignment = 2 * factor;
+  if (roi.x < 0 || roi.y < 0 || roi.x + roi.width > sensor_width ||
+      roi.y + roi.height > sensor_height || roi.x % alignment != 0 ||
+      roi.y % alignment != 0 || roi.width % alignment != 0 ||
+      roi.height % alignment != 0) {
+    return tensorflow::errors::InvalidArgument(absl::StrFormat(
+        "Readout window (%d, %d) %dx%d is not aligned to %d pixels inside the "
+        "sensor of %dx%d.",
+        roi.x, roi.y, roi.width, roi.height, alignment, sensor_width,
+        sensor_height));
+  }
+  return tensorflow::Status();
+}
+
+cv::Size GetReadoutSize(const ReadoutMode& mode, int sensor_width,
+                        int sensor_height) {
+  const int factor = mode.subsampling == Subsampling::NONE ? 1 : mode.factor;
+  if (mode.roi.area() > 0) {
+    return cv::Size(mode.roi.width / factor, mode.roi.height / factor);
+  }
+  return cv::Size(sensor_width / factor, sensor_height / factor);
+}
+
+tensorflow::Status SubsampleBayerImage(const cv::Mat& input,
+                                       Subsampling subsampling, int factor,
+                                       cv::Mat* output) {
+  if (subsampling == Subsampling::NONE || factor < 1 ||
+      input.cols % (2 * factor) != 0 || input.rows % (2 * factor) != 0 ||
+      (input.type() != CV_8UC1 && input.type() != CV_16UC1)) {
+    return tensorflow::errors::InvalidArgument(absl::StrFormat(
+        "Cannot subsample the Bayer image of %dx%d by %d.", input.cols,
+        input.rows, factor));
+  }
+  output->create(input.rows / factor, input.cols / factor, input.type());
+  if (input.type() == CV_8UC1) {
+    SubsampleBayerImage<uint8_t>(input, subsampling, factor, output);
+  } else {
+    SubsampleBayerImage<uint16_t>(input, subsampling, factor, output);
+  }
+  return tensorflow::Status();
+}
+
+bool MapSensorPixel(const ReadoutMode& mode, const cv::Point& sensor_pixel,
+                    cv::Point* pixel) {
+  cv::Point point = sensor_pixel;
+  if (mode.roi.area() > 0) {
+    if (!mode.roi.contains(point)) return false;
+    point -= mode.roi.tl();
+  }
+  if (mode.subsampling == Subsampling::NONE) {
+    *pixel = point;
+    return true;
+  }
+  // The same-color pixels of factor x factor Bayer tiles are combined, so the
+  // pixel is at tile position / factor of the output, with the same color.
+  const int tile_x = point.x / 2;
+  const int tile_y = point.y / 2;
+  if (mode.subsampling == Subsampling::DECIMATION &&
+      (tile_x % mode.factor != 0 || tile_y % mode.factor != 0)) {
+    return false;
+  }
+  *pixel = cv::Point(tile_x / mode.factor * 2 + point.x % 2,
+                     tile_y / mode.factor * 2 + point.y % 2);
+  return true;
+}
+
+tensorflow::Status ApplyReadoutMode(const cv::Mat& sensor_image,
+                                    const ReadoutMode& mode, cv::Mat* output) {
+  TF_RETURN_IF_ERROR(
+      CheckReadoutMode(mode, sensor_image.cols, sensor_image.rows));
+  const cv::Mat window =
+      mode.roi.area() > 0 ? sensor_image(mode.roi) : sensor_image;
+  if (mode.subsampling == Subsampling::NONE) {
+    *output = window;
+    return tensorflow::Status();
+  }
+  return SubsampleBayerImage(window, mode.subsampling, mode.factor, output);
+}
+
+}  // namespace image_captor
@@ -0,0 +1,105 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+// Readout modes of the sensor. A readout mode reads a window of the sensor,
+// and may reduce its resolution by binning or decimation, which combine the
+// same-color pixels of factor x factor Bayer tiles into a single tile. The
+// result is a smaller Bayer image of the same pattern, so that less data is
+// captured and debayered when models need less than the sensor resolution.
+
+#ifndef AR_MICROSCOPE_IMAGE_CAPTOR_READOUT_MODE_H_
+#define AR_MICROSCOPE_IMAGE_CAPTOR_READOUT_MODE_H_
+
+#include <vector>
+
+#include "opencv2/core.hpp"
+#include "tensorflow/core/lib/core/status.h"
+
+namespace image_captor {
+
+enum class Subsampling {
+  NONE,
+  // Averages the same-color pixels of the tiles.
+  BINNING,
+  // Keeps the first tile and skips the others.
+  DECIMATION,
+};
+
+struct ReadoutMode {
+  // Window of the sensor that is read out, in sensor pixels, or empty for the
+  // whole sensor. The window is read out before subsampling, and its
+  // coordinates and size must be multiples of 2 * factor so that the Bayer
+  // pattern is kept.
+  cv::Rect roi;
+  Subsampling subsampling = Subsampling::NONE;
+  // Tiles combined in each dimension by the subsampling.
+  int factor = 1;
+};
+
+bool operator==(const ReadoutMode& a, const ReadoutMode& b);
+inline bool operator!=(const ReadoutMode& a, const ReadoutMode& b) {
+  return !(a == b);
+}
+
+// Readout supported by the hardware of a device.
+struct ReadoutCapabilities {
+  // Binning and decimation factors, besides 1.
+  std::vector<int> binning_factors;
+  std::vector<int> decimation_factors;
+  // Whether windows of the sensor can be read out.
+  bool roi = false;
+
+  bool SupportsSubsampling(Subsampling subsampling, int factor) const;
+};
+
+// Checks that the mode is valid for the sensor.
+tensorflow::Status CheckReadoutMode(const ReadoutMode& mode, int sensor_width,
+                                    int sensor_height);
+
+// Returns the size of the Bayer image of the mode.
+cv::Size GetReadoutSize(const ReadoutMode& mode, int sensor_width,
+                        int sensor_height);
+
+// Bins or decimates the unpacked Bayer image, as the sensor would.
+//
+// Args:
+//   input: Bayer image, whose size is a multiple of 2 * factor.
+//   subsampling: Subsampling, not NONE.
+//   factor: Tiles combined in each dimension.
+//   output: Bayer image of input size / factor. It is allocated if necessary.
+tensorflow::Status SubsampleBayerImage(const cv::Mat& input,
+                                       Subsampling subsampling, int factor,
+                                       cv::Mat* output);
+
+// Maps the pixel of the sensor to the pixel of the Bayer image of the mode it
+// is read out into. Returns false if it is outside the window, or skipped by
+// decimation. A binned pixel is mapped to the pixel its tile is averaged into.
+bool MapSensorPixel(const ReadoutMode& mode, const cv::Point& sensor_pixel,
+                    cv::Point* pixel);
+
+// Reads out the unpacked Bayer image of the whole sensor in the mode, as the
+// sensor would, e.g. to derive the calibration of the mode from frames
+// captured at full readout.
+//
+// Args:
+//   sensor_image: Bayer image of the whole sensor.
+//   mode: Readout mode, which must be valid for the sensor.
+//   output: Bayer image of the readout size. It is a view of sensor_image if
+//     the mode does not subsample, and allocated if necessary otherwise.
+tensorflow::Status ApplyReadoutMode(const cv::Mat& sensor_image,
+                                    const ReadoutMode& mode, cv::Mat* output);
+
+}  // namespace image_captor
+
+#endif  // AR_MICROSCOPE_IMAGE_CAPTOR_READOUT_MODE_H_
@@ -0,0 +1,197 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_captor/readout_mode.h"
+
+#include <cstdint>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "opencv2/core.hpp"
+
+namespace {
+
+using image_captor::ApplyReadoutMode;
+using image_captor::CheckReadoutMode;
+using image_captor::GetReadoutSize;
+using image_captor::MapSensorPixel;
+using image_captor::ReadoutCapabilities;
+using image_captor::ReadoutMode;
+using image_captor::SubsampleBayerImage;
+using image_captor::Subsampling;
+
+using ::testing::Eq;
+
+// Returns a 16-bit Bayer image whose pixel values encode their position.
+cv::Mat MakeBayerImage(int width, int height) {
+  cv::Mat image(height, width, CV_16UC1);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      image.at<uint16_t>(y, x) = y * 100 + x;
+    }
+  }
+  return image;
+}
+
+TEST(ReadoutModeTest, CheckReadoutMode) {
+  ReadoutMode mode;
+  EXPECT_TRUE(CheckReadoutMode(mode, 24, 12).ok());
+  mode.roi = cv::Rect(4, 2, 8, 6);
+  EXPECT_TRUE(CheckReadoutMode(mode, 24, 12).ok());
+  EXPECT_THAT(GetReadoutSize(mode, 24, 12).width, Eq(8));
+  EXPECT_THAT(GetReadoutSize(mode, 24, 12).height, Eq(6));
+  // Odd coordinates change the Bayer pattern.
+  mode.roi = cv::Rect(3, 2, 8, 6);
+  EXPECT_FALSE(CheckReadoutMode(mode, 24, 12).ok());
+  mode.roi = cv::Rect(20, 2, 8, 6);
+  EXPECT_FALSE(CheckReadoutMode(mode, 24, 12).ok());
+
+  mode.subsampling = Subsampling::BINNING;
+  mode.factor = 2;
+  mode.roi = cv::Rect(4, 4, 16, 8);
+  EXPECT_TRUE(CheckReadoutMode(mode, 24, 12).ok());
+  EXPECT_THAT(GetReadoutSize(mode, 24, 12).width, Eq(8));
+  EXPECT_THAT(GetReadoutSize(mode, 24, 12).height, Eq(4));
+  mode.roi = cv::Rect(4, 2, 16, 8);
+  EXPECT_FALSE(CheckReadoutMode(mode, 24, 12).ok());
+  mode.roi = cv::Rect();
+  mode.factor = 3;
+  EXPECT_TRUE(CheckReadoutMode(mode, 24, 12).ok());
+  EXPECT_FALSE(CheckReadoutMode(mode, 24, 8).ok());
+  EXPECT_THAT(GetReadoutSize(mode, 24, 12).width, Eq(8));
+  mode.factor = 0;
+  EXPECT_FALSE(CheckReadoutMode(mode, 24, 12).ok());
+}
+
+TEST(ReadoutModeTest, Capabilities) {
+  ReadoutCapabilities capabilities;
+  capabilities.binning_factors = {2, 4};
+  EXPECT_TRUE(capabilities.SupportsSubsampling(Subsampling::NONE, 1));
+  EXPECT_TRUE(capabilities.SupportsSubsampling(Subsampling::BINNING, 4));
+  EXPECT_FALSE(capabilities.SupportsSubsampling(Subsampling::BINNING, 3));
+  EXPECT_FALSE(capabilities.SupportsSubsampling(Subsampling::DECIMATION, 2));
+}
+
+TEST(ReadoutModeTest, Binning) {
+  const cv::Mat input = MakeBayerImage(12, 8);
+  cv::Mat output;
+  ASSERT_TRUE(
+      SubsampleBayerImage(input, Subsampling::BINNING, 2, &output).ok());
+  ASSERT_THAT(output.cols, Eq(6));
+  ASSERT_THAT(output.rows, Eq(4));
+  for (int y = 0; y < output.rows; y++) {
+    for (int x = 0; x < output.cols; x++) {
+      // Mean of the pixels of rows input_y and input_y + 2, and columns
+      // input_x and input_x + 2.
+      const int input_y = y / 2 * 4 + y % 2;
+      const int input_x = x / 2 * 4 + x % 2;
+      const int expected = input_y * 100 + input_x + 101;
+      EXPECT_THAT(output.at<uint16_t>(y, x), Eq(expected));
+    }
+  }
+}
+
+TEST(ReadoutModeTest, Decimation) {
+  const cv::Mat input = MakeBayerImage(18, 6);
+  cv::Mat output;
+  ASSERT_TRUE(
+      SubsampleBayerImage(input, Subsampling::DECIMATION, 3, &output).ok());
+  ASSERT_THAT(output.cols, Eq(6));
+  ASSERT_THAT(output.rows, Eq(2));
+  for (int y = 0; y < output.rows; y++) {
+    for (int x = 0; x < output.cols; x++) {
+      EXPECT_THAT(output.at<uint16_t>(y, x),
+                  Eq((y / 2 * 6 + y % 2) * 100 + x / 2 * 6 + x % 2));
+    }
+  }
+}
+
+TEST(ReadoutModeTest, SubsampleInvalid) {
+  cv::Mat output;
+  EXPECT_FALSE(SubsampleBayerImage(MakeBayerImage(12, 6),
+                                   Subsampling::BINNING, 2, &output)
+                   .ok());
+  EXPECT_FALSE(SubsampleBayerImage(MakeBayerImage(12, 8), Subsampling::NONE,
+                                   2, &output)
+                   .ok());
+}
+
+TEST(ReadoutModeTest, ApplyWindowAndSubsampling) {
+  const cv::Mat input = MakeBayerImage(24, 16);
+  ReadoutMode mode;
+  mode.roi = cv::Rect(4, 8, 16, 8);
+  cv::Mat window;
+  ASSERT_TRUE(ApplyReadoutMode(input, mode, &window).ok());
+  ASSERT_THAT(window.cols, Eq(16));
+  ASSERT_THAT(window.rows, Eq(8));
+  EXPECT_THAT(window.at<uint16_t>(0, 0), Eq(8 * 100 + 4));
+
+  mode.subsampling = Subsampling::DECIMATION;
+  mode.factor = 2;
+  cv::Mat output;
+  ASSERT_TRUE(ApplyReadoutMode(input, mode, &output).ok());
+  cv::Mat expected;
+  ASSERT_TRUE(
+      SubsampleBayerImage(window, Subsampling::DECIMATION, 2, &expected).ok());
+  ASSERT_THAT(output.cols, Eq(8));
+  ASSERT_THAT(output.rows, Eq(4));
+  for (int y = 0; y < output.rows; y++) {
+    for (int x = 0; x < output.cols; x++) {
+      EXPECT_THAT(output.at<uint16_t>(y, x), Eq(expected.at<uint16_t>(y, x)));
+    }
+  }
+
+  mode.roi = cv::Rect(2, 0, 16, 8);
+  EXPECT_FALSE(ApplyReadoutMode(input, mode, &output).ok());
+}
+
+TEST(ReadoutModeTest, MapSensorPixel) {
+  ReadoutMode mode;
+  cv::Point pixel;
+  ASSERT_TRUE(MapSensorPixel(mode, cv::Point(5, 3), &pixel));
+  EXPECT_THAT(pixel, Eq(cv::Point(5, 3)));
+
+  mode.roi = cv::Rect(4, 8, 16, 8);
+  ASSERT_TRUE(MapSensorPixel(mode, cv::Point(5, 9), &pixel));
+  EXPECT_THAT(pixel, Eq(cv::Point(1, 1)));
+  EXPECT_FALSE(MapSensorPixel(mode, cv::Point(3, 9), &pixel));
+  EXPECT_FALSE(MapSensorPixel(mode, cv::Point(5, 16), &pixel));
+
+  // Every pixel read out by the subsampling maps to the output pixel it
+  // lands in.
+  const cv::Mat input = MakeBayerImage(24, 16);
+  for (Subsampling subsampling :
+       {Subsampling::BINNING, Subsampling::DECIMATION}) {
+    mode.subsampling = subsampling;
+    mode.factor = 2;
+    cv::Mat output;
+    ASSERT_TRUE(ApplyReadoutMode(input, mode, &output).ok());
+    int num_mapped = 0;
+    for (int y = 0; y < input.rows; y++) {
+      for (int x = 0; x < input.cols; x++) {
+        if (!MapSensorPixel(mode, cv::Point(x, y), &pixel)) continue;
+        num_mapped++;
+        ASSERT_TRUE(cv::Rect(0, 0, output.cols, output.rows).contains(pixel));
+        if (subsampling == Subsampling::DECIMATION) {
+          EXPECT_THAT(output.at<uint16_t>(pixel), Eq(input.at<uint16_t>(y, x)));
+        }
+      }
+    }
+    EXPECT_THAT(num_mapped, Eq(subsampling == Subsampling::BINNING
+                                   ? mode.roi.area()
+                                   : mode.roi.area() / 4));
+  }
+}
+
+}  // namespace
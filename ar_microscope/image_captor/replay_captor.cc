@@ -0,0 +1,203 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_captor/replay_captor.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <thread>
+
+#include "absl/flags/flag.h"
+#include "absl/strings/str_format.h"
+#include "absl/time/clock.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/platform/logging.h"
+
+ABSL_FLAG(std::string, replay_file, "",
+          "Raw recording replayed by --capture_device=replay.");
+ABSL_FLAG(bool, replay_realtime, true,
+          "Replays the frames at the pace of their capture, dropping the "
+          "frames that the looper is too slow for. Otherwise frames are "
+          "replayed as fast as the looper requests them.");
+ABSL_FLAG(bool, replay_loop, true,
+          "Restarts the replay at the end of the recording. Otherwise capture "
+          "fails with OutOfRange after the last frame.");
+ABSL_FLAG(int, replay_pulse_period, 0,
+          "Replaces the recorded frames by a light pulse, black frames and "
+          "saturated frames alternating every half of the period, in frames, "
+          "to measure the latency from the sensor to the display. The "
+          "recording still sets the frame format and pace. Disabled if 0.");
+
+namespace image_captor {
+
+ReplayCaptor::~ReplayCaptor() {
+  StopAsyncCapture();
+  tensorflow::Status status = Finalize();
+  if (!status.ok()) {
+    LOG(ERROR) << "Replay captor finalize error: " << status;
+  }
+}
+
+tensorflow::Status ReplayCaptor::Initialize() {
+  TF_RETURN_IF_ERROR(Finalize());
+  realtime_ = absl::GetFlag(FLAGS_replay_realtime);
+  loop_ = absl::GetFlag(FLAGS_replay_loop);
+  const std::string path = absl::GetFlag(FLAGS_replay_file);
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return tensorflow::errors::NotFound(absl::StrFormat(
+        "Failed to open raw recording %s: %s", path, strerror(errno)));
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 ||
+      file_stat.st_size < static_cast<off_t>(sizeof(RawRecordingHeader))) {
+    close(fd);
+    return tensorflow::errors::InvalidArgument(
+        absl::StrFormat("Invalid raw recording %s.", path));
+  }
+  const size_t size = file_stat.st_size;
+  // Recordings may be larger than the memory, so the pages are read in as
+  // the frames are served.
+  void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return tensorflow::errors::Internal(absl::StrFormat(
+        "Failed to map raw recording %s: %s", path, strerror(errno)));
+  }
+  const RawRecordingHeader& header =
+      *static_cast<const RawRecordingHeader*>(data);
+  tensorflow::Status status = CheckRawRecordingHeader(header, size);
+  if (status.ok() && header.num_frames == 0) {
+    status = tensorflow::errors::InvalidArgument("Raw recording is empty.");
+  }
+  if (!status.ok()) {
+    munmap(data, size);
+    return status;
+  }
+  madvise(data, size, MADV_SEQUENTIAL);
+  data_ = data;
+  size_ = size;
+  header_ = header;
+  next_frame_ = 0;
+  num_served_frames_ = 0;
+  num_dropped_frames_ = 0;
+  pacing_started_ = false;
+  pulse_period_ = absl::GetFlag(FLAGS_replay_pulse_period);
+  pulse_on_ = false;
+  if (pulse_period_ > 0) {
+    // All bits set is the maximum value of every packing.
+    dark_frame_.assign(header_.frame_bytes, 0);
+    bright_frame_.assign(header_.frame_bytes, 0xff);
+  }
+  {
+    absl::MutexLock unused_lock(&pulse_mutex_);
+    pulse_edges_.clear();
+  }
+  LOG(INFO) << "Replaying " << header_.num_frames << " frames of "
+            << header_.width << " x " << header_.height << " from " << path;
+  return tensorflow::Status();
+}
+
+tensorflow::Status ReplayCaptor::Finalize() {
+  if (data_) {
+    LOG(INFO) << "Replayed " << num_served_frames_ << " frames, dropped "
+              << num_dropped_frames_;
+    munmap(data_, size_);
+    data_ = nullptr;
+  }
+  return tensorflow::Status();
+}
+
+int ReplayCaptor::GetExposureTimeInMicroseconds() {
+  const RawFrameHeader* frame_header = GetLastFrameHeader();
+  return frame_header ? frame_header->exposure_time_microseconds : -1;
+}
+
+std::vector<absl::Time> ReplayCaptor::GetPulseEdges() const {
+  absl::MutexLock unused_lock(&pulse_mutex_);
+  return pulse_edges_;
+}
+
+const RawFrameHeader* ReplayCaptor::GetLastFrameHeader() const {
+  if (!data_ || num_served_frames_ == 0) return nullptr;
+  return &GetFrameHeader(last_frame_);
+}
+
+tensorflow::Status ReplayCaptor::CaptureImage(uint8_t** image) {
+  if (!data_) {
+    return tensorflow::errors::FailedPrecondition(
+        "Replay captor is not initialized.");
+  }
+  if (next_frame_ >= header_.num_frames) {
+    if (!loop_) {
+      return tensorflow::errors::OutOfRange("End of the raw recording.");
+    }
+    next_frame_ = 0;
+    pacing_started_ = false;
+  }
+  if (realtime_) WaitForNextFrame();
+  last_frame_ = next_frame_++;
+  num_served_frames_++;
+  if (pulse_period_ > 0) {
+    *image = GetPulseFrame();
+    return tensorflow::Status();
+  }
+  // The mapping is read-only, and the debayer only reads the frame.
+  *image = const_cast<uint8_t*>(GetRecord(last_frame_)) +
+           sizeof(RawFrameHeader);
+  return tensorflow::Status();
+}
+
+uint8_t* ReplayCaptor::GetPulseFrame() {
+  // The pulse follows the frames of the sensor, including the dropped ones.
+  const int64_t sensor_frame = num_served_frames_ + num_dropped_frames_ - 1;
+  const bool pulse_on = sensor_frame / ((pulse_period_ + 1) / 2) % 2 == 1;
+  if (pulse_on != pulse_on_) {
+    pulse_on_ = pulse_on;
+    absl::MutexLock unused_lock(&pulse_mutex_);
+    pulse_edges_.push_back(absl::Now());
+  }
+  return pulse_on_ ? bright_frame_.data() : dark_frame_.data();
+}
+
+void ReplayCaptor::WaitForNextFrame() {
+  const auto now = std::chrono::steady_clock::now();
+  if (!pacing_started_) {
+    pacing_started_ = true;
+    pacing_start_ = now;
+    pacing_start_timestamp_ =
+        GetFrameHeader(next_frame_).timestamp_microseconds;
+    return;
+  }
+  auto get_due_time = [this](size_t frame) {
+    return pacing_start_ +
+           std::chrono::microseconds(
+               GetFrameHeader(frame).timestamp_microseconds -
+               pacing_start_timestamp_);
+  };
+  // A live camera overwrites the frames that are not read in time.
+  while (next_frame_ + 1 < header_.num_frames &&
+         get_due_time(next_frame_ + 1) <= now) {
+    next_frame_++;
+    num_dropped_frames_++;
+  }
+  std::this_thread::sleep_until(get_due_time(next_frame_));
+}
+
+}  // namespace image_captor
@@ -0,0 +1,129 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#ifndef AR_MICROSCOPE_IMAGE_CAPTOR_REPLAY_CAPTOR_H_
+#define AR_MICROSCOPE_IMAGE_CAPTOR_REPLAY_CAPTOR_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "image_captor/image_captor.h"
+#include "image_captor/raw_recording.h"
+#include "tensorflow/core/lib/core/status.h"
+
+namespace image_captor {
+
+// Image captor that replays a raw recording, see raw_recording.h, from
+// --replay_file. The recording is memory-mapped and its frames are served
+// without a copy, so that the pipeline can be run and benchmarked on any
+// Linux machine. With --replay_realtime, frames are served at the pace of
+// their capture timestamps, and frames that the caller is too slow for are
+// dropped as a live camera would. Otherwise they are served as fast as they
+// are requested.
+//
+// With --replay_pulse_period, the recorded frames are replaced by a synthetic
+// light pulse, which stands in for a light source switched on and off in front
+// of the sensor: the latency to the display is the time from each switch,
+// returned by GetPulseEdges, to the display of the first image with the new
+// state.
+class ReplayCaptor : public ImageCaptor {
+ public:
+  ~ReplayCaptor() override;
+
+  tensorflow::Status Initialize() override;
+  tensorflow::Status Finalize() override;
+
+  int GetSensorWidth() override { return header_.width; }
+
+  int GetSensorHeight() override { return header_.height; }
+
+  image_processor::BayerPattern GetBayerPattern() override {
+    return static_cast<image_processor::BayerPattern>(header_.pattern);
+  }
+
+  image_processor::BayerPacking GetBayerPacking() override {
+    return static_cast<image_processor::BayerPacking>(header_.packing);
+  }
+
+  // Returns the recorded exposure time of the last frame.
+  int GetExposureTimeInMicroseconds() override;
+
+  // Returns the header of the last frame, or nullptr before the first one.
+  const RawFrameHeader* GetLastFrameHeader() const;
+
+  // Returns the number of frames served and dropped by the real-time pacing.
+  int64_t GetNumServedFrames() const { return num_served_frames_; }
+  int64_t GetNumDroppedFrames() const override { return num_dropped_frames_; }
+
+  // Returns the times the light pulse was switched on or off, alternately
+  // from off, as the time the first frame of the new state was served.
+  std::vector<absl::Time> GetPulseEdges() const;
+
+ protected:
+  // Returns the frame in the mapped recording. It must not be written.
+  tensorflow::Status CaptureImage(uint8_t** image) override;
+
+  int GetBytesPerPixel() override { return header_.bytes_per_pixel; }
+
+ private:
+  const uint8_t* GetRecord(size_t frame) const {
+    return static_cast<const uint8_t*>(data_) +
+           GetRawRecordOffset(header_, frame);
+  }
+
+  const RawFrameHeader& GetFrameHeader(size_t frame) const {
+    return *reinterpret_cast<const RawFrameHeader*>(GetRecord(frame));
+  }
+
+  // Skips the frames that are overdue, and waits until the next frame is due.
+  void WaitForNextFrame();
+
+  // Returns the frame of the light pulse in the state of the served frame.
+  uint8_t* GetPulseFrame();
+
+  bool realtime_ = true;
+  bool loop_ = true;
+
+  void* data_ = nullptr;
+  size_t size_ = 0;
+  RawRecordingHeader header_ = {};
+
+  // Frame to serve next, and the last served frame.
+  size_t next_frame_ = 0;
+  size_t last_frame_ = 0;
+  int64_t num_served_frames_ = 0;
+  int64_t num_dropped_frames_ = 0;
+
+  // Whether the pacing has started since the start of the recording, the time
+  // it started, and the timestamp of its first frame.
+  bool pacing_started_ = false;
+  std::chrono::steady_clock::time_point pacing_start_;
+  int64_t pacing_start_timestamp_ = 0;
+
+  // Light pulse, with a period in frames, or 0 to serve the recorded frames.
+  int pulse_period_ = 0;
+  bool pulse_on_ = false;
+  std::vector<uint8_t> dark_frame_;
+  std::vector<uint8_t> bright_frame_;
+  mutable absl::Mutex pulse_mutex_;
+  std::vector<absl::Time> pulse_edges_ ABSL_GUARDED_BY(pulse_mutex_);
+};
+
+}  // namespace image_captor
+
+#endif  // AR_MICROSCOPE_IMAGE_CAPTOR_REPLAY_CAPTOR_H_
@@ -0,0 +1,572 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_captor/replay_captor.h"
+
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "opencv2/core.hpp"
+#include "absl/flags/flag.h"
+#include "absl/synchronization/notification.h"
+#include "image_captor/raw_recording.h"
+#include "image_captor/readout_mode.h"
+#include "image_processor/debayer.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/core/status.h"
+
+extern absl::Flag<std::string> FLAGS_replay_file;
+extern absl::Flag<bool> FLAGS_replay_realtime;
+extern absl::Flag<bool> FLAGS_replay_loop;
+extern absl::Flag<int> FLAGS_replay_pulse_period;
+
+namespace {
+
+using image_captor::MakeRawRecordingHeader;
+using image_captor::RawFrameHeader;
+using image_captor::RawRecordingHeader;
+using image_captor::ReplayCaptor;
+using image_processor::BayerPacking;
+using image_processor::BayerPattern;
+using image_processor::DebayerMode;
+
+using ::testing::ElementsAre;
+using ::testing::Eq;
+
+constexpr int kWidth = 24;
+constexpr int kHeight = 8;
+
+std::string GetTestPath(const std::string& name) {
+  return ::testing::TempDir() + "/" + name;
+}
+
+// Returns the frames of random bytes of the recording.
+std::vector<std::vector<uint8_t>> MakeFrames(const RawRecordingHeader& header,
+                                             int num_frames) {
+  std::mt19937 generator(num_frames);
+  std::uniform_int_distribution<int> distribution(0, 0xff);
+  std::vector<std::vector<uint8_t>> frames(num_frames);
+  for (std::vector<uint8_t>& frame : frames) {
+    frame.resize(header.frame_bytes);
+    for (uint8_t& value : frame) value = distribution(generator);
+  }
+  return frames;
+}
+
+// Writes the recording of the frames, captured at the timestamps.
+void WriteRecording(const std::string& path, RawRecordingHeader header,
+                    const std::vector<std::vector<uint8_t>>& frames,
+                    const std::vector<int64_t>& timestamps) {
+  header.num_frames = frames.size();
+  std::vector<uint8_t> file(
+      image_captor::GetRawRecordOffset(header, frames.size()));
+  memcpy(file.data(), &header, sizeof(header));
+  for (size_t i = 0; i < frames.size(); i++) {
+    RawFrameHeader frame_header = {};
+    frame_header.timestamp_microseconds = timestamps[i];
+    frame_header.frame_id = 100 + i;
+    frame_header.exposure_time_microseconds = 1000 + i;
+    uint8_t* record = file.data() + image_captor::GetRawRecordOffset(header, i);
+    memcpy(record, &frame_header, sizeof(frame_header));
+    memcpy(record + sizeof(frame_header), frames[i].data(), frames[i].size());
+  }
+  FILE* output = fopen(path.c_str(), "wb");
+  ASSERT_NE(output, nullptr);
+  ASSERT_THAT(fwrite(file.data(), 1, file.size(), output), Eq(file.size()));
+  fclose(output);
+}
+
+void SetReplayFlags(const std::string& path, bool realtime, bool loop) {
+  absl::SetFlag(&FLAGS_replay_file, path);
+  absl::SetFlag(&FLAGS_replay_realtime, realtime);
+  absl::SetFlag(&FLAGS_replay_loop, loop);
+}
+
+TEST(ReplayCaptorTest, ServesFrames) {
+  const RawRecordingHeader header = MakeRawRecordingHeader(
+      kWidth, kHeight, 2, BayerPacking::NONE, BayerPattern::GRBG);
+  const auto frames = MakeFrames(header, 3);
+  const std::string path = GetTestPath("frames.raw");
+  WriteRecording(path, header, frames, {0, 10, 20});
+  SetReplayFlags(path, false, true);
+  ReplayCaptor captor;
+  ASSERT_TRUE(captor.Initialize().ok());
+  EXPECT_THAT(captor.GetSensorWidth(), Eq(kWidth));
+  EXPECT_THAT(captor.GetSensorHeight(), Eq(kHeight));
+  EXPECT_THAT(captor.GetBayerPattern(), Eq(BayerPattern::GRBG));
+  EXPECT_THAT(captor.GetExposureTimeInMicroseconds(), Eq(-1));
+  // The replay restarts after the last frame.
+  for (int i = 0; i < 5; i++) {
+    cv::Mat bayer;
+    ASSERT_TRUE(captor.GetBayerImage(&bayer).ok());
+    ASSERT_THAT(bayer.type(), Eq(CV_16UC1));
+    const std::vector<uint8_t>& frame = frames[i % 3];
+    for (int y = 0; y < kHeight; y++) {
+      ASSERT_THAT(memcmp(bayer.ptr(y), frame.data() + y * kWidth * 2,
+                         kWidth * 2),
+                  Eq(0));
+    }
+    EXPECT_THAT(captor.GetLastFrameHeader()->frame_id, Eq(100 + i % 3));
+    EXPECT_THAT(captor.GetExposureTimeInMicroseconds(), Eq(1000 + i % 3));
+  }
+  EXPECT_THAT(captor.GetNumServedFrames(), Eq(5));
+}
+
+TEST(ReplayCaptorTest, PackedFrames) {
+  const RawRecordingHeader header = MakeRawRecordingHeader(
+      kWidth, kHeight, 2, BayerPacking::RAW12, BayerPattern::RGGB);
+  EXPECT_THAT(header.frame_bytes, Eq(kWidth * kHeight * 3 / 2));
+  const auto frames = MakeFrames(header, 1);
+  const std::string path = GetTestPath("packed.raw");
+  WriteRecording(path, header, frames, {0});
+  SetReplayFlags(path, false, true);
+  ReplayCaptor captor;
+  ASSERT_TRUE(captor.Initialize().ok());
+  EXPECT_THAT(captor.GetBayerPacking(), Eq(BayerPacking::RAW12));
+
+  image_processor::Debayer debayer;
+  debayer.SetBayerPacking(BayerPacking::RAW12);
+  const cv::Mat packed(kHeight, kWidth * 3 / 2, CV_8UC1,
+                       const_cast<uint8_t*>(frames[0].data()));
+  cv::Mat unpacked;
+  ASSERT_TRUE(debayer.UnpackBayerImage(packed, &unpacked).ok());
+  debayer.SetBayerPacking(BayerPacking::NONE);
+  cv::Mat expected;
+  ASSERT_TRUE(debayer.HalfDebayer(unpacked, BayerPattern::RGGB, true,
+                                  &expected)
+                  .ok());
+
+  cv::Mat bayer;
+  ASSERT_TRUE(captor.GetBayerImage(&bayer).ok());
+  ASSERT_THAT(bayer.type(), Eq(CV_16UC1));
+  ASSERT_THAT(bayer.cols, Eq(kWidth));
+  for (int y = 0; y < kHeight; y++) {
+    ASSERT_THAT(memcmp(bayer.ptr(y), unpacked.ptr(y), kWidth * 2), Eq(0));
+  }
+  cv::Mat rgb;
+  ASSERT_TRUE(captor.GetImage(true, &rgb).ok());
+  ASSERT_THAT(rgb.cols, Eq(expected.cols));
+  ASSERT_THAT(rgb.rows, Eq(expected.rows));
+  for (int y = 0; y < rgb.rows; y++) {
+    ASSERT_THAT(memcmp(rgb.ptr(y), expected.ptr(y), rgb.cols * 3), Eq(0));
+  }
+}
+
+TEST(ReplayCaptorTest, EndOfRecording) {
+  const RawRecordingHeader header = MakeRawRecordingHeader(
+      kWidth, kHeight, 1, BayerPacking::NONE, BayerPattern::RGGB);
+  const std::string path = GetTestPath("end.raw");
+  WriteRecording(path, header, MakeFrames(header, 2), {0, 10});
+  SetReplayFlags(path, false, false);
+  ReplayCaptor captor;
+  ASSERT_TRUE(captor.Initialize().ok());
+  cv::Mat rgb;
+  ASSERT_TRUE(captor.GetImage(true, &rgb).ok());
+  ASSERT_TRUE(captor.GetImage(true, &rgb).ok());
+  EXPECT_TRUE(tensorflow::errors::IsOutOfRange(captor.GetImage(true, &rgb)));
+}
+
+TEST(ReplayCaptorTest, RealtimePacing) {
+  const RawRecordingHeader header = MakeRawRecordingHeader(
+      kWidth, kHeight, 1, BayerPacking::NONE, BayerPattern::RGGB);
+  const std::string path = GetTestPath("realtime.raw");
+  WriteRecording(path, header, MakeFrames(header, 4),
+                 {5000, 35000, 65000, 95000});
+  SetReplayFlags(path, true, false);
+  ReplayCaptor captor;
+  ASSERT_TRUE(captor.Initialize().ok());
+  cv::Mat bayer;
+  const auto start = std::chrono::steady_clock::now();
+  ASSERT_TRUE(captor.GetBayerImage(&bayer).ok());
+  ASSERT_TRUE(captor.GetBayerImage(&bayer).ok());
+  EXPECT_GE(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(30));
+  EXPECT_THAT(captor.GetLastFrameHeader()->frame_id, Eq(101));
+  // Frame 102 is overwritten while the caller is busy.
+  std::this_thread::sleep_until(start + std::chrono::milliseconds(100));
+  ASSERT_TRUE(captor.GetBayerImage(&bayer).ok());
+  EXPECT_THAT(captor.GetLastFrameHeader()->frame_id, Eq(103));
+  EXPECT_THAT(captor.GetNumDroppedFrames(), Eq(1));
+}
+
+TEST(ReplayCaptorTest, EmulatedReadoutMode) {
+  for (BayerPacking packing : {BayerPacking::NONE, BayerPacking::RAW12}) {
+    const RawRecordingHeader header = MakeRawRecordingHeader(
+        kWidth, kHeight, 2, packing, BayerPattern::RGGB);
+    const std::string path = GetTestPath("readout.raw");
+    WriteRecording(path, header, MakeFrames(header, 1), {0});
+    SetReplayFlags(path, false, true);
+    ReplayCaptor captor;
+    ASSERT_TRUE(captor.Initialize().ok());
+    cv::Mat full;
+    ASSERT_TRUE(captor.GetBayerImage(&full).ok());
+
+    image_captor::ReadoutMode mode;
+    mode.roi = cv::Rect(4, 0, 16, 8);
+    mode.subsampling = image_captor::Subsampling::BINNING;
+    mode.factor = 2;
+    ASSERT_TRUE(captor.SetReadoutMode(mode).ok());
+    EXPECT_THAT(captor.GetBayerWidth(), Eq(8));
+    EXPECT_THAT(captor.GetBayerHeight(), Eq(4));
+    EXPECT_THAT(captor.GetImageWidth(), Eq(4));
+    EXPECT_THAT(captor.GetImageHeight(), Eq(2));
+    cv::Mat expected;
+    ASSERT_TRUE(image_captor::SubsampleBayerImage(
+                    full(mode.roi), mode.subsampling, mode.factor, &expected)
+                    .ok());
+    cv::Mat bayer;
+    ASSERT_TRUE(captor.GetBayerImage(&bayer).ok());
+    ASSERT_THAT(bayer.cols, Eq(8));
+    ASSERT_THAT(bayer.rows, Eq(4));
+    for (int y = 0; y < bayer.rows; y++) {
+      ASSERT_THAT(memcmp(bayer.ptr(y), expected.ptr(y), bayer.cols * 2),
+                  Eq(0));
+    }
+    cv::Mat rgb;
+    ASSERT_TRUE(captor.GetImage(true, &rgb).ok());
+    EXPECT_THAT(rgb.cols, Eq(4));
+    EXPECT_THAT(rgb.rows, Eq(2));
+
+    // Windows must keep the Bayer pattern.
+    mode.roi = cv::Rect(2, 0, 16, 8);
+    EXPECT_FALSE(captor.SetReadoutMode(mode).ok());
+    EXPECT_THAT(captor.GetBayerWidth(), Eq(8));
+  }
+}
+
+TEST(ReplayCaptorTest, AsyncCapture) {
+  constexpr int kNumFrames = 4;
+  const RawRecordingHeader header = MakeRawRecordingHeader(
+      kWidth, kHeight, 1, BayerPacking::NONE, BayerPattern::RGGB);
+  const std::string path = GetTestPath("async.raw");
+  WriteRecording(path, header, MakeFrames(header, kNumFrames), {0, 1, 2, 3});
+  SetReplayFlags(path, false, false);
+  std::vector<cv::Mat> expected(kNumFrames);
+  {
+    ReplayCaptor captor;
+    ASSERT_TRUE(captor.Initialize().ok());
+    for (cv::Mat& image : expected) {
+      ASSERT_TRUE(captor.GetImage(false, &image).ok());
+    }
+  }
+
+  ReplayCaptor captor;
+  ASSERT_TRUE(captor.Initialize().ok());
+  ASSERT_TRUE(captor.StartAsyncCapture(false).ok());
+  EXPECT_FALSE(captor.StartAsyncCapture(false).ok());
+  cv::Mat bayer;
+  EXPECT_FALSE(captor.GetBayerImage(&bayer).ok());
+  cv::Mat image;
+  EXPECT_FALSE(captor.GetImage(true, &image).ok());
+  // Images come newest first, and the others are dropped, until the end of
+  // the recording.
+  int num_images = 0;
+  int last_frame = -1;
+  tensorflow::Status status;
+  while ((status = captor.GetImage(false, &image)).ok()) {
+    num_images++;
+    int frame = last_frame + 1;
+    while (frame < kNumFrames &&
+           memcmp(image.ptr(), expected[frame].ptr(), image.total() * 3)) {
+      frame++;
+    }
+    ASSERT_LT(frame, kNumFrames);
+    // The frame identifiers follow the images.
+    EXPECT_THAT(captor.GetLastFrameInfo().id, Eq(frame + 1));
+    last_frame = frame;
+  }
+  EXPECT_TRUE(tensorflow::errors::IsOutOfRange(status));
+  EXPECT_THAT(last_frame, Eq(kNumFrames - 1));
+  EXPECT_THAT(num_images + captor.GetNumDroppedAsyncImages(), Eq(kNumFrames));
+  // The capture is retried after errors.
+  EXPECT_TRUE(tensorflow::errors::IsOutOfRange(captor.GetImage(false, &image)));
+  EXPECT_TRUE(captor.IsAsyncCaptureRunning());
+  captor.StopAsyncCapture();
+  EXPECT_FALSE(captor.IsAsyncCaptureRunning());
+}
+
+TEST(ReplayCaptorTest, AsyncCaptureIntoCallerBuffers) {
+  constexpr int kNumFrames = 4;
+  const RawRecordingHeader header = MakeRawRecordingHeader(
+      kWidth, kHeight, 1, BayerPacking::NONE, BayerPattern::RGGB);
+  const std::string path = GetTestPath("caller_buffers.raw");
+  WriteRecording(path, header, MakeFrames(header, kNumFrames), {0, 1, 2, 3});
+  SetReplayFlags(path, false, true);
+  std::vector<cv::Mat> expected(kNumFrames);
+  {
+    ReplayCaptor captor;
+    ASSERT_TRUE(captor.Initialize().ok());
+    for (cv::Mat& image : expected) {
+      ASSERT_TRUE(captor.GetImage(true, &image).ok());
+    }
+  }
+
+  ReplayCaptor captor;
+  ASSERT_TRUE(captor.Initialize().ok());
+  ASSERT_TRUE(captor.StartAsyncCapture(true).ok());
+  // The caller passes views of padded buffers, as the inferers do, and gets
+  // back the buffers it passed once the captor has written a frame into them.
+  const cv::Rect roi(1, 1, captor.GetImageWidth(), captor.GetImageHeight());
+  std::vector<cv::Mat> padded(4);
+  std::vector<bool> in_captor(padded.size(), false);
+  for (cv::Mat& buffer : padded) {
+    buffer.create(roi.height + 2, roi.width + 2, CV_8UC3);
+  }
+  int num_images_in_caller_buffers = 0;
+  constexpr int kNumImages = 12;
+  for (int i = 0; i < kNumImages; i++) {
+    int free_buffer = 0;
+    while (in_captor[free_buffer]) free_buffer++;
+    cv::Mat image = padded[free_buffer](roi);
+    ASSERT_TRUE(captor.GetImage(true, &image).ok());
+    in_captor[free_buffer] = true;
+    for (size_t j = 0; j < padded.size(); j++) {
+      if (image.data == padded[j].ptr(1, 1)) {
+        in_captor[j] = false;
+        num_images_in_caller_buffers++;
+      }
+    }
+    bool is_captured_frame = false;
+    for (const cv::Mat& frame : expected) {
+      bool equal = true;
+      for (int y = 0; y < image.rows; y++) {
+        equal &= !memcmp(image.ptr(y), frame.ptr(y), image.cols * 3);
+      }
+      is_captured_frame |= equal;
+    }
+    EXPECT_TRUE(is_captured_frame) << "Image " << i;
+  }
+  captor.StopAsyncCapture();
+  // Only the images of the first three calls come in buffers of the captor.
+  EXPECT_THAT(num_images_in_caller_buffers, Eq(kNumImages - 3));
+}
+
+TEST(ReplayCaptorTest, DestroyedDuringAsyncCapture) {
+  const RawRecordingHeader header = MakeRawRecordingHeader(
+      kWidth, kHeight, 1, BayerPacking::NONE, BayerPattern::RGGB);
+  const std::string path = GetTestPath("destroyed.raw");
+  WriteRecording(path, header, MakeFrames(header, 2), {0, 10});
+  SetReplayFlags(path, false, true);
+  // The captor stops the capture thread before it releases the recording.
+  auto captor = std::make_unique<ReplayCaptor>();
+  ASSERT_TRUE(captor->Initialize().ok());
+  ASSERT_TRUE(captor->StartAsyncCapture(true).ok());
+  cv::Mat image;
+  ASSERT_TRUE(captor->GetImage(true, &image).ok());
+  captor.reset();
+}
+
+TEST(ReplayCaptorTest, AsyncChannelStatistics) {
+  constexpr int kNumFrames = 4;
+  const RawRecordingHeader header = MakeRawRecordingHeader(
+      kWidth, kHeight, 1, BayerPacking::NONE, BayerPattern::RGGB);
+  const std::string path = GetTestPath("statistics.raw");
+  WriteRecording(path, header, MakeFrames(header, kNumFrames), {0, 1, 2, 3});
+  SetReplayFlags(path, false, true);
+  ReplayCaptor captor;
+  ASSERT_TRUE(captor.Initialize().ok());
+  captor.SetCollectStatistics(true);
+  ASSERT_TRUE(captor.StartAsyncCapture(true).ok());
+  // The statistics come with the frame they were gathered from, even though
+  // later frames are being debayered.
+  cv::Mat image;
+  for (int i = 0; i < 8; i++) {
+    ASSERT_TRUE(captor.GetImage(true, &image).ok());
+    const image_processor::ChannelStatistics& statistics =
+        captor.GetLastFrameInfo().channel_statistics;
+    ASSERT_THAT(statistics.num_pixels, Eq(image.total()));
+    for (int channel = 0; channel < 3; channel++) {
+      double sum = 0;
+      for (int y = 0; y < image.rows; y++) {
+        const uint8_t* row = image.ptr(y);
+        for (int x = 0; x < image.cols; x++) sum += row[x * 3 + channel];
+      }
+      EXPECT_DOUBLE_EQ(statistics.means[channel], sum / image.total());
+    }
+  }
+  captor.StopAsyncCapture();
+}
+
+TEST(ReplayCaptorTest, LightPulse) {
+  const RawRecordingHeader header = MakeRawRecordingHeader(
+      kWidth, kHeight, 2, BayerPacking::NONE, BayerPattern::RGGB);
+  const std::string path = GetTestPath("pulse.raw");
+  WriteRecording(path, header, MakeFrames(header, 2), {0, 10});
+  SetReplayFlags(path, false, true);
+  absl::SetFlag(&FLAGS_replay_pulse_period, 4);
+  ReplayCaptor captor;
+  ASSERT_TRUE(captor.Initialize().ok());
+  absl::SetFlag(&FLAGS_replay_pulse_period, 0);
+  // Two dark frames, then two saturated frames, and so on.
+  for (int i = 0; i < 7; i++) {
+    cv::Mat image;
+    ASSERT_TRUE(captor.GetImage(true, &image).ok());
+    const uint8_t expected = (i / 2) % 2 ? 0xff : 0;
+    for (int y = 0; y < image.rows; y++) {
+      for (int x = 0; x < image.cols * 3; x++) {
+        ASSERT_THAT(image.ptr(y)[x], Eq(expected));
+      }
+    }
+    EXPECT_THAT(captor.GetLastFrameInfo().id, Eq(i + 1));
+  }
+  EXPECT_THAT(captor.GetPulseEdges().size(), Eq(3));
+}
+
+// Replay captor whose exposure time is applied one frame after it is set.
+class ExposureReplayCaptor : public ReplayCaptor {
+ public:
+  tensorflow::Status SetExposureTime(int microseconds) override {
+    exposure_times_.push_back(microseconds);
+    return tensorflow::Status();
+  }
+
+  const std::vector<int>& GetSetExposureTimes() const {
+    return exposure_times_;
+  }
+
+ protected:
+  int GetExposureLatencyFrames() override { return 1; }
+
+ private:
+  std::vector<int> exposure_times_;
+};
+
+TEST(ReplayCaptorTest, ExposureBracket) {
+  const RawRecordingHeader header = MakeRawRecordingHeader(
+      kWidth, kHeight, 1, BayerPacking::NONE, BayerPattern::RGGB);
+  const std::string path = GetTestPath("bracket.raw");
+  WriteRecording(path, header, MakeFrames(header, 2), {0, 10});
+  SetReplayFlags(path, false, true);
+  ExposureReplayCaptor captor;
+  ASSERT_TRUE(captor.Initialize().ok());
+  EXPECT_FALSE(captor.StartExposureBracket({100, 0}).ok());
+  ASSERT_TRUE(captor.StartExposureBracket({100, 200}).ok());
+  EXPECT_TRUE(captor.IsBracketingExposure());
+  EXPECT_FALSE(captor.StartExposureBracket({300}).ok());
+  // Each step waits a frame for its exposure to be applied.
+  const int expected_steps[] = {-1, 0, -1, 1, -1};
+  const int expected_exposures[] = {-1, 100, -1, 200, 1000};
+  cv::Mat image;
+  for (int i = 0; i < 5; i++) {
+    ASSERT_TRUE(captor.GetImage(true, &image).ok());
+    EXPECT_THAT(captor.GetLastFrameInfo().bracket_step, Eq(expected_steps[i]));
+    EXPECT_THAT(captor.GetLastFrameInfo().exposure_time_microseconds,
+                Eq(expected_exposures[i]));
+  }
+  EXPECT_FALSE(captor.IsBracketingExposure());
+  EXPECT_THAT(captor.GetSetExposureTimes(), ElementsAre(100, 200));
+}
+
+TEST(ReplayCaptorTest, AsyncExposureBracket) {
+  const RawRecordingHeader header = MakeRawRecordingHeader(
+      kWidth, kHeight, 1, BayerPacking::NONE, BayerPattern::RGGB);
+  const std::string path = GetTestPath("async_bracket.raw");
+  WriteRecording(path, header, MakeFrames(header, 2), {0, 10});
+  SetReplayFlags(path, false, true);
+  ExposureReplayCaptor captor;
+  ASSERT_TRUE(captor.Initialize().ok());
+  ASSERT_TRUE(captor.StartAsyncCapture(true).ok());
+  ASSERT_TRUE(captor.StartExposureBracket({100, 200, 300}).ok());
+  // The frames of the bracket are not dropped, however slow the caller.
+  std::vector<int> steps;
+  cv::Mat image;
+  while (steps.size() < 3) {
+    ASSERT_TRUE(captor.GetImage(true, &image).ok());
+    if (captor.GetLastFrameInfo().bracket_step >= 0) {
+      steps.push_back(captor.GetLastFrameInfo().bracket_step);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+  EXPECT_THAT(steps, ElementsAre(0, 1, 2));
+  captor.StopAsyncCapture();
+}
+
+// Exposure replay captor whose first capture waits until it is released.
+class BlockingReplayCaptor : public ExposureReplayCaptor {
+ public:
+  absl::Notification capture_started;
+  absl::Notification capture_released;
+
+ protected:
+  tensorflow::Status CaptureImage(uint8_t** image) override {
+    if (!capture_started.HasBeenNotified()) {
+      capture_started.Notify();
+      capture_released.WaitForNotification();
+    }
+    return ReplayCaptor::CaptureImage(image);
+  }
+};
+
+TEST(ReplayCaptorTest, ExposureBracketDuringCapture) {
+  const RawRecordingHeader header = MakeRawRecordingHeader(
+      kWidth, kHeight, 1, BayerPacking::NONE, BayerPattern::RGGB);
+  const std::string path = GetTestPath("capture_bracket.raw");
+  WriteRecording(path, header, MakeFrames(header, 2), {0, 10});
+  SetReplayFlags(path, false, true);
+  BlockingReplayCaptor captor;
+  ASSERT_TRUE(captor.Initialize().ok());
+  cv::Mat image;
+  std::thread capture_thread([&captor, &image] {
+    ASSERT_TRUE(captor.GetImage(true, &image).ok());
+  });
+  captor.capture_started.WaitForNotification();
+  ASSERT_TRUE(captor.StartExposureBracket({100}).ok());
+  captor.capture_released.Notify();
+  capture_thread.join();
+  // The frame in flight keeps the exposure it was captured with, and the
+  // latency of the bracket counts from the next frame.
+  EXPECT_THAT(captor.GetLastFrameInfo().bracket_step, Eq(-1));
+  EXPECT_THAT(captor.GetLastFrameInfo().exposure_time_microseconds, Eq(1000));
+  const int expected_steps[] = {-1, 0};
+  const int expected_exposures[] = {-1, 100};
+  for (int i = 0; i < 2; i++) {
+    ASSERT_TRUE(captor.GetImage(true, &image).ok());
+    EXPECT_THAT(captor.GetLastFrameInfo().bracket_step, Eq(expected_steps[i]));
+    EXPECT_THAT(captor.GetLastFrameInfo().exposure_time_microseconds,
+                Eq(expected_exposures[i]));
+  }
+  EXPECT_FALSE(captor.IsBracketingExposure());
+  EXPECT_THAT(captor.GetSetExposureTimes(), ElementsAre(100));
+}
+
+TEST(ReplayCaptorTest, InvalidRecording) {
+  SetReplayFlags(GetTestPath("missing.raw"), false, true);
+  ReplayCaptor captor;
+  EXPECT_FALSE(captor.Initialize().ok());
+
+  RawRecordingHeader header = MakeRawRecordingHeader(
+      kWidth, kHeight, 2, BayerPacking::NONE, BayerPattern::RGGB);
+  const std::string path = GetTestPath("truncated.raw");
+  WriteRecording(path, header, MakeFrames(header, 2), {0, 10});
+  ASSERT_THAT(truncate(path.c_str(), image_captor::GetRawRecordOffset(
+                                         header, 1)),
+              Eq(0));
+  SetReplayFlags(path, false, true);
+  EXPECT_FALSE(captor.Initialize().ok());
+
+  header.packing = static_cast<uint32_t>(BayerPacking::RAW10);
+  EXPECT_FALSE(image_captor::CheckRawRecordingHeader(header, 1 << 20).ok());
+}
+
+}  // namespace
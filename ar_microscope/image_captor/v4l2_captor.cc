@@ -0,0 +1,460 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_captor/v4l2_captor.h"
+
+#include <fcntl.h>
+#include <linux/videodev2.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include "absl/flags/flag.h"
+#include "absl/strings/str_format.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/platform/logging.h"
+
+ABSL_FLAG(std::string, v4l2_device, "/dev/video0",
+          "Video4Linux2 device of --capture_device=v4l2.");
+ABSL_FLAG(std::string, v4l2_pixel_format, "",
+          "Four character code of the Bayer format of the V4L2 camera, such "
+          "as RGGB, RG16 or pRAA. The first Bayer format of the camera if "
+          "empty.");
+ABSL_FLAG(int, v4l2_width, 0,
+          "Width of the V4L2 frames. The current width of the camera if 0.");
+ABSL_FLAG(int, v4l2_height, 0,
+          "Height of the V4L2 frames. The current height of the camera if 0.");
+ABSL_FLAG(int, v4l2_num_buffers, 4,
+          "Number of buffers the V4L2 driver captures into. Frames are "
+          "dropped while all the buffers hold frames not taken yet.");
+
+namespace image_captor {
+namespace {
+
+using image_processor::BayerPacking;
+using image_processor::BayerPattern;
+
+// Time to wait for a frame before capture fails.
+constexpr int kFrameTimeoutMilliseconds = 2000;
+
+// Unit of the absolute exposure control.
+constexpr int kExposureUnitMicroseconds = 100;
+
+struct BayerFormat {
+  uint32_t pixel_format;
+  BayerPattern pattern;
+  int bytes_per_pixel;
+  BayerPacking packing;
+};
+
+// 16-bit formats are little-endian, as the machines the looper runs on.
+constexpr BayerFormat kBayerFormats[] = {
+    {V4L2_PIX_FMT_SRGGB8, BayerPattern::RGGB, 1, BayerPacking::NONE},
+    {V4L2_PIX_FMT_SBGGR8, BayerPattern::BGGR, 1, BayerPacking::NONE},
+    {V4L2_PIX_FMT_SGRBG8, BayerPattern::GRBG, 1, BayerPacking::NONE},
+    {V4L2_PIX_FMT_SGBRG8, BayerPattern::GBRG, 1, BayerPacking::NONE},
+    {V4L2_PIX_FMT_SRGGB16, BayerPattern::RGGB, 2, BayerPacking::NONE},
+    {V4L2_PIX_FMT_SBGGR16, BayerPattern::BGGR, 2, BayerPacking::NONE},
+    {V4L2_PIX_FMT_SGRBG16, BayerPattern::GRBG, 2, BayerPacking::NONE},
+    {V4L2_PIX_FMT_SGBRG16, BayerPattern::GBRG, 2, BayerPacking::NONE},
+    {V4L2_PIX_FMT_SRGGB10P, BayerPattern::RGGB, 2, BayerPacking::RAW10},
+    {V4L2_PIX_FMT_SBGGR10P, BayerPattern::BGGR, 2, BayerPacking::RAW10},
+    {V4L2_PIX_FMT_SGRBG10P, BayerPattern::GRBG, 2, BayerPacking::RAW10},
+    {V4L2_PIX_FMT_SGBRG10P, BayerPattern::GBRG, 2, BayerPacking::RAW10},
+    {V4L2_PIX_FMT_SRGGB12P, BayerPattern::RGGB, 2, BayerPacking::RAW12},
+    {V4L2_PIX_FMT_SBGGR12P, BayerPattern::BGGR, 2, BayerPacking::RAW12},
+    {V4L2_PIX_FMT_SGRBG12P, BayerPattern::GRBG, 2, BayerPacking::RAW12},
+    {V4L2_PIX_FMT_SGBRG12P, BayerPattern::GBRG, 2, BayerPacking::RAW12},
+};
+
+const BayerFormat* FindBayerFormat(uint32_t pixel_format) {
+  for (const BayerFormat& format : kBayerFormats) {
+    if (format.pixel_format == pixel_format) return &format;
+  }
+  return nullptr;
+}
+
+std::string FourccToString(uint32_t fourcc) {
+  return std::string{static_cast<char>(fourcc & 0xff),
+                     static_cast<char>((fourcc >> 8) & 0xff),
+                     static_cast<char>((fourcc >> 16) & 0xff),
+                     static_cast<char>((fourcc >> 24) & 0xff)};
+}
+
+// Retries the ioctl interrupted by a signal.
+int Ioctl(int fd, unsigned long request, void* arg) {  // NOLINT
+  int result;
+  do {
+    result = ioctl(fd, request, arg);
+  } while (result < 0 && errno == EINTR);
+  return result;
+}
+
+tensorflow::Status ErrnoToStatus(const char* error_message) {
+  return tensorflow::errors::Internal(
+      absl::StrFormat("%s: %s", error_message, strerror(errno)));
+}
+
+}  // namespace
+
+V4l2Captor::~V4l2Captor() {
+  StopAsyncCapture();
+  tensorflow::Status status = Finalize();
+  if (!status.ok()) {
+    LOG(ERROR) << "V4L2 captor finalize error: " << status;
+  }
+}
+
+tensorflow::Status V4l2Captor::Initialize() {
+  TF_RETURN_IF_ERROR(Finalize());
+  const std::string path = absl::GetFlag(FLAGS_v4l2_device);
+  // Non-blocking, so that CaptureImage can time out and drain the filled
+  // buffers.
+  fd_ = open(path.c_str(), O_RDWR | O_NONBLOCK);
+  if (fd_ < 0) {
+    return tensorflow::errors::NotFound(absl::StrFormat(
+        "Failed to open V4L2 device %s: %s", path, strerror(errno)));
+  }
+  v4l2_capability capability = {};
+  if (Ioctl(fd_, VIDIOC_QUERYCAP, &capability) < 0) {
+    return ErrnoToStatus("Failed to query V4L2 device");
+  }
+  const uint32_t capabilities =
+      (capability.capabilities & V4L2_CAP_DEVICE_CAPS)
+          ? capability.device_caps
+          : capability.capabilities;
+  if (!(capabilities & V4L2_CAP_VIDEO_CAPTURE) ||
+      !(capabilities & V4L2_CAP_STREAMING)) {
+    return tensorflow::errors::FailedPrecondition(absl::StrFormat(
+        "V4L2 device %s can't stream video capture.", path));
+  }
+  LOG(INFO) << "Camera name: " << capability.card << " ("
+            << capability.driver << ")";
+
+  TF_RETURN_IF_ERROR(SetFormat());
+
+  int32_t minimum, maximum;
+  has_auto_exposure_ =
+      QueryControl(V4L2_CID_EXPOSURE_AUTO, &minimum, &maximum);
+  if (has_auto_exposure_) {
+    // UVC cameras only have the aperture priority mode, in which the
+    // exposure time is automatic and the iris is fixed.
+    auto_exposure_mode_ = HasMenuItem(V4L2_CID_EXPOSURE_AUTO,
+                                      V4L2_EXPOSURE_AUTO)
+                              ? V4L2_EXPOSURE_AUTO
+                              : V4L2_EXPOSURE_APERTURE_PRIORITY;
+  }
+  return StartStreaming();
+}
+
+tensorflow::Status V4l2Captor::SetFormat() {
+  v4l2_format format = {};
+  format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (Ioctl(fd_, VIDIOC_G_FMT, &format) < 0) {
+    return ErrnoToStatus("Failed to get the V4L2 format");
+  }
+  const std::string pixel_format_flag = absl::GetFlag(FLAGS_v4l2_pixel_format);
+  if (!pixel_format_flag.empty()) {
+    if (pixel_format_flag.size() != 4) {
+      return tensorflow::errors::InvalidArgument(absl::StrFormat(
+          "Invalid V4L2 pixel format %s.", pixel_format_flag));
+    }
+    format.fmt.pix.pixelformat =
+        v4l2_fourcc(pixel_format_flag[0], pixel_format_flag[1],
+                    pixel_format_flag[2], pixel_format_flag[3]);
+  } else {
+    v4l2_fmtdesc description = {};
+    description.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    bool found = false;
+    for (; Ioctl(fd_, VIDIOC_ENUM_FMT, &description) == 0;
+         description.index++) {
+      if (FindBayerFormat(description.pixelformat)) {
+        format.fmt.pix.pixelformat = description.pixelformat;
+        found = true;
+        break;
+      }
+    }
+    if (!found) {
+      return tensorflow::errors::FailedPrecondition(
+          "The V4L2 device has no Bayer format.");
+    }
+  }
+  if (absl::GetFlag(FLAGS_v4l2_width) > 0) {
+    format.fmt.pix.width = absl::GetFlag(FLAGS_v4l2_width);
+  }
+  if (absl::GetFlag(FLAGS_v4l2_height) > 0) {
+    format.fmt.pix.height = absl::GetFlag(FLAGS_v4l2_height);
+  }
+  format.fmt.pix.field = V4L2_FIELD_NONE;
+  format.fmt.pix.bytesperline = 0;
+  const uint32_t requested_pixel_format = format.fmt.pix.pixelformat;
+  if (Ioctl(fd_, VIDIOC_S_FMT, &format) < 0) {
+    return ErrnoToStatus("Failed to set the V4L2 format");
+  }
+  // The driver replaces the formats it does not support.
+  const BayerFormat* bayer_format = FindBayerFormat(format.fmt.pix.pixelformat);
+  if (format.fmt.pix.pixelformat != requested_pixel_format || !bayer_format) {
+    return tensorflow::errors::Unimplemented(absl::StrFormat(
+        "V4L2 pixel format %s not supported, the camera provides %s.",
+        FourccToString(requested_pixel_format),
+        FourccToString(format.fmt.pix.pixelformat)));
+  }
+  width_ = format.fmt.pix.width;
+  height_ = format.fmt.pix.height;
+  pattern_ = bayer_format->pattern;
+  bytes_per_pixel_ = bayer_format->bytes_per_pixel;
+  packing_ = bayer_format->packing;
+  // The Bayer images are wrapped without padding, in whole packed groups.
+  const int group_pixels = image_processor::GetPackedGroupPixels(packing_);
+  const size_t row_bytes =
+      packing_ == BayerPacking::NONE
+          ? static_cast<size_t>(width_) * bytes_per_pixel_
+          : static_cast<size_t>(width_) / group_pixels *
+                image_processor::GetPackedGroupBytes(packing_);
+  if (width_ % 2 != 0 || height_ % 2 != 0 || width_ % group_pixels != 0 ||
+      format.fmt.pix.bytesperline != row_bytes) {
+    return tensorflow::errors::Unimplemented(absl::StrFormat(
+        "V4L2 frames of %d x %d with rows of %d bytes not supported.", width_,
+        height_, format.fmt.pix.bytesperline));
+  }
+  frame_bytes_ = row_bytes * height_;
+  LOG(INFO) << "Captured image size " << width_ << " x " << height_ << ", "
+            << FourccToString(format.fmt.pix.pixelformat);
+  return tensorflow::Status();
+}
+
+tensorflow::Status V4l2Captor::StartStreaming() {
+  v4l2_requestbuffers request = {};
+  request.count = absl::GetFlag(FLAGS_v4l2_num_buffers);
+  request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  request.memory = V4L2_MEMORY_MMAP;
+  if (Ioctl(fd_, VIDIOC_REQBUFS, &request) < 0) {
+    return ErrnoToStatus("Failed to request V4L2 buffers");
+  }
+  // One buffer is held while the frame is debayered, so the driver needs
+  // another one to capture into meanwhile.
+  if (request.count < 2) {
+    return tensorflow::errors::ResourceExhausted(
+        "Not enough V4L2 buffers for streaming.");
+  }
+  buffers_.resize(request.count);
+  for (int index = 0; index < static_cast<int>(buffers_.size()); index++) {
+    v4l2_buffer buffer = {};
+    buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buffer.memory = V4L2_MEMORY_MMAP;
+    buffer.index = index;
+    if (Ioctl(fd_, VIDIOC_QUERYBUF, &buffer) < 0) {
+      return ErrnoToStatus("Failed to query V4L2 buffer");
+    }
+    if (buffer.length < frame_bytes_) {
+      return tensorflow::errors::Internal("V4L2 buffer is too small.");
+    }
+    // The frames are only read, by the debayer and the recorder.
+    void* data = mmap(nullptr, buffer.length, PROT_READ, MAP_SHARED, fd_,
+                      buffer.m.offset);
+    if (data == MAP_FAILED) {
+      return ErrnoToStatus("Failed to map V4L2 buffer");
+    }
+    buffers_[index].data = data;
+    buffers_[index].length = buffer.length;
+    TF_RETURN_IF_ERROR(QueueBuffer(index));
+  }
+  v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (Ioctl(fd_, VIDIOC_STREAMON, &type) < 0) {
+    return ErrnoToStatus("Failed to start V4L2 streaming");
+  }
+  streaming_ = true;
+  num_skipped_frames_ = 0;
+  LOG(INFO) << "Streaming into " << buffers_.size() << " V4L2 buffers";
+  return tensorflow::Status();
+}
+
+tensorflow::Status V4l2Captor::Finalize() {
+  if (fd_ < 0) return tensorflow::Status();
+  tensorflow::Status status;
+  if (streaming_) {
+    LOG(INFO) << "Skipped " << num_skipped_frames_ << " V4L2 frames";
+    v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (Ioctl(fd_, VIDIOC_STREAMOFF, &type) < 0) {
+      status = ErrnoToStatus("Failed to stop V4L2 streaming");
+    }
+    streaming_ = false;
+  }
+  for (const Buffer& buffer : buffers_) {
+    if (buffer.data) munmap(buffer.data, buffer.length);
+  }
+  buffers_.clear();
+  dequeued_index_ = -1;
+  // Closing the device frees the buffers of the driver.
+  close(fd_);
+  fd_ = -1;
+  return status;
+}
+
+tensorflow::Status V4l2Captor::QueueBuffer(int index) {
+  v4l2_buffer buffer = {};
+  buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buffer.memory = V4L2_MEMORY_MMAP;
+  buffer.index = index;
+  if (Ioctl(fd_, VIDIOC_QBUF, &buffer) < 0) {
+    return ErrnoToStatus("Failed to queue V4L2 buffer");
+  }
+  return tensorflow::Status();
+}
+
+tensorflow::Status V4l2Captor::DequeueBuffer(int* index) {
+  while (true) {
+    v4l2_buffer buffer = {};
+    buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buffer.memory = V4L2_MEMORY_MMAP;
+    if (Ioctl(fd_, VIDIOC_DQBUF, &buffer) < 0) {
+      if (errno == EAGAIN) {
+        return tensorflow::errors::Unavailable("No V4L2 frame.");
+      }
+      return ErrnoToStatus("Failed to dequeue V4L2 buffer");
+    }
+    // Corrupted frames are given back to the driver.
+    if (!(buffer.flags & V4L2_BUF_FLAG_ERROR)) {
+      *index = buffer.index;
+      return tensorflow::Status();
+    }
+    num_skipped_frames_++;
+    TF_RETURN_IF_ERROR(QueueBuffer(buffer.index));
+  }
+}
+
+tensorflow::Status V4l2Captor::CaptureImage(uint8_t** image) {
+  if (!streaming_) {
+    return tensorflow::errors::FailedPrecondition("V4L2 is not streaming.");
+  }
+  if (dequeued_index_ >= 0) {
+    return tensorflow::errors::FailedPrecondition(
+        "The last V4L2 frame is not released.");
+  }
+  int index = -1;
+  tensorflow::Status status = DequeueBuffer(&index);
+  while (tensorflow::errors::IsUnavailable(status)) {
+    pollfd poll_fd = {fd_, POLLIN, 0};
+    const int result = poll(&poll_fd, 1, kFrameTimeoutMilliseconds);
+    if (result == 0) {
+      return tensorflow::errors::DeadlineExceeded("No V4L2 frame in time.");
+    }
+    if (result < 0 && errno != EINTR) {
+      return ErrnoToStatus("Failed to wait for V4L2 frame");
+    }
+    status = DequeueBuffer(&index);
+  }
+  TF_RETURN_IF_ERROR(status);
+  // Frames queue up in the buffers while the caller is slower than the
+  // camera. Only the newest is kept.
+  int newer_index;
+  while ((status = DequeueBuffer(&newer_index)).ok()) {
+    TF_RETURN_IF_ERROR(QueueBuffer(index));
+    index = newer_index;
+    num_skipped_frames_++;
+  }
+  if (!tensorflow::errors::IsUnavailable(status)) return status;
+  dequeued_index_ = index;
+  *image = static_cast<uint8_t*>(buffers_[index].data);
+  return tensorflow::Status();
+}
+
+tensorflow::Status V4l2Captor::ReleaseImage() {
+  if (dequeued_index_ < 0) return tensorflow::Status();
+  const int index = dequeued_index_;
+  dequeued_index_ = -1;
+  return QueueBuffer(index);
+}
+
+tensorflow::Status V4l2Captor::SetControl(uint32_t id, int32_t value,
+                                          const char* name) {
+  v4l2_control control = {};
+  control.id = id;
+  control.value = value;
+  if (Ioctl(fd_, VIDIOC_S_CTRL, &control) < 0) {
+    return tensorflow::errors::Internal(absl::StrFormat(
+        "Failed to set V4L2 %s to %d: %s", name, value, strerror(errno)));
+  }
+  return tensorflow::Status();
+}
+
+bool V4l2Captor::QueryControl(uint32_t id, int32_t* minimum,
+                              int32_t* maximum) {
+  v4l2_queryctrl query = {};
+  query.id = id;
+  if (Ioctl(fd_, VIDIOC_QUERYCTRL, &query) < 0 ||
+      (query.flags & V4L2_CTRL_FLAG_DISABLED)) {
+    return false;
+  }
+  *minimum = query.minimum;
+  *maximum = query.maximum;
+  return true;
+}
+
+bool V4l2Captor::HasMenuItem(uint32_t id, int32_t index) {
+  v4l2_querymenu query = {};
+  query.id = id;
+  query.index = index;
+  return Ioctl(fd_, VIDIOC_QUERYMENU, &query) == 0;
+}
+
+tensorflow::Status V4l2Captor::SetAutoExposureBrightness(
+    int target_brightness) {
+  if (!has_auto_exposure_) {
+    return tensorflow::errors::Unimplemented("Auto exposure not available.");
+  }
+  TF_RETURN_IF_ERROR(SetControl(V4L2_CID_EXPOSURE_AUTO, auto_exposure_mode_,
+                                "exposure auto"));
+  int32_t minimum, maximum;
+  if (QueryControl(V4L2_CID_BRIGHTNESS, &minimum, &maximum)) {
+    const int32_t brightness =
+        minimum + (static_cast<int64_t>(maximum) - minimum) *
+                      target_brightness / 100;
+    TF_RETURN_IF_ERROR(
+        SetControl(V4L2_CID_BRIGHTNESS, brightness, "brightness"));
+  }
+  return tensorflow::Status();
+}
+
+int V4l2Captor::GetExposureTimeInMicroseconds() {
+  if (fd_ < 0) return -1;
+  v4l2_control control = {};
+  control.id = V4L2_CID_EXPOSURE_ABSOLUTE;
+  if (Ioctl(fd_, VIDIOC_G_CTRL, &control) < 0) return -1;
+  return control.value * kExposureUnitMicroseconds;
+}
+
+tensorflow::Status V4l2Captor::SetExposureTime(int microseconds) {
+  int32_t minimum, maximum;
+  if (!QueryControl(V4L2_CID_EXPOSURE_ABSOLUTE, &minimum, &maximum)) {
+    return tensorflow::errors::Unimplemented(
+        "Exposure time not available.");
+  }
+  if (has_auto_exposure_) {
+    TF_RETURN_IF_ERROR(SetControl(V4L2_CID_EXPOSURE_AUTO,
+                                  V4L2_EXPOSURE_MANUAL, "exposure auto"));
+  }
+  int32_t exposure = (microseconds + kExposureUnitMicroseconds / 2) /
+                     kExposureUnitMicroseconds;
+  exposure = std::min(std::max(exposure, minimum), maximum);
+  return SetControl(V4L2_CID_EXPOSURE_ABSOLUTE, exposure, "exposure time");
+}
+
+}  // namespace image_captor
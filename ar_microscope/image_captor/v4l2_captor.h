@@ -0,0 +1,134 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#ifndef AR_MICROSCOPE_IMAGE_CAPTOR_V4L2_CAPTOR_H_
+#define AR_MICROSCOPE_IMAGE_CAPTOR_V4L2_CAPTOR_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "image_captor/image_captor.h"
+#include "image_processor/debayer.h"
+#include "image_processor/debayer_kernels.h"
+#include "tensorflow/core/lib/core/status.h"
+
+namespace image_captor {
+
+// Image captor of the Video4Linux2 camera of --v4l2_device, such as a UVC
+// camera. The camera must provide one of the raw Bayer formats, 8-bit, 16-bit
+// or MIPI packed. Frames are streamed into --v4l2_num_buffers buffers of the
+// driver, memory-mapped, and are debayered from the buffer without a copy: the
+// buffer is only returned to the driver by ReleaseImage.
+//
+// The vivid test driver provides all of these formats without a camera, see
+// v4l2_captor_test.cc.
+class V4l2Captor : public ImageCaptor {
+ public:
+  ~V4l2Captor() override;
+
+  tensorflow::Status Initialize() override;
+  tensorflow::Status Finalize() override;
+
+  int GetSensorWidth() override { return width_; }
+
+  int GetSensorHeight() override { return height_; }
+
+  image_processor::BayerPattern GetBayerPattern() override { return pattern_; }
+
+  image_processor::BayerPacking GetBayerPacking() override { return packing_; }
+
+  // Auto-exposure needs the exposure auto control of the camera.
+  bool SupportsAutoExposure() override { return has_auto_exposure_; }
+
+  // Turns on the auto-exposure of the camera. V4L2 has no target of the
+  // auto-exposure, so the target brightness sets the brightness control
+  // instead, as a percentage of its range, which UVC cameras take into
+  // account in their auto-exposure.
+  tensorflow::Status SetAutoExposureBrightness(int target_brightness) override;
+
+  // Returns the absolute exposure time of the camera, with its resolution of
+  // 100 microseconds.
+  int GetExposureTimeInMicroseconds() override;
+
+  // Returns the frames skipped for newer ones, and the corrupted frames.
+  int64_t GetNumDroppedFrames() const override { return num_skipped_frames_; }
+
+  tensorflow::Status SetExposureTime(int microseconds) override;
+
+ protected:
+  // Dequeues the newest filled buffer of the driver, waiting for one if
+  // none is filled. Older filled buffers are given back to the driver, so
+  // that the frame is not older than the capture is slow.
+  tensorflow::Status CaptureImage(uint8_t** image) override;
+
+  // Gives the buffer of the last CaptureImage back to the driver.
+  tensorflow::Status ReleaseImage() override;
+
+  int GetBytesPerPixel() override { return bytes_per_pixel_; }
+
+ private:
+  // Memory-mapped buffer of the driver.
+  struct Buffer {
+    void* data = nullptr;
+    size_t length = 0;
+  };
+
+  // Negotiates the Bayer format of --v4l2_pixel_format, or the first one the
+  // camera provides.
+  tensorflow::Status SetFormat();
+
+  // Requests and maps the buffers, and starts streaming.
+  tensorflow::Status StartStreaming();
+
+  // Hands the buffer of the index to the driver.
+  tensorflow::Status QueueBuffer(int index);
+
+  // Dequeues a filled buffer, if any, into index. Returns Unavailable if no
+  // buffer is filled.
+  tensorflow::Status DequeueBuffer(int* index);
+
+  // Sets a control of the camera, and returns an error with the name of the
+  // control otherwise.
+  tensorflow::Status SetControl(uint32_t id, int32_t value, const char* name);
+
+  // Returns whether the camera has the control, with its range.
+  bool QueryControl(uint32_t id, int32_t* minimum, int32_t* maximum);
+
+  // Returns whether the menu control of the camera has the item.
+  bool HasMenuItem(uint32_t id, int32_t index);
+
+  int fd_ = -1;
+  bool streaming_ = false;
+  std::vector<Buffer> buffers_;
+  // Buffer returned by CaptureImage, or -1 if none.
+  int dequeued_index_ = -1;
+  int64_t num_skipped_frames_ = 0;
+
+  int width_ = 0;
+  int height_ = 0;
+  int bytes_per_pixel_ = 1;
+  size_t frame_bytes_ = 0;
+  image_processor::BayerPattern pattern_ = image_processor::BayerPattern::RGGB;
+  image_processor::BayerPacking packing_ =
+      image_processor::BayerPacking::NONE;
+
+  // Mode of the exposure auto control that turns auto-exposure on.
+  bool has_auto_exposure_ = false;
+  int32_t auto_exposure_mode_ = 0;
+};
+
+}  // namespace image_captor
+
+#endif  // AR_MICROSCOPE_IMAGE_CAPTOR_V4L2_CAPTOR_H_
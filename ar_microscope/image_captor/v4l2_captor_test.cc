@@ -0,0 +1,164 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+// Integration tests of V4l2Captor against the vivid virtual driver, loaded
+// with `modprobe vivid`. They are skipped on machines without it.
+#include "image_captor/v4l2_captor.h"
+
+#include <fcntl.h>
+#include <linux/videodev2.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <string>
+
+#include "gtest/gtest.h"
+#include "opencv2/core.hpp"
+#include "absl/flags/flag.h"
+#include "absl/strings/str_format.h"
+#include "image_processor/debayer.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/core/status.h"
+
+extern absl::Flag<std::string> FLAGS_v4l2_device;
+extern absl::Flag<std::string> FLAGS_v4l2_pixel_format;
+extern absl::Flag<int> FLAGS_v4l2_width;
+extern absl::Flag<int> FLAGS_v4l2_height;
+
+namespace {
+
+using image_captor::V4l2Captor;
+using image_processor::BayerPacking;
+using image_processor::BayerPattern;
+
+constexpr int kWidth = 640;
+constexpr int kHeight = 480;
+constexpr int kNumFrames = 5;
+
+// Returns the first video capture device of the vivid driver, or an empty
+// path if there is none.
+std::string FindVividDevice() {
+  for (int i = 0; i < 64; i++) {
+    const std::string path = absl::StrFormat("/dev/video%d", i);
+    const int fd = open(path.c_str(), O_RDWR | O_NONBLOCK);
+    if (fd < 0) continue;
+    v4l2_capability capability = {};
+    const bool is_vivid_capture =
+        ioctl(fd, VIDIOC_QUERYCAP, &capability) == 0 &&
+        strcmp(reinterpret_cast<const char*>(capability.driver), "vivid") ==
+            0 &&
+        (capability.device_caps & V4L2_CAP_VIDEO_CAPTURE);
+    close(fd);
+    if (is_vivid_capture) return path;
+  }
+  return "";
+}
+
+class V4l2CaptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    device_ = FindVividDevice();
+    if (device_.empty()) GTEST_SKIP() << "No vivid device.";
+    absl::SetFlag(&FLAGS_v4l2_device, device_);
+    absl::SetFlag(&FLAGS_v4l2_width, kWidth);
+    absl::SetFlag(&FLAGS_v4l2_height, kHeight);
+  }
+
+  void TearDown() override {
+    absl::SetFlag(&FLAGS_v4l2_pixel_format, "");
+  }
+
+  std::string device_;
+};
+
+TEST_F(V4l2CaptorTest, Captures8BitBayer) {
+  absl::SetFlag(&FLAGS_v4l2_pixel_format, "BA81");
+  V4l2Captor captor;
+  ASSERT_TRUE(captor.Initialize().ok());
+  EXPECT_EQ(captor.GetSensorWidth(), kWidth);
+  EXPECT_EQ(captor.GetSensorHeight(), kHeight);
+  EXPECT_EQ(captor.GetBayerPattern(), BayerPattern::BGGR);
+  EXPECT_EQ(captor.GetBayerPacking(), BayerPacking::NONE);
+
+  cv::Mat rgb;
+  for (int i = 0; i < kNumFrames; i++) {
+    ASSERT_TRUE(captor.GetImage(true, &rgb).ok());
+    EXPECT_EQ(rgb.cols, kWidth / 2);
+    EXPECT_EQ(rgb.rows, kHeight / 2);
+    EXPECT_EQ(rgb.type(), CV_8UC3);
+  }
+  // The test pattern is not black.
+  const cv::Scalar mean = cv::mean(rgb);
+  EXPECT_GT(mean[0] + mean[1] + mean[2], 0);
+
+  cv::Mat bayer;
+  ASSERT_TRUE(captor.GetBayerImage(&bayer).ok());
+  EXPECT_EQ(bayer.cols, kWidth);
+  EXPECT_EQ(bayer.rows, kHeight);
+  EXPECT_EQ(bayer.type(), CV_8UC1);
+  EXPECT_TRUE(captor.Finalize().ok());
+}
+
+TEST_F(V4l2CaptorTest, Captures16BitBayer) {
+  absl::SetFlag(&FLAGS_v4l2_pixel_format, "RG16");
+  V4l2Captor captor;
+  const tensorflow::Status status = captor.Initialize();
+  if (tensorflow::errors::IsUnimplemented(status)) {
+    GTEST_SKIP() << "vivid has no 16-bit Bayer: " << status;
+  }
+  ASSERT_TRUE(status.ok()) << status;
+  EXPECT_EQ(captor.GetBayerPattern(), BayerPattern::RGGB);
+
+  cv::Mat bayer;
+  ASSERT_TRUE(captor.GetBayerImage(&bayer).ok());
+  EXPECT_EQ(bayer.type(), CV_16UC1);
+  cv::Mat rgb;
+  ASSERT_TRUE(captor.GetImage(false, &rgb).ok());
+  EXPECT_EQ(rgb.cols, kWidth / 2);
+  EXPECT_EQ(rgb.rows, kHeight / 2);
+}
+
+TEST_F(V4l2CaptorTest, AsyncCapture) {
+  V4l2Captor captor;
+  ASSERT_TRUE(captor.Initialize().ok());
+  ASSERT_TRUE(captor.StartAsyncCapture(true).ok());
+  cv::Mat rgb;
+  int64_t last_frame_id = -1;
+  for (int i = 0; i < kNumFrames; i++) {
+    ASSERT_TRUE(captor.GetImage(true, &rgb).ok());
+    EXPECT_GT(captor.GetLastFrameInfo().id, last_frame_id);
+    last_frame_id = captor.GetLastFrameInfo().id;
+  }
+  captor.StopAsyncCapture();
+  EXPECT_EQ(rgb.cols, kWidth / 2);
+}
+
+TEST_F(V4l2CaptorTest, ReinitializesDevice) {
+  V4l2Captor captor;
+  ASSERT_TRUE(captor.Initialize().ok());
+  ASSERT_TRUE(captor.Initialize().ok());
+  cv::Mat rgb;
+  EXPECT_TRUE(captor.GetImage(true, &rgb).ok());
+}
+
+TEST(V4l2CaptorErrorTest, MissingDevice) {
+  absl::SetFlag(&FLAGS_v4l2_device, "/dev/no_such_video");
+  V4l2Captor captor;
+  EXPECT_TRUE(tensorflow::errors::IsNotFound(captor.Initialize()));
+  cv::Mat rgb;
+  EXPECT_FALSE(captor.GetImage(true, &rgb).ok());
+}
+
+}  // namespace
@@ -0,0 +1,82 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_captor/white_balance_controller.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace image_captor {
+namespace {
+
+// Output values below or above these are excluded from the means, since
+// clipped pixels do not follow the gains.
+constexpr int kMinValue = 8;
+constexpr int kMaxValue = 250;
+// Minimum fraction of the pixels within the range above to update the gains.
+constexpr double kMinValidFraction = 0.05;
+// Fraction of the correction applied per frame, to avoid oscillation and
+// flicker with changing content.
+constexpr double kDamping = 0.25;
+// Relative difference of the means to green below which the gains are kept.
+constexpr double kTolerance = 0.01;
+constexpr double kMinGain = 0.25;
+constexpr double kMaxGain = 8.0;
+
+// Returns the mean of the histogram within [kMinValue, kMaxValue], and the
+// number of pixels counted.
+double GetClippedMean(const image_processor::Histogram& histogram,
+                      int64_t* count) {
+  double sum = 0;
+  *count = 0;
+  for (int value = kMinValue; value <= kMaxValue; value++) {
+    sum += static_cast<double>(value) * histogram[value];
+    *count += histogram[value];
+  }
+  return *count > 0 ? sum / *count : 0;
+}
+
+// Moves the gain towards the gain that would make the mean equal to the
+// target mean.
+double DampGain(double gain, double mean, double target_mean) {
+  const double correction = std::pow(target_mean / mean, kDamping);
+  return std::clamp(gain * correction, kMinGain, kMaxGain);
+}
+
+}  // namespace
+
+bool WhiteBalanceController::Update(
+    const image_processor::ChannelStatistics& statistics, double* red_gain,
+    double* blue_gain) const {
+  if (statistics.num_pixels == 0) {
+    return false;
+  }
+  double means[3];
+  for (int channel = 0; channel < 3; channel++) {
+    int64_t count;
+    means[channel] = GetClippedMean(statistics.histograms[channel], &count);
+    if (count < kMinValidFraction * statistics.num_pixels) {
+      return false;
+    }
+  }
+  if (std::abs(means[0] / means[1] - 1) < kTolerance &&
+      std::abs(means[2] / means[1] - 1) < kTolerance) {
+    return false;
+  }
+  *red_gain = DampGain(*red_gain, means[0], means[1]);
+  *blue_gain = DampGain(*blue_gain, means[2], means[1]);
+  return true;
+}
+
+}  // namespace image_captor
@@ -0,0 +1,38 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#ifndef AR_MICROSCOPE_IMAGE_CAPTOR_WHITE_BALANCE_CONTROLLER_H_
+#define AR_MICROSCOPE_IMAGE_CAPTOR_WHITE_BALANCE_CONTROLLER_H_
+
+#include "image_processor/debayer.h"
+
+namespace image_captor {
+
+// Software auto white balance with the gray world assumption: the red and
+// blue gains are moved so that the mean of each channel matches the mean of
+// green. Microscope slides are mostly bright background, so this converges to
+// a neutral background.
+class WhiteBalanceController {
+ public:
+  // Updates the red and blue gains from the statistics of a frame debayered
+  // with these gains. Green is the reference and is left as is. Returns true
+  // if the gains changed. Changing the gains rebuilds the debayer lookup
+  // tables, so the gains are kept once the means are within a tolerance.
+  bool Update(const image_processor::ChannelStatistics& statistics,
+              double* red_gain, double* blue_gain) const;
+};
+
+}  // namespace image_captor
+
+#endif  // AR_MICROSCOPE_IMAGE_CAPTOR_WHITE_BALANCE_CONTROLLER_H_
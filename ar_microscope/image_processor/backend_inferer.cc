@@ -0,0 +1,214 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_processor/backend_inferer.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/flags/flag.h"
+#include "absl/strings/str_format.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "arm_app/arm_config.h"
+#include "image_processor/heatmap_kernels.h"
+#include "image_processor/model_config_util.h"
+#include "tensorflow/core/lib/core/errors.h"
+
+extern absl::Flag<bool> FLAGS_preload_models;
+extern absl::Flag<int> FLAGS_model_cache_megabytes;
+extern absl::Flag<int> FLAGS_num_warm_up_inferences;
+
+namespace image_processor {
+namespace {
+
+int64_t GetModelCacheBudgetBytes() {
+  return int64_t{absl::GetFlag(FLAGS_model_cache_megabytes)} << 20;
+}
+
+}  // namespace
+
+BackendInferer::~BackendInferer() {
+  CHECK(!model_cache_) << "The model cache must be stopped by the derived "
+                          "inferer.";
+}
+
+tensorflow::Status BackendInferer::Initialize(ObjectiveLensPower objective,
+                                              ModelType model_type) {
+  MaybeCreateInputTensors();
+  model_cache_ = std::make_unique<ModelCache>(
+      [this](const ModelRequest& request,
+             std::unique_ptr<CachedModel>* model) {
+        return LoadBackendModel(request, model);
+      },
+      GetModelCacheBudgetBytes());
+  return LoadModel(objective, model_type);
+}
+
+cv::Mat BackendInferer::GetImageBuffer(int width, int height) {
+  MaybeCreateInputTensors();
+  MaybeTakeBuffers();
+  CHECK(width < patch_size_)
+      << "Width: " << width << "  patch size: " << patch_size_;
+  CHECK(height < patch_size_)
+      << "Height: " << height << "  patch size: " << patch_size_;
+  int left_padding = (patch_size_ - width) / 2;
+  int top_padding = (patch_size_ - height) / 2;
+
+  cv::Rect roi(left_padding, top_padding, width, height);
+  current_->CreateInputImage(roi);
+  return *current_->input_image;
+}
+
+void BackendInferer::ProcessImageWithoutInference(cv::Mat* output) {
+  MaybeTakeBuffers();
+  cv::Mat* heatmap = GetReusableMat(&current_->heatmap);
+  heatmap->create(1, 1, CV_8UC1);
+  heatmap->setTo(0);
+  // The output tensor may be a view of an inference output, which create
+  // replaces with a buffer of its own.
+  cv::Mat* output_tensor = GetReusableMat(&current_->output_tensor);
+  output_tensor->create(1, 1, CV_8UC1);
+  output_tensor->setTo(0);
+  heatmap->copyTo(*output);
+  PublishCurrentFrame();
+}
+
+tensorflow::Status BackendInferer::ProcessImage(cv::Mat* output) {
+  if (model_directory_.empty()) {
+    ProcessImageWithoutInference(output);
+    return tensorflow::Status();
+  }
+
+  CHECK(model_) << "Model not initialized";
+  MaybeTakeBuffers();
+  TF_RETURN_IF_ERROR(RunModel());
+
+  // The output tensor has 3 dimensions, y and x of the result heatmap image,
+  // and output category.
+  const cv::Mat& output_tensor = *current_->output_tensor;
+  CHECK(output_tensor.dims == 3)
+      << "Unexpected output tensor dimension: " << output_tensor.dims;
+  const int height = output_tensor.size[0];
+  const int width = output_tensor.size[1];
+  const int depth = output_tensor.size[2];  // Number of classes.
+
+  // Sum the requested output classes into the heatmap, whose buffer is only
+  // allocated when the heatmap size changes.
+  MaybeUpdateClassMask(depth);
+  cv::Mat* heatmap = GetReusableMat(&current_->heatmap);
+  heatmap->create(height, width, CV_8UC1);
+  GetSumClassesKernel(depth)(output_tensor.ptr(), height * width, depth,
+                             class_mask_.data(), heatmap->ptr());
+
+  heatmap->copyTo(*output);
+  last_inferred_frame_ = PublishCurrentFrame();
+
+  return tensorflow::Status();
+}
+
+tensorflow::Status BackendInferer::ReuseLastOutput(cv::Mat* output) {
+  if (!last_inferred_frame_) {
+    return tensorflow::errors::FailedPrecondition("No output to reuse.");
+  }
+  MaybeTakeBuffers();
+  // The output tensor may be a view of an earlier inference output of the
+  // buffers, which only they hold, so it is written in place.
+  last_inferred_frame_->heatmap->copyTo(*GetReusableMat(&current_->heatmap));
+  last_inferred_frame_->output_tensor->copyTo(
+      *GetReusableMat(&current_->output_tensor));
+  last_inferred_frame_->heatmap->copyTo(*output);
+  PublishCurrentFrame();
+
+  return tensorflow::Status();
+}
+
+tensorflow::Status BackendInferer::LoadModel(ObjectiveLensPower power,
+                                             ModelType model_type) {
+  last_inferred_frame_.reset();
+  if (arm_app::GetArmConfig().IsModelConfigOverridden(model_type, power)) {
+    std::string folder = arm_app::GetArmConfig()
+                             .GetModelConfig(model_type, power)
+                             .absolute_model_path();
+    model_type_ = model_type;
+    objective_ = power;
+    new_input_tensors_needed_ = true;
+    // Returns at once if the model was preloaded.
+    std::shared_ptr<const CachedModel> model;
+    TF_RETURN_IF_ERROR(
+        model_cache_->Get({{model_type, power}, folder}, &model));
+    std::shared_ptr<const BackendModel> backend_model =
+        std::static_pointer_cast<const BackendModel>(model);
+    TF_RETURN_IF_ERROR(MaybeWarmUpModel(folder, *backend_model));
+    model_ = std::move(backend_model);
+    model_directory_ = folder;
+    if (model_type != preloaded_model_type_) PreloadModels(model_type);
+    return tensorflow::Status();
+  } else {
+    model_directory_ = "";
+    return tensorflow::errors::Unavailable(absl::StrFormat(
+        "No model for objective lens power and model type: %s, %s",
+        ObjectiveToString(power), ModelTypeToString(model_type)));
+  }
+}
+
+absl::Duration BackendInferer::GetModelWarmUpDuration() const {
+  return model_ ? model_->warm_up_duration : absl::ZeroDuration();
+}
+
+tensorflow::Status BackendInferer::MaybeWarmUpModel(
+    const std::string& model_directory, const BackendModel& model) {
+  if (model.warmed_up) return tensorflow::Status();
+  const int num_inferences = absl::GetFlag(FLAGS_num_warm_up_inferences);
+  const absl::Time start = absl::Now();
+  for (int i = 0; i < num_inferences; i++) {
+    TF_RETURN_IF_ERROR(RunWarmUpInference(model));
+  }
+  model.warm_up_duration = absl::Now() - start;
+  model.warmed_up = true;
+  LOG(INFO) << "Warmed up " << model_directory << " in "
+            << absl::FormatDuration(model.warm_up_duration);
+  // The warm-up inferences reach the peak memory of the model.
+  const int64_t device_budget = GetDeviceMemoryBudget(model);
+  if (device_budget >= 0) {
+    const int64_t budget = std::min(GetModelCacheBudgetBytes(), device_budget);
+    LOG(INFO) << "Model cache budget: " << (budget >> 20) << " MB";
+    model_cache_->SetMemoryBudget(budget);
+  }
+  return tensorflow::Status();
+}
+
+void BackendInferer::PreloadModels(ModelType model_type) {
+  if (!absl::GetFlag(FLAGS_preload_models)) return;
+  // The models of the other backends are loaded by their inferers.
+  model_cache_->Preload(GetPreloadRequests(model_type, backend_));
+  preloaded_model_type_ = model_type;
+}
+
+void BackendInferer::MaybeCreateInputTensors() {
+  if (!new_input_tensors_needed_) return;
+  const int new_patch_size = GetPatchSize(model_type_, objective_);
+  if (new_patch_size != patch_size_) {
+    patch_size_ = new_patch_size;
+    // The published frames keep their buffers until they are released, and
+    // buffers of the old size are dropped when taken from the pool.
+    current_.reset();
+  }
+  new_input_tensors_needed_ = false;
+}
+
+}  // namespace image_processor
@@ -0,0 +1,122 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+// Base class of the inferers of a backend, which run the models of the ARM
+// config one at a time.
+
+#ifndef AR_MICROSCOPE_IMAGE_PROCESSOR_BACKEND_INFERER_H_
+#define AR_MICROSCOPE_IMAGE_PROCESSOR_BACKEND_INFERER_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "opencv2/core.hpp"
+#include "absl/time/time.h"
+#include "arm_app/arm_config.pb.h"
+#include "image_processor/inferer.h"
+#include "image_processor/model_cache.h"
+#include "tensorflow/core/lib/core/status.h"
+
+namespace image_processor {
+
+// Model loaded by a backend.
+struct BackendModel : public CachedModel {
+  // Size of the square input patch.
+  int patch_size = 0;
+  // Whether the warm-up inferences ran, and the time they took. They run on
+  // the inference thread when the model first becomes current, so that the
+  // preloads never compete with the inferences of the current model. Only
+  // the inference thread uses them.
+  mutable bool warmed_up = false;
+  mutable absl::Duration warm_up_duration = absl::ZeroDuration();
+};
+
+// Inferer that loads the models of a backend through a ModelCache, and turns
+// their outputs into heatmaps. The backends only create the input buffers,
+// load the models and run them.
+class BackendInferer : public Inferer {
+ public:
+  ~BackendInferer() override;
+
+  tensorflow::Status Initialize(ObjectiveLensPower objective,
+                                ModelType model_type) override;
+  cv::Mat GetImageBuffer(int width, int height) override;
+  tensorflow::Status ProcessImage(cv::Mat* output) override;
+  tensorflow::Status ReuseLastOutput(cv::Mat* output) override;
+  tensorflow::Status LoadModel(ObjectiveLensPower power,
+                               ModelType model_type) override;
+  absl::Duration GetModelWarmUpDuration() const override;
+
+ protected:
+  explicit BackendInferer(arm_app::ModelConfig::InferenceBackend backend)
+      : backend_(backend) {}
+
+  // Loads the model of the request. The model cache may call it on its
+  // preload thread.
+  virtual tensorflow::Status LoadBackendModel(
+      const ModelRequest& request, std::unique_ptr<CachedModel>* model) = 0;
+
+  // Runs model_ on the input of the current frame, and sets the output
+  // tensor of the frame to the uint8 output, of shape [height, width,
+  // classes].
+  virtual tensorflow::Status RunModel() = 0;
+
+  // Runs the model once on a blank patch.
+  virtual tensorflow::Status RunWarmUpInference(const BackendModel& model) = 0;
+
+  // Returns the memory of the device the warmed-up model runs on that the
+  // loaded models may take, or -1 if they are in host memory. The model cache
+  // budget is capped by it.
+  virtual int64_t GetDeviceMemoryBudget(const BackendModel& model) const {
+    return -1;
+  }
+
+  // Stops the model cache, whose preload thread calls LoadBackendModel. The
+  // derived inferers call it at the start of their destructors.
+  void StopModelCache() { model_cache_.reset(); }
+
+  // Current model, or nullptr.
+  std::shared_ptr<const BackendModel> model_;
+
+ private:
+  // Preloads the configured models of the backend in the background, the
+  // ones of model_type first.
+  void PreloadModels(ModelType model_type);
+  void MaybeCreateInputTensors();
+  // Runs the warm-up inferences of the model, unless they ran.
+  tensorflow::Status MaybeWarmUpModel(const std::string& model_directory,
+                                      const BackendModel& model);
+
+  void ProcessImageWithoutInference(cv::Mat* output);
+
+  const arm_app::ModelConfig::InferenceBackend backend_;
+
+  // Loaded models, so that switching to a preloaded model only swaps model_.
+  std::unique_ptr<ModelCache> model_cache_;
+  // Model type whose models were last preloaded.
+  ModelType preloaded_model_type_ = ModelType::UNSPECIFIED_MODEL_TYPE;
+
+  // Frame of the last inference of the model, or nullptr. It is never
+  // written again, so its outputs are only copied when they are reused.
+  std::shared_ptr<const InputOutputBuffers> last_inferred_frame_;
+
+  // Boolean for deciding whether to possibly create new input tensors for a
+  // newly loaded model.
+  bool new_input_tensors_needed_ = true;
+};
+
+}  // namespace image_processor
+
+#endif  // AR_MICROSCOPE_IMAGE_PROCESSOR_BACKEND_INFERER_H_
@@ -0,0 +1,274 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_processor/backend_inferer.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT
+#include <utility>
+
+#include "gtest/gtest.h"
+#include "opencv2/core.hpp"
+#include "absl/container/flat_hash_map.h"
+#include "absl/flags/flag.h"
+#include "absl/synchronization/mutex.h"
+#include "arm_app/arm_config.h"
+#include "arm_app/arm_config.pb.h"
+#include "image_processor/inferer.h"
+#include "image_processor/model_cache.h"
+#include "image_processor/model_config_util.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/core/status.h"
+
+// Defined by the previewer in the app.
+ABSL_FLAG(int, image_size, 16, "Expected image size for the patch.");
+
+extern absl::Flag<bool> FLAGS_preload_models;
+extern absl::Flag<int> FLAGS_model_cache_megabytes;
+extern absl::Flag<int> FLAGS_num_warm_up_inferences;
+
+namespace {
+
+using image_processor::BackendModel;
+using image_processor::CachedModel;
+using image_processor::InputOutputBuffers;
+using image_processor::ModelRequest;
+using image_processor::ModelType;
+using image_processor::ObjectiveLensPower;
+
+constexpr int kWidth = 12;
+constexpr int kHeight = 8;
+constexpr int64_t kModelBytes = 1 << 20;
+
+constexpr char kArmConfig[] = R"pb(
+  model_config_default { input_patch_size: 20 prediction_patch_size: 8 }
+  custom_model_configs {
+    model_type: "lymph"
+    objective: "10x"
+    absolute_model_path: "lymph_10x"
+  }
+  custom_model_configs {
+    model_type: "lymph"
+    objective: "20x"
+    absolute_model_path: "lymph_20x"
+  }
+  objective_positions { position_10x: 1 position_20x: 2 position_40x: 3 }
+)pb";
+
+void InitializeArmConfig() {
+  static const bool initialized = [] {
+    const std::string path = ::testing::TempDir() + "/arm_config.pbtxt";
+    FILE* file = fopen(path.c_str(), "w");
+    fputs(kArmConfig, file);
+    fclose(file);
+    return arm_app::GetArmConfig().Initialize(path, "").ok();
+  }();
+  ASSERT_TRUE(initialized);
+}
+
+struct FakeModel : public BackendModel {
+  int64_t GetMemoryBytes() const override { return kModelBytes; }
+
+  std::string directory;
+};
+
+// Backend whose models output the first value of the input image as the tumor
+// class, and its complement as the benign class, for each of 2x2 patches.
+class FakeBackendInferer : public image_processor::BackendInferer {
+ public:
+  FakeBackendInferer()
+      : BackendInferer(arm_app::ModelConfig::TENSORFLOW),
+        test_thread_id_(std::this_thread::get_id()) {}
+
+  ~FakeBackendInferer() override { StopModelCache(); }
+
+  int GetNumLoads(const std::string& directory) {
+    absl::MutexLock unused_lock(&mutex_);
+    return num_loads_[directory];
+  }
+
+  int GetNumWarmUps(const std::string& directory) {
+    absl::MutexLock unused_lock(&mutex_);
+    return num_warm_ups_[directory];
+  }
+
+  bool warmed_up_on_other_thread() {
+    absl::MutexLock unused_lock(&mutex_);
+    return warmed_up_on_other_thread_;
+  }
+
+  int64_t device_memory_budget = -1;
+
+ protected:
+  tensorflow::Status LoadBackendModel(
+      const ModelRequest& request,
+      std::unique_ptr<CachedModel>* model) override {
+    auto fake_model = std::make_unique<FakeModel>();
+    fake_model->directory = request.model_directory;
+    fake_model->patch_size = image_processor::GetPatchSize(
+        request.key.model_type, request.key.objective);
+    absl::MutexLock unused_lock(&mutex_);
+    num_loads_[request.model_directory]++;
+    *model = std::move(fake_model);
+    return tensorflow::Status();
+  }
+
+  tensorflow::Status RunModel() override {
+    const uint8_t value = current_->input_image->ptr()[0];
+    const int shape[] = {2, 2, 2};
+    cv::Mat* output = image_processor::GetReusableMat(&current_->output_tensor);
+    output->create(3, shape, CV_8UC1);
+    for (int i = 0; i < 4; i++) {
+      output->ptr()[i * 2] = 255 - value;
+      output->ptr()[i * 2 + 1] = value;
+    }
+    return tensorflow::Status();
+  }
+
+  tensorflow::Status RunWarmUpInference(const BackendModel& model) override {
+    absl::MutexLock unused_lock(&mutex_);
+    num_warm_ups_[static_cast<const FakeModel&>(model).directory]++;
+    if (std::this_thread::get_id() != test_thread_id_) {
+      warmed_up_on_other_thread_ = true;
+    }
+    return tensorflow::Status();
+  }
+
+  int64_t GetDeviceMemoryBudget(const BackendModel& model) const override {
+    return device_memory_budget;
+  }
+
+ private:
+  const std::thread::id test_thread_id_;
+  absl::Mutex mutex_;
+  absl::flat_hash_map<std::string, int> num_loads_ ABSL_GUARDED_BY(mutex_);
+  absl::flat_hash_map<std::string, int> num_warm_ups_ ABSL_GUARDED_BY(mutex_);
+  bool warmed_up_on_other_thread_ ABSL_GUARDED_BY(mutex_) = false;
+};
+
+class BackendInfererTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    InitializeArmConfig();
+    absl::SetFlag(&FLAGS_preload_models, false);
+    absl::SetFlag(&FLAGS_model_cache_megabytes, 16);
+    absl::SetFlag(&FLAGS_num_warm_up_inferences, 2);
+  }
+
+  // Infers an image of the value, and returns the heatmap.
+  cv::Mat Infer(uint8_t value) {
+    cv::Mat image = inferer_.GetImageBuffer(kWidth, kHeight);
+    image.setTo(cv::Scalar(value, value, value));
+    cv::Mat heatmap;
+    EXPECT_TRUE(inferer_.ProcessImage(&heatmap).ok());
+    return heatmap;
+  }
+
+  FakeBackendInferer inferer_;
+};
+
+// Returns whether all the values of the heatmap are value.
+bool HeatmapIs(const cv::Mat& heatmap, int rows, int cols, uint8_t value) {
+  if (heatmap.rows != rows || heatmap.cols != cols) return false;
+  for (int y = 0; y < heatmap.rows; y++) {
+    for (int x = 0; x < heatmap.cols; x++) {
+      if (heatmap.at<uint8_t>(y, x) != value) return false;
+    }
+  }
+  return true;
+}
+
+TEST_F(BackendInfererTest, ProcessImageSumsTheHeatmapClasses) {
+  ASSERT_TRUE(inferer_
+                  .Initialize(ObjectiveLensPower::OBJECTIVE_10x,
+                              ModelType::LYNA)
+                  .ok());
+  EXPECT_TRUE(HeatmapIs(Infer(77), 2, 2, 77));
+  EXPECT_TRUE(HeatmapIs(Infer(5), 2, 2, 5));
+  std::shared_ptr<const InputOutputBuffers> frame;
+  ASSERT_TRUE(inferer_.GetPreviewProvider()(&frame).ok());
+  EXPECT_EQ(frame->input_image->ptr()[0], 5);
+  EXPECT_EQ(frame->output_tensor->dims, 3);
+}
+
+TEST_F(BackendInfererTest, ReusesTheLastOutputOfTheModel) {
+  ASSERT_TRUE(inferer_
+                  .Initialize(ObjectiveLensPower::OBJECTIVE_10x,
+                              ModelType::LYNA)
+                  .ok());
+  cv::Mat heatmap;
+  EXPECT_FALSE(inferer_.ReuseLastOutput(&heatmap).ok());
+  Infer(42);
+  inferer_.GetImageBuffer(kWidth, kHeight).setTo(cv::Scalar(0, 0, 0));
+  ASSERT_TRUE(inferer_.ReuseLastOutput(&heatmap).ok());
+  EXPECT_TRUE(HeatmapIs(heatmap, 2, 2, 42));
+  // The output of another model is not reused.
+  ASSERT_TRUE(
+      inferer_.LoadModel(ObjectiveLensPower::OBJECTIVE_20x, ModelType::LYNA)
+          .ok());
+  EXPECT_FALSE(inferer_.ReuseLastOutput(&heatmap).ok());
+}
+
+TEST_F(BackendInfererTest, WithoutModelOutputsEmptyHeatmap) {
+  ASSERT_TRUE(inferer_
+                  .Initialize(ObjectiveLensPower::OBJECTIVE_10x,
+                              ModelType::LYNA)
+                  .ok());
+  EXPECT_TRUE(tensorflow::errors::IsUnavailable(
+      inferer_.LoadModel(ObjectiveLensPower::OBJECTIVE_40x, ModelType::LYNA)));
+  EXPECT_TRUE(HeatmapIs(Infer(77), 1, 1, 0));
+}
+
+TEST_F(BackendInfererTest, WarmsUpOnceWhenModelBecomesCurrent) {
+  absl::SetFlag(&FLAGS_preload_models, true);
+  ASSERT_TRUE(inferer_
+                  .Initialize(ObjectiveLensPower::OBJECTIVE_10x,
+                              ModelType::LYNA)
+                  .ok());
+  EXPECT_EQ(inferer_.GetNumWarmUps("lymph_10x"), 2);
+  ASSERT_TRUE(
+      inferer_.LoadModel(ObjectiveLensPower::OBJECTIVE_20x, ModelType::LYNA)
+          .ok());
+  ASSERT_TRUE(
+      inferer_.LoadModel(ObjectiveLensPower::OBJECTIVE_10x, ModelType::LYNA)
+          .ok());
+  EXPECT_EQ(inferer_.GetNumWarmUps("lymph_10x"), 2);
+  EXPECT_EQ(inferer_.GetNumWarmUps("lymph_20x"), 2);
+  EXPECT_EQ(inferer_.GetNumLoads("lymph_20x"), 1);
+  // The preloaded model is warmed up on the inference thread.
+  EXPECT_FALSE(inferer_.warmed_up_on_other_thread());
+  EXPECT_TRUE(HeatmapIs(Infer(9), 2, 2, 9));
+}
+
+TEST_F(BackendInfererTest, DeviceMemoryCapsTheModelCache) {
+  inferer_.device_memory_budget = kModelBytes;
+  ASSERT_TRUE(inferer_
+                  .Initialize(ObjectiveLensPower::OBJECTIVE_10x,
+                              ModelType::LYNA)
+                  .ok());
+  ASSERT_TRUE(
+      inferer_.LoadModel(ObjectiveLensPower::OBJECTIVE_20x, ModelType::LYNA)
+          .ok());
+  ASSERT_TRUE(
+      inferer_.LoadModel(ObjectiveLensPower::OBJECTIVE_10x, ModelType::LYNA)
+          .ok());
+  // Only one model fits in the memory of the device.
+  EXPECT_EQ(inferer_.GetNumLoads("lymph_10x"), 2);
+  EXPECT_TRUE(HeatmapIs(Infer(3), 2, 2, 3));
+}
+
+}  // namespace
@@ -0,0 +1,73 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_processor/calibration_frames.h"
+
+#include "tensorflow/core/lib/core/errors.h"
+
+namespace image_processor {
+
+tensorflow::Status CalibrationFrames::AddDarkFrame(
+    const cv::Mat& bayer_image) {
+  return AddFrame(bayer_image, &dark_sums_, &num_dark_frames_);
+}
+
+tensorflow::Status CalibrationFrames::AddFlatFrame(
+    const cv::Mat& bayer_image) {
+  return AddFrame(bayer_image, &flat_sums_, &num_flat_frames_);
+}
+
+tensorflow::Status CalibrationFrames::CheckComplete() const {
+  if (num_dark_frames_ == 0 || num_flat_frames_ == 0) {
+    return tensorflow::errors::FailedPrecondition(
+        "Calibration needs dark and flat frames.");
+  }
+  return tensorflow::Status();
+}
+
+tensorflow::Status CalibrationFrames::AddFrame(const cv::Mat& bayer_image,
+                                               std::vector<uint32_t>* sums,
+                                               int* num_frames) {
+  const int bytes_per_pixel = bayer_image.elemSize();
+  if (bayer_image.channels() != 1 ||
+      (bytes_per_pixel != 1 && bytes_per_pixel != 2) ||
+      bayer_image.rows % 2 != 0 || bayer_image.cols % 2 != 0) {
+    return tensorflow::errors::InvalidArgument(
+        "Calibration frames must be Bayer images with even dimensions.");
+  }
+  if (width_ == 0) {
+    width_ = bayer_image.cols;
+    height_ = bayer_image.rows;
+    bytes_per_pixel_ = bytes_per_pixel;
+  } else if (bayer_image.cols != width_ || bayer_image.rows != height_ ||
+             bytes_per_pixel != bytes_per_pixel_) {
+    return tensorflow::errors::InvalidArgument(
+        "Calibration frames must all have the same format.");
+  }
+  sums->resize(static_cast<size_t>(width_) * height_);
+  for (int y = 0; y < height_; y++) {
+    uint32_t* row_sums = sums->data() + static_cast<size_t>(y) * width_;
+    if (bytes_per_pixel_ == 1) {
+      const uint8_t* row = bayer_image.ptr<uint8_t>(y);
+      for (int x = 0; x < width_; x++) row_sums[x] += row[x];
+    } else {
+      const uint16_t* row = bayer_image.ptr<uint16_t>(y);
+      for (int x = 0; x < width_; x++) row_sums[x] += row[x];
+    }
+  }
+  ++*num_frames;
+  return tensorflow::Status();
+}
+
+}  // namespace image_processor
@@ -0,0 +1,67 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+// Accumulation of the raw Bayer frames of the sensor calibrations, which
+// average frames captured without light and of a blank slide.
+
+#ifndef AR_MICROSCOPE_IMAGE_PROCESSOR_CALIBRATION_FRAMES_H_
+#define AR_MICROSCOPE_IMAGE_PROCESSOR_CALIBRATION_FRAMES_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "opencv2/core.hpp"
+#include "tensorflow/core/lib/core/status.h"
+
+namespace image_processor {
+
+// Sums of the dark and flat frames of a calibration, per Bayer pixel.
+class CalibrationFrames {
+ public:
+  // Adds a raw Bayer frame captured with the light path blocked.
+  tensorflow::Status AddDarkFrame(const cv::Mat& bayer_image);
+
+  // Adds a raw Bayer frame of a blank area of a slide.
+  tensorflow::Status AddFlatFrame(const cv::Mat& bayer_image);
+
+  // Returns an error unless at least one frame of each kind was added.
+  tensorflow::Status CheckComplete() const;
+
+  // Dimension and bytes per pixel of the frames, or 0 before the first one.
+  int GetWidth() const { return width_; }
+  int GetHeight() const { return height_; }
+  int GetBytesPerPixel() const { return bytes_per_pixel_; }
+
+  // Returns the sums of the frames, width * height values in row order.
+  const std::vector<uint32_t>& GetDarkSums() const { return dark_sums_; }
+  const std::vector<uint32_t>& GetFlatSums() const { return flat_sums_; }
+  int GetNumDarkFrames() const { return num_dark_frames_; }
+  int GetNumFlatFrames() const { return num_flat_frames_; }
+
+ private:
+  tensorflow::Status AddFrame(const cv::Mat& bayer_image,
+                              std::vector<uint32_t>* sums, int* num_frames);
+
+  int width_ = 0;
+  int height_ = 0;
+  int bytes_per_pixel_ = 0;
+  std::vector<uint32_t> dark_sums_;
+  std::vector<uint32_t> flat_sums_;
+  int num_dark_frames_ = 0;
+  int num_flat_frames_ = 0;
+};
+
+}  // namespace image_processor
+
+#endif  // AR_MICROSCOPE_IMAGE_PROCESSOR_CALIBRATION_FRAMES_H_
@@ -0,0 +1,76 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_processor/change_detector.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <limits>
+
+namespace image_processor {
+namespace {
+
+// Pixels read in each dimension of a cell.
+constexpr int kSamplesPerCell = kChangeCellSize / 2;
+
+}  // namespace
+
+double ChangeDetector::ComputeDifference(const cv::Mat& image) {
+  width_ = image.cols / kChangeCellSize;
+  height_ = image.rows / kChangeCellSize;
+  ComputeThumbnail(image, &thumbnail_);
+  if (reference_.empty() || thumbnail_.empty() ||
+      width_ != reference_width_ || height_ != reference_height_) {
+    return std::numeric_limits<double>::infinity();
+  }
+  int max_difference = 0;
+  for (size_t i = 0; i < thumbnail_.size(); i++) {
+    max_difference =
+        std::max(max_difference, std::abs(thumbnail_[i] - reference_[i]));
+  }
+  // Cells hold 4x the sum of the luma of the samples, see ComputeThumbnail.
+  return static_cast<double>(max_difference) /
+         (4 * kSamplesPerCell * kSamplesPerCell);
+}
+
+void ChangeDetector::UpdateReference() {
+  std::swap(thumbnail_, reference_);
+  reference_width_ = width_;
+  reference_height_ = height_;
+}
+
+void ChangeDetector::ComputeThumbnail(const cv::Mat& image,
+                                      std::vector<uint16_t>* output) {
+  output->assign(static_cast<size_t>(width_) * height_, 0);
+  // With luma as (r + 2g + b) / 4, which is the same for RGB and BGR, a cell
+  // sums to at most 64 samples x 1020.
+  static_assert(kSamplesPerCell * kSamplesPerCell * 1020 <= 0xffff,
+                "The cell sums must fit in 16 bits.");
+  for (int cell_y = 0; cell_y < height_; cell_y++) {
+    uint16_t* cells = output->data() + static_cast<size_t>(cell_y) * width_;
+    for (int y = 0; y < kChangeCellSize; y += 2) {
+      const uint8_t* row = image.ptr<uint8_t>(cell_y * kChangeCellSize + y);
+      for (int cell_x = 0; cell_x < width_; cell_x++) {
+        const uint8_t* pixel = row + cell_x * kChangeCellSize * 3;
+        uint16_t sum = 0;
+        for (int x = 0; x < kSamplesPerCell; x++, pixel += 6) {
+          sum += pixel[0] + 2 * pixel[1] + pixel[2];
+        }
+        cells[cell_x] += sum;
+      }
+    }
+  }
+}
+
+}  // namespace image_processor
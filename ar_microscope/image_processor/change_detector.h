@@ -0,0 +1,62 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#ifndef AR_MICROSCOPE_IMAGE_PROCESSOR_CHANGE_DETECTOR_H_
+#define AR_MICROSCOPE_IMAGE_PROCESSOR_CHANGE_DETECTOR_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "opencv2/core.hpp"
+
+namespace image_processor {
+
+// Width and height of the thumbnail cells, in pixels.
+constexpr int kChangeCellSize = 16;
+
+// Measures how much the field of view changed between images, from luma
+// thumbnails of kChangeCellSize x kChangeCellSize pixel cells. Stage motion
+// and focus changes move the texture of the tissue between cells, while the
+// sensor noise averages out within them. Only every other pixel of every other
+// row is read, so that this costs a fraction of the debayer.
+class ChangeDetector {
+ public:
+  // Returns the largest absolute difference of the mean luma of a thumbnail
+  // cell between the 8-bit 3-channel image and the reference image, in
+  // [0, 255], so that a change of a small region, e.g. an object entering a
+  // still field, is not averaged away by the rest. It is infinite without a
+  // reference of the same size.
+  double ComputeDifference(const cv::Mat& image);
+
+  // Makes the image of the last ComputeDifference the reference.
+  void UpdateReference();
+
+  // Clears the reference.
+  void Reset() { reference_.clear(); }
+
+ private:
+  void ComputeThumbnail(const cv::Mat& image, std::vector<uint16_t>* output);
+
+  // Thumbnail of the last image, in cells.
+  int width_ = 0;
+  int height_ = 0;
+  std::vector<uint16_t> thumbnail_;
+  int reference_width_ = 0;
+  int reference_height_ = 0;
+  std::vector<uint16_t> reference_;
+};
+
+}  // namespace image_processor
+
+#endif  // AR_MICROSCOPE_IMAGE_PROCESSOR_CHANGE_DETECTOR_H_
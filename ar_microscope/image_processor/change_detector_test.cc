@@ -0,0 +1,92 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_processor/change_detector.h"
+
+#include <cmath>
+#include <random>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "opencv2/core.hpp"
+
+namespace {
+
+using image_processor::ChangeDetector;
+
+using ::testing::DoubleEq;
+using ::testing::Gt;
+using ::testing::Lt;
+
+// Returns an image of random 16x16 pixel blocks, shifted by the offset, with
+// noise of the amplitude added.
+cv::Mat MakeImage(int offset, int noise, int seed) {
+  std::mt19937 generator(seed);
+  std::uniform_int_distribution<int> noise_distribution(-noise, noise);
+  cv::Mat image(96, 128, CV_8UC3);
+  for (int y = 0; y < image.rows; y++) {
+    for (int x = 0; x < image.cols; x++) {
+      // Deterministic texture of the slide.
+      std::mt19937 texture((y / 16) * 1000 + (x + offset) / 16);
+      const int value = texture() % 200 + 20;
+      for (int c = 0; c < 3; c++) {
+        image.ptr<uint8_t>(y)[x * 3 + c] =
+            value + noise_distribution(generator);
+      }
+    }
+  }
+  return image;
+}
+
+TEST(ChangeDetectorTest, NoReference) {
+  ChangeDetector detector;
+  EXPECT_TRUE(std::isinf(detector.ComputeDifference(MakeImage(0, 0, 1))));
+  detector.UpdateReference();
+  EXPECT_THAT(detector.ComputeDifference(MakeImage(0, 0, 1)), DoubleEq(0));
+  detector.Reset();
+  EXPECT_TRUE(std::isinf(detector.ComputeDifference(MakeImage(0, 0, 1))));
+}
+
+TEST(ChangeDetectorTest, NoiseAndMotion) {
+  ChangeDetector detector;
+  detector.ComputeDifference(MakeImage(0, 4, 1));
+  detector.UpdateReference();
+  // Sensor noise averages out.
+  EXPECT_THAT(detector.ComputeDifference(MakeImage(0, 4, 2)), Lt(1.0));
+  // Moving the stage by half a cell changes the cells.
+  EXPECT_THAT(detector.ComputeDifference(MakeImage(8, 4, 3)), Gt(10.0));
+  // The reference is kept until it is updated.
+  EXPECT_THAT(detector.ComputeDifference(MakeImage(0, 4, 4)), Lt(1.0));
+}
+
+TEST(ChangeDetectorTest, LocalizedChange) {
+  ChangeDetector detector;
+  detector.ComputeDifference(MakeImage(0, 4, 1));
+  detector.UpdateReference();
+  // An object of a quarter of a cell entering a still field changes that
+  // cell, however large the rest of the field is.
+  cv::Mat image = MakeImage(0, 4, 2);
+  image(cv::Rect(36, 40, 8, 8)) += cv::Scalar(40, 40, 40);
+  EXPECT_THAT(detector.ComputeDifference(image), Gt(5.0));
+}
+
+TEST(ChangeDetectorTest, SizeChange) {
+  ChangeDetector detector;
+  detector.ComputeDifference(MakeImage(0, 0, 1));
+  detector.UpdateReference();
+  EXPECT_TRUE(
+      std::isinf(detector.ComputeDifference(cv::Mat(32, 32, CV_8UC3))));
+}
+
+}  // namespace
@@ -0,0 +1,49 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+// CPU features of the vector kernels, shared by the kernel files so that they
+// target and detect the instruction sets the same way. On x86, the AVX2
+// kernels are compiled for the AVX2 target and only run if the CPU supports
+// it. On ARM, NEON is part of the target.
+
+#ifndef AR_MICROSCOPE_IMAGE_PROCESSOR_CPU_FEATURES_H_
+#define AR_MICROSCOPE_IMAGE_PROCESSOR_CPU_FEATURES_H_
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNELS_HAVE_AVX2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define KERNELS_HAVE_NEON 1
+#endif
+
+#ifdef KERNELS_HAVE_AVX2
+
+// Compiles the function for AVX2, which must only be called if
+// CpuSupportsAvx2.
+#define KERNELS_TARGET_AVX2 __attribute__((target("avx2")))
+
+namespace image_processor {
+
+// Returns whether the CPU running the process supports AVX2.
+inline bool CpuSupportsAvx2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+}  // namespace image_processor
+
+#endif  // KERNELS_HAVE_AVX2
+
+#endif  // AR_MICROSCOPE_IMAGE_PROCESSOR_CPU_FEATURES_H_
@@ -14,14 +14,14 @@
 // =============================================================================
 #include "image_processor/debayer.h"
 
-#include <thread>
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
 
 #include "opencv2/core.hpp"
-#include "opencv2/imgproc.hpp"
 #include "absl/flags/flag.h"
 #include "absl/memory/memory.h"
 #include "absl/strings/str_format.h"
-#include "absl/synchronization/blocking_counter.h"
 #include "tensorflow/core/lib/core/errors.h"
 #include "tensorflow/core/lib/core/status.h"
 #include "tensorflow/core/platform/logging.h"
@@ -30,134 +30,636 @@ ABSL_FLAG(int, num_debayer_threads, 8,
           "Number of debayer threads for quick debayer.");
 ABSL_FLAG(bool, smooth_image, false,
           "Whether to perform image smoothing after debayer.");
+ABSL_FLAG(bool, simd_debayer, true,
+          "Whether to use SIMD (AVX2 or NEON) debayer kernels when the CPU "
+          "supports them.");
+ABSL_FLAG(double, debayer_gamma, 1.0,
+          "Gamma of the tone curve applied during debayer. 1.0 keeps the "
+          "output linear.");
 
 namespace image_processor {
+namespace {
+
+// Approximate number of input and output bytes processed by a band of
+// debayer rows. Bands should fit in the L2 cache, and be small enough for
+// the workers to balance their load.
+constexpr int kDebayerBandBytes = 256 * 1024;
+
+// Number of bands per demosaic thread. Demosaic only keeps 5 split rows in the
+// cache, so bands are sized for load balance. Each band splits 4 rows more than
+// it outputs.
+constexpr int kDemosaicBandsPerThread = 4;
+
+// Number of Bayer rows around an output row read by the demosaic kernels.
+constexpr int kDemosaicRows = 5;
+
+// Positions of the color pixels in the 2x2 Bayer tile. Green is always taken
+// from the first row.
+struct BayerOffsets {
+  int red_row;
+  int red_column;
+  int green_column;
+  int blue_row;
+  int blue_column;
+};
+
+constexpr BayerOffsets GetBayerOffsets(BayerPattern pattern) {
+  switch (pattern) {
+    case BayerPattern::RGGB:
+      return {0, 0, 1, 1, 1};
+    case BayerPattern::BGGR:
+      return {1, 1, 1, 0, 0};
+    case BayerPattern::GRBG:
+      return {0, 1, 0, 1, 0};
+    case BayerPattern::GBRG:
+      return {1, 0, 0, 0, 1};
+  }
+  return {0, 0, 1, 1, 1};
+}
+
+// Channel of the Bayer pixel at the row and column parities, 0 for red, 1 for
+// green and 2 for blue.
+int GetBayerChannel(BayerPattern pattern, int row, int column) {
+  const BayerOffsets offsets = GetBayerOffsets(pattern);
+  if (row == offsets.red_row && column == offsets.red_column) return 0;
+  if (row == offsets.blue_row && column == offsets.blue_column) return 2;
+  return 1;
+}
+
+// Index of the row in the image, with the borders mirrored without repeating
+// the edge rows.
+int MirrorRow(int y, int rows) {
+  if (rows == 1) return 0;
+  if (y < 0) return -y;
+  if (y >= rows) return 2 * rows - 2 - y;
+  return y;
+}
+
+}  // namespace
 
 Debayer::Debayer() {
-  num_debayer_threads_ = absl::GetFlag(FLAGS_num_debayer_threads);
+  worker_pool_ = std::make_unique<WorkerPool>(
+      std::max(absl::GetFlag(FLAGS_num_debayer_threads), 1));
+  use_vector_kernels_ = absl::GetFlag(FLAGS_simd_debayer);
+  SetGamma(absl::GetFlag(FLAGS_debayer_gamma));
 }
 
-tensorflow::Status Debayer::HalfDebayer(const cv::Mat& input, bool is_rgb,
+tensorflow::Status Debayer::HalfDebayer(const cv::Mat& input,
+                                        BayerPattern pattern, bool is_rgb,
                                         cv::Mat* output) {
+  if (packing_ != BayerPacking::NONE) {
+    TF_RETURN_IF_ERROR(CheckPacking(input));
+    return HalfDebayerInternal<uint16_t>(input, pattern, is_rgb, output);
+  }
   switch (input.elemSize()) {
     case 1:
-      TF_RETURN_IF_ERROR(HalfDebayerInternal<uint8_t>(input, is_rgb, output));
-      break;
+      return HalfDebayerInternal<uint8_t>(input, pattern, is_rgb, output);
     case 2:
-      TF_RETURN_IF_ERROR(HalfDebayerInternal<uint16_t>(input, is_rgb, output));
-      break;
+      return HalfDebayerInternal<uint16_t>(input, pattern, is_rgb, output);
     default:
       LOG(FATAL) << "Unsupported Bayer pixel byte size: " << input.elemSize();
   }
+  return tensorflow::Status();
+}
 
-  // Blur the image for smoothing.
-  if (absl::GetFlag(FLAGS_smooth_image)) {
-    cv::Mat tmp;
-    output->copyTo(tmp);
-    cv::blur(tmp, *output, cv::Size(3, 3));
+tensorflow::Status Debayer::Demosaic(const cv::Mat& input,
+                                     BayerPattern pattern, DebayerMode mode,
+                                     bool is_rgb, cv::Mat* output) {
+  if (mode == DebayerMode::HALF) {
+    return tensorflow::errors::InvalidArgument(
+        "Demosaic needs a full resolution mode.");
+  }
+  if (packing_ != BayerPacking::NONE) {
+    TF_RETURN_IF_ERROR(CheckPacking(input));
+  }
+  const int width = GetBayerWidth(input);
+  if (input.rows < 4 || width < 4 || input.rows % 2 != 0 || width % 2 != 0) {
+    return tensorflow::errors::InvalidArgument(absl::StrFormat(
+        "Invalid Bayer image dimension for demosaic: %dx%d", width,
+        input.rows));
+  }
+  if (packing_ != BayerPacking::NONE) {
+    return DemosaicInternal<uint16_t>(input, pattern, mode, is_rgb, output);
+  }
+  switch (input.elemSize()) {
+    case 1:
+      return DemosaicInternal<uint8_t>(input, pattern, mode, is_rgb, output);
+    case 2:
+      return DemosaicInternal<uint16_t>(input, pattern, mode, is_rgb, output);
+    default:
+      LOG(FATAL) << "Unsupported Bayer pixel byte size: " << input.elemSize();
   }
-
   return tensorflow::Status();
 }
 
+tensorflow::Status Debayer::Convert(const cv::Mat& input, BayerPattern pattern,
+                                    DebayerMode mode, bool is_rgb,
+                                    cv::Mat* output) {
+  if (mode == DebayerMode::HALF) {
+    return HalfDebayer(input, pattern, is_rgb, output);
+  }
+  return Demosaic(input, pattern, mode, is_rgb, output);
+}
+
 void Debayer::SetRgbGains(double red, double green, double blue) {
-  has_gain_ = true;
-  red_gain_ = red;
-  green_gain_ = green;
-  blue_gain_ = blue;
+  red_gain_ = ToFixedPointGain(red);
+  green_gain_ = ToFixedPointGain(green);
+  blue_gain_ = ToFixedPointGain(blue);
+  UpdateLookupTables();
 }
 
-template <typename T>
-tensorflow::Status Debayer::HalfDebayerInternal(const cv::Mat& input,
-                                                bool is_rgb, cv::Mat* output) {
-  // Adjust the output to the right size if it's not already.
-  output->create(input.rows / 2, input.cols / 2, CV_8UC3);
+void Debayer::SetGamma(double gamma) {
+  if (gamma <= 0) {
+    LOG(ERROR) << "Invalid gamma " << gamma << ", using 1.0 instead.";
+    gamma = 1.0;
+  }
+  gamma_ = gamma;
+  UpdateLookupTables();
+}
+
+void Debayer::GetRgbGains(double* red, double* green, double* blue) const {
+  *red = static_cast<double>(red_gain_) / kUnitGain;
+  *green = static_cast<double>(green_gain_) / kUnitGain;
+  *blue = static_cast<double>(blue_gain_) / kUnitGain;
+}
+
+ChannelStatistics Debayer::GetStatistics() const {
+  absl::MutexLock lock(&statistics_mutex_);
+  return statistics_;
+}
 
-  if (num_debayer_threads_ <= 1) {
-    PartialHalfDebayer<T>(input, 0, output->rows, is_rgb, output);
+void Debayer::StartFrameStatistics() {
+  absl::MutexLock lock(&statistics_mutex_);
+  frame_statistics_ = ChannelStatistics();
+}
+
+void Debayer::MergeBandStatistics(const std::array<Histogram, 3>& histograms,
+                                  bool is_rgb) {
+  absl::MutexLock lock(&statistics_mutex_);
+  for (int channel = 0; channel < 3; channel++) {
+    const Histogram& band_histogram =
+        histograms[is_rgb ? channel : 2 - channel];
+    Histogram& histogram = frame_statistics_.histograms[channel];
+    for (size_t value = 0; value < band_histogram.size(); value++) {
+      histogram[value] += band_histogram[value];
+    }
+  }
+}
+
+void Debayer::FinishFrameStatistics(int64_t num_pixels) {
+  absl::MutexLock lock(&statistics_mutex_);
+  frame_statistics_.num_pixels = num_pixels;
+  for (int channel = 0; channel < 3; channel++) {
+    const Histogram& histogram = frame_statistics_.histograms[channel];
+    double sum = 0;
+    for (size_t value = 0; value < histogram.size(); value++) {
+      sum += static_cast<double>(value) * histogram[value];
+    }
+    frame_statistics_.means[channel] = num_pixels > 0 ? sum / num_pixels : 0;
+  }
+  statistics_ = frame_statistics_;
+}
+
+void Debayer::UpdateLookupTables() {
+  const uint16_t gains[3] = {red_gain_, green_gain_, blue_gain_};
+  for (int channel = 0; channel < 3; channel++) {
+    BuildLookupTable<uint8_t>(gains[channel], gamma_,
+                              &lookup_tables_8bit_[channel]);
+    BuildLookupTable<uint16_t>(gains[channel], gamma_,
+                               &lookup_tables_16bit_[channel]);
+  }
+  BuildLookupTable<uint8_t>(kUnitGain, gamma_, &tone_table_);
+}
+
+template <>
+const Debayer::LookupTables& Debayer::GetLookupTables<uint8_t>() const {
+  return lookup_tables_8bit_;
+}
+
+template <>
+const Debayer::LookupTables& Debayer::GetLookupTables<uint16_t>() const {
+  return lookup_tables_16bit_;
+}
+
+tensorflow::Status Debayer::CheckPacking(const cv::Mat& input) const {
+  if (input.type() != CV_8UC1 ||
+      input.cols % GetPackedGroupBytes(packing_) != 0) {
+    return tensorflow::errors::InvalidArgument(absl::StrFormat(
+        "Packed Bayer image must be 8-bit with rows of groups of %d bytes, "
+        "got type %d with %d bytes per row.",
+        GetPackedGroupBytes(packing_), input.type(), input.cols));
+  }
+  return tensorflow::Status();
+}
+
+tensorflow::Status Debayer::UnpackBayerImage(const cv::Mat& input,
+                                             cv::Mat* output) const {
+  if (packing_ == BayerPacking::NONE) {
+    input.copyTo(*output);
     return tensorflow::Status();
   }
+  TF_RETURN_IF_ERROR(CheckPacking(input));
+  output->create(input.rows, GetBayerWidth(input), CV_16UC1);
+  const UnpackRowKernel unpack_kernel = GetUnpackRowKernel();
+  for (int y = 0; y < input.rows; y++) {
+    unpack_kernel(input.row(y).ptr(), output->cols,
+                  reinterpret_cast<uint16_t*>(output->row(y).ptr()));
+  }
+  return tensorflow::Status();
+}
+
+UnpackRowKernel Debayer::GetUnpackRowKernel() const {
+  if (packing_ == BayerPacking::NONE) return nullptr;
+  const UnpackRowKernel kernel =
+      use_vector_kernels_ ? GetVectorUnpackRowKernel(packing_) : nullptr;
+  if (kernel) return kernel;
+  return packing_ == BayerPacking::RAW10
+             ? &UnpackRowScalar<BayerPacking::RAW10>
+             : &UnpackRowScalar<BayerPacking::RAW12>;
+}
+
+template <typename T>
+tensorflow::Status Debayer::CheckFlatField(int width, int height) const {
+  if (flat_field_ && (flat_field_->GetWidth() != width ||
+                      flat_field_->GetHeight() != height ||
+                      flat_field_->GetBytesPerPixel() != sizeof(T))) {
+    return tensorflow::errors::InvalidArgument(absl::StrFormat(
+        "Flat field of %dx%d, %d bytes per pixel, does not match the Bayer "
+        "image of %dx%d, %d bytes per pixel.",
+        flat_field_->GetWidth(), flat_field_->GetHeight(),
+        flat_field_->GetBytesPerPixel(), width, height, sizeof(T)));
+  }
+  return tensorflow::Status();
+}
 
-  int height_per_thread = output->rows / num_debayer_threads_;
-  absl::BlockingCounter blocking_counter(num_debayer_threads_);
-  std::vector<std::thread> workers;
-  workers.reserve(num_debayer_threads_);
-  for (int thread_index = 0; thread_index < num_debayer_threads_;
-       thread_index++) {
-    workers.emplace_back([this, &blocking_counter, thread_index,
-                          height_per_thread, &input, output, is_rgb] {
-      PartialHalfDebayer<T>(input, height_per_thread * thread_index,
-                            height_per_thread, is_rgb, output);
-      blocking_counter.DecrementCount();
-    });
+template <typename T>
+FlatFieldRowKernel<T> Debayer::GetFlatFieldRowKernel() const {
+  if (!flat_field_) return nullptr;
+  FlatFieldRowKernel<T> kernel =
+      use_vector_kernels_ ? GetVectorFlatFieldRowKernel<T>() : nullptr;
+  return kernel ? kernel : &CorrectFlatFieldRowScalar<T>;
+}
+
+template <typename T>
+const T* Debayer::GetBayerRow(const cv::Mat& input, int y, int begin, int end,
+                              UnpackRowKernel unpack_kernel,
+                              FlatFieldRowKernel<T> flat_field_kernel,
+                              T* buffer) const {
+  const T* row = reinterpret_cast<const T*>(input.row(y).ptr());
+  if constexpr (std::is_same_v<T, uint16_t>) {
+    if (unpack_kernel) {
+      // The packed row is unpacked into the cache, and never expanded in
+      // memory as a whole image. The unpacked columns are widened to groups.
+      const int group_pixels = GetPackedGroupPixels(packing_);
+      const int first_group = begin / group_pixels;
+      const int last_group = (end + group_pixels - 1) / group_pixels;
+      unpack_kernel(input.row(y).ptr() +
+                        first_group * GetPackedGroupBytes(packing_),
+                    (last_group - first_group) * group_pixels,
+                    buffer + first_group * group_pixels);
+      row = buffer;
+    }
+  }
+  if (flat_field_kernel) {
+    // The row is corrected while it is in the cache, just before the debayer
+    // kernels read it.
+    flat_field_kernel(row + begin, flat_field_->GetDarkRow(y) + begin,
+                      flat_field_->GetGainRow(y) + begin, end - begin,
+                      buffer + begin);
+    row = buffer;
   }
-  blocking_counter.Wait();
-  for (std::thread& w : workers) {
-    w.join();
+  if (!defect_map_ || !defect_map_->HasDefects(y)) return row;
+  // Only the rows with defects are copied to be patched.
+  if (row != buffer) {
+    memcpy(buffer + begin, row + begin, (end - begin) * sizeof(T));
+  }
+  defect_map_->CorrectRow<T>(y, begin, end, buffer);
+  return buffer;
+}
+
+tensorflow::Status Debayer::CheckDefectMap(int width, int height) const {
+  if (defect_map_ && (defect_map_->GetWidth() != width ||
+                      defect_map_->GetHeight() != height)) {
+    return tensorflow::errors::InvalidArgument(absl::StrFormat(
+        "Defect map of %dx%d does not match the Bayer image of %dx%d.",
+        defect_map_->GetWidth(), defect_map_->GetHeight(), width, height));
   }
   return tensorflow::Status();
 }
 
+tensorflow::Status Debayer::CheckFieldOfView(int rows, int cols) const {
+  if (field_of_view_ && (field_of_view_->GetWidth() != cols ||
+                         field_of_view_->GetHeight() != rows)) {
+    return tensorflow::errors::InvalidArgument(absl::StrFormat(
+        "Field of view of %dx%d does not match the output of %dx%d.",
+        field_of_view_->GetWidth(), field_of_view_->GetHeight(), cols, rows));
+  }
+  return tensorflow::Status();
+}
+
+template <typename T>
+HalfDebayerRowKernel<T> Debayer::GetVectorRowKernel() const {
+  // The vector kernels compute linear gains only, with the same results as
+  // the lookup tables.
+  if (!use_vector_kernels_ || gamma_ != 1.0) return nullptr;
+  return GetVectorHalfDebayerRowKernel<T>();
+}
+
+template <typename T>
+SplitDemosaicRowKernel<T> Debayer::GetSplitDemosaicRowKernel() const {
+  SplitDemosaicRowKernel<T> kernel =
+      use_vector_kernels_ ? GetVectorSplitDemosaicRowKernel<T>() : nullptr;
+  return kernel ? kernel : &SplitDemosaicRowScalar<T>;
+}
+
+template <typename T>
+Debayer::PartialHalfDebayerFunction Debayer::GetPartialHalfDebayer(
+    BayerPattern pattern, bool is_rgb) {
+  switch (pattern) {
+    case BayerPattern::RGGB:
+      return GetPartialHalfDebayer<T, BayerPattern::RGGB>(is_rgb);
+    case BayerPattern::BGGR:
+      return GetPartialHalfDebayer<T, BayerPattern::BGGR>(is_rgb);
+    case BayerPattern::GRBG:
+      return GetPartialHalfDebayer<T, BayerPattern::GRBG>(is_rgb);
+    case BayerPattern::GBRG:
+      return GetPartialHalfDebayer<T, BayerPattern::GBRG>(is_rgb);
+  }
+  LOG(FATAL) << "Unsupported Bayer pattern: " << static_cast<int>(pattern);
+  return nullptr;
+}
+
 template <typename T>
+tensorflow::Status Debayer::HalfDebayerInternal(const cv::Mat& input,
+                                                BayerPattern pattern,
+                                                bool is_rgb, cv::Mat* output) {
+  const int width = GetBayerWidth(input);
+  TF_RETURN_IF_ERROR(CheckFlatField<T>(width, input.rows));
+  TF_RETURN_IF_ERROR(CheckDefectMap(width, input.rows));
+  TF_RETURN_IF_ERROR(CheckFieldOfView(input.rows / 2, width / 2));
+  // Adjust the output to the right size if it's not already.
+  output->create(input.rows / 2, width / 2, CV_8UC3);
+
+  const PartialHalfDebayerFunction partial_half_debayer =
+      GetPartialHalfDebayer<T>(pattern, is_rgb);
+  // The 3x3 box blur for smoothing is fused into the debayer bands.
+  const bool smooth = absl::GetFlag(FLAGS_smooth_image);
+  if (collect_statistics_) StartFrameStatistics();
+  // Each output row reads two input rows.
+  const int bytes_per_row = output->cols * 3 + width * 2 * sizeof(T);
+  const int band_rows = std::max(kDebayerBandBytes / bytes_per_row, 1);
+  worker_pool_->ParallelFor(
+      output->rows, band_rows,
+      [this, partial_half_debayer, &input, smooth, output](int begin,
+                                                           int end) {
+        (this->*partial_half_debayer)(input, begin, end - begin, smooth,
+                                      output);
+      });
+  if (collect_statistics_) {
+    FinishFrameStatistics(GetNumOutputPixels(*output));
+  }
+  return tensorflow::Status();
+}
+
+template <typename T, BayerPattern kPattern, bool kIsRgb>
 void Debayer::PartialHalfDebayer(const cv::Mat& input, int offset, int height,
-                                 bool is_rgb, cv::Mat* output) {
-  for (int y = offset; y < offset + height; y++) {
+                                 bool smooth, cv::Mat* output) {
+  constexpr BayerOffsets kOffsets = GetBayerOffsets(kPattern);
+  // Indices of the first and the last output channels in the RGB order.
+  constexpr int kFirstChannel = kIsRgb ? 0 : 2;
+  constexpr int kLastChannel = 2 - kFirstChannel;
+
+  const HalfDebayerRowKernel<T> vector_kernel = GetVectorRowKernel<T>();
+  const uint16_t rgb_gains[3] = {red_gain_, green_gain_, blue_gain_};
+  const uint16_t gains[3] = {rgb_gains[kFirstChannel], rgb_gains[1],
+                             rgb_gains[kLastChannel]};
+  const LookupTables& tables = GetLookupTables<T>();
+  const uint8_t* const channel_tables[3] = {tables[kFirstChannel].data(),
+                                            tables[1].data(),
+                                            tables[kLastChannel].data()};
+  const int input_width = GetBayerWidth(input);
+  const UnpackRowKernel unpack_kernel = GetUnpackRowKernel();
+  const FlatFieldRowKernel<T> flat_field_kernel = GetFlatFieldRowKernel<T>();
+  // The two unpacked or corrected input rows of an output row.
+  thread_local std::vector<T> bayer_rows;
+  if (unpack_kernel || flat_field_kernel || defect_map_) {
+    bayer_rows.resize(2 * input_width);
+  }
+  // Sets the output pixels of row y outside the field of view to the padding.
+  auto pad_row = [&](int y, uint8_t* output_ptr) {
+    const RowSpan span = GetOutputSpan(y, output->cols);
+    if (span.begin >= span.end) {
+      memset(output_ptr, kFieldOfViewPadding, output->cols * 3);
+      return;
+    }
+    memset(output_ptr, kFieldOfViewPadding, span.begin * 3);
+    memset(output_ptr + span.end * 3, kFieldOfViewPadding,
+           (output->cols - span.end) * 3);
+  };
+  auto debayer_row = [&](int y, uint8_t* output_ptr) {
+    const RowSpan span = GetOutputSpan(y, output->cols);
+    pad_row(y, output_ptr);
+    if (span.begin >= span.end) return;
     int input_y = y << 1;
-    const T* input_row1 = reinterpret_cast<const T*>(input.row(input_y).ptr());
-    const T* input_row2 =
-        reinterpret_cast<const T*>(input.row(input_y + 1).ptr());
-    uint8_t* output_ptr = output->row(y).ptr();
-    for (int x = 0; x < output->cols; x++) {
-      // Bayer pixel pattern:
-      //   RG
-      //   GB
-      int input_x1 = x << 1;
-      int input_x2 = input_x1 + 1;
-      if (is_rgb) {
-        // Output is RGB.
-        *(output_ptr++) =
-            GetPixelValue(input_row1[input_x1], red_gain_);  // Red
-        *(output_ptr++) =
-            GetPixelValue(input_row1[input_x2], green_gain_);  // Green
-        *(output_ptr++) =
-            GetPixelValue(input_row2[input_x2], blue_gain_);  // Blue
-      } else {
-        // Output is BGR.
-        *(output_ptr++) =
-            GetPixelValue(input_row2[input_x2], blue_gain_);  // Blue
-        *(output_ptr++) =
-            GetPixelValue(input_row1[input_x2], green_gain_);  // Green
-        *(output_ptr++) =
-            GetPixelValue(input_row1[input_x1], red_gain_);  // Red
-      }
+    const int input_begin = span.begin << 1;
+    const int input_end = span.end << 1;
+    const T* input_rows[2] = {
+        GetBayerRow<T>(input, input_y, input_begin, input_end, unpack_kernel,
+                       flat_field_kernel, bayer_rows.data()),
+        GetBayerRow<T>(input, input_y + 1, input_begin, input_end,
+                       unpack_kernel, flat_field_kernel,
+                       bayer_rows.data() + input_width)};
+    const T* red = input_rows[kOffsets.red_row] + kOffsets.red_column;
+    const T* green = input_rows[0] + kOffsets.green_column;
+    const T* blue = input_rows[kOffsets.blue_row] + kOffsets.blue_column;
+    const T* first = (kIsRgb ? red : blue) + input_begin;
+    const T* last = (kIsRgb ? blue : red) + input_begin;
+    green += input_begin;
+    const int width = span.end - span.begin;
+    output_ptr += span.begin * 3;
+    if (vector_kernel) {
+      vector_kernel(first, green, last, gains, width, output_ptr);
+    } else {
+      HalfDebayerRowLookup<T>(first, green, last, channel_tables, width,
+                              output_ptr);
     }
+  };
+
+  // Histograms of the band, counted right after each output row is written.
+  std::array<Histogram, 3> histograms = {};
+  auto accumulate_row = [&](int y, const uint8_t* output_ptr) {
+    const RowSpan span = GetOutputSpan(y, output->cols);
+    AccumulateHistograms(output_ptr + span.begin * 3, span.end - span.begin,
+                         &histograms);
+  };
+  if (!smooth) {
+    for (int y = offset; y < offset + height; y++) {
+      uint8_t* output_ptr = output->row(y).ptr();
+      debayer_row(y, output_ptr);
+      if (collect_statistics_) accumulate_row(y, output_ptr);
+    }
+    if (collect_statistics_) MergeBandStatistics(histograms, kIsRgb);
+    return;
+  }
+
+  // Blur while the debayered rows are in the cache. The rows y - 1, y and
+  // y + 1 of output row y are kept in a rolling window, so that the blurred
+  // rows can be written in place. The padding outside the field of view is
+  // blurred in at its edge, and set again afterwards.
+  const int row_size = output->cols * 3;
+  thread_local std::vector<uint8_t> window;
+  thread_local std::vector<uint16_t> column_sums;
+  window.resize(3 * row_size);
+  column_sums.resize(row_size);
+  uint8_t* rows[3] = {window.data(), window.data() + row_size,
+                      window.data() + 2 * row_size};
+  debayer_row(MirrorRow(offset - 1, output->rows), rows[0]);
+  debayer_row(offset, rows[1]);
+  for (int y = offset; y < offset + height; y++) {
+    debayer_row(MirrorRow(y + 1, output->rows), rows[2]);
+    uint8_t* output_ptr = output->row(y).ptr();
+    BoxBlurRow(rows, output->cols, column_sums.data(), output_ptr);
+    if (field_of_view_) pad_row(y, output_ptr);
+    if (collect_statistics_) accumulate_row(y, output_ptr);
+    std::rotate(rows, rows + 1, rows + 3);
   }
+  if (collect_statistics_) MergeBandStatistics(histograms, kIsRgb);
 }
 
 template <typename T>
-uint8_t Debayer::GetPixelValue(T bayer_value, double gain) {
-  // Bit shift value, so that we take the most significant byte value as uint8.
-  constexpr int bit_shift = (sizeof(T) - 1) * 8;
+tensorflow::Status Debayer::DemosaicInternal(const cv::Mat& input,
+                                             BayerPattern pattern,
+                                             DebayerMode mode, bool is_rgb,
+                                             cv::Mat* output) {
+  const int width = GetBayerWidth(input);
+  TF_RETURN_IF_ERROR(CheckFlatField<T>(width, input.rows));
+  TF_RETURN_IF_ERROR(CheckDefectMap(width, input.rows));
+  TF_RETURN_IF_ERROR(CheckFieldOfView(input.rows, width));
+  // Adjust the output to the right size if it's not already.
+  output->create(input.rows, width, CV_8UC3);
 
-  if (has_gain_) {
-    T adjusted_value = static_cast<T>(
-        std::min<double>(gain * bayer_value, std::numeric_limits<T>::max()));
-    return static_cast<uint8_t>(adjusted_value >> bit_shift);
-  } else {
-    return static_cast<uint8_t>(bayer_value >> bit_shift);
+  const bool gradient_correction = mode == DebayerMode::MALVAR_HE_CUTLER;
+  DemosaicRowKernel kernel =
+      use_vector_kernels_ ? GetVectorDemosaicRowKernel(gradient_correction)
+                          : nullptr;
+  if (!kernel) {
+    kernel = gradient_correction ? &DemosaicRowScalar<true>
+                                 : &DemosaicRowScalar<false>;
+  }
+  if (collect_statistics_) StartFrameStatistics();
+  const int num_bands = worker_pool_->GetNumThreads() * kDemosaicBandsPerThread;
+  const int band_rows = std::max((output->rows + num_bands - 1) / num_bands,
+                                 kDemosaicRows);
+  worker_pool_->ParallelFor(
+      output->rows, band_rows,
+      [this, &input, pattern, kernel, is_rgb, output](int begin, int end) {
+        PartialDemosaic<T>(input, pattern, kernel, is_rgb, begin, end - begin,
+                           output);
+      });
+  if (collect_statistics_) {
+    FinishFrameStatistics(GetNumOutputPixels(*output));
   }
+  return tensorflow::Status();
 }
 
-template <>
-uint8_t Debayer::GetPixelValue(uint8_t bayer_value, double gain) {
-  // Bit shift value, so that we take the most significant byte value as uint8.
-  if (has_gain_) {
-    uint8_t adjusted_value = static_cast<uint8_t>(std::min<double>(
-        gain * bayer_value, std::numeric_limits<uint8_t>::max()));
-    return adjusted_value;
-  } else {
-    return bayer_value;
+template <typename T>
+void Debayer::PartialDemosaic(const cv::Mat& input, BayerPattern pattern,
+                              DemosaicRowKernel kernel, bool is_rgb,
+                              int offset, int height, cv::Mat* output) {
+  const uint16_t rgb_gains[3] = {red_gain_, green_gain_, blue_gain_};
+  // Gains of the even and the odd columns of the even and the odd rows.
+  uint16_t gains[2][2];
+  for (int row = 0; row < 2; row++) {
+    for (int column = 0; column < 2; column++) {
+      gains[row][column] = rgb_gains[GetBayerChannel(pattern, row, column)];
+    }
+  }
+
+  const int width = GetBayerWidth(input);
+  // Split rows y - 2 to y + 2 of output row y, in a ring of slots indexed by
+  // y modulo kDemosaicRows.
+  // A kernel starting inside the row reads up to a block past its end.
+  const int plane_size = GetDemosaicPlaneSize(width) +
+                         (field_of_view_ ? kDemosaicBlockPairs : 0);
+  thread_local std::vector<int16_t> planes;
+  planes.resize(kDemosaicRows * 2 * plane_size);
+  int16_t* even_planes[kDemosaicRows];
+  int16_t* odd_planes[kDemosaicRows];
+  for (int slot = 0; slot < kDemosaicRows; slot++) {
+    // Planes start after their mirrored padding value.
+    even_planes[slot] = planes.data() + slot * 2 * plane_size + 1;
+    odd_planes[slot] = even_planes[slot] + plane_size;
+  }
+  auto get_slot = [](int y) {
+    return (y % kDemosaicRows + kDemosaicRows) % kDemosaicRows;
+  };
+  auto get_planes = [&](int y) {
+    const int slot = get_slot(y);
+    return DemosaicPlanes{even_planes[slot], odd_planes[slot]};
+  };
+  const SplitDemosaicRowKernel<T> split_kernel =
+      GetSplitDemosaicRowKernel<T>();
+  const UnpackRowKernel unpack_kernel = GetUnpackRowKernel();
+  const FlatFieldRowKernel<T> flat_field_kernel = GetFlatFieldRowKernel<T>();
+  // The unpacked or corrected input row.
+  thread_local std::vector<T> bayer_row;
+  if (unpack_kernel || flat_field_kernel || defect_map_) {
+    bayer_row.resize(width);
+  }
+  auto split_row = [&](int y) {
+    const int input_y = MirrorRow(y, input.rows);
+    const int slot = get_slot(y);
+    split_kernel(GetBayerRow<T>(input, input_y, 0, width, unpack_kernel,
+                                flat_field_kernel, bayer_row.data()),
+                 width, gains[input_y & 1], even_planes[slot],
+                 odd_planes[slot]);
+  };
+
+  for (int y = offset - 2; y < offset + 2; y++) {
+    split_row(y);
+  }
+  // Histograms of the band, counted right after each output row is written.
+  std::array<Histogram, 3> histograms = {};
+  for (int y = offset; y < offset + height; y++) {
+    split_row(y + 2);
+    const DemosaicPlanes rows[kDemosaicRows] = {
+        get_planes(y - 2), get_planes(y - 1), get_planes(y),
+        get_planes(y + 1), get_planes(y + 2)};
+    const int green_column = GetBayerChannel(pattern, y & 1, 0) == 1 ? 0 : 1;
+    const int row_color = GetBayerChannel(pattern, y & 1, 1 - green_column);
+    uint8_t* output_ptr = output->row(y).ptr();
+    const RowSpan span = GetOutputSpan(y, output->cols);
+    if (span.begin >= span.end) {
+      memset(output_ptr, kFieldOfViewPadding, output->cols * 3);
+      continue;
+    }
+    // The kernels work on pixel pairs, so they run on the span widened to
+    // even columns, and the padding is set afterwards.
+    const int first_pair = span.begin / 2;
+    const DemosaicPlanes span_rows[kDemosaicRows] = {
+        {rows[0].even + first_pair, rows[0].odd + first_pair},
+        {rows[1].even + first_pair, rows[1].odd + first_pair},
+        {rows[2].even + first_pair, rows[2].odd + first_pair},
+        {rows[3].even + first_pair, rows[3].odd + first_pair},
+        {rows[4].even + first_pair, rows[4].odd + first_pair}};
+    const int kernel_width = (span.end + 1 - first_pair * 2) & ~1;
+    kernel(span_rows, kernel_width, green_column,
+           is_rgb ? row_color : 2 - row_color, output_ptr + first_pair * 6);
+    memset(output_ptr, kFieldOfViewPadding, span.begin * 3);
+    memset(output_ptr + span.end * 3, kFieldOfViewPadding,
+           (output->cols - span.end) * 3);
+    uint8_t* span_ptr = output_ptr + span.begin * 3;
+    const int span_width = span.end - span.begin;
+    if (gamma_ != 1.0) {
+      for (int x = 0; x < span_width * 3; x++) {
+        span_ptr[x] = tone_table_[span_ptr[x]];
+      }
+    }
+    if (collect_statistics_) {
+      AccumulateHistograms(span_ptr, span_width, &histograms);
+    }
   }
+  if (collect_statistics_) MergeBandStatistics(histograms, is_rgb);
 }
 
 }  // namespace image_processor
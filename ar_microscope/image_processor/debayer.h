@@ -15,19 +15,67 @@
 #ifndef AR_MICROSCOPE_IMAGE_PROCESSOR_DEBAYER_H_
 #define AR_MICROSCOPE_IMAGE_PROCESSOR_DEBAYER_H_
 
+#include <array>
+#include <cstdint>
 #include <memory>
+#include <vector>
 
 #include "opencv2/core.hpp"
+#include "absl/synchronization/mutex.h"
+#include "image_processor/debayer_kernels.h"
+#include "image_processor/field_of_view.h"
+#include "image_processor/defect_map.h"
+#include "image_processor/flat_field.h"
+#include "image_processor/worker_pool.h"
 #include "tensorflow/core/lib/core/status.h"
 
 namespace image_processor {
 
+// Color filter layouts of the 2x2 Bayer tile, listed row by row.
+enum class BayerPattern {
+  RGGB,
+  BGGR,
+  GRBG,
+  GBRG,
+};
+
+// Ways to turn the Bayer image into the RGB image.
+enum class DebayerMode {
+  // Each 2x2 Bayer tile becomes a single pixel, see HalfDebayer.
+  HALF,
+  // Full resolution, bilinear interpolation of the missing colors.
+  BILINEAR,
+  // Full resolution, gradient-corrected bilinear interpolation of Malvar, He
+  // and Cutler. Sharper than BILINEAR with fewer color fringes.
+  MALVAR_HE_CUTLER,
+};
+
+// Per-channel statistics of the debayer output.
+struct ChannelStatistics {
+  // Histograms of the output values of the red, green and blue channels, in
+  // this order regardless of the output order.
+  std::array<Histogram, 3> histograms = {};
+  // Means of the output values of the red, green and blue channels.
+  std::array<double, 3> means = {};
+  // Number of pixels of the frame. Zero if no frame has been debayered with
+  // statistics enabled.
+  int64_t num_pixels = 0;
+};
+
+// Value of the output pixels outside the field of view, which is the same as
+// the padding of the inference input.
+constexpr uint8_t kFieldOfViewPadding = 0;
+
 // Class to perform Debayer in multi-thread.
 class Debayer {
  public:
   Debayer();
   virtual ~Debayer() {}
 
+  // Returns the worker pool used for debayer. Other per-frame kernels may
+  // share it.
+  WorkerPool* GetWorkerPool() { return worker_pool_.get(); }
+
   tensorflow::Status HalfDebayer(const cv::Mat& input, cv::Mat* output) {
     return HalfDebayer(input, false, output);
   }
@@ -41,35 +89,254 @@ class Debayer {
   //   is_rgb: Output is in RGB if true, otherwise output is in BGR.
   //   output: Output image.
   tensorflow::Status HalfDebayer(const cv::Mat& input, bool is_rgb,
-                                 cv::Mat* output);
+                                 cv::Mat* output) {
+    return HalfDebayer(input, BayerPattern::RGGB, is_rgb, output);
+  }
+
+  // Same as above, for the input in the given Bayer pattern. Each pattern and
+  // output order has its own specialized kernel.
+  tensorflow::Status HalfDebayer(const cv::Mat& input, BayerPattern pattern,
+                                 bool is_rgb, cv::Mat* output);
+
+  // Demosaics the image in multiple threads into an output of the same
+  // dimension as the input, interpolating the missing colors of each pixel.
+  //
+  // Args:
+  //   input: Input image, with even width and height of at least 4.
+  //   pattern: Bayer pattern of the input.
+  //   mode: Interpolation, either BILINEAR or MALVAR_HE_CUTLER.
+  //   is_rgb: Output is in RGB if true, otherwise output is in BGR.
+  //   output: Output image. May be a view, e.g. of an inference tensor, in
+  //     which case it is written in place.
+  tensorflow::Status Demosaic(const cv::Mat& input, BayerPattern pattern,
+                              DebayerMode mode, bool is_rgb, cv::Mat* output);
+
+  // Converts the image with HalfDebayer or Demosaic, depending on the mode.
+  tensorflow::Status Convert(const cv::Mat& input, BayerPattern pattern,
+                             DebayerMode mode, bool is_rgb, cv::Mat* output);
 
   // Sets RGB gains of each color. In some devices, such as Jenoptik,
   // white balance adjustment is not applied to raw Bayer image, therefore
   // we must apply when we Debayer.
+  // The gains are folded into per-channel lookup tables, which are rebuilt
+  // here, so this should not be called for every frame.
   void SetRgbGains(double red, double green, double blue);
 
+  // Sets the gamma of the tone curve applied after the gains. Output values
+  // are 255 * (linear value)^(1 / gamma), with linear values in [0, 1]. Gamma
+  // 1.0 keeps the output linear. This rebuilds the lookup tables.
+  void SetGamma(double gamma);
+
+  // Sets the flat-field and dark-frame calibration applied to the Bayer
+  // values before debayer, or nullptr for none. The calibration must match the
+  // dimension and the pixel size of the input, otherwise debayer fails. This
+  // should not be called during debayer.
+  void SetFlatField(std::shared_ptr<const FlatField> flat_field) {
+    flat_field_ = std::move(flat_field);
+  }
+
+  // Sets the defect pixel map whose pixels are replaced before debayer, after
+  // the flat field, or nullptr for none. The map must match the dimension of
+  // the input, otherwise debayer fails. This should not be called during
+  // debayer.
+  void SetDefectMap(std::shared_ptr<const DefectMap> defect_map) {
+    defect_map_ = std::move(defect_map);
+  }
+
+  // Sets how the Bayer pixels of the input are packed. Packed input is a
+  // CV_8UC1 image whose rows are the packed bytes, and is unpacked row by row
+  // inside the debayer bands into 16-bit values, so the flat field must have 2
+  // bytes per pixel. This should not be called during debayer.
+  void SetBayerPacking(BayerPacking packing) { packing_ = packing; }
+
+  // Unpacks a whole Bayer image in the current packing into a CV_16UC1 image,
+  // or copies it if it is not packed. Debayer does not need this, as it
+  // unpacks the rows itself.
+  tensorflow::Status UnpackBayerImage(const cv::Mat& input,
+                                      cv::Mat* output) const;
+
+  // Sets the circular field of view of the output, or nullptr for the whole
+  // image. Only the pixels inside it are debayered, and the rest are set to
+  // kFieldOfViewPadding. Statistics only count the pixels inside. It must
+  // match the output dimension, otherwise debayer fails. This should not be
+  // called during debayer.
+  void SetFieldOfView(std::shared_ptr<const FieldOfView> field_of_view) {
+    field_of_view_ = std::move(field_of_view);
+  }
+
+  // Returns the RGB gains set by SetRgbGains, after fixed-point rounding.
+  void GetRgbGains(double* red, double* green, double* blue) const;
+
+  // Enables gathering ChannelStatistics while debayering. Each output row is
+  // counted right after it is written, while it is still in the cache. This
+  // should not be called during debayer.
+  void SetCollectStatistics(bool collect) { collect_statistics_ = collect; }
+  bool IsCollectingStatistics() const { return collect_statistics_; }
+
+  // Returns the statistics of the last frame debayered with statistics
+  // enabled. May be called from any thread.
+  ChannelStatistics GetStatistics() const;
+
  private:
+  // Lookup tables from Bayer pixel values to output values of the red, green
+  // and blue channels, in this order.
+  using LookupTables = std::array<std::vector<uint8_t>, 3>;
+
+  // Rebuilds the lookup tables from the current gains and gamma.
+  void UpdateLookupTables();
+
+  // Clears the statistics of the frame before debayering it.
+  void StartFrameStatistics();
+
+  // Adds the histograms of a band, in the output channel order.
+  void MergeBandStatistics(const std::array<Histogram, 3>& histograms,
+                           bool is_rgb);
+
+  // Publishes the statistics of the frame of the given number of pixels.
+  void FinishFrameStatistics(int64_t num_pixels);
+
+  template <typename T>
+  const LookupTables& GetLookupTables() const;
+
+  // Returns an error if the packed input is not made of whole groups.
+  tensorflow::Status CheckPacking(const cv::Mat& input) const;
+
+  // Returns the number of Bayer pixels of the rows of the input.
+  int GetBayerWidth(const cv::Mat& input) const {
+    return packing_ == BayerPacking::NONE
+               ? input.cols
+               : input.cols / GetPackedGroupBytes(packing_) *
+                     GetPackedGroupPixels(packing_);
+  }
+
+  // Returns an error if the flat field does not match the Bayer image of the
+  // given dimension.
+  template <typename T>
+  tensorflow::Status CheckFlatField(int width, int height) const;
+
+  // Returns an error if the defect map does not match the Bayer image of the
+  // given dimension.
+  tensorflow::Status CheckDefectMap(int width, int height) const;
+
+  // Returns an error if the field of view does not match the output.
+  tensorflow::Status CheckFieldOfView(int rows, int cols) const;
+
+  // Returns the span of the output row inside the field of view.
+  RowSpan GetOutputSpan(int y, int cols) const {
+    return field_of_view_ ? field_of_view_->GetSpan(y) : RowSpan{0, cols};
+  }
+
+  // Returns the number of output pixels inside the field of view.
+  int64_t GetNumOutputPixels(const cv::Mat& output) const {
+    return field_of_view_ ? field_of_view_->GetNumPixels() : output.total();
+  }
+
+  // Returns the flat-field kernel for the pixel type.
   template <typename T>
-  tensorflow::Status HalfDebayerInternal(const cv::Mat& input, bool is_rgb,
+  FlatFieldRowKernel<T> GetFlatFieldRowKernel() const;
+
+  // Returns the unpack kernel of the packing, or nullptr if the input is not
+  // packed.
+  UnpackRowKernel GetUnpackRowKernel() const;
+
+  // Returns Bayer row y of the input. With packed input, at least the columns
+  // [begin, end) are unpacked into the buffer, which must hold the whole row.
+  // The columns [begin, end) are then corrected with the flat field into the
+  // buffer if there is one, and the defects of the row patched in the buffer
+  // if it has any.
+  template <typename T>
+  const T* GetBayerRow(const cv::Mat& input, int y, int begin, int end,
+                       UnpackRowKernel unpack_kernel,
+                       FlatFieldRowKernel<T> flat_field_kernel,
+                       T* buffer) const;
+
+  template <typename T>
+  tensorflow::Status HalfDebayerInternal(const cv::Mat& input,
+                                         BayerPattern pattern, bool is_rgb,
                                          cv::Mat* output);
 
   // Debayer the partial image. Offset and height is specified in
-  // output image dimension.
+  // output image dimension. If smooth is true, the output is blurred with a
+  // 3x3 box filter, as cv::blur would do on the whole output.
   // typename T: Type of pixel value.
-  template <typename T>
+  // kPattern: Bayer pattern of the input.
+  // kIsRgb: Output is in RGB if true, otherwise output is in BGR.
+  template <typename T, BayerPattern kPattern, bool kIsRgb>
   void PartialHalfDebayer(const cv::Mat& input, int offset, int height,
-                          bool is_rgb, cv::Mat* output);
+                          bool smooth, cv::Mat* output);
+
+  using PartialHalfDebayerFunction = void (Debayer::*)(const cv::Mat& input,
+                                                       int offset, int height,
+                                                       bool smooth,
+                                                       cv::Mat* output);
+
+  // Returns the PartialHalfDebayer specialization for the pattern and the
+  // output order.
+  template <typename T>
+  static PartialHalfDebayerFunction GetPartialHalfDebayer(BayerPattern pattern,
+                                                          bool is_rgb);
+
+  template <typename T, BayerPattern kPattern>
+  static PartialHalfDebayerFunction GetPartialHalfDebayer(bool is_rgb) {
+    return is_rgb ? &Debayer::PartialHalfDebayer<T, kPattern, true>
+                  : &Debayer::PartialHalfDebayer<T, kPattern, false>;
+  }
 
   template <typename T>
-  inline uint8_t GetPixelValue(T bayer_value, double gain);
+  tensorflow::Status DemosaicInternal(const cv::Mat& input,
+                                      BayerPattern pattern, DebayerMode mode,
+                                      bool is_rgb, cv::Mat* output);
+
+  // Demosaics the output rows [offset, offset + height).
+  template <typename T>
+  void PartialDemosaic(const cv::Mat& input, BayerPattern pattern,
+                       DemosaicRowKernel kernel, bool is_rgb, int offset,
+                       int height, cv::Mat* output);
+
+  // Returns the split kernel for the pixel type.
+  template <typename T>
+  SplitDemosaicRowKernel<T> GetSplitDemosaicRowKernel() const;
+
+  // Returns the vector row kernel for the pixel type, or nullptr if the
+  // lookup tables must be used.
+  template <typename T>
+  HalfDebayerRowKernel<T> GetVectorRowKernel() const;
+
+  // Long-lived debayer threads.
+  std::unique_ptr<WorkerPool> worker_pool_;
+
+  // Whether to use the vector row kernels when the CPU supports them.
+  bool use_vector_kernels_;
+
+  // RGB gains in fixed-point. Multipliers for each color channel.
+  uint16_t red_gain_ = kUnitGain;
+  uint16_t green_gain_ = kUnitGain;
+  uint16_t blue_gain_ = kUnitGain;
+
+  double gamma_ = 1.0;
+
+  // Lookup tables for 8-bit and 16-bit Bayer input.
+  LookupTables lookup_tables_8bit_;
+  LookupTables lookup_tables_16bit_;
+
+  // Gamma curve applied to the demosaic output, indexed by output value.
+  std::vector<uint8_t> tone_table_;
+
+  BayerPacking packing_ = BayerPacking::NONE;
+
+  std::shared_ptr<const FlatField> flat_field_;
+
+  std::shared_ptr<const DefectMap> defect_map_;
+
+  std::shared_ptr<const FieldOfView> field_of_view_;
 
-  int num_debayer_threads_;
+  bool collect_statistics_ = false;
 
-  // RGB gains. Multipliers for each color channel.
-  bool has_gain_ = false;
-  double red_gain_ = 1.0;
-  double green_gain_ = 1.0;
-  double blue_gain_ = 1.0;
+  mutable absl::Mutex statistics_mutex_;
+  // Statistics of the frame being debayered, merged from the bands.
+  ChannelStatistics frame_statistics_ ABSL_GUARDED_BY(statistics_mutex_);
+  // Statistics of the last frame.
+  ChannelStatistics statistics_ ABSL_GUARDED_BY(statistics_mutex_);
 };
 
 }  // namespace image_processor
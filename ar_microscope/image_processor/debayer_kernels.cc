@@ -0,0 +1,1137 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_processor/debayer_kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include "image_processor/cpu_features.h"
+
+namespace image_processor {
+namespace {
+
+// Number of output pixels produced by one iteration of the vector kernels.
+constexpr int kVectorPixels = 16;
+
+// Returns the number of output pixels the vector kernels may process. The
+// vector loads read 2 * kVectorPixels Bayer pixels starting at the channel
+// pointer, which may be one pixel to the right of the row start, so the last
+// vector iteration must finish before the last output pixel.
+inline int GetVectorWidth(int width) {
+  return width > kVectorPixels
+             ? (width - 1) / kVectorPixels * kVectorPixels
+             : 0;
+}
+
+// The demosaic filters are scaled by 16 to have integer weights.
+constexpr int kDemosaicFilterBits = 4;
+constexpr int kDemosaicOutputShift = kDemosaicBits + kDemosaicFilterBits - 8;
+constexpr int kMaxDemosaicValue = (1 << kDemosaicBits) - 1;
+
+// Converts a Bayer pixel value in the 16-bit range to kDemosaicBits bits, with
+// the fixed-point gain applied.
+inline int16_t ToDemosaicValue(uint16_t value, uint16_t gain) {
+  const uint32_t adjusted_value = (static_cast<uint32_t>(value) * gain) >>
+                                  (kGainFractionBits + 16 - kDemosaicBits);
+  return static_cast<int16_t>(
+      std::min<uint32_t>(adjusted_value, kMaxDemosaicValue));
+}
+
+// Rounds a demosaic filter result to the 8-bit output.
+inline uint8_t ToDemosaicOutput(int value) {
+  value = (value + (1 << (kDemosaicOutputShift - 1))) >> kDemosaicOutputShift;
+  return static_cast<uint8_t>(std::clamp(value, 0, 255));
+}
+
+template <typename T>
+void SplitDemosaicPairs(const T* input, int begin, int end,
+                        const uint16_t gains[2], int16_t* even, int16_t* odd) {
+  for (int i = begin; i < end; i++) {
+    even[i] = ToDemosaicValue(ToUint16Range(input[2 * i]), gains[0]);
+    odd[i] = ToDemosaicValue(ToUint16Range(input[2 * i + 1]), gains[1]);
+  }
+}
+
+// Mirrors the borders of the split row without repeating the edge pixels.
+inline void MirrorDemosaicBorders(int width, int16_t* even, int16_t* odd) {
+  const int pairs = width / 2;
+  even[-1] = even[1];
+  odd[-1] = odd[0];
+  even[pairs] = even[pairs - 1];
+  odd[pairs] = odd[pairs - 2];
+}
+
+// 5x5 neighbourhood of a block of pixels of the same color, which are
+// consecutive values of a plane of the center row.
+struct DemosaicBlock {
+  // Planes of the pixel color in the rows -2 to 2, at the first pixel.
+  const int16_t* same[5];
+  // Planes of the other column parity in the rows -1 to 1, at the left
+  // neighbour of the first pixel.
+  const int16_t* other[3];
+};
+
+// Gets the neighbourhoods of the even and the odd pixels of the pairs starting
+// at pair i.
+inline void GetDemosaicBlocks(const DemosaicPlanes rows[5], int i,
+                              DemosaicBlock* even, DemosaicBlock* odd) {
+  for (int row = 0; row < 5; row++) {
+    even->same[row] = rows[row].even + i;
+    odd->same[row] = rows[row].odd + i;
+  }
+  for (int row = 0; row < 3; row++) {
+    even->other[row] = rows[row + 1].odd + i - 1;
+    odd->other[row] = rows[row + 1].even + i;
+  }
+}
+
+// Interpolates kDemosaicBlockPairs pixels of the same color.
+//
+// In the neighbourhood, ns and ew are the sums of the 4-neighbours in the
+// column and in the row, ns2 and ew2 the sums of the pixels 2 away, and
+// diagonal the sum of the diagonal neighbours. The outputs are the other color
+// in the row, green, and the color in the column, each as a filter result
+// scaled by 16.
+template <bool kGradientCorrection, bool kIsGreen>
+void InterpolateBlock(const DemosaicBlock& block,
+                      int values[3][kDemosaicBlockPairs]) {
+  constexpr int kCorrection = kGradientCorrection ? 1 : 0;
+  const int16_t* __restrict same_0 = block.same[0];
+  const int16_t* __restrict same_1 = block.same[1];
+  const int16_t* __restrict same_2 = block.same[2];
+  const int16_t* __restrict same_3 = block.same[3];
+  const int16_t* __restrict same_4 = block.same[4];
+  const int16_t* __restrict other_0 = block.other[0];
+  const int16_t* __restrict other_1 = block.other[1];
+  const int16_t* __restrict other_2 = block.other[2];
+  for (int i = 0; i < kDemosaicBlockPairs; i++) {
+    const int center = same_2[i];
+    const int ns = same_1[i] + same_3[i];
+    const int ns2 = same_0[i] + same_4[i];
+    const int ew = other_1[i] + other_1[i + 1];
+    const int ew2 = same_2[i - 1] + same_2[i + 1];
+    const int diagonal =
+        other_0[i] + other_0[i + 1] + other_2[i] + other_2[i + 1];
+    if (kIsGreen) {
+      values[0][i] =
+          8 * ew + kCorrection * (10 * center - 2 * ew2 - 2 * diagonal + ns2);
+      values[1][i] = 16 * center;
+      values[2][i] =
+          8 * ns + kCorrection * (10 * center - 2 * ns2 - 2 * diagonal + ew2);
+    } else {
+      values[0][i] = 16 * center;
+      values[1][i] =
+          4 * (ns + ew) + kCorrection * (8 * center - 2 * (ns2 + ew2));
+      values[2][i] =
+          4 * diagonal + kCorrection * (12 * center - 3 * (ns2 + ew2));
+    }
+  }
+}
+
+// Byte positions of 8 consecutive packed pixels, starting at a group, and the
+// multipliers that move their low bits to the top of the low byte.
+struct UnpackTables {
+  // Bytes of the 8 high bits of each pixel.
+  std::array<uint8_t, 8> high_bytes;
+  // Bytes of the low bits of the group of each pixel.
+  std::array<uint8_t, 8> low_bytes;
+  // Bytes of 8 16-bit words, each with the low bits byte in its low byte and
+  // the high bits byte in its high byte.
+  std::array<uint8_t, 16> word_bytes;
+  std::array<uint16_t, 8> multipliers;
+};
+
+template <BayerPacking kPacking>
+constexpr UnpackTables GetUnpackTables() {
+  constexpr int kGroupPixels = GetPackedGroupPixels(kPacking);
+  constexpr int kGroupBytes = GetPackedGroupBytes(kPacking);
+  constexpr int kLowBits = GetPackedBits(kPacking) - 8;
+  UnpackTables tables = {};
+  for (int j = 0; j < 8; j++) {
+    const int group_start = j / kGroupPixels * kGroupBytes;
+    const int i = j % kGroupPixels;
+    tables.high_bytes[j] = group_start + i;
+    tables.low_bytes[j] = group_start + kGroupPixels;
+    tables.word_bytes[2 * j] = tables.low_bytes[j];
+    tables.word_bytes[2 * j + 1] = tables.high_bytes[j];
+    tables.multipliers[j] = 1 << (8 - kLowBits - i * kLowBits);
+  }
+  return tables;
+}
+
+// Mask of the low bits of a pixel once moved to the top of the low byte.
+constexpr uint16_t GetUnpackLowMask(BayerPacking packing) {
+  const int low_bits = GetPackedBits(packing) - 8;
+  return ((1 << low_bits) - 1) << (8 - low_bits);
+}
+
+#ifdef KERNELS_HAVE_AVX2
+
+// Applies the fixed-point gain to 16 values in the 16-bit range and packs the
+// saturated most significant bytes.
+KERNELS_TARGET_AVX2 inline __m128i ApplyGainAvx2(__m256i values,
+                                                 __m256i gain) {
+  // (value * gain) >> 16 fits in 16 bits, the remaining shift is
+  // kGainFractionBits + 8 - 16.
+  __m256i adjusted = _mm256_srli_epi16(_mm256_mulhi_epu16(values, gain),
+                                       kGainFractionBits + 8 - 16);
+  adjusted = _mm256_min_epu16(adjusted, _mm256_set1_epi16(0xff));
+  return _mm_packus_epi16(_mm256_castsi256_si128(adjusted),
+                          _mm256_extracti128_si256(adjusted, 1));
+}
+
+// Loads every other pixel of 32 Bayer pixels.
+KERNELS_TARGET_AVX2 inline __m256i LoadEvenPixelsAvx2(const uint16_t* input) {
+  const __m256i low_mask = _mm256_set1_epi32(0xffff);
+  __m256i low = _mm256_and_si256(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input)), low_mask);
+  __m256i high = _mm256_and_si256(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + 16)),
+      low_mask);
+  // packus works within 128-bit lanes, so restore the order of the 64-bit
+  // blocks afterwards.
+  return _mm256_permute4x64_epi64(_mm256_packus_epi32(low, high), 0xd8);
+}
+
+KERNELS_TARGET_AVX2 inline __m256i LoadEvenPixelsAvx2(const uint8_t* input) {
+  // Shifting each 16-bit lane left by 8 bits drops the odd pixel, and scales
+  // the even pixel to the 16-bit range at the same time.
+  return _mm256_slli_epi16(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input)), 8);
+}
+
+// Interleaves 16 pixels of 3 planar channels into 48 bytes.
+KERNELS_TARGET_AVX2 inline void StoreInterleavedAvx2(__m128i channel0,
+                                                     __m128i channel1,
+                                                     __m128i channel2,
+                                                     uint8_t* output) {
+  const __m128i shuffle00 = _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3,
+                                          -1, -1, 4, -1, -1, 5);
+  const __m128i shuffle01 = _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1,
+                                          3, -1, -1, 4, -1, -1);
+  const __m128i shuffle02 = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1,
+                                          -1, 3, -1, -1, 4, -1);
+  const __m128i shuffle10 = _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1,
+                                          -1, 9, -1, -1, 10, -1);
+  const __m128i shuffle11 = _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8,
+                                          -1, -1, 9, -1, -1, 10);
+  const __m128i shuffle12 = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1,
+                                          8, -1, -1, 9, -1, -1);
+  const __m128i shuffle20 = _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1,
+                                          -1, 14, -1, -1, 15, -1, -1);
+  const __m128i shuffle21 = _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13,
+                                          -1, -1, 14, -1, -1, 15, -1);
+  const __m128i shuffle22 = _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1,
+                                          13, -1, -1, 14, -1, -1, 15);
+  __m128i* output_vector = reinterpret_cast<__m128i*>(output);
+  _mm_storeu_si128(output_vector,
+                   _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(channel0,
+                                                              shuffle00),
+                                             _mm_shuffle_epi8(channel1,
+                                                              shuffle01)),
+                                _mm_shuffle_epi8(channel2, shuffle02)));
+  _mm_storeu_si128(output_vector + 1,
+                   _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(channel0,
+                                                              shuffle10),
+                                             _mm_shuffle_epi8(channel1,
+                                                              shuffle11)),
+                                _mm_shuffle_epi8(channel2, shuffle12)));
+  _mm_storeu_si128(output_vector + 2,
+                   _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(channel0,
+                                                              shuffle20),
+                                             _mm_shuffle_epi8(channel1,
+                                                              shuffle21)),
+                                _mm_shuffle_epi8(channel2, shuffle22)));
+}
+
+template <typename T>
+KERNELS_TARGET_AVX2 void HalfDebayerRowAvx2(const T* channel0,
+                                            const T* channel1,
+                                            const T* channel2,
+                                            const uint16_t gains[3], int width,
+                                            uint8_t* output) {
+  const __m256i gain0 = _mm256_set1_epi16(gains[0]);
+  const __m256i gain1 = _mm256_set1_epi16(gains[1]);
+  const __m256i gain2 = _mm256_set1_epi16(gains[2]);
+  const int vector_width = GetVectorWidth(width);
+  for (int x = 0; x < vector_width; x += kVectorPixels) {
+    const int input_x = x << 1;
+    StoreInterleavedAvx2(
+        ApplyGainAvx2(LoadEvenPixelsAvx2(channel0 + input_x), gain0),
+        ApplyGainAvx2(LoadEvenPixelsAvx2(channel1 + input_x), gain1),
+        ApplyGainAvx2(LoadEvenPixelsAvx2(channel2 + input_x), gain2),
+        output + x * 3);
+  }
+  const int input_x = vector_width << 1;
+  HalfDebayerRowScalar<T>(channel0 + input_x, channel1 + input_x,
+                          channel2 + input_x, gains, width - vector_width,
+                          output + vector_width * 3);
+}
+
+// Converts 32 Bayer pixels in the 16-bit range to kDemosaicBits bits, with
+// the fixed-point gain applied.
+KERNELS_TARGET_AVX2 inline __m256i ToDemosaicValuesAvx2(__m256i values,
+                                                        __m256i gain) {
+  // (value * gain) >> 16, and then the remaining shift.
+  const __m256i adjusted =
+      _mm256_srli_epi16(_mm256_mulhi_epu16(values, gain),
+                        kGainFractionBits - kDemosaicBits);
+  return _mm256_min_epu16(adjusted, _mm256_set1_epi16(kMaxDemosaicValue));
+}
+
+template <typename T>
+KERNELS_TARGET_AVX2 void SplitDemosaicRowAvx2(const T* input, int width,
+                                              const uint16_t gains[2],
+                                              int16_t* even, int16_t* odd) {
+  const __m256i even_gain = _mm256_set1_epi16(gains[0]);
+  const __m256i odd_gain = _mm256_set1_epi16(gains[1]);
+  const int pairs = width / 2;
+  // The odd pixels are loaded as the even pixels one pixel to the right.
+  const int vector_pairs = GetVectorWidth(pairs);
+  for (int i = 0; i < vector_pairs; i += kVectorPixels) {
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i*>(even + i),
+        ToDemosaicValuesAvx2(LoadEvenPixelsAvx2(input + 2 * i), even_gain));
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i*>(odd + i),
+        ToDemosaicValuesAvx2(LoadEvenPixelsAvx2(input + 2 * i + 1), odd_gain));
+  }
+  SplitDemosaicPairs<T>(input, vector_pairs, pairs, gains, even, odd);
+  MirrorDemosaicBorders(width, even, odd);
+}
+
+KERNELS_TARGET_AVX2 inline __m256i LoadPlaneAvx2(const int16_t* plane) {
+  return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(plane));
+}
+
+// Same as InterpolateBlock, for 16 pixels.
+template <bool kGradientCorrection, bool kIsGreen>
+KERNELS_TARGET_AVX2 inline void InterpolateBlockAvx2(
+    const DemosaicBlock& block, __m256i values[3]) {
+  const __m256i center = LoadPlaneAvx2(block.same[2]);
+  const __m256i ns = _mm256_add_epi16(LoadPlaneAvx2(block.same[1]),
+                                      LoadPlaneAvx2(block.same[3]));
+  const __m256i ns2 = _mm256_add_epi16(LoadPlaneAvx2(block.same[0]),
+                                       LoadPlaneAvx2(block.same[4]));
+  const __m256i ew = _mm256_add_epi16(LoadPlaneAvx2(block.other[1]),
+                                      LoadPlaneAvx2(block.other[1] + 1));
+  const __m256i ew2 = _mm256_add_epi16(LoadPlaneAvx2(block.same[2] - 1),
+                                       LoadPlaneAvx2(block.same[2] + 1));
+  const __m256i diagonal = _mm256_add_epi16(
+      _mm256_add_epi16(LoadPlaneAvx2(block.other[0]),
+                       LoadPlaneAvx2(block.other[0] + 1)),
+      _mm256_add_epi16(LoadPlaneAvx2(block.other[2]),
+                       LoadPlaneAvx2(block.other[2] + 1)));
+  if (kIsGreen) {
+    values[0] = _mm256_slli_epi16(ew, 3);
+    values[1] = _mm256_slli_epi16(center, 4);
+    values[2] = _mm256_slli_epi16(ns, 3);
+    if (kGradientCorrection) {
+      const __m256i common =
+          _mm256_sub_epi16(_mm256_mullo_epi16(center, _mm256_set1_epi16(10)),
+                           _mm256_slli_epi16(diagonal, 1));
+      values[0] = _mm256_add_epi16(
+          values[0], _mm256_add_epi16(_mm256_sub_epi16(
+                                          common, _mm256_slli_epi16(ew2, 1)),
+                                      ns2));
+      values[2] = _mm256_add_epi16(
+          values[2], _mm256_add_epi16(_mm256_sub_epi16(
+                                          common, _mm256_slli_epi16(ns2, 1)),
+                                      ew2));
+    }
+  } else {
+    values[0] = _mm256_slli_epi16(center, 4);
+    values[1] = _mm256_slli_epi16(_mm256_add_epi16(ns, ew), 2);
+    values[2] = _mm256_slli_epi16(diagonal, 2);
+    if (kGradientCorrection) {
+      const __m256i distant = _mm256_add_epi16(ns2, ew2);
+      values[1] = _mm256_add_epi16(
+          values[1], _mm256_sub_epi16(_mm256_slli_epi16(center, 3),
+                                      _mm256_slli_epi16(distant, 1)));
+      values[2] = _mm256_add_epi16(
+          values[2],
+          _mm256_sub_epi16(_mm256_mullo_epi16(center, _mm256_set1_epi16(12)),
+                           _mm256_mullo_epi16(distant, _mm256_set1_epi16(3))));
+    }
+  }
+}
+
+// Rounds the filter results of 16 even and 16 odd pixels to 8 bits, and
+// returns the 32 pixels in order.
+KERNELS_TARGET_AVX2 inline __m256i ToDemosaicOutputAvx2(__m256i even,
+                                                        __m256i odd) {
+  const __m256i rounding = _mm256_set1_epi16(1 << (kDemosaicOutputShift - 1));
+  even = _mm256_srai_epi16(_mm256_add_epi16(even, rounding),
+                           kDemosaicOutputShift);
+  odd = _mm256_srai_epi16(_mm256_add_epi16(odd, rounding),
+                          kDemosaicOutputShift);
+  // packus saturates to [0, 255], and gives 8 even and then 8 odd pixels
+  // within each 128-bit lane.
+  const __m256i interleave =
+      _mm256_setr_epi8(0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15, 0,
+                       8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15);
+  return _mm256_shuffle_epi8(_mm256_packus_epi16(even, odd), interleave);
+}
+
+template <bool kGradientCorrection>
+KERNELS_TARGET_AVX2 void DemosaicRowAvx2(const DemosaicPlanes rows[5],
+                                         int width, int green_column,
+                                         int row_color_channel,
+                                         uint8_t* output) {
+  const int pairs = width / 2;
+  for (int i = 0; i < pairs; i += kDemosaicBlockPairs) {
+    DemosaicBlock even_block;
+    DemosaicBlock odd_block;
+    GetDemosaicBlocks(rows, i, &even_block, &odd_block);
+    __m256i even_values[3];
+    __m256i odd_values[3];
+    if (green_column == 0) {
+      InterpolateBlockAvx2<kGradientCorrection, true>(even_block, even_values);
+      InterpolateBlockAvx2<kGradientCorrection, false>(odd_block, odd_values);
+    } else {
+      InterpolateBlockAvx2<kGradientCorrection, false>(even_block,
+                                                       even_values);
+      InterpolateBlockAvx2<kGradientCorrection, true>(odd_block, odd_values);
+    }
+    __m256i channels[3];
+    channels[row_color_channel] =
+        ToDemosaicOutputAvx2(even_values[0], odd_values[0]);
+    channels[1] = ToDemosaicOutputAvx2(even_values[1], odd_values[1]);
+    channels[2 - row_color_channel] =
+        ToDemosaicOutputAvx2(even_values[2], odd_values[2]);
+
+    // The last block may be partial.
+    uint8_t partial_block[kDemosaicBlockPairs * 6];
+    const bool is_partial = pairs - i < kDemosaicBlockPairs;
+    uint8_t* block_output = is_partial ? partial_block : output + i * 6;
+    StoreInterleavedAvx2(_mm256_castsi256_si128(channels[0]),
+                         _mm256_castsi256_si128(channels[1]),
+                         _mm256_castsi256_si128(channels[2]), block_output);
+    StoreInterleavedAvx2(_mm256_extracti128_si256(channels[0], 1),
+                         _mm256_extracti128_si256(channels[1], 1),
+                         _mm256_extracti128_si256(channels[2], 1),
+                         block_output + kDemosaicBlockPairs * 3);
+    if (is_partial) {
+      std::memcpy(output + i * 6, partial_block, (pairs - i) * 6);
+    }
+  }
+}
+
+// Subtracts the dark frame from 16 values and applies the flat-field gains.
+KERNELS_TARGET_AVX2 inline __m256i CorrectFlatFieldAvx2(__m256i values,
+                                                        const uint16_t* dark,
+                                                        const uint16_t* gains) {
+  const __m256i difference = _mm256_subs_epu16(
+      values, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dark)));
+  const __m256i gain =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(gains));
+  // The 32-bit products, from their low and high halves.
+  const __m256i low = _mm256_mullo_epi16(difference, gain);
+  const __m256i high = _mm256_mulhi_epu16(difference, gain);
+  const __m256i rounding = _mm256_set1_epi32(1 << (kGainFractionBits - 1));
+  const __m256i products0 = _mm256_srli_epi32(
+      _mm256_add_epi32(_mm256_unpacklo_epi16(low, high), rounding),
+      kGainFractionBits);
+  const __m256i products1 = _mm256_srli_epi32(
+      _mm256_add_epi32(_mm256_unpackhi_epi16(low, high), rounding),
+      kGainFractionBits);
+  // unpack and packus both work within 128-bit lanes, so the order is kept.
+  return _mm256_packus_epi32(products0, products1);
+}
+
+KERNELS_TARGET_AVX2 void CorrectFlatFieldRowAvx2(const uint16_t* input,
+                                                 const uint16_t* dark,
+                                                 const uint16_t* gains,
+                                                 int width, uint16_t* output) {
+  const int vector_width = width / kVectorPixels * kVectorPixels;
+  for (int x = 0; x < vector_width; x += kVectorPixels) {
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i*>(output + x),
+        CorrectFlatFieldAvx2(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + x)),
+            dark + x, gains + x));
+  }
+  CorrectFlatFieldRowScalar<uint16_t>(input + vector_width, dark + vector_width,
+                                      gains + vector_width,
+                                      width - vector_width,
+                                      output + vector_width);
+}
+
+KERNELS_TARGET_AVX2 void CorrectFlatFieldRowAvx2(const uint8_t* input,
+                                                 const uint16_t* dark,
+                                                 const uint16_t* gains,
+                                                 int width, uint8_t* output) {
+  const __m256i max_value = _mm256_set1_epi16(0xff);
+  const int vector_width = width / kVectorPixels * kVectorPixels;
+  for (int x = 0; x < vector_width; x += kVectorPixels) {
+    const __m256i corrected = _mm256_min_epu16(
+        CorrectFlatFieldAvx2(_mm256_cvtepu8_epi16(_mm_loadu_si128(
+                                 reinterpret_cast<const __m128i*>(input + x))),
+                             dark + x, gains + x),
+        max_value);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(output + x),
+                     _mm_packus_epi16(_mm256_castsi256_si128(corrected),
+                                      _mm256_extracti128_si256(corrected, 1)));
+  }
+  CorrectFlatFieldRowScalar<uint8_t>(input + vector_width, dark + vector_width,
+                                     gains + vector_width, width - vector_width,
+                                     output + vector_width);
+}
+
+template <BayerPacking kPacking>
+KERNELS_TARGET_AVX2 void UnpackRowAvx2(const uint8_t* input, int width,
+                                       uint16_t* output) {
+  constexpr int kGroupPixels = GetPackedGroupPixels(kPacking);
+  constexpr int kGroupBytes = GetPackedGroupBytes(kPacking);
+  // Each 128-bit lane unpacks 8 pixels.
+  constexpr int kLaneBytes = 8 / kGroupPixels * kGroupBytes;
+  static constexpr UnpackTables kTables = GetUnpackTables<kPacking>();
+  const __m256i word_bytes = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(&kTables.word_bytes)));
+  const __m256i multipliers = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(&kTables.multipliers)));
+  const __m256i high_mask = _mm256_set1_epi16(static_cast<int16_t>(0xff00));
+  const __m256i low_mask = _mm256_set1_epi16(GetUnpackLowMask(kPacking));
+  const int row_bytes = width / kGroupPixels * kGroupBytes;
+  // Each lane loads 16 bytes, so the last iteration must leave enough bytes
+  // after the last group.
+  int x = 0;
+  int offset = 0;
+  for (; offset + kLaneBytes + 16 <= row_bytes;
+       x += kVectorPixels, offset += 2 * kLaneBytes) {
+    const __m256i bytes = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(input + offset))),
+        _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(input + offset + kLaneBytes)),
+        1);
+    const __m256i words = _mm256_shuffle_epi8(bytes, word_bytes);
+    const __m256i values = _mm256_or_si256(
+        _mm256_and_si256(words, high_mask),
+        _mm256_and_si256(_mm256_mullo_epi16(words, multipliers), low_mask));
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i*>(output + x),
+        _mm256_or_si256(values,
+                        _mm256_srli_epi16(values, GetPackedBits(kPacking))));
+  }
+  UnpackRowScalar<kPacking>(input + offset, width - x, output + x);
+}
+
+#endif  // KERNELS_HAVE_AVX2
+
+#ifdef KERNELS_HAVE_NEON
+
+// Applies the fixed-point gain to 8 values in the 16-bit range and narrows
+// the saturated most significant bytes.
+inline uint8x8_t ApplyGainNeon(uint16x8_t values, uint16x4_t gain) {
+  // (value * gain) >> 16 fits in 16 bits, the remaining shift is
+  // kGainFractionBits + 8 - 16.
+  uint16x8_t adjusted =
+      vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(values), gain), 16),
+                   vshrn_n_u32(vmull_u16(vget_high_u16(values), gain), 16));
+  return vqmovn_u16(vshrq_n_u16(adjusted, kGainFractionBits + 8 - 16));
+}
+
+// Loads every other pixel of 32 Bayer pixels, and applies the gain.
+inline uint8x16_t LoadEvenPixelsWithGainNeon(const uint16_t* input,
+                                             uint16x4_t gain) {
+  // vld2q deinterleaves even and odd pixels.
+  uint16x8x2_t low = vld2q_u16(input);
+  uint16x8x2_t high = vld2q_u16(input + 16);
+  return vcombine_u8(ApplyGainNeon(low.val[0], gain),
+                     ApplyGainNeon(high.val[0], gain));
+}
+
+inline uint8x16_t LoadEvenPixelsWithGainNeon(const uint8_t* input,
+                                             uint16x4_t gain) {
+  uint8x16x2_t pixels = vld2q_u8(input);
+  // Scale to the 16-bit range.
+  return vcombine_u8(
+      ApplyGainNeon(vshll_n_u8(vget_low_u8(pixels.val[0]), 8), gain),
+      ApplyGainNeon(vshll_n_u8(vget_high_u8(pixels.val[0]), 8), gain));
+}
+
+template <typename T>
+void HalfDebayerRowNeon(const T* channel0, const T* channel1,
+                        const T* channel2, const uint16_t gains[3], int width,
+                        uint8_t* output) {
+  const uint16x4_t gain0 = vdup_n_u16(gains[0]);
+  const uint16x4_t gain1 = vdup_n_u16(gains[1]);
+  const uint16x4_t gain2 = vdup_n_u16(gains[2]);
+  const int vector_width = GetVectorWidth(width);
+  for (int x = 0; x < vector_width; x += kVectorPixels) {
+    const int input_x = x << 1;
+    uint8x16x3_t pixels;
+    pixels.val[0] = LoadEvenPixelsWithGainNeon(channel0 + input_x, gain0);
+    pixels.val[1] = LoadEvenPixelsWithGainNeon(channel1 + input_x, gain1);
+    pixels.val[2] = LoadEvenPixelsWithGainNeon(channel2 + input_x, gain2);
+    // vst3q interleaves the 3 channels.
+    vst3q_u8(output + x * 3, pixels);
+  }
+  const int input_x = vector_width << 1;
+  HalfDebayerRowScalar<T>(channel0 + input_x, channel1 + input_x,
+                          channel2 + input_x, gains, width - vector_width,
+                          output + vector_width * 3);
+}
+
+// Converts 8 Bayer pixels in the 16-bit range to kDemosaicBits bits, with the
+// fixed-point gain applied.
+inline int16x8_t ToDemosaicValuesNeon(uint16x8_t values, uint16x4_t gain) {
+  const uint16x8_t adjusted =
+      vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(values), gain), 16),
+                   vshrn_n_u32(vmull_u16(vget_high_u16(values), gain), 16));
+  return vreinterpretq_s16_u16(
+      vminq_u16(vshrq_n_u16(adjusted, kGainFractionBits - kDemosaicBits),
+                vdupq_n_u16(kMaxDemosaicValue)));
+}
+
+inline void SplitDemosaicPairsNeon(const uint16_t* input, uint16x4_t even_gain,
+                                   uint16x4_t odd_gain, int16_t* even,
+                                   int16_t* odd) {
+  // vld2q deinterleaves even and odd pixels.
+  for (int half = 0; half < 2; half++) {
+    const uint16x8x2_t pixels = vld2q_u16(input + half * 16);
+    vst1q_s16(even + half * 8, ToDemosaicValuesNeon(pixels.val[0], even_gain));
+    vst1q_s16(odd + half * 8, ToDemosaicValuesNeon(pixels.val[1], odd_gain));
+  }
+}
+
+inline void SplitDemosaicPairsNeon(const uint8_t* input, uint16x4_t even_gain,
+                                   uint16x4_t odd_gain, int16_t* even,
+                                   int16_t* odd) {
+  const uint8x16x2_t pixels = vld2q_u8(input);
+  // Scale to the 16-bit range.
+  vst1q_s16(even, ToDemosaicValuesNeon(
+                      vshll_n_u8(vget_low_u8(pixels.val[0]), 8), even_gain));
+  vst1q_s16(even + 8, ToDemosaicValuesNeon(
+                          vshll_n_u8(vget_high_u8(pixels.val[0]), 8),
+                          even_gain));
+  vst1q_s16(odd, ToDemosaicValuesNeon(
+                     vshll_n_u8(vget_low_u8(pixels.val[1]), 8), odd_gain));
+  vst1q_s16(odd + 8, ToDemosaicValuesNeon(
+                         vshll_n_u8(vget_high_u8(pixels.val[1]), 8),
+                         odd_gain));
+}
+
+template <typename T>
+void SplitDemosaicRowNeon(const T* input, int width, const uint16_t gains[2],
+                          int16_t* even, int16_t* odd) {
+  const uint16x4_t even_gain = vdup_n_u16(gains[0]);
+  const uint16x4_t odd_gain = vdup_n_u16(gains[1]);
+  const int pairs = width / 2;
+  const int vector_pairs = pairs / kVectorPixels * kVectorPixels;
+  for (int i = 0; i < vector_pairs; i += kVectorPixels) {
+    SplitDemosaicPairsNeon(input + 2 * i, even_gain, odd_gain, even + i,
+                           odd + i);
+  }
+  SplitDemosaicPairs<T>(input, vector_pairs, pairs, gains, even, odd);
+  MirrorDemosaicBorders(width, even, odd);
+}
+
+// Same as InterpolateBlock, for the 8 pixels at the offset of the block.
+template <bool kGradientCorrection, bool kIsGreen>
+inline void InterpolateBlockNeon(const DemosaicBlock& block, int offset,
+                                 int16x8_t values[3]) {
+  const int16x8_t center = vld1q_s16(block.same[2] + offset);
+  const int16x8_t ns = vaddq_s16(vld1q_s16(block.same[1] + offset),
+                                 vld1q_s16(block.same[3] + offset));
+  const int16x8_t ns2 = vaddq_s16(vld1q_s16(block.same[0] + offset),
+                                  vld1q_s16(block.same[4] + offset));
+  const int16x8_t ew = vaddq_s16(vld1q_s16(block.other[1] + offset),
+                                 vld1q_s16(block.other[1] + offset + 1));
+  const int16x8_t ew2 = vaddq_s16(vld1q_s16(block.same[2] + offset - 1),
+                                  vld1q_s16(block.same[2] + offset + 1));
+  const int16x8_t diagonal =
+      vaddq_s16(vaddq_s16(vld1q_s16(block.other[0] + offset),
+                          vld1q_s16(block.other[0] + offset + 1)),
+                vaddq_s16(vld1q_s16(block.other[2] + offset),
+                          vld1q_s16(block.other[2] + offset + 1)));
+  if (kIsGreen) {
+    values[0] = vshlq_n_s16(ew, 3);
+    values[1] = vshlq_n_s16(center, 4);
+    values[2] = vshlq_n_s16(ns, 3);
+    if (kGradientCorrection) {
+      const int16x8_t common =
+          vsubq_s16(vmulq_n_s16(center, 10), vshlq_n_s16(diagonal, 1));
+      values[0] = vaddq_s16(
+          values[0],
+          vaddq_s16(vsubq_s16(common, vshlq_n_s16(ew2, 1)), ns2));
+      values[2] = vaddq_s16(
+          values[2],
+          vaddq_s16(vsubq_s16(common, vshlq_n_s16(ns2, 1)), ew2));
+    }
+  } else {
+    values[0] = vshlq_n_s16(center, 4);
+    values[1] = vshlq_n_s16(vaddq_s16(ns, ew), 2);
+    values[2] = vshlq_n_s16(diagonal, 2);
+    if (kGradientCorrection) {
+      const int16x8_t distant = vaddq_s16(ns2, ew2);
+      values[1] = vaddq_s16(values[1], vsubq_s16(vshlq_n_s16(center, 3),
+                                                 vshlq_n_s16(distant, 1)));
+      values[2] = vaddq_s16(values[2], vsubq_s16(vmulq_n_s16(center, 12),
+                                                 vmulq_n_s16(distant, 3)));
+    }
+  }
+}
+
+// Rounds the filter results of 8 even and 8 odd pixels to 8 bits, and returns
+// the 16 pixels in order.
+inline uint8x16_t ToDemosaicOutputNeon(int16x8_t even, int16x8_t odd) {
+  // vqrshrun rounds, and saturates to [0, 255].
+  const uint8x8x2_t pixels =
+      vzip_u8(vqrshrun_n_s16(even, kDemosaicOutputShift),
+              vqrshrun_n_s16(odd, kDemosaicOutputShift));
+  return vcombine_u8(pixels.val[0], pixels.val[1]);
+}
+
+template <bool kGradientCorrection>
+void DemosaicRowNeon(const DemosaicPlanes rows[5], int width,
+                     int green_column, int row_color_channel,
+                     uint8_t* output) {
+  const int pairs = width / 2;
+  for (int i = 0; i < pairs; i += kDemosaicBlockPairs) {
+    DemosaicBlock even_block;
+    DemosaicBlock odd_block;
+    GetDemosaicBlocks(rows, i, &even_block, &odd_block);
+    // The last block may be partial.
+    uint8_t partial_block[kDemosaicBlockPairs * 6];
+    const bool is_partial = pairs - i < kDemosaicBlockPairs;
+    uint8_t* block_output = is_partial ? partial_block : output + i * 6;
+    for (int offset = 0; offset < kDemosaicBlockPairs; offset += 8) {
+      int16x8_t even_values[3];
+      int16x8_t odd_values[3];
+      if (green_column == 0) {
+        InterpolateBlockNeon<kGradientCorrection, true>(even_block, offset,
+                                                        even_values);
+        InterpolateBlockNeon<kGradientCorrection, false>(odd_block, offset,
+                                                         odd_values);
+      } else {
+        InterpolateBlockNeon<kGradientCorrection, false>(even_block, offset,
+                                                         even_values);
+        InterpolateBlockNeon<kGradientCorrection, true>(odd_block, offset,
+                                                        odd_values);
+      }
+      uint8x16x3_t pixels;
+      pixels.val[row_color_channel] =
+          ToDemosaicOutputNeon(even_values[0], odd_values[0]);
+      pixels.val[1] = ToDemosaicOutputNeon(even_values[1], odd_values[1]);
+      pixels.val[2 - row_color_channel] =
+          ToDemosaicOutputNeon(even_values[2], odd_values[2]);
+      // vst3q interleaves the 3 channels.
+      vst3q_u8(block_output + offset * 6, pixels);
+    }
+    if (is_partial) {
+      std::memcpy(output + i * 6, partial_block, (pairs - i) * 6);
+    }
+  }
+}
+
+// Subtracts the dark frame from 8 values and applies the flat-field gains.
+inline uint16x8_t CorrectFlatFieldNeon(uint16x8_t values, const uint16_t* dark,
+                                       const uint16_t* gains) {
+  const uint16x8_t difference = vqsubq_u16(values, vld1q_u16(dark));
+  const uint16x8_t gain = vld1q_u16(gains);
+  // Rounding shift and saturating narrow of the 32-bit products.
+  return vcombine_u16(
+      vqrshrn_n_u32(vmull_u16(vget_low_u16(difference), vget_low_u16(gain)),
+                    kGainFractionBits),
+      vqrshrn_n_u32(vmull_u16(vget_high_u16(difference), vget_high_u16(gain)),
+                    kGainFractionBits));
+}
+
+void CorrectFlatFieldRowNeon(const uint16_t* input, const uint16_t* dark,
+                             const uint16_t* gains, int width,
+                             uint16_t* output) {
+  const int vector_width = width / 8 * 8;
+  for (int x = 0; x < vector_width; x += 8) {
+    vst1q_u16(output + x,
+              CorrectFlatFieldNeon(vld1q_u16(input + x), dark + x, gains + x));
+  }
+  CorrectFlatFieldRowScalar<uint16_t>(input + vector_width, dark + vector_width,
+                                      gains + vector_width,
+                                      width - vector_width,
+                                      output + vector_width);
+}
+
+void CorrectFlatFieldRowNeon(const uint8_t* input, const uint16_t* dark,
+                             const uint16_t* gains, int width,
+                             uint8_t* output) {
+  const int vector_width = width / 8 * 8;
+  for (int x = 0; x < vector_width; x += 8) {
+    const uint16x8_t corrected = CorrectFlatFieldNeon(
+        vmovl_u8(vld1_u8(input + x)), dark + x, gains + x);
+    vst1_u8(output + x, vqmovn_u16(corrected));
+  }
+  CorrectFlatFieldRowScalar<uint8_t>(input + vector_width, dark + vector_width,
+                                     gains + vector_width, width - vector_width,
+                                     output + vector_width);
+}
+
+template <BayerPacking kPacking>
+void UnpackRowNeon(const uint8_t* input, int width, uint16_t* output) {
+  constexpr int kGroupPixels = GetPackedGroupPixels(kPacking);
+  constexpr int kGroupBytes = GetPackedGroupBytes(kPacking);
+  // Each iteration unpacks 8 pixels, from a table of 16 bytes.
+  constexpr int kStepBytes = 8 / kGroupPixels * kGroupBytes;
+  static constexpr UnpackTables kTables = GetUnpackTables<kPacking>();
+  const uint8x8_t high_bytes = vld1_u8(kTables.high_bytes.data());
+  const uint8x8_t low_bytes = vld1_u8(kTables.low_bytes.data());
+  const uint16x8_t multipliers = vld1q_u16(kTables.multipliers.data());
+  const uint16x8_t low_mask = vdupq_n_u16(GetUnpackLowMask(kPacking));
+  const int row_bytes = width / kGroupPixels * kGroupBytes;
+  int x = 0;
+  int offset = 0;
+  for (; offset + 16 <= row_bytes; x += 8, offset += kStepBytes) {
+    uint8x8x2_t bytes;
+    bytes.val[0] = vld1_u8(input + offset);
+    bytes.val[1] = vld1_u8(input + offset + 8);
+    const uint16x8_t low = vandq_u16(
+        vmulq_u16(vmovl_u8(vtbl2_u8(bytes, low_bytes)), multipliers),
+        low_mask);
+    const uint16x8_t values =
+        vorrq_u16(vshll_n_u8(vtbl2_u8(bytes, high_bytes), 8), low);
+    vst1q_u16(output + x,
+              vorrq_u16(values, vshrq_n_u16(values, GetPackedBits(kPacking))));
+  }
+  UnpackRowScalar<kPacking>(input + offset, width - x, output + x);
+}
+
+#endif  // KERNELS_HAVE_NEON
+
+}  // namespace
+
+uint16_t ToFixedPointGain(double gain) {
+  const double fixed_point_gain = std::round(gain * kUnitGain);
+  return static_cast<uint16_t>(std::clamp<double>(
+      fixed_point_gain, 0, std::numeric_limits<uint16_t>::max()));
+}
+
+template <typename T>
+void HalfDebayerRowScalar(const T* channel0, const T* channel1,
+                          const T* channel2, const uint16_t gains[3],
+                          int width, uint8_t* output) {
+  for (int x = 0; x < width; x++) {
+    const int input_x = x << 1;
+    *(output++) = ApplyFixedPointGain(ToUint16Range(channel0[input_x]),
+                                      gains[0]);
+    *(output++) = ApplyFixedPointGain(ToUint16Range(channel1[input_x]),
+                                      gains[1]);
+    *(output++) = ApplyFixedPointGain(ToUint16Range(channel2[input_x]),
+                                      gains[2]);
+  }
+}
+
+template <typename T>
+void HalfDebayerRowLookup(const T* channel0, const T* channel1,
+                          const T* channel2, const uint8_t* const tables[3],
+                          int width, uint8_t* output) {
+  const uint8_t* table0 = tables[0];
+  const uint8_t* table1 = tables[1];
+  const uint8_t* table2 = tables[2];
+  for (int x = 0; x < width; x++) {
+    const int input_x = x << 1;
+    *(output++) = table0[channel0[input_x]];
+    *(output++) = table1[channel1[input_x]];
+    *(output++) = table2[channel2[input_x]];
+  }
+}
+
+template <typename T>
+void BuildLookupTable(uint16_t gain, double gamma,
+                      std::vector<uint8_t>* table) {
+  constexpr int kNumValues = std::numeric_limits<T>::max() + 1;
+  table->resize(kNumValues);
+  if (gamma == 1.0) {
+    for (int value = 0; value < kNumValues; value++) {
+      (*table)[value] =
+          ApplyFixedPointGain(ToUint16Range(static_cast<T>(value)), gain);
+    }
+    return;
+  }
+  // Apply the curve to the full precision value, so that dark pixels keep
+  // their low bits.
+  constexpr double kFullScale = static_cast<double>(kUnitGain) * (1 << 16);
+  const double exponent = 1.0 / gamma;
+  for (int value = 0; value < kNumValues; value++) {
+    const double linear = std::min(
+        static_cast<double>(ToUint16Range(static_cast<T>(value))) * gain /
+            kFullScale,
+        1.0);
+    (*table)[value] =
+        static_cast<uint8_t>(std::round(0xff * std::pow(linear, exponent)));
+  }
+}
+
+template <typename T>
+HalfDebayerRowKernel<T> GetVectorHalfDebayerRowKernel() {
+#if defined(KERNELS_HAVE_AVX2)
+  static const bool supports_avx2 = CpuSupportsAvx2();
+  return supports_avx2 ? &HalfDebayerRowAvx2<T> : nullptr;
+#elif defined(KERNELS_HAVE_NEON)
+  // NEON is mandatory on ARMv8, and the kernels are only compiled when the
+  // target enables it on ARMv7.
+  return &HalfDebayerRowNeon<T>;
+#else
+  return nullptr;
+#endif
+}
+
+void AccumulateHistograms(const uint8_t* row, int width,
+                          std::array<Histogram, 3>* histograms) {
+  Histogram& histogram0 = (*histograms)[0];
+  Histogram& histogram1 = (*histograms)[1];
+  Histogram& histogram2 = (*histograms)[2];
+  for (int x = 0; x < width; x++) {
+    histogram0[row[0]]++;
+    histogram1[row[1]]++;
+    histogram2[row[2]]++;
+    row += 3;
+  }
+}
+
+void BoxBlurRow(const uint8_t* const rows[3], int width, uint16_t* column_sums,
+                uint8_t* output) {
+  const int row_size = width * 3;
+  const uint8_t* __restrict above = rows[0];
+  const uint8_t* __restrict center = rows[1];
+  const uint8_t* __restrict below = rows[2];
+  for (int i = 0; i < row_size; i++) {
+    column_sums[i] = above[i] + center[i] + below[i];
+  }
+  // Sums of 9 values are never halfway between multiples of 9, so rounding
+  // to nearest is the same as cv::blur.
+  auto average = [](int sum) { return static_cast<uint8_t>((sum + 4) / 9); };
+  if (width == 1) {
+    for (int channel = 0; channel < 3; channel++) {
+      output[channel] = average(3 * column_sums[channel]);
+    }
+    return;
+  }
+  for (int channel = 0; channel < 3; channel++) {
+    output[channel] =
+        average(column_sums[channel] + 2 * column_sums[3 + channel]);
+    output[row_size - 3 + channel] =
+        average(column_sums[row_size - 3 + channel] +
+                2 * column_sums[row_size - 6 + channel]);
+  }
+  for (int i = 3; i < row_size - 3; i++) {
+    output[i] =
+        average(column_sums[i - 3] + column_sums[i] + column_sums[i + 3]);
+  }
+}
+
+template <typename T>
+void CorrectFlatFieldRowScalar(const T* input, const uint16_t* dark,
+                               const uint16_t* gains, int width, T* output) {
+  for (int x = 0; x < width; x++) {
+    const uint32_t difference =
+        input[x] > dark[x] ? static_cast<uint32_t>(input[x] - dark[x]) : 0;
+    const uint32_t corrected =
+        (difference * gains[x] + (1 << (kGainFractionBits - 1))) >>
+        kGainFractionBits;
+    output[x] = static_cast<T>(
+        std::min<uint32_t>(corrected, std::numeric_limits<T>::max()));
+  }
+}
+
+template <typename T>
+FlatFieldRowKernel<T> GetVectorFlatFieldRowKernel() {
+#if defined(KERNELS_HAVE_AVX2)
+  static const bool supports_avx2 = CpuSupportsAvx2();
+  if (!supports_avx2) return nullptr;
+  return static_cast<FlatFieldRowKernel<T>>(&CorrectFlatFieldRowAvx2);
+#elif defined(KERNELS_HAVE_NEON)
+  return static_cast<FlatFieldRowKernel<T>>(&CorrectFlatFieldRowNeon);
+#else
+  return nullptr;
+#endif
+}
+
+template <BayerPacking kPacking>
+void UnpackRowScalar(const uint8_t* input, int width, uint16_t* output) {
+  constexpr int kGroupPixels = GetPackedGroupPixels(kPacking);
+  constexpr int kLowBits = GetPackedBits(kPacking) - 8;
+  constexpr int kLowMask = (1 << kLowBits) - 1;
+  for (int x = 0; x < width; x += kGroupPixels) {
+    const int low_bits = input[kGroupPixels];
+    for (int i = 0; i < kGroupPixels; i++) {
+      const uint16_t value =
+          (input[i] << 8) |
+          (((low_bits >> (i * kLowBits)) & kLowMask) << (8 - kLowBits));
+      output[x + i] = value | (value >> GetPackedBits(kPacking));
+    }
+    input += GetPackedGroupBytes(kPacking);
+  }
+}
+
+UnpackRowKernel GetVectorUnpackRowKernel(BayerPacking packing) {
+#if defined(KERNELS_HAVE_AVX2)
+  static const bool supports_avx2 = CpuSupportsAvx2();
+  if (!supports_avx2) return nullptr;
+  switch (packing) {
+    case BayerPacking::RAW10:
+      return &UnpackRowAvx2<BayerPacking::RAW10>;
+    case BayerPacking::RAW12:
+      return &UnpackRowAvx2<BayerPacking::RAW12>;
+    default:
+      return nullptr;
+  }
+#elif defined(KERNELS_HAVE_NEON)
+  switch (packing) {
+    case BayerPacking::RAW10:
+      return &UnpackRowNeon<BayerPacking::RAW10>;
+    case BayerPacking::RAW12:
+      return &UnpackRowNeon<BayerPacking::RAW12>;
+    default:
+      return nullptr;
+  }
+#else
+  return nullptr;
+#endif
+}
+
+int GetDemosaicPlaneSize(int width) {
+  const int pairs = width / 2;
+  const int blocks = (pairs + kDemosaicBlockPairs - 1) / kDemosaicBlockPairs;
+  // The kernels read one value before and after each block.
+  return blocks * kDemosaicBlockPairs + 2;
+}
+
+template <typename T>
+void SplitDemosaicRowScalar(const T* input, int width,
+                            const uint16_t gains[2], int16_t* even,
+                            int16_t* odd) {
+  SplitDemosaicPairs<T>(input, 0, width / 2, gains, even, odd);
+  MirrorDemosaicBorders(width, even, odd);
+}
+
+template <typename T>
+SplitDemosaicRowKernel<T> GetVectorSplitDemosaicRowKernel() {
+#if defined(KERNELS_HAVE_AVX2)
+  static const bool supports_avx2 = CpuSupportsAvx2();
+  return supports_avx2 ? &SplitDemosaicRowAvx2<T> : nullptr;
+#elif defined(KERNELS_HAVE_NEON)
+  return &SplitDemosaicRowNeon<T>;
+#else
+  return nullptr;
+#endif
+}
+
+template <bool kGradientCorrection>
+void DemosaicRowScalar(const DemosaicPlanes rows[5], int width,
+                       int green_column, int row_color_channel,
+                       uint8_t* output) {
+  const int pairs = width / 2;
+  // Output channels of the other color in the row, green, and the color in
+  // the column.
+  const int channels[3] = {row_color_channel, 1, 2 - row_color_channel};
+  for (int i = 0; i < pairs; i += kDemosaicBlockPairs) {
+    DemosaicBlock even_block;
+    DemosaicBlock odd_block;
+    GetDemosaicBlocks(rows, i, &even_block, &odd_block);
+    int even_values[3][kDemosaicBlockPairs];
+    int odd_values[3][kDemosaicBlockPairs];
+    if (green_column == 0) {
+      InterpolateBlock<kGradientCorrection, true>(even_block, even_values);
+      InterpolateBlock<kGradientCorrection, false>(odd_block, odd_values);
+    } else {
+      InterpolateBlock<kGradientCorrection, false>(even_block, even_values);
+      InterpolateBlock<kGradientCorrection, true>(odd_block, odd_values);
+    }
+    const int count = std::min(kDemosaicBlockPairs, pairs - i);
+    uint8_t* output_pair = output + i * 6;
+    for (int k = 0; k < count; k++) {
+      for (int channel = 0; channel < 3; channel++) {
+        output_pair[channels[channel]] =
+            ToDemosaicOutput(even_values[channel][k]);
+        output_pair[3 + channels[channel]] =
+            ToDemosaicOutput(odd_values[channel][k]);
+      }
+      output_pair += 6;
+    }
+  }
+}
+
+DemosaicRowKernel GetVectorDemosaicRowKernel(bool gradient_correction) {
+#if defined(KERNELS_HAVE_AVX2)
+  static const bool supports_avx2 = CpuSupportsAvx2();
+  if (!supports_avx2) return nullptr;
+  return gradient_correction ? &DemosaicRowAvx2<true>
+                             : &DemosaicRowAvx2<false>;
+#elif defined(KERNELS_HAVE_NEON)
+  return gradient_correction ? &DemosaicRowNeon<true>
+                             : &DemosaicRowNeon<false>;
+#else
+  return nullptr;
+#endif
+}
+
+template void HalfDebayerRowScalar<uint8_t>(const uint8_t*, const uint8_t*,
+                                            const uint8_t*, const uint16_t[3],
+                                            int, uint8_t*);
+template void HalfDebayerRowScalar<uint16_t>(const uint16_t*,
+                                             const uint16_t*,
+                                             const uint16_t*,
+                                             const uint16_t[3], int,
+                                             uint8_t*);
+template void HalfDebayerRowLookup<uint8_t>(const uint8_t*, const uint8_t*,
+                                            const uint8_t*,
+                                            const uint8_t* const[3], int,
+                                            uint8_t*);
+template void HalfDebayerRowLookup<uint16_t>(const uint16_t*,
+                                             const uint16_t*,
+                                             const uint16_t*,
+                                             const uint8_t* const[3], int,
+                                             uint8_t*);
+template void BuildLookupTable<uint8_t>(uint16_t, double,
+                                        std::vector<uint8_t>*);
+template void BuildLookupTable<uint16_t>(uint16_t, double,
+                                         std::vector<uint8_t>*);
+template HalfDebayerRowKernel<uint8_t>
+GetVectorHalfDebayerRowKernel<uint8_t>();
+template HalfDebayerRowKernel<uint16_t>
+GetVectorHalfDebayerRowKernel<uint16_t>();
+template void SplitDemosaicRowScalar<uint8_t>(const uint8_t*, int,
+                                              const uint16_t[2], int16_t*,
+                                              int16_t*);
+template void SplitDemosaicRowScalar<uint16_t>(const uint16_t*, int,
+                                               const uint16_t[2], int16_t*,
+                                               int16_t*);
+template SplitDemosaicRowKernel<uint8_t>
+GetVectorSplitDemosaicRowKernel<uint8_t>();
+template SplitDemosaicRowKernel<uint16_t>
+GetVectorSplitDemosaicRowKernel<uint16_t>();
+template void CorrectFlatFieldRowScalar<uint8_t>(const uint8_t*,
+                                                 const uint16_t*,
+                                                 const uint16_t*, int,
+                                                 uint8_t*);
+template void CorrectFlatFieldRowScalar<uint16_t>(const uint16_t*,
+                                                  const uint16_t*,
+                                                  const uint16_t*, int,
+                                                  uint16_t*);
+template FlatFieldRowKernel<uint8_t> GetVectorFlatFieldRowKernel<uint8_t>();
+template FlatFieldRowKernel<uint16_t> GetVectorFlatFieldRowKernel<uint16_t>();
+template void UnpackRowScalar<BayerPacking::RAW10>(const uint8_t*, int,
+                                                   uint16_t*);
+template void UnpackRowScalar<BayerPacking::RAW12>(const uint8_t*, int,
+                                                   uint16_t*);
+template void DemosaicRowScalar<false>(const DemosaicPlanes[5], int, int, int,
+                                       uint8_t*);
+template void DemosaicRowScalar<true>(const DemosaicPlanes[5], int, int, int,
+                                      uint8_t*);
+
+}  // namespace image_processor
@@ -0,0 +1,269 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+// Row kernels used by Debayer. The scalar kernels are the reference
+// implementation, and the vector kernels (AVX2 on x86, NEON on ARM) must
+// produce bit-exact results with them.
+
+#ifndef AR_MICROSCOPE_IMAGE_PROCESSOR_DEBAYER_KERNELS_H_
+#define AR_MICROSCOPE_IMAGE_PROCESSOR_DEBAYER_KERNELS_H_
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+namespace image_processor {
+
+// Number of fractional bits of the fixed-point channel gains.
+constexpr int kGainFractionBits = 12;
+
+// Fixed-point gain that leaves pixel values unchanged.
+constexpr uint16_t kUnitGain = 1 << kGainFractionBits;
+
+// Converts a channel gain to the fixed-point representation used by the
+// kernels. Gains are clamped to [0, 16).
+uint16_t ToFixedPointGain(double gain);
+
+// Scales a Bayer pixel value to the 16-bit range, so that 8-bit and 16-bit
+// input share the same gain arithmetic.
+inline uint16_t ToUint16Range(uint8_t value) { return value << 8; }
+inline uint16_t ToUint16Range(uint16_t value) { return value; }
+
+// Applies the fixed-point gain to a 16-bit range value, and returns the most
+// significant byte of the result, saturated to 255.
+inline uint8_t ApplyFixedPointGain(uint16_t value, uint16_t gain) {
+  uint32_t adjusted_value =
+      (static_cast<uint32_t>(value) * gain) >> (kGainFractionBits + 8);
+  return adjusted_value > 0xff ? 0xff : static_cast<uint8_t>(adjusted_value);
+}
+
+// Kernel to produce a single row of the half debayer output. The i-th output
+// pixel is made of channel0[2 * i], channel1[2 * i] and channel2[2 * i], each
+// multiplied by its gain, in this order. Choosing the channel pointers is how
+// callers select the Bayer phase and the RGB/BGR output order.
+//
+// Args:
+//   channel0, channel1, channel2: Bayer pixels of each output channel.
+//   gains: Fixed-point gains of each output channel.
+//   width: Number of output pixels.
+//   output: Interleaved 3-channel output row.
+template <typename T>
+using HalfDebayerRowKernel = void (*)(const T* channel0, const T* channel1,
+                                      const T* channel2,
+                                      const uint16_t gains[3], int width,
+                                      uint8_t* output);
+
+// Reference implementation, one output pixel per iteration.
+template <typename T>
+void HalfDebayerRowScalar(const T* channel0, const T* channel1,
+                          const T* channel2, const uint16_t gains[3],
+                          int width, uint8_t* output);
+
+// Row kernel that maps the Bayer pixels of each output channel through a
+// lookup table, so that gains and tone curve cost a single load per pixel.
+// Arguments are the same as HalfDebayerRowKernel, except that tables holds
+// the lookup table of each output channel, indexed by Bayer pixel value.
+template <typename T>
+void HalfDebayerRowLookup(const T* channel0, const T* channel1,
+                          const T* channel2, const uint8_t* const tables[3],
+                          int width, uint8_t* output);
+
+// Builds the lookup table from every Bayer pixel value of type T to the output
+// value, with the fixed-point gain and then the gamma curve applied. With
+// gamma 1.0, the table gives the same values as ApplyFixedPointGain.
+template <typename T>
+void BuildLookupTable(uint16_t gain, double gamma, std::vector<uint8_t>* table);
+
+// Returns the vector kernel supported by the running CPU, or nullptr if
+// there is none.
+template <typename T>
+HalfDebayerRowKernel<T> GetVectorHalfDebayerRowKernel();
+
+// Returns the fastest kernel supported by the running CPU.
+template <typename T>
+HalfDebayerRowKernel<T> GetHalfDebayerRowKernel() {
+  HalfDebayerRowKernel<T> kernel = GetVectorHalfDebayerRowKernel<T>();
+  return kernel ? kernel : &HalfDebayerRowScalar<T>;
+}
+
+// Histogram of 8-bit values.
+using Histogram = std::array<uint32_t, 256>;
+
+// Adds the values of each channel of an interleaved 3-channel row to the
+// histogram of the channel.
+void AccumulateHistograms(const uint8_t* row, int width,
+                          std::array<Histogram, 3>* histograms);
+
+// Kernel to produce a single row of the 3x3 box blur of an interleaved
+// 3-channel image. Results are the same as cv::blur with the default border,
+// which mirrors the image without repeating the edge pixels.
+//
+// Args:
+//   rows: Rows y - 1, y and y + 1 of the input, mirrored at the borders.
+//   width: Number of pixels.
+//   column_sums: Buffer of width * 3 values.
+//   output: Output row y, which must not be one of the input rows.
+void BoxBlurRow(const uint8_t* const rows[3], int width, uint16_t* column_sums,
+                uint8_t* output);
+
+// Kernel to correct a Bayer row with a dark frame and flat-field gains, as a
+// fused subtract and multiply: output[x] = (input[x] - dark[x]) * gains[x],
+// with the difference clamped at 0, the fixed-point gain rounded, and the
+// result saturated to the range of T. Input and output may be the same row.
+//
+// Args:
+//   input: Bayer row.
+//   dark: Dark frame values of the row, in the range of T.
+//   gains: Fixed-point flat-field gains of the row.
+//   width: Number of Bayer pixels.
+//   output: Corrected Bayer row.
+template <typename T>
+using FlatFieldRowKernel = void (*)(const T* input, const uint16_t* dark,
+                                    const uint16_t* gains, int width,
+                                    T* output);
+
+template <typename T>
+void CorrectFlatFieldRowScalar(const T* input, const uint16_t* dark,
+                               const uint16_t* gains, int width, T* output);
+
+// Returns the vector flat-field kernel supported by the running CPU, or
+// nullptr if there is none.
+template <typename T>
+FlatFieldRowKernel<T> GetVectorFlatFieldRowKernel();
+
+// Layouts of the Bayer pixels in memory.
+enum class BayerPacking {
+  // One pixel per 8-bit or 16-bit value.
+  NONE,
+  // MIPI RAW10. Groups of 4 pixels in 5 bytes: the 8 high bits of each pixel,
+  // then a byte of their 2 low bits, the first pixel in the lowest bits.
+  RAW10,
+  // MIPI RAW12. Groups of 2 pixels in 3 bytes: the 8 high bits of each pixel,
+  // then a byte of their 4 low bits, the first pixel in the lowest bits.
+  RAW12,
+};
+
+// Returns the number of bits of a packed pixel.
+constexpr int GetPackedBits(BayerPacking packing) {
+  switch (packing) {
+    case BayerPacking::RAW10:
+      return 10;
+    case BayerPacking::RAW12:
+      return 12;
+    default:
+      return 16;
+  }
+}
+
+// Returns the number of pixels and of bytes of a group of packed pixels, whose
+// low bits share a byte. Packed rows are made of whole groups.
+constexpr int GetPackedGroupPixels(BayerPacking packing) {
+  return packing == BayerPacking::NONE ? 1 : 8 / (GetPackedBits(packing) - 8);
+}
+constexpr int GetPackedGroupBytes(BayerPacking packing) {
+  return GetPackedGroupPixels(packing) * GetPackedBits(packing) / 8;
+}
+
+// Kernel to unpack a row of packed Bayer pixels into 16-bit values. The packed
+// bits are the most significant bits of the output, and are repeated in the
+// low bits so that the full scale of the packed value maps to 0xffff. Only
+// the packed bytes of the width pixels are read.
+//
+// Args:
+//   input: Packed row, starting at a group.
+//   width: Number of pixels, a multiple of the group pixels.
+//   output: Unpacked row.
+using UnpackRowKernel = void (*)(const uint8_t* input, int width,
+                                 uint16_t* output);
+
+template <BayerPacking kPacking>
+void UnpackRowScalar(const uint8_t* input, int width, uint16_t* output);
+
+// Returns the vector unpack kernel supported by the running CPU, or nullptr
+// if there is none.
+UnpackRowKernel GetVectorUnpackRowKernel(BayerPacking packing);
+
+// Precision of the white balanced Bayer values used by the full resolution
+// demosaic. The interpolation sums fit in int16 with this precision.
+constexpr int kDemosaicBits = 10;
+
+// Number of pixel pairs produced by one iteration of the demosaic kernels.
+constexpr int kDemosaicBlockPairs = 16;
+
+// Returns the number of values of a plane of a split Bayer row, including the
+// mirrored borders and the room for the last kernel iteration.
+int GetDemosaicPlaneSize(int width);
+
+// Kernel to split a Bayer row into the planes of the even and the odd columns,
+// so that the demosaic kernels read pixels of the same color from contiguous
+// memory. Values are white balanced and reduced to kDemosaicBits bits. The
+// value of column 2 * i goes to even[i], and of column 2 * i + 1 to odd[i].
+// The borders are mirrored, with even[-1], odd[-1], even[width / 2] and
+// odd[width / 2] holding columns -2, -1, width and width + 1.
+//
+// Args:
+//   input: Bayer row.
+//   width: Number of Bayer pixels, even and at least 4.
+//   gains: Fixed-point gains of the even and the odd columns.
+//   even, odd: Output planes, each pointing one value after the start of a
+//     buffer of GetDemosaicPlaneSize(width) values.
+template <typename T>
+using SplitDemosaicRowKernel = void (*)(const T* input, int width,
+                                        const uint16_t gains[2], int16_t* even,
+                                        int16_t* odd);
+
+template <typename T>
+void SplitDemosaicRowScalar(const T* input, int width,
+                            const uint16_t gains[2], int16_t* even,
+                            int16_t* odd);
+
+// Returns the vector split kernel supported by the running CPU, or nullptr if
+// there is none.
+template <typename T>
+SplitDemosaicRowKernel<T> GetVectorSplitDemosaicRowKernel();
+
+// Planes of a split Bayer row.
+struct DemosaicPlanes {
+  const int16_t* even;
+  const int16_t* odd;
+};
+
+// Kernel to produce a single row of the full resolution demosaic output.
+//
+// Args:
+//   rows: Planes of the Bayer rows y - 2 to y + 2, for output row y.
+//   width: Number of output pixels.
+//   green_column: Column parity, 0 or 1, of the green pixels in the row.
+//   row_color_channel: Output channel, 0 or 2, of the other color in the row.
+//   output: Interleaved 3-channel output row.
+using DemosaicRowKernel = void (*)(const DemosaicPlanes rows[5], int width,
+                                   int green_column, int row_color_channel,
+                                   uint8_t* output);
+
+// Reference implementation. Without gradient correction, the missing colors
+// are interpolated bilinearly. With it, the interpolation is corrected by the
+// Laplacian of the pixel color, as in High-Quality Linear Interpolation for
+// Demosaicing of Bayer-Patterned Color Images, Malvar, He and Cutler, 2004.
+template <bool kGradientCorrection>
+void DemosaicRowScalar(const DemosaicPlanes rows[5], int width,
+                       int green_column, int row_color_channel,
+                       uint8_t* output);
+
+// Returns the vector demosaic kernel supported by the running CPU, or nullptr
+// if there is none.
+DemosaicRowKernel GetVectorDemosaicRowKernel(bool gradient_correction);
+
+}  // namespace image_processor
+
+#endif  // AR_MICROSCOPE_IMAGE_PROCESSOR_DEBAYER_KERNELS_H_
@@ -14,16 +14,36 @@
 // =============================================================================
 #include "image_processor/debayer.h"
 
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <vector>
+
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "opencv2/core.hpp"
+#include "opencv2/imgproc.hpp"
+#include "image_processor/debayer_kernels.h"
 #include "tensorflow/core/lib/core/status.h"
 
 extern absl::Flag<int> FLAGS_num_debayer_threads;
+extern absl::Flag<bool> FLAGS_simd_debayer;
+extern absl::Flag<bool> FLAGS_smooth_image;
 
 namespace {
 
+using image_processor::BayerPacking;
+using image_processor::BayerPattern;
+using image_processor::ChannelStatistics;
 using image_processor::Debayer;
+using image_processor::FieldOfView;
+using image_processor::DebayerMode;
+using image_processor::HalfDebayerRowKernel;
+using image_processor::RowSpan;
+using image_processor::Histogram;
+using image_processor::UnpackRowKernel;
+using image_processor::ToFixedPointGain;
 
 using ::testing::Eq;
 using ::testing::Ne;
@@ -74,6 +94,20 @@ uint8_t kBgrGainAdjusted[]{
     0x41, 0xff, 0x93, 0xef, 0xc8, 0xfa,
 };
 
+// Fills the image with random pixel values.
+template <typename T>
+void FillRandom(cv::Mat* image) {
+  std::mt19937 generator(1234);
+  std::uniform_int_distribution<int> distribution(
+      0, std::numeric_limits<T>::max());
+  for (int y = 0; y < image->rows; y++) {
+    T* row = reinterpret_cast<T*>(image->ptr(y));
+    for (int x = 0; x < image->cols * image->channels(); x++) {
+      row[x] = static_cast<T>(distribution(generator));
+    }
+  }
+}
+
 void AssertEquals(const cv::Mat& a, const cv::Mat& b) {
   ASSERT_THAT(a.elemSize(), Eq(3));
   ASSERT_THAT(b.elemSize(), Eq(3));
@@ -111,6 +145,24 @@ TEST(DebayerTest, MultiThread) {
   AssertEquals(expected, rgb);
 }
 
+TEST(DebayerTest, MultiThreadUnevenHeight) {
+  // Output height is not divisible by the number of threads.
+  cv::Mat bayer(2 * 37, 2 * 21, CV_16UC1);
+  FillRandom<uint16_t>(&bayer);
+
+  absl::SetFlag(&FLAGS_num_debayer_threads, 1);
+  Debayer single_thread_debayer;
+  cv::Mat expected;
+  ASSERT_TRUE(single_thread_debayer.HalfDebayer(bayer, true, &expected).ok());
+
+  absl::SetFlag(&FLAGS_num_debayer_threads, 4);
+  Debayer debayer;
+  // Zero the output to make sure no row is left unwritten.
+  cv::Mat rgb = cv::Mat::zeros(37, 21, CV_8UC3);
+  ASSERT_TRUE(debayer.HalfDebayer(bayer, true, &rgb).ok());
+  AssertEquals(expected, rgb);
+}
+
 TEST(DebayerTest, NotAllocated) {
   absl::SetFlag(&FLAGS_num_debayer_threads, 1);
   Debayer debayer;
@@ -199,4 +251,590 @@ TEST(DebayerTest, Bgr16bitWhiteBalance) {
   AssertEquals(expected, bgr);
 }
 
+template <typename T>
+void AssertVectorKernelMatchesScalar() {
+  HalfDebayerRowKernel<T> vector_kernel =
+      image_processor::GetVectorHalfDebayerRowKernel<T>();
+  if (!vector_kernel) {
+    GTEST_SKIP() << "No vector kernel for this CPU";
+  }
+  // Cover widths with and without a scalar tail, and gains that saturate.
+  const uint16_t gains[3] = {ToFixedPointGain(kRedGain),
+                             ToFixedPointGain(kGreenGain),
+                             ToFixedPointGain(0.7)};
+  for (int width = 0; width <= 70; width++) {
+    cv::Mat bayer(1, width * 2, sizeof(T) == 1 ? CV_8UC1 : CV_16UC1);
+    FillRandom<T>(&bayer);
+    const T* row = reinterpret_cast<const T*>(bayer.ptr());
+    std::vector<uint8_t> expected(width * 3);
+    std::vector<uint8_t> actual(width * 3);
+    image_processor::HalfDebayerRowScalar<T>(row, row + 1, row + 1, gains,
+                                             width, expected.data());
+    vector_kernel(row, row + 1, row + 1, gains, width, actual.data());
+    ASSERT_THAT(actual, Eq(expected)) << "width: " << width;
+  }
+}
+
+TEST(DebayerTest, VectorKernelMatchesScalar8bit) {
+  AssertVectorKernelMatchesScalar<uint8_t>();
+}
+
+TEST(DebayerTest, VectorKernelMatchesScalar16bit) {
+  AssertVectorKernelMatchesScalar<uint16_t>();
+}
+
+TEST(DebayerTest, SimdMatchesScalar16bit) {
+  absl::SetFlag(&FLAGS_num_debayer_threads, 1);
+  cv::Mat bayer(24, 2 * 53, CV_16UC1);
+  FillRandom<uint16_t>(&bayer);
+
+  absl::SetFlag(&FLAGS_simd_debayer, false);
+  Debayer scalar_debayer;
+  scalar_debayer.SetRgbGains(kRedGain, kGreenGain, kBlueGain);
+  cv::Mat expected;
+  ASSERT_TRUE(scalar_debayer.HalfDebayer(bayer, true, &expected).ok());
+
+  absl::SetFlag(&FLAGS_simd_debayer, true);
+  Debayer simd_debayer;
+  simd_debayer.SetRgbGains(kRedGain, kGreenGain, kBlueGain);
+  cv::Mat rgb;
+  ASSERT_TRUE(simd_debayer.HalfDebayer(bayer, true, &rgb).ok());
+  AssertEquals(expected, rgb);
+}
+
+TEST(DebayerTest, SimdMatchesScalar8bitBgr) {
+  absl::SetFlag(&FLAGS_num_debayer_threads, 1);
+  cv::Mat bayer(24, 2 * 53, CV_8UC1);
+  FillRandom<uint8_t>(&bayer);
+
+  absl::SetFlag(&FLAGS_simd_debayer, false);
+  Debayer scalar_debayer;
+  cv::Mat expected;
+  ASSERT_TRUE(scalar_debayer.HalfDebayer(bayer, false, &expected).ok());
+
+  absl::SetFlag(&FLAGS_simd_debayer, true);
+  Debayer simd_debayer;
+  cv::Mat bgr;
+  ASSERT_TRUE(simd_debayer.HalfDebayer(bayer, false, &bgr).ok());
+  AssertEquals(expected, bgr);
+}
+
+TEST(DebayerTest, LookupTableMatchesFixedPointGain) {
+  cv::Mat bayer(1, 2 * 100, CV_16UC1);
+  FillRandom<uint16_t>(&bayer);
+  const uint16_t* row = reinterpret_cast<const uint16_t*>(bayer.ptr());
+  const uint16_t gains[3] = {ToFixedPointGain(kRedGain),
+                             ToFixedPointGain(kGreenGain),
+                             ToFixedPointGain(kBlueGain)};
+  std::vector<uint8_t> tables[3];
+  for (int channel = 0; channel < 3; channel++) {
+    image_processor::BuildLookupTable<uint16_t>(gains[channel], 1.0,
+                                                &tables[channel]);
+  }
+  const uint8_t* const table_pointers[3] = {
+      tables[0].data(), tables[1].data(), tables[2].data()};
+  std::vector<uint8_t> expected(100 * 3);
+  std::vector<uint8_t> actual(100 * 3);
+  image_processor::HalfDebayerRowScalar<uint16_t>(row, row + 1, row + 1,
+                                                  gains, 100, expected.data());
+  image_processor::HalfDebayerRowLookup<uint16_t>(
+      row, row + 1, row + 1, table_pointers, 100, actual.data());
+  ASSERT_THAT(actual, Eq(expected));
+}
+
+TEST(DebayerTest, Gamma) {
+  absl::SetFlag(&FLAGS_num_debayer_threads, 1);
+  Debayer debayer;
+  debayer.SetGamma(2.0);
+  cv::Mat bayer(4, 6, CV_8UC1, kBayer8bit);
+  cv::Mat rgb;
+  ASSERT_TRUE(debayer.HalfDebayer(bayer, true, &rgb).ok());
+  // Each output value is 255 * sqrt(value / 256) of the linear output.
+  cv::Mat expected(2, 3, CV_8UC3);
+  for (int i = 0; i < sizeof(kRgb); i++) {
+    expected.ptr()[i] = static_cast<uint8_t>(
+        std::round(255 * std::sqrt(kRgb[i] / 256.0)));
+  }
+  AssertEquals(expected, rgb);
+}
+
+TEST(DebayerTest, GammaIgnoresSimd) {
+  absl::SetFlag(&FLAGS_num_debayer_threads, 1);
+  cv::Mat bayer(8, 2 * 40, CV_16UC1);
+  FillRandom<uint16_t>(&bayer);
+
+  absl::SetFlag(&FLAGS_simd_debayer, false);
+  Debayer scalar_debayer;
+  scalar_debayer.SetGamma(2.2);
+  cv::Mat expected;
+  ASSERT_TRUE(scalar_debayer.HalfDebayer(bayer, true, &expected).ok());
+
+  absl::SetFlag(&FLAGS_simd_debayer, true);
+  Debayer simd_debayer;
+  simd_debayer.SetGamma(2.2);
+  cv::Mat rgb;
+  ASSERT_TRUE(simd_debayer.HalfDebayer(bayer, true, &rgb).ok());
+  AssertEquals(expected, rgb);
+}
+
+// Mosaics the 8-bit RGB image into a Bayer image of the given pattern. Each
+// RGB pixel covers pixel_size x pixel_size Bayer pixels, so that with size 2
+// both greens of each tile take the green value.
+cv::Mat Mosaic(const cv::Mat& rgb, BayerPattern pattern, int pixel_size = 2) {
+  // Channels of the 2x2 tile, row by row.
+  int tile[4];
+  switch (pattern) {
+    case BayerPattern::RGGB:
+      tile[0] = 0, tile[1] = 1, tile[2] = 1, tile[3] = 2;
+      break;
+    case BayerPattern::BGGR:
+      tile[0] = 2, tile[1] = 1, tile[2] = 1, tile[3] = 0;
+      break;
+    case BayerPattern::GRBG:
+      tile[0] = 1, tile[1] = 0, tile[2] = 2, tile[3] = 1;
+      break;
+    case BayerPattern::GBRG:
+      tile[0] = 1, tile[1] = 2, tile[2] = 0, tile[3] = 1;
+      break;
+  }
+  cv::Mat bayer(rgb.rows * pixel_size, rgb.cols * pixel_size, CV_8UC1);
+  for (int y = 0; y < bayer.rows; y++) {
+    for (int x = 0; x < bayer.cols; x++) {
+      bayer.at<uint8_t>(y, x) =
+          rgb.ptr(y / pixel_size)[(x / pixel_size) * 3 +
+                                  tile[(y % 2) * 2 + x % 2]];
+    }
+  }
+  return bayer;
+}
+
+TEST(DebayerTest, BayerPatterns) {
+  absl::SetFlag(&FLAGS_num_debayer_threads, 2);
+  cv::Mat expected_rgb(6, 45, CV_8UC3);
+  FillRandom<uint8_t>(&expected_rgb);
+  cv::Mat expected_bgr(expected_rgb.rows, expected_rgb.cols, CV_8UC3);
+  for (int i = 0; i < expected_rgb.total(); i++) {
+    for (int channel = 0; channel < 3; channel++) {
+      expected_bgr.ptr()[i * 3 + channel] =
+          expected_rgb.ptr()[i * 3 + 2 - channel];
+    }
+  }
+
+  for (bool simd : {false, true}) {
+    absl::SetFlag(&FLAGS_simd_debayer, simd);
+    Debayer debayer;
+    for (BayerPattern pattern : {BayerPattern::RGGB, BayerPattern::BGGR,
+                                 BayerPattern::GRBG, BayerPattern::GBRG}) {
+      SCOPED_TRACE(static_cast<int>(pattern));
+      cv::Mat bayer = Mosaic(expected_rgb, pattern);
+      cv::Mat rgb;
+      ASSERT_TRUE(debayer.HalfDebayer(bayer, pattern, true, &rgb).ok());
+      AssertEquals(expected_rgb, rgb);
+      cv::Mat bgr;
+      ASSERT_TRUE(debayer.HalfDebayer(bayer, pattern, false, &bgr).ok());
+      AssertEquals(expected_bgr, bgr);
+    }
+  }
+}
+
+constexpr BayerPattern kBayerPatterns[] = {
+    BayerPattern::RGGB, BayerPattern::BGGR, BayerPattern::GRBG,
+    BayerPattern::GBRG};
+
+constexpr DebayerMode kDemosaicModes[] = {DebayerMode::BILINEAR,
+                                          DebayerMode::MALVAR_HE_CUTLER};
+
+TEST(DebayerTest, DemosaicUniformColor) {
+  absl::SetFlag(&FLAGS_num_debayer_threads, 2);
+  // Odd number of pixel pairs, which leaves a partial block.
+  cv::Mat expected(12, 70, CV_8UC3);
+  expected.setTo(cv::Scalar(200, 100, 30));
+  for (bool simd : {false, true}) {
+    absl::SetFlag(&FLAGS_simd_debayer, simd);
+    Debayer debayer;
+    for (BayerPattern pattern : kBayerPatterns) {
+      for (DebayerMode mode : kDemosaicModes) {
+        SCOPED_TRACE(static_cast<int>(pattern) * 10 + static_cast<int>(mode));
+        // Interpolation keeps uniform colors, at every border.
+        cv::Mat rgb;
+        ASSERT_TRUE(debayer
+                        .Demosaic(Mosaic(expected, pattern, 1), pattern,
+                                  mode, true, &rgb)
+                        .ok());
+        AssertEquals(expected, rgb);
+      }
+    }
+  }
+}
+
+TEST(DebayerTest, DemosaicBilinear) {
+  absl::SetFlag(&FLAGS_num_debayer_threads, 1);
+  // Green at the red pixel (1, 1) of the RGGB pattern is the average of its
+  // 4 neighbours, and blue the average of its diagonal neighbours.
+  cv::Mat bayer = cv::Mat::zeros(4, 4, CV_8UC1);
+  bayer.at<uint8_t>(0, 1) = 40;
+  bayer.at<uint8_t>(1, 0) = 80;
+  bayer.at<uint8_t>(1, 2) = 120;
+  bayer.at<uint8_t>(2, 1) = 160;
+  bayer.at<uint8_t>(0, 0) = 16;
+  bayer.at<uint8_t>(0, 2) = 32;
+  bayer.at<uint8_t>(2, 0) = 48;
+  bayer.at<uint8_t>(2, 2) = 64;
+  bayer.at<uint8_t>(1, 1) = 200;
+  Debayer debayer;
+  cv::Mat rgb;
+  ASSERT_TRUE(debayer
+                  .Demosaic(bayer, BayerPattern::BGGR, DebayerMode::BILINEAR,
+                            true, &rgb)
+                  .ok());
+  const uint8_t* pixel = rgb.ptr(1) + 3;
+  ASSERT_THAT(pixel[0], Eq(200));
+  ASSERT_THAT(pixel[1], Eq(100));
+  ASSERT_THAT(pixel[2], Eq(40));
+}
+
+template <typename T>
+void AssertDemosaicSimdMatchesScalar() {
+  absl::SetFlag(&FLAGS_num_debayer_threads, 3);
+  cv::Mat bayer(26, 2 * 53, sizeof(T) == 1 ? CV_8UC1 : CV_16UC1);
+  FillRandom<T>(&bayer);
+  absl::SetFlag(&FLAGS_simd_debayer, false);
+  Debayer scalar_debayer;
+  scalar_debayer.SetRgbGains(kRedGain, kGreenGain, kBlueGain);
+  absl::SetFlag(&FLAGS_simd_debayer, true);
+  Debayer simd_debayer;
+  simd_debayer.SetRgbGains(kRedGain, kGreenGain, kBlueGain);
+  for (BayerPattern pattern : kBayerPatterns) {
+    for (DebayerMode mode : kDemosaicModes) {
+      for (bool is_rgb : {false, true}) {
+        SCOPED_TRACE(static_cast<int>(pattern) * 10 +
+                     static_cast<int>(mode) * 2 + is_rgb);
+        cv::Mat expected;
+        ASSERT_TRUE(
+            scalar_debayer.Demosaic(bayer, pattern, mode, is_rgb, &expected)
+                .ok());
+        cv::Mat actual;
+        ASSERT_TRUE(
+            simd_debayer.Demosaic(bayer, pattern, mode, is_rgb, &actual).ok());
+        AssertEquals(expected, actual);
+      }
+    }
+  }
+}
+
+TEST(DebayerTest, DemosaicSimdMatchesScalar8bit) {
+  AssertDemosaicSimdMatchesScalar<uint8_t>();
+}
+
+TEST(DebayerTest, DemosaicSimdMatchesScalar16bit) {
+  AssertDemosaicSimdMatchesScalar<uint16_t>();
+}
+
+TEST(DebayerTest, DemosaicIntoView) {
+  absl::SetFlag(&FLAGS_num_debayer_threads, 2);
+  cv::Mat bayer(8, 40, CV_16UC1);
+  FillRandom<uint16_t>(&bayer);
+  Debayer debayer;
+  cv::Mat expected;
+  ASSERT_TRUE(debayer
+                  .Demosaic(bayer, BayerPattern::RGGB,
+                            DebayerMode::MALVAR_HE_CUTLER, true, &expected)
+                  .ok());
+
+  // Same as the inference input, a view centered in a larger buffer.
+  cv::Mat buffer = cv::Mat::zeros(12, 48, CV_8UC3);
+  cv::Mat view(buffer, cv::Rect(4, 2, 40, 8));
+  const uint8_t* data = view.ptr();
+  ASSERT_TRUE(debayer
+                  .Demosaic(bayer, BayerPattern::RGGB,
+                            DebayerMode::MALVAR_HE_CUTLER, true, &view)
+                  .ok());
+  ASSERT_THAT(view.ptr(), Eq(data));
+  AssertEquals(expected, view);
+  ASSERT_THAT(buffer.at<cv::Vec3b>(1, 10), Eq(cv::Vec3b(0, 0, 0)));
+  ASSERT_THAT(buffer.at<cv::Vec3b>(5, 3), Eq(cv::Vec3b(0, 0, 0)));
+  ASSERT_THAT(buffer.at<cv::Vec3b>(5, 44), Eq(cv::Vec3b(0, 0, 0)));
+}
+
+TEST(DebayerTest, DemosaicInvalidDimension) {
+  Debayer debayer;
+  cv::Mat bayer(8, 9, CV_8UC1);
+  cv::Mat rgb;
+  ASSERT_FALSE(debayer
+                   .Demosaic(bayer, BayerPattern::RGGB, DebayerMode::BILINEAR,
+                             true, &rgb)
+                   .ok());
+}
+
+TEST(DebayerTest, SmoothImageMatchesBlur) {
+  absl::SetFlag(&FLAGS_num_debayer_threads, 3);
+  // Sizes with one row or column, and with many bands.
+  const cv::Size sizes[] = {cv::Size(1, 1), cv::Size(2, 1), cv::Size(1, 3),
+                            cv::Size(17, 2), cv::Size(45, 400)};
+  for (const cv::Size& size : sizes) {
+    SCOPED_TRACE(size.width * 1000 + size.height);
+    cv::Mat bayer(size.height * 2, size.width * 2, CV_16UC1);
+    FillRandom<uint16_t>(&bayer);
+    Debayer debayer;
+    cv::Mat rgb;
+    absl::SetFlag(&FLAGS_smooth_image, false);
+    ASSERT_TRUE(debayer.HalfDebayer(bayer, true, &rgb).ok());
+    cv::Mat expected;
+    cv::blur(rgb, expected, cv::Size(3, 3));
+
+    absl::SetFlag(&FLAGS_smooth_image, true);
+    cv::Mat smoothed;
+    ASSERT_TRUE(debayer.HalfDebayer(bayer, true, &smoothed).ok());
+    absl::SetFlag(&FLAGS_smooth_image, false);
+    AssertEquals(expected, smoothed);
+  }
+}
+
+TEST(DebayerTest, Statistics) {
+  absl::SetFlag(&FLAGS_num_debayer_threads, 3);
+  // Counts the output of the debayer directly.
+  const auto expected_histograms = [](const cv::Mat& rgb, bool is_rgb) {
+    std::array<Histogram, 3> histograms = {};
+    for (int y = 0; y < rgb.rows; y++) {
+      for (int x = 0; x < rgb.cols; x++) {
+        const cv::Vec3b& pixel = rgb.at<cv::Vec3b>(y, x);
+        for (int channel = 0; channel < 3; channel++) {
+          histograms[channel][pixel[is_rgb ? channel : 2 - channel]]++;
+        }
+      }
+    }
+    return histograms;
+  };
+  cv::Mat bayer(400, 90, CV_16UC1);
+  FillRandom<uint16_t>(&bayer);
+  Debayer debayer;
+  ASSERT_THAT(debayer.GetStatistics().num_pixels, Eq(0));
+  debayer.SetCollectStatistics(true);
+  for (bool is_rgb : {true, false}) {
+    for (DebayerMode mode : {DebayerMode::HALF, DebayerMode::BILINEAR}) {
+      cv::Mat rgb;
+      ASSERT_TRUE(
+          debayer.Convert(bayer, BayerPattern::GRBG, mode, is_rgb, &rgb).ok());
+      const ChannelStatistics statistics = debayer.GetStatistics();
+      ASSERT_THAT(statistics.num_pixels, Eq(rgb.total()));
+      ASSERT_THAT(statistics.histograms,
+                  Eq(expected_histograms(rgb, is_rgb)));
+      const cv::Scalar means = cv::mean(rgb);
+      ASSERT_NEAR(statistics.means[0], means[is_rgb ? 0 : 2], 1e-9);
+      ASSERT_NEAR(statistics.means[1], means[1], 1e-9);
+      ASSERT_NEAR(statistics.means[2], means[is_rgb ? 2 : 0], 1e-9);
+    }
+  }
+}
+
+TEST(DebayerTest, FieldOfViewSpans) {
+  for (const cv::Size& size :
+       {cv::Size(1, 1), cv::Size(7, 4), cv::Size(40, 30), cv::Size(30, 41)}) {
+    for (double diameter : {0.5, 3.0, 29.0, 40.0, 60.0}) {
+      const FieldOfView field_of_view(size.width, size.height, diameter);
+      int64_t num_pixels = 0;
+      for (int y = 0; y < size.height; y++) {
+        const RowSpan& span = field_of_view.GetSpan(y);
+        for (int x = 0; x < size.width; x++) {
+          const double dx = x - (size.width / 2.0 - 0.5);
+          const double dy = y - (size.height / 2.0 - 0.5);
+          const bool inside = dx * dx + dy * dy <= diameter * diameter / 4;
+          ASSERT_THAT(x >= span.begin && x < span.end, Eq(inside))
+              << size.width << "x" << size.height << " " << diameter << " "
+              << x << "," << y;
+          num_pixels += inside;
+        }
+      }
+      ASSERT_THAT(field_of_view.GetNumPixels(), Eq(num_pixels));
+    }
+  }
+}
+
+TEST(DebayerTest, FieldOfView) {
+  absl::SetFlag(&FLAGS_num_debayer_threads, 3);
+  cv::Mat bayer(60, 86, CV_16UC1);
+  FillRandom<uint16_t>(&bayer);
+  Debayer debayer;
+  debayer.SetCollectStatistics(true);
+  for (DebayerMode mode : {DebayerMode::HALF, DebayerMode::BILINEAR,
+                           DebayerMode::MALVAR_HE_CUTLER}) {
+    SCOPED_TRACE(static_cast<int>(mode));
+    cv::Mat expected;
+    debayer.SetFieldOfView(nullptr);
+    ASSERT_TRUE(
+        debayer.Convert(bayer, BayerPattern::GRBG, mode, false, &expected)
+            .ok());
+    const auto field_of_view = std::make_shared<FieldOfView>(
+        expected.cols, expected.rows, expected.rows * 1.2);
+    // Pixels outside the field of view are padded.
+    for (int y = 0; y < expected.rows; y++) {
+      const RowSpan& span = field_of_view->GetSpan(y);
+      for (int x = 0; x < expected.cols; x++) {
+        if (x < span.begin || x >= span.end) {
+          expected.at<cv::Vec3b>(y, x) = cv::Vec3b(0, 0, 0);
+        }
+      }
+    }
+    cv::Mat rgb(expected.rows, expected.cols, CV_8UC3, cv::Scalar(7, 7, 7));
+    debayer.SetFieldOfView(field_of_view);
+    ASSERT_TRUE(
+        debayer.Convert(bayer, BayerPattern::GRBG, mode, false, &rgb).ok());
+    AssertEquals(expected, rgb);
+    ASSERT_THAT(debayer.GetStatistics().num_pixels,
+                Eq(field_of_view->GetNumPixels()));
+
+    debayer.SetFieldOfView(std::make_shared<FieldOfView>(8, 8, 8));
+    ASSERT_FALSE(
+        debayer.Convert(bayer, BayerPattern::GRBG, mode, false, &rgb).ok());
+  }
+}
+
+// Packs the high bits of the 16-bit Bayer image, and replaces its values with
+// the expected unpacked values, whose low bits repeat the packed bits.
+cv::Mat PackBayer(BayerPacking packing, cv::Mat* bayer) {
+  const int bits = image_processor::GetPackedBits(packing);
+  const int low_bits = bits - 8;
+  const int group_pixels = image_processor::GetPackedGroupPixels(packing);
+  cv::Mat packed(bayer->rows,
+                 bayer->cols / group_pixels *
+                     image_processor::GetPackedGroupBytes(packing),
+                 CV_8UC1);
+  for (int y = 0; y < bayer->rows; y++) {
+    uint16_t* row = reinterpret_cast<uint16_t*>(bayer->ptr(y));
+    uint8_t* output = packed.ptr(y);
+    for (int x = 0; x < bayer->cols; x += group_pixels) {
+      uint8_t low = 0;
+      for (int i = 0; i < group_pixels; i++) {
+        const int value = row[x + i] >> (16 - bits);
+        *(output++) = value >> low_bits;
+        low |= (value & ((1 << low_bits) - 1)) << (i * low_bits);
+        const uint16_t unpacked = value << (16 - bits);
+        row[x + i] = unpacked | (unpacked >> bits);
+      }
+      *(output++) = low;
+    }
+  }
+  return packed;
+}
+
+TEST(DebayerTest, UnpackRowScalar) {
+  // 10-bit pixels 0x3ff, 0x000, 0x200 and 0x001.
+  const uint8_t raw10[] = {0xff, 0x00, 0x80, 0x00, 0x43};
+  std::vector<uint16_t> output(4);
+  image_processor::UnpackRowScalar<BayerPacking::RAW10>(raw10, 4,
+                                                        output.data());
+  EXPECT_THAT(output, Eq(std::vector<uint16_t>{0xffff, 0x0000, 0x8020,
+                                               0x0040}));
+
+  // 12-bit pixels 0xfff and 0x801.
+  const uint8_t raw12[] = {0xff, 0x80, 0x1f};
+  output.resize(2);
+  image_processor::UnpackRowScalar<BayerPacking::RAW12>(raw12, 2,
+                                                        output.data());
+  EXPECT_THAT(output, Eq(std::vector<uint16_t>{0xffff, 0x8018}));
+}
+
+TEST(DebayerTest, UnpackVectorKernelMatchesScalar) {
+  for (BayerPacking packing : {BayerPacking::RAW10, BayerPacking::RAW12}) {
+    SCOPED_TRACE(static_cast<int>(packing));
+    const UnpackRowKernel vector_kernel =
+        image_processor::GetVectorUnpackRowKernel(packing);
+    if (!vector_kernel) {
+      GTEST_SKIP() << "No vector kernel for this CPU";
+    }
+    const UnpackRowKernel scalar_kernel =
+        packing == BayerPacking::RAW10
+            ? &image_processor::UnpackRowScalar<BayerPacking::RAW10>
+            : &image_processor::UnpackRowScalar<BayerPacking::RAW12>;
+    const int group_pixels = image_processor::GetPackedGroupPixels(packing);
+    // Cover widths with and without a scalar tail.
+    for (int width = 0; width <= 100; width += group_pixels) {
+      cv::Mat packed(1,
+                     width / group_pixels *
+                         image_processor::GetPackedGroupBytes(packing),
+                     CV_8UC1);
+      FillRandom<uint8_t>(&packed);
+      std::vector<uint16_t> expected(width);
+      std::vector<uint16_t> actual(width);
+      scalar_kernel(packed.ptr(), width, expected.data());
+      vector_kernel(packed.ptr(), width, actual.data());
+      ASSERT_THAT(actual, Eq(expected)) << "width: " << width;
+    }
+  }
+}
+
+TEST(DebayerTest, PackedInput) {
+  absl::SetFlag(&FLAGS_num_debayer_threads, 3);
+  for (bool simd : {false, true}) {
+    absl::SetFlag(&FLAGS_simd_debayer, simd);
+    for (BayerPacking packing : {BayerPacking::RAW10, BayerPacking::RAW12}) {
+      SCOPED_TRACE(static_cast<int>(packing));
+      cv::Mat bayer(30, 92, CV_16UC1);
+      FillRandom<uint16_t>(&bayer);
+      const cv::Mat packed = PackBayer(packing, &bayer);
+      Debayer debayer;
+      debayer.SetRgbGains(kRedGain, kGreenGain, kBlueGain);
+      debayer.SetBayerPacking(packing);
+      cv::Mat unpacked;
+      ASSERT_TRUE(debayer.UnpackBayerImage(packed, &unpacked).ok());
+      ASSERT_THAT(unpacked.cols, Eq(bayer.cols));
+      for (int y = 0; y < bayer.rows; y++) {
+        ASSERT_THAT(std::memcmp(unpacked.ptr(y), bayer.ptr(y), bayer.cols * 2),
+                    Eq(0));
+      }
+
+      for (DebayerMode mode : {DebayerMode::HALF, DebayerMode::BILINEAR,
+                               DebayerMode::MALVAR_HE_CUTLER}) {
+        SCOPED_TRACE(static_cast<int>(mode));
+        for (bool field_of_view : {false, true}) {
+          cv::Mat expected;
+          debayer.SetBayerPacking(BayerPacking::NONE);
+          debayer.SetFieldOfView(nullptr);
+          ASSERT_TRUE(
+              debayer.Convert(bayer, BayerPattern::BGGR, mode, true, &expected)
+                  .ok());
+          // Spans of odd width exercise the unpacking of partial groups.
+          debayer.SetFieldOfView(
+              field_of_view ? std::make_shared<FieldOfView>(
+                                  expected.cols, expected.rows,
+                                  expected.rows * 0.9)
+                            : nullptr);
+          if (field_of_view) {
+            ASSERT_TRUE(debayer
+                            .Convert(bayer, BayerPattern::BGGR, mode, true,
+                                     &expected)
+                            .ok());
+          }
+          debayer.SetBayerPacking(packing);
+          cv::Mat rgb;
+          ASSERT_TRUE(
+              debayer.Convert(packed, BayerPattern::BGGR, mode, true, &rgb)
+                  .ok());
+          AssertEquals(expected, rgb);
+        }
+      }
+    }
+  }
+  absl::SetFlag(&FLAGS_simd_debayer, true);
+}
+
+TEST(DebayerTest, PackedInputInvalid) {
+  Debayer debayer;
+  debayer.SetBayerPacking(BayerPacking::RAW10);
+  cv::Mat rgb;
+  // Not made of whole groups.
+  cv::Mat bayer(8, 12, CV_8UC1, cv::Scalar(0));
+  EXPECT_FALSE(debayer.HalfDebayer(bayer, true, &rgb).ok());
+  EXPECT_FALSE(debayer
+                   .Demosaic(bayer, BayerPattern::RGGB, DebayerMode::BILINEAR,
+                             true, &rgb)
+                   .ok());
+  // Not 8-bit.
+  bayer = cv::Mat(8, 10, CV_16UC1, cv::Scalar(0));
+  EXPECT_FALSE(debayer.HalfDebayer(bayer, true, &rgb).ok());
+  bayer = cv::Mat(8, 10, CV_8UC1, cv::Scalar(0));
+  ASSERT_TRUE(debayer.HalfDebayer(bayer, true, &rgb).ok());
+  EXPECT_THAT(rgb.cols, Eq(4));
+}
+
 }  // namespace
@@ -0,0 +1,236 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_processor/defect_map.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "absl/flags/flag.h"
+#include "absl/strings/str_format.h"
+#include "tensorflow/core/lib/core/errors.h"
+
+ABSL_FLAG(std::string, defect_pixel_map, "",
+          "Defect pixel map file of the sensor, written by "
+          "calibrate_defect_pixels. No correction is applied if empty.");
+
+namespace image_processor {
+namespace {
+
+// Minimum signal of the neighbours in the flat frame, as a fraction of the
+// full scale of the pixels, for the response to light to be compared to
+// theirs. Below it, e.g. outside of the field of view, the signal is mostly
+// noise.
+constexpr double kMinNeighbourSignal = 0.02;
+
+}  // namespace
+
+tensorflow::Status DefectMap::Create(int width, int height,
+                                     std::vector<cv::Point> defects,
+                                     std::unique_ptr<DefectMap>* defect_map) {
+  if (width <= 0 || height <= 0) {
+    return tensorflow::errors::InvalidArgument(
+        absl::StrFormat("Invalid defect map dimension %dx%d.", width, height));
+  }
+  for (const cv::Point& defect : defects) {
+    if (defect.x < 0 || defect.x >= width || defect.y < 0 ||
+        defect.y >= height) {
+      return tensorflow::errors::InvalidArgument(absl::StrFormat(
+          "Defect pixel %d,%d outside the sensor of %dx%d.", defect.x,
+          defect.y, width, height));
+    }
+  }
+  std::sort(defects.begin(), defects.end(),
+            [](const cv::Point& a, const cv::Point& b) {
+              return a.y != b.y ? a.y < b.y : a.x < b.x;
+            });
+  defects.erase(std::unique(defects.begin(), defects.end()), defects.end());
+
+  std::unique_ptr<DefectMap> map(new DefectMap());
+  map->width_ = width;
+  map->height_ = height;
+  map->row_offsets_.assign(height + 1, 0);
+  map->columns_.reserve(defects.size());
+  for (const cv::Point& defect : defects) {
+    map->columns_.push_back(defect.x);
+    map->row_offsets_[defect.y + 1]++;
+  }
+  for (int y = 0; y < height; y++) {
+    map->row_offsets_[y + 1] += map->row_offsets_[y];
+  }
+  *defect_map = std::move(map);
+  return tensorflow::Status();
+}
+
+tensorflow::Status DefectMap::Load(const std::string& path,
+                                   std::unique_ptr<DefectMap>* defect_map) {
+  std::ifstream file(path);
+  if (!file) {
+    return tensorflow::errors::NotFound(absl::StrFormat(
+        "Failed to open defect map file %s: %s", path, strerror(errno)));
+  }
+  int width = 0;
+  int height = 0;
+  std::vector<cv::Point> defects;
+  std::string line;
+  for (int line_number = 1; std::getline(file, line); line_number++) {
+    if (line.empty() || line[0] == '#') continue;
+    std::istringstream values(line);
+    int first, second;
+    std::string rest;
+    if (!(values >> first >> second) || (values >> rest)) {
+      return tensorflow::errors::InvalidArgument(absl::StrFormat(
+          "Invalid defect map file %s at line %d.", path, line_number));
+    }
+    if (width == 0) {
+      width = first;
+      height = second;
+    } else {
+      defects.emplace_back(first, second);
+    }
+  }
+  return Create(width, height, std::move(defects), defect_map);
+}
+
+tensorflow::Status DefectMap::Save(const std::string& path) const {
+  // Write a temporary file and rename it, so that a starting app never reads
+  // a partial file.
+  const std::string temporary_path = path + ".tmp";
+  {
+    std::ofstream file(temporary_path, std::ios::trunc);
+    file << "# Defect pixel map, see image_processor/defect_map.h.\n";
+    file << width_ << " " << height_ << "\n";
+    for (int y = 0; y < height_; y++) {
+      for (int i = row_offsets_[y]; i < row_offsets_[y + 1]; i++) {
+        file << columns_[i] << " " << y << "\n";
+      }
+    }
+    file.close();
+    if (!file) {
+      return tensorflow::errors::Internal(absl::StrFormat(
+          "Failed to write defect map file %s.", temporary_path));
+    }
+  }
+  if (std::rename(temporary_path.c_str(), path.c_str()) != 0) {
+    return tensorflow::errors::Internal(absl::StrFormat(
+        "Failed to rename defect map file to %s: %s", path, strerror(errno)));
+  }
+  return tensorflow::Status();
+}
+
+std::vector<cv::Point> DefectMap::GetDefects() const {
+  std::vector<cv::Point> defects;
+  defects.reserve(columns_.size());
+  for (int y = 0; y < height_; y++) {
+    for (int i = row_offsets_[y]; i < row_offsets_[y + 1]; i++) {
+      defects.emplace_back(columns_[i], y);
+    }
+  }
+  return defects;
+}
+
+bool DefectMap::IsDefect(int y, int x) const {
+  return std::binary_search(columns_.begin() + row_offsets_[y],
+                            columns_.begin() + row_offsets_[y + 1], x);
+}
+
+template <typename T>
+void DefectMap::CorrectRow(int y, int begin, int end, T* row) const {
+  const auto row_begin = columns_.begin() + row_offsets_[y];
+  const auto row_end = columns_.begin() + row_offsets_[y + 1];
+  for (auto it = std::lower_bound(row_begin, row_end, begin);
+       it != row_end && *it < end; ++it) {
+    const int x = *it;
+    int sum = 0;
+    int count = 0;
+    for (const int neighbour : {x - 2, x + 2}) {
+      if (neighbour >= begin && neighbour < end && !IsDefect(y, neighbour)) {
+        sum += row[neighbour];
+        count++;
+      }
+    }
+    if (count > 0) row[x] = static_cast<T>((sum + count / 2) / count);
+  }
+}
+
+template void DefectMap::CorrectRow<uint8_t>(int y, int begin, int end,
+                                             uint8_t* row) const;
+template void DefectMap::CorrectRow<uint16_t>(int y, int begin, int end,
+                                              uint16_t* row) const;
+
+double DefectMapCalibrator::GetNeighbourMedian(
+    const std::vector<uint32_t>& sums, int num_frames, int y, int x) const {
+  const int width = frames_.GetWidth();
+  const int height = frames_.GetHeight();
+  uint32_t neighbours[8];
+  int count = 0;
+  for (int dy = -2; dy <= 2; dy += 2) {
+    for (int dx = -2; dx <= 2; dx += 2) {
+      const int neighbour_y = y + dy;
+      const int neighbour_x = x + dx;
+      if ((dy == 0 && dx == 0) || neighbour_y < 0 || neighbour_y >= height ||
+          neighbour_x < 0 || neighbour_x >= width) {
+        continue;
+      }
+      neighbours[count++] =
+          sums[static_cast<size_t>(neighbour_y) * width + neighbour_x];
+    }
+  }
+  std::nth_element(neighbours, neighbours + count / 2, neighbours + count);
+  return static_cast<double>(neighbours[count / 2]) / num_frames;
+}
+
+tensorflow::Status DefectMapCalibrator::Detect(
+    std::unique_ptr<DefectMap>* defect_map) const {
+  TF_RETURN_IF_ERROR(frames_.CheckComplete());
+  const int width = frames_.GetWidth();
+  const int height = frames_.GetHeight();
+  const std::vector<uint32_t>& dark_sums = frames_.GetDarkSums();
+  const std::vector<uint32_t>& flat_sums = frames_.GetFlatSums();
+  const int num_dark_frames = frames_.GetNumDarkFrames();
+  const int num_flat_frames = frames_.GetNumFlatFrames();
+  const double full_scale = frames_.GetBytesPerPixel() == 1 ? 0xff : 0xffff;
+  std::vector<cv::Point> defects;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      const size_t i = static_cast<size_t>(y) * width + x;
+      const double dark = static_cast<double>(dark_sums[i]) / num_dark_frames;
+      const double neighbour_dark =
+          GetNeighbourMedian(dark_sums, num_dark_frames, y, x);
+      if (dark - neighbour_dark > hot_threshold_ * full_scale) {
+        defects.emplace_back(x, y);
+        continue;
+      }
+      // The response to light is compared to the neighbours, which share the
+      // vignetting of the optics.
+      const double signal =
+          static_cast<double>(flat_sums[i]) / num_flat_frames - dark;
+      const double neighbour_signal =
+          GetNeighbourMedian(flat_sums, num_flat_frames, y, x) -
+          neighbour_dark;
+      if (neighbour_signal < kMinNeighbourSignal * full_scale) continue;
+      const double ratio = signal / neighbour_signal;
+      if (ratio < dead_threshold_ || ratio * dead_threshold_ > 1) {
+        defects.emplace_back(x, y);
+      }
+    }
+  }
+  return DefectMap::Create(width, height, std::move(defects), defect_map);
+}
+
+}  // namespace image_processor
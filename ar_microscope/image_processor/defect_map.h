@@ -0,0 +1,133 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+// Defect pixel map of the raw Bayer images. Hot pixels, whose dark current
+// makes them bright without light, and dead pixels, which do not respond to
+// light, show up as specks that the models may mistake for cells. The listed
+// pixels are replaced by the mean of their same-color neighbours in the row
+// before debayer, so the correction costs in proportion to the number of
+// defects rather than to the frame size.
+//
+// The map is stored in a text file:
+//   # Comment lines.
+//   <width> <height>
+//   <x> <y>
+//   ...
+// with one defect per line, sorted by y and then x.
+
+#ifndef AR_MICROSCOPE_IMAGE_PROCESSOR_DEFECT_MAP_H_
+#define AR_MICROSCOPE_IMAGE_PROCESSOR_DEFECT_MAP_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "opencv2/core.hpp"
+#include "image_processor/calibration_frames.h"
+#include "tensorflow/core/lib/core/status.h"
+
+namespace image_processor {
+
+class DefectMap {
+ public:
+  // Creates the map of the defects, in Bayer pixel coordinates of a sensor of
+  // the dimension. Defects are sorted, and duplicates removed. Returns an
+  // error if a defect is outside the sensor.
+  static tensorflow::Status Create(int width, int height,
+                                   std::vector<cv::Point> defects,
+                                   std::unique_ptr<DefectMap>* defect_map);
+
+  // Reads the map file.
+  static tensorflow::Status Load(const std::string& path,
+                                 std::unique_ptr<DefectMap>* defect_map);
+
+  // Writes the map file. The file is replaced atomically.
+  tensorflow::Status Save(const std::string& path) const;
+
+  int GetWidth() const { return width_; }
+  int GetHeight() const { return height_; }
+  int GetNumDefects() const { return columns_.size(); }
+
+  // Returns the defects, sorted by y and then x.
+  std::vector<cv::Point> GetDefects() const;
+
+  // Returns whether row y has defects.
+  bool HasDefects(int y) const {
+    return row_offsets_[y] != row_offsets_[y + 1];
+  }
+
+  // Replaces the defects of row y in the columns [begin, end) by the mean of
+  // the pixels two columns to the left and to the right, which have the same
+  // color, among those in [begin, end) that are not defects. Defects without
+  // such neighbours are left as they are.
+  template <typename T>
+  void CorrectRow(int y, int begin, int end, T* row) const;
+
+ private:
+  DefectMap() = default;
+
+  // Returns whether the pixel of row y is a defect.
+  bool IsDefect(int y, int x) const;
+
+  int width_ = 0;
+  int height_ = 0;
+  // Columns of the defects of row y are columns_[row_offsets_[y]] to
+  // columns_[row_offsets_[y + 1] - 1], in increasing order.
+  std::vector<int> row_offsets_;
+  std::vector<int> columns_;
+};
+
+// Averages raw Bayer frames captured without light and of a blank slide, and
+// finds the pixels that deviate from their same-color neighbours.
+class DefectMapCalibrator {
+ public:
+  // Args:
+  //   hot_threshold: Minimum excess over the neighbours in the dark frame of
+  //     a hot pixel, as a fraction of the full scale of the pixels.
+  //   dead_threshold: Maximum ratio to the neighbours in the flat frame of a
+  //     dead pixel. Pixels brighter than the neighbours by the inverse ratio
+  //     are stuck, and also defects. Pixels whose neighbours are barely lit,
+  //     like those outside of the field of view, are not tested.
+  DefectMapCalibrator(double hot_threshold, double dead_threshold)
+      : hot_threshold_(hot_threshold), dead_threshold_(dead_threshold) {}
+
+  // Adds a raw Bayer frame captured with the light path blocked.
+  tensorflow::Status AddDarkFrame(const cv::Mat& bayer_image) {
+    return frames_.AddDarkFrame(bayer_image);
+  }
+
+  // Adds a raw Bayer frame of a blank area of a slide.
+  tensorflow::Status AddFlatFrame(const cv::Mat& bayer_image) {
+    return frames_.AddFlatFrame(bayer_image);
+  }
+
+  // Finds the defects. Needs at least one frame of each kind.
+  tensorflow::Status Detect(std::unique_ptr<DefectMap>* defect_map) const;
+
+ private:
+  // Returns the median of the neighbours of the same color of the pixel in
+  // the 5x5 window around it, from the sums of the frames. Unlike the mean, it
+  // is not raised by a defect among the neighbours.
+  double GetNeighbourMedian(const std::vector<uint32_t>& sums, int num_frames,
+                            int y, int x) const;
+
+  const double hot_threshold_;
+  const double dead_threshold_;
+  CalibrationFrames frames_;
+};
+
+}  // namespace image_processor
+
+#endif  // AR_MICROSCOPE_IMAGE_PROCESSOR_DEFECT_MAP_H_
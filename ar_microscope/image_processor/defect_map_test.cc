@@ -0,0 +1,244 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_processor/defect_map.h"
+
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "opencv2/core.hpp"
+#include "image_processor/debayer.h"
+#include "tensorflow/core/lib/core/status.h"
+
+namespace {
+
+using image_processor::BayerPattern;
+using image_processor::Debayer;
+using image_processor::DebayerMode;
+using image_processor::DefectMap;
+using image_processor::DefectMapCalibrator;
+
+using ::testing::ElementsAre;
+using ::testing::ElementsAreArray;
+using ::testing::Eq;
+
+constexpr int kWidth = 40;
+constexpr int kHeight = 8;
+
+std::string GetTestPath(const std::string& name) {
+  return ::testing::TempDir() + "/" + name;
+}
+
+std::unique_ptr<DefectMap> MakeDefectMap(std::vector<cv::Point> defects) {
+  std::unique_ptr<DefectMap> defect_map;
+  EXPECT_TRUE(
+      DefectMap::Create(kWidth, kHeight, std::move(defects), &defect_map)
+          .ok());
+  return defect_map;
+}
+
+TEST(DefectMapTest, SaveAndLoad) {
+  const std::unique_ptr<DefectMap> defect_map =
+      MakeDefectMap({{5, 3}, {1, 7}, {2, 3}, {5, 3}});
+  ASSERT_THAT(defect_map->GetNumDefects(), Eq(3));
+  const std::string path = GetTestPath("defect_map.txt");
+  ASSERT_TRUE(defect_map->Save(path).ok());
+
+  std::ifstream file(path);
+  std::vector<std::string> lines;
+  for (std::string line; std::getline(file, line);) lines.push_back(line);
+  ASSERT_THAT(lines.size(), Eq(5));
+  EXPECT_THAT(std::vector<std::string>(lines.begin() + 1, lines.end()),
+              ElementsAre("40 8", "2 3", "5 3", "1 7"));
+
+  std::unique_ptr<DefectMap> loaded;
+  ASSERT_TRUE(DefectMap::Load(path, &loaded).ok());
+  EXPECT_THAT(loaded->GetWidth(), Eq(kWidth));
+  EXPECT_THAT(loaded->GetHeight(), Eq(kHeight));
+  EXPECT_THAT(loaded->GetNumDefects(), Eq(3));
+  EXPECT_TRUE(loaded->HasDefects(3));
+  EXPECT_FALSE(loaded->HasDefects(4));
+  EXPECT_TRUE(loaded->HasDefects(7));
+  EXPECT_THAT(loaded->GetDefects(),
+              ElementsAre(cv::Point(2, 3), cv::Point(5, 3), cv::Point(1, 7)));
+}
+
+TEST(DefectMapTest, InvalidFiles) {
+  std::unique_ptr<DefectMap> defect_map;
+  EXPECT_FALSE(DefectMap::Create(kWidth, kHeight, {{kWidth, 0}}, &defect_map)
+                   .ok());
+  EXPECT_FALSE(DefectMap::Load(GetTestPath("missing.txt"), &defect_map).ok());
+  const std::string path = GetTestPath("invalid_defect_map.txt");
+  {
+    std::ofstream file(path);
+    file << "40 8\n1 2 3\n";
+  }
+  EXPECT_FALSE(DefectMap::Load(path, &defect_map).ok());
+  {
+    std::ofstream file(path);
+    file << "# Empty\n";
+  }
+  EXPECT_FALSE(DefectMap::Load(path, &defect_map).ok());
+}
+
+TEST(DefectMapTest, CorrectRowFromSameColorNeighbours) {
+  const std::unique_ptr<DefectMap> defect_map =
+      MakeDefectMap({{0, 0}, {4, 0}, {6, 0}, {9, 0}, {13, 0}});
+  std::vector<uint16_t> row(kWidth, 0);
+  for (int x = 0; x < kWidth; x++) row[x] = 100 * x;
+  row[4] = row[6] = row[9] = 0xffff;
+  defect_map->CorrectRow<uint16_t>(0, 0, kWidth, row.data());
+  // The border defect only has its right neighbour.
+  EXPECT_THAT(row[0], Eq(200));
+  // Neighbouring defects are not used.
+  EXPECT_THAT(row[4], Eq(200));
+  EXPECT_THAT(row[6], Eq(800));
+  EXPECT_THAT(row[9], Eq(900));
+  // Columns outside the range are not touched, nor used.
+  row[13] = 7;
+  defect_map->CorrectRow<uint16_t>(0, 12, 16, row.data());
+  EXPECT_THAT(row[13], Eq(1500));
+  row[13] = 7;
+  defect_map->CorrectRow<uint16_t>(0, 0, 13, row.data());
+  EXPECT_THAT(row[13], Eq(7));
+}
+
+TEST(DefectMapTest, CalibratorFindsDefects) {
+  DefectMapCalibrator calibrator(/*hot_threshold=*/0.05,
+                                 /*dead_threshold=*/0.5);
+  cv::Mat dark_frame(kHeight, kWidth, CV_16UC1, cv::Scalar(300));
+  dark_frame.at<uint16_t>(2, 10) = 20000;
+  // Vignetting and Bayer colors are not defects.
+  cv::Mat flat_frame(kHeight, kWidth, CV_16UC1);
+  for (int y = 0; y < kHeight; y++) {
+    for (int x = 0; x < kWidth; x++) {
+      const int color = 8000 * (1 + (y & 1) + 2 * (x & 1));
+      flat_frame.at<uint16_t>(y, x) = 300 + color * (kWidth + x) / (2 * kWidth);
+    }
+  }
+  flat_frame.at<uint16_t>(2, 10) = 20000;
+  flat_frame.at<uint16_t>(5, 3) = 300;
+  flat_frame.at<uint16_t>(6, 30) = 0xffff;
+  for (int i = 0; i < 2; i++) {
+    ASSERT_TRUE(calibrator.AddDarkFrame(dark_frame).ok());
+    ASSERT_TRUE(calibrator.AddFlatFrame(flat_frame).ok());
+  }
+  ASSERT_FALSE(calibrator.AddFlatFrame(cv::Mat(4, 4, CV_16UC1)).ok());
+
+  std::unique_ptr<DefectMap> defect_map;
+  ASSERT_TRUE(calibrator.Detect(&defect_map).ok());
+  const std::string path = GetTestPath("calibrated_defect_map.txt");
+  ASSERT_TRUE(defect_map->Save(path).ok());
+  std::ifstream file(path);
+  std::vector<std::string> lines;
+  for (std::string line; std::getline(file, line);) lines.push_back(line);
+  EXPECT_THAT(std::vector<std::string>(lines.begin() + 2, lines.end()),
+              ElementsAre("10 2", "3 5", "30 6"));
+}
+
+TEST(DefectMapTest, CalibratorIgnoresUnlitBorder) {
+  DefectMapCalibrator calibrator(/*hot_threshold=*/0.05,
+                                 /*dead_threshold=*/0.5);
+  const cv::Mat dark_frame(kHeight, kWidth, CV_16UC1, cv::Scalar(300));
+  // The columns outside of the field of view only have a few counts of noise.
+  cv::Mat flat_frame(kHeight, kWidth, CV_16UC1);
+  for (int y = 0; y < kHeight; y++) {
+    for (int x = 0; x < kWidth; x++) {
+      const bool is_lit = x >= 8 && x < kWidth - 8;
+      const int color = 8000 * (1 + (y & 1) + 2 * (x & 1));
+      flat_frame.at<uint16_t>(y, x) =
+          300 + (is_lit ? color : (7 * x + 3 * y) % 6);
+    }
+  }
+  flat_frame.at<uint16_t>(4, 20) = 300;
+  ASSERT_TRUE(calibrator.AddDarkFrame(dark_frame).ok());
+  ASSERT_TRUE(calibrator.AddFlatFrame(flat_frame).ok());
+
+  std::unique_ptr<DefectMap> defect_map;
+  ASSERT_TRUE(calibrator.Detect(&defect_map).ok());
+  EXPECT_THAT(defect_map->GetDefects(), ElementsAre(cv::Point(20, 4)));
+}
+
+TEST(DefectMapTest, CalibratorNeedsFrames) {
+  DefectMapCalibrator calibrator(0.05, 0.5);
+  ASSERT_TRUE(calibrator.AddDarkFrame(cv::Mat::zeros(kHeight, kWidth, CV_8UC1))
+                  .ok());
+  std::unique_ptr<DefectMap> defect_map;
+  EXPECT_FALSE(calibrator.Detect(&defect_map).ok());
+}
+
+template <typename T>
+void TestDebayerPatchesDefects(int type) {
+  std::mt19937 generator(3);
+  std::uniform_int_distribution<int> distribution(
+      0, std::numeric_limits<T>::max());
+  cv::Mat bayer(kHeight, kWidth, type);
+  for (int y = 0; y < kHeight; y++) {
+    for (int x = 0; x < kWidth; x++) {
+      bayer.at<T>(y, x) = distribution(generator);
+    }
+  }
+  const std::shared_ptr<const DefectMap> defect_map =
+      MakeDefectMap({{0, 0}, {7, 0}, {9, 0}, {20, 3}, {39, 7}});
+  const cv::Mat original = bayer.clone();
+  cv::Mat corrected = bayer.clone();
+  for (int y = 0; y < kHeight; y++) {
+    defect_map->CorrectRow<T>(y, 0, kWidth, corrected.ptr<T>(y));
+  }
+
+  Debayer debayer;
+  for (DebayerMode mode : {DebayerMode::HALF, DebayerMode::BILINEAR,
+                           DebayerMode::MALVAR_HE_CUTLER}) {
+    cv::Mat expected;
+    debayer.SetDefectMap(nullptr);
+    ASSERT_TRUE(
+        debayer.Convert(corrected, BayerPattern::GRBG, mode, true, &expected)
+            .ok());
+    cv::Mat rgb;
+    debayer.SetDefectMap(defect_map);
+    ASSERT_TRUE(
+        debayer.Convert(bayer, BayerPattern::GRBG, mode, true, &rgb).ok());
+    ASSERT_THAT(std::vector<uint8_t>(rgb.ptr(), rgb.ptr() + rgb.total() * 3),
+                ElementsAreArray(expected.ptr(),
+                                 expected.ptr() + expected.total() * 3));
+  }
+  // The input is not modified.
+  EXPECT_THAT(memcmp(bayer.ptr(), original.ptr(), bayer.total() * sizeof(T)),
+              Eq(0));
+}
+
+TEST(DefectMapTest, DebayerPatchesDefects8bit) {
+  TestDebayerPatchesDefects<uint8_t>(CV_8UC1);
+}
+
+TEST(DefectMapTest, DebayerPatchesDefects16bit) {
+  TestDebayerPatchesDefects<uint16_t>(CV_16UC1);
+}
+
+TEST(DefectMapTest, MismatchedDimension) {
+  Debayer debayer;
+  debayer.SetDefectMap(MakeDefectMap({{1, 1}}));
+  cv::Mat rgb;
+  EXPECT_FALSE(
+      debayer.HalfDebayer(cv::Mat::zeros(4, 4, CV_8UC1), true, &rgb).ok());
+}
+
+}  // namespace
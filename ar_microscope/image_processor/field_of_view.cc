@@ -0,0 +1,54 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_processor/field_of_view.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace image_processor {
+
+FieldOfView::FieldOfView(int width, int height, double diameter)
+    : width_(width), height_(height), spans_(height) {
+  const double radius_square = diameter * diameter / 4;
+  const double center_x = width / 2.0 - 0.5;
+  const double center_y = height / 2.0 - 0.5;
+  for (int y = 0; y < height; y++) {
+    const double dy = y - center_y;
+    auto inside = [&](int x) {
+      const double dx = x - center_x;
+      return dx * dx + dy * dy <= radius_square;
+    };
+    const double half_chord_square = radius_square - dy * dy;
+    if (half_chord_square < 0) {
+      spans_[y] = {0, 0};
+      continue;
+    }
+    // Start from the chord, and fix the rounding at its ends so that the spans
+    // match the distance test exactly.
+    const double half_chord = std::sqrt(half_chord_square);
+    int begin = std::clamp(static_cast<int>(std::ceil(center_x - half_chord)),
+                           0, width);
+    while (begin > 0 && inside(begin - 1)) begin--;
+    while (begin < width && !inside(begin)) begin++;
+    int end = std::clamp(
+        static_cast<int>(std::floor(center_x + half_chord)) + 1, begin, width);
+    while (end < width && inside(end)) end++;
+    while (end > begin && !inside(end - 1)) end--;
+    spans_[y] = begin < end ? RowSpan{begin, end} : RowSpan{0, 0};
+    num_pixels_ += spans_[y].end - spans_[y].begin;
+  }
+}
+
+}  // namespace image_processor
@@ -0,0 +1,53 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#ifndef AR_MICROSCOPE_IMAGE_PROCESSOR_FIELD_OF_VIEW_H_
+#define AR_MICROSCOPE_IMAGE_PROCESSOR_FIELD_OF_VIEW_H_
+
+#include <cstdint>
+#include <vector>
+
+namespace image_processor {
+
+// Pixels [begin, end) of a row. Empty if begin == end.
+struct RowSpan {
+  int begin;
+  int end;
+};
+
+// Circular field of view of the eyepiece, centered in an image, as the span of
+// the pixels inside the circle on each row. A pixel is inside if its center is
+// within the radius.
+class FieldOfView {
+ public:
+  FieldOfView(int width, int height, double diameter);
+
+  int GetWidth() const { return width_; }
+  int GetHeight() const { return height_; }
+
+  const RowSpan& GetSpan(int y) const { return spans_[y]; }
+
+  // Returns the number of pixels inside the circle.
+  int64_t GetNumPixels() const { return num_pixels_; }
+
+ private:
+  int width_;
+  int height_;
+  std::vector<RowSpan> spans_;
+  int64_t num_pixels_ = 0;
+};
+
+}  // namespace image_processor
+
+#endif  // AR_MICROSCOPE_IMAGE_PROCESSOR_FIELD_OF_VIEW_H_
@@ -0,0 +1,257 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_processor/flat_field.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include "absl/flags/flag.h"
+#include "absl/strings/str_format.h"
+#include "image_processor/debayer_kernels.h"
+#include "tensorflow/core/lib/core/errors.h"
+
+ABSL_FLAG(std::string, flat_field_dir, "",
+          "Directory of the flat-field calibration files of the objectives. "
+          "No correction is applied if empty.");
+
+namespace image_processor {
+namespace {
+
+constexpr char kMagic[8] = {'A', 'R', 'M', 'F', 'L', 'A', 'T', '\0'};
+constexpr uint32_t kVersion = 1;
+
+static_assert(sizeof(FlatFieldHeader) == 32,
+              "The maps must start at the same offset on every platform.");
+
+// Percentile of the signals of a Bayer color in the flat frames taken as the
+// brightness of the field of view, which a few hot pixels do not raise.
+constexpr double kBrightSignalPercentile = 0.99;
+
+// Fraction of the brightness of the field of view below which pixels are
+// unlit, outside of the field of view.
+constexpr double kMinLitSignalFraction = 0.1;
+
+// Returns the size of the file with the calibration of the dimension.
+size_t GetFileSize(size_t width, size_t height) {
+  return sizeof(FlatFieldHeader) + 2 * width * height * sizeof(uint16_t);
+}
+
+}  // namespace
+
+std::string GetFlatFieldPath(const std::string& directory,
+                             const std::string& objective) {
+  return absl::StrFormat("%s/flat_field_%s.bin", directory, objective);
+}
+
+FlatField::FlatField(void* data, size_t size)
+    : data_(data),
+      size_(size),
+      header_(static_cast<const FlatFieldHeader*>(data)),
+      dark_frame_(reinterpret_cast<const uint16_t*>(header_ + 1)),
+      gain_map_(dark_frame_ + static_cast<size_t>(header_->width) *
+                                  header_->height) {}
+
+FlatField::~FlatField() { munmap(data_, size_); }
+
+tensorflow::Status FlatField::Load(const std::string& path,
+                                   std::unique_ptr<FlatField>* flat_field) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return tensorflow::errors::NotFound(absl::StrFormat(
+        "Failed to open flat-field file %s: %s", path, strerror(errno)));
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 ||
+      file_stat.st_size < static_cast<off_t>(sizeof(FlatFieldHeader))) {
+    close(fd);
+    return tensorflow::errors::InvalidArgument(
+        absl::StrFormat("Invalid flat-field file %s.", path));
+  }
+  const size_t size = file_stat.st_size;
+  // Read the pages in now, rather than on the first frames.
+  void* data =
+      mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return tensorflow::errors::Internal(absl::StrFormat(
+        "Failed to map flat-field file %s: %s", path, strerror(errno)));
+  }
+  const FlatFieldHeader* header = static_cast<const FlatFieldHeader*>(data);
+  if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 ||
+      header->version != kVersion ||
+      (header->bytes_per_pixel != 1 && header->bytes_per_pixel != 2) ||
+      size != GetFileSize(header->width, header->height)) {
+    munmap(data, size);
+    return tensorflow::errors::InvalidArgument(
+        absl::StrFormat("Invalid flat-field file %s.", path));
+  }
+  flat_field->reset(new FlatField(data, size));
+  return tensorflow::Status();
+}
+
+tensorflow::Status FlatField::Create(const cv::Mat& dark_frame,
+                                     const cv::Mat& gain_map,
+                                     int bytes_per_pixel,
+                                     std::unique_ptr<FlatField>* flat_field) {
+  if (dark_frame.type() != CV_16UC1 || gain_map.type() != CV_16UC1 ||
+      dark_frame.size() != gain_map.size() ||
+      (bytes_per_pixel != 1 && bytes_per_pixel != 2)) {
+    return tensorflow::errors::InvalidArgument(
+        "Invalid flat-field calibration.");
+  }
+  const int width = dark_frame.cols;
+  const int height = dark_frame.rows;
+  const size_t size = GetFileSize(width, height);
+  // The calibration has the layout of the file, so that it is released like
+  // a mapped one.
+  void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED) {
+    return tensorflow::errors::ResourceExhausted(absl::StrFormat(
+        "Failed to allocate the flat-field calibration: %s", strerror(errno)));
+  }
+  FlatFieldHeader* header = static_cast<FlatFieldHeader*>(data);
+  memcpy(header->magic, kMagic, sizeof(kMagic));
+  header->version = kVersion;
+  header->width = width;
+  header->height = height;
+  header->bytes_per_pixel = bytes_per_pixel;
+  uint16_t* dark_rows = reinterpret_cast<uint16_t*>(header + 1);
+  uint16_t* gain_rows = dark_rows + static_cast<size_t>(width) * height;
+  for (int y = 0; y < height; y++) {
+    memcpy(dark_rows + static_cast<size_t>(y) * width,
+           dark_frame.ptr<uint16_t>(y), width * sizeof(uint16_t));
+    memcpy(gain_rows + static_cast<size_t>(y) * width,
+           gain_map.ptr<uint16_t>(y), width * sizeof(uint16_t));
+  }
+  flat_field->reset(new FlatField(data, size));
+  return tensorflow::Status();
+}
+
+cv::Mat FlatField::GetDarkFrame() const {
+  return cv::Mat(GetHeight(), GetWidth(), CV_16UC1,
+                 const_cast<uint16_t*>(dark_frame_));
+}
+
+cv::Mat FlatField::GetGainMap() const {
+  return cv::Mat(GetHeight(), GetWidth(), CV_16UC1,
+                 const_cast<uint16_t*>(gain_map_));
+}
+
+tensorflow::Status FlatFieldCalibrator::Save(const std::string& path) const {
+  TF_RETURN_IF_ERROR(frames_.CheckComplete());
+  const int width = frames_.GetWidth();
+  const int height = frames_.GetHeight();
+  const std::vector<uint32_t>& dark_sums = frames_.GetDarkSums();
+  const std::vector<uint32_t>& flat_sums = frames_.GetFlatSums();
+  const int num_dark_frames = frames_.GetNumDarkFrames();
+  const int num_flat_frames = frames_.GetNumFlatFrames();
+  const size_t num_pixels = static_cast<size_t>(width) * height;
+  std::vector<uint16_t> dark_frame(num_pixels);
+  std::vector<double> signals(num_pixels);
+  // Signals at each position of the 2x2 Bayer tile, which is a single color.
+  std::vector<double> tile_signals[2][2];
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      const size_t i = static_cast<size_t>(y) * width + x;
+      dark_frame[i] = static_cast<uint16_t>(
+          (dark_sums[i] + num_dark_frames / 2) / num_dark_frames);
+      signals[i] = std::max(
+          static_cast<double>(flat_sums[i]) / num_flat_frames -
+              dark_frame[i],
+          0.0);
+      tile_signals[y & 1][x & 1].push_back(signals[i]);
+    }
+  }
+  // The sensor corners outside the circular field of view are unlit, and must
+  // not darken the mean that the lit pixels are brought to.
+  double min_lit_signals[2][2] = {};
+  for (int tile_y = 0; tile_y < 2; tile_y++) {
+    for (int tile_x = 0; tile_x < 2; tile_x++) {
+      std::vector<double>& values = tile_signals[tile_y][tile_x];
+      if (values.empty()) continue;
+      const auto bright = values.begin() + static_cast<size_t>(
+                              (values.size() - 1) * kBrightSignalPercentile);
+      std::nth_element(values.begin(), bright, values.end());
+      min_lit_signals[tile_y][tile_x] = *bright * kMinLitSignalFraction;
+    }
+  }
+  // Dead and unlit pixels have no signal to correct.
+  const auto is_lit = [&min_lit_signals](int y, int x, double signal) {
+    return signal > 0 && signal >= min_lit_signals[y & 1][x & 1];
+  };
+  double tile_sums[2][2] = {};
+  int tile_counts[2][2] = {};
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      const double signal = signals[static_cast<size_t>(y) * width + x];
+      if (is_lit(y, x, signal)) {
+        tile_sums[y & 1][x & 1] += signal;
+        tile_counts[y & 1][x & 1]++;
+      }
+    }
+  }
+  std::vector<uint16_t> gain_map(num_pixels);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      const size_t i = static_cast<size_t>(y) * width + x;
+      if (!is_lit(y, x, signals[i])) {
+        gain_map[i] = kUnitGain;
+        continue;
+      }
+      const double mean =
+          tile_sums[y & 1][x & 1] / tile_counts[y & 1][x & 1];
+      gain_map[i] = ToFixedPointGain(mean / signals[i]);
+    }
+  }
+
+  FlatFieldHeader header = {};
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.width = width;
+  header.height = height;
+  header.bytes_per_pixel = frames_.GetBytesPerPixel();
+  // Write a temporary file and rename it, so that a running app never maps a
+  // partial file.
+  const std::string temporary_path = path + ".tmp";
+  {
+    std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(dark_frame.data()),
+               num_pixels * sizeof(uint16_t));
+    file.write(reinterpret_cast<const char*>(gain_map.data()),
+               num_pixels * sizeof(uint16_t));
+    file.close();
+    if (!file) {
+      return tensorflow::errors::Internal(absl::StrFormat(
+          "Failed to write flat-field file %s.", temporary_path));
+    }
+  }
+  if (std::rename(temporary_path.c_str(), path.c_str()) != 0) {
+    return tensorflow::errors::Internal(absl::StrFormat(
+        "Failed to rename flat-field file to %s: %s", path, strerror(errno)));
+  }
+  return tensorflow::Status();
+}
+
+}  // namespace image_processor
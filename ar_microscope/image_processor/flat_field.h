@@ -0,0 +1,135 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+// Flat-field and dark-frame calibration of the raw Bayer images. Vignetting of
+// the optics darkens the edge of the field of view, and the dark current of
+// the sensor adds an offset that varies per pixel. Each Bayer value is
+// corrected as (value - dark) * gain before debayer.
+//
+// The calibration of an objective is stored in a binary file, which is
+// memory-mapped so that loading costs no computation:
+//   FlatFieldHeader, 32 bytes.
+//   Dark frame, width * height uint16 values in the range of the Bayer pixels.
+//   Gain map, width * height uint16 values in the fixed-point format of
+//     ToFixedPointGain.
+// All values are little-endian.
+
+#ifndef AR_MICROSCOPE_IMAGE_PROCESSOR_FLAT_FIELD_H_
+#define AR_MICROSCOPE_IMAGE_PROCESSOR_FLAT_FIELD_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "opencv2/core.hpp"
+#include "image_processor/calibration_frames.h"
+#include "tensorflow/core/lib/core/status.h"
+
+namespace image_processor {
+
+struct FlatFieldHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  // Bytes per Bayer pixel of the calibrated sensor, 1 or 2.
+  uint32_t bytes_per_pixel;
+  uint32_t reserved[2];
+};
+
+// Returns the path of the calibration file of the objective, e.g. "10x", in
+// the directory.
+std::string GetFlatFieldPath(const std::string& directory,
+                             const std::string& objective);
+
+// Calibration of an objective, mapped from its file.
+class FlatField {
+ public:
+  ~FlatField();
+
+  FlatField(const FlatField&) = delete;
+  FlatField& operator=(const FlatField&) = delete;
+
+  // Maps the calibration file.
+  static tensorflow::Status Load(const std::string& path,
+                                 std::unique_ptr<FlatField>* flat_field);
+
+  // Creates the calibration of the CV_16UC1 dark frame and gain map of the
+  // same size, e.g. those of a readout mode derived from the calibration of
+  // the whole sensor.
+  static tensorflow::Status Create(const cv::Mat& dark_frame,
+                                   const cv::Mat& gain_map,
+                                   int bytes_per_pixel,
+                                   std::unique_ptr<FlatField>* flat_field);
+
+  int GetWidth() const { return header_->width; }
+  int GetHeight() const { return header_->height; }
+  int GetBytesPerPixel() const { return header_->bytes_per_pixel; }
+
+  // Returns the dark frame values of the Bayer row.
+  const uint16_t* GetDarkRow(int y) const {
+    return dark_frame_ + static_cast<size_t>(y) * header_->width;
+  }
+
+  // Returns the fixed-point gains of the Bayer row.
+  const uint16_t* GetGainRow(int y) const {
+    return gain_map_ + static_cast<size_t>(y) * header_->width;
+  }
+
+  // Returns the dark frame and the gain map as CV_16UC1 images, which are
+  // read-only views of the calibration.
+  cv::Mat GetDarkFrame() const;
+  cv::Mat GetGainMap() const;
+
+ private:
+  FlatField(void* data, size_t size);
+
+  void* data_;
+  size_t size_;
+  const FlatFieldHeader* header_;
+  const uint16_t* dark_frame_;
+  const uint16_t* gain_map_;
+};
+
+// Averages raw Bayer frames captured without light and of a blank slide, and
+// writes the calibration file.
+class FlatFieldCalibrator {
+ public:
+  // Adds a raw Bayer frame captured with the light path blocked.
+  tensorflow::Status AddDarkFrame(const cv::Mat& bayer_image) {
+    return frames_.AddDarkFrame(bayer_image);
+  }
+
+  // Adds a raw Bayer frame of a blank area of a slide, with the exposure used
+  // for inference.
+  tensorflow::Status AddFlatFrame(const cv::Mat& bayer_image) {
+    return frames_.AddFlatFrame(bayer_image);
+  }
+
+  // Writes the calibration file. The gains bring every lit pixel to the mean
+  // of the lit pixels of its Bayer color, so that the white balance is kept.
+  // Pixels far darker than the field of view, like the sensor corners outside
+  // of it, are unlit and keep the unit gain. Needs at least one frame of each
+  // kind. The file is replaced atomically.
+  tensorflow::Status Save(const std::string& path) const;
+
+ private:
+  CalibrationFrames frames_;
+};
+
+}  // namespace image_processor
+
+#endif  // AR_MICROSCOPE_IMAGE_PROCESSOR_FLAT_FIELD_H_
@@ -0,0 +1,290 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_processor/flat_field.h"
+
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "opencv2/core.hpp"
+#include "image_processor/debayer.h"
+#include "image_processor/debayer_kernels.h"
+#include "tensorflow/core/lib/core/status.h"
+
+namespace {
+
+using image_processor::BayerPattern;
+using image_processor::CorrectFlatFieldRowScalar;
+using image_processor::Debayer;
+using image_processor::DebayerMode;
+using image_processor::FlatField;
+using image_processor::FlatFieldCalibrator;
+using image_processor::FlatFieldRowKernel;
+using image_processor::GetVectorFlatFieldRowKernel;
+using image_processor::kUnitGain;
+
+using ::testing::ElementsAreArray;
+using ::testing::Eq;
+
+constexpr int kWidth = 40;
+constexpr int kHeight = 6;
+constexpr int kDark = 300;
+
+std::string GetTestPath(const std::string& name) {
+  return ::testing::TempDir() + "/" + name;
+}
+
+// Bayer image of a blank slide, darker towards the left with a Bayer color
+// pattern, on top of the dark frame.
+cv::Mat MakeFlatFrame() {
+  cv::Mat frame(kHeight, kWidth, CV_16UC1);
+  for (int y = 0; y < kHeight; y++) {
+    for (int x = 0; x < kWidth; x++) {
+      const int color = 1000 * (1 + (y & 1) + 2 * (x & 1));
+      frame.at<uint16_t>(y, x) = kDark + color * (kWidth + x) / (2 * kWidth);
+    }
+  }
+  return frame;
+}
+
+template <typename T>
+void TestVectorKernel() {
+  FlatFieldRowKernel<T> kernel = GetVectorFlatFieldRowKernel<T>();
+  if (!kernel) GTEST_SKIP() << "No vector kernel.";
+  std::mt19937 generator(1);
+  std::uniform_int_distribution<int> distribution(
+      0, std::numeric_limits<T>::max());
+  std::uniform_int_distribution<int> gain_distribution(0, 0xffff);
+  for (int width : {1, 15, 16, 17, 33, 100}) {
+    std::vector<T> input(width);
+    std::vector<uint16_t> dark(width);
+    std::vector<uint16_t> gains(width);
+    for (int x = 0; x < width; x++) {
+      input[x] = distribution(generator);
+      dark[x] = distribution(generator) / 4;
+      gains[x] = gain_distribution(generator);
+    }
+    std::vector<T> expected(width);
+    std::vector<T> output(width);
+    CorrectFlatFieldRowScalar<T>(input.data(), dark.data(), gains.data(),
+                                 width, expected.data());
+    kernel(input.data(), dark.data(), gains.data(), width, output.data());
+    ASSERT_THAT(output, ElementsAreArray(expected)) << width;
+  }
+}
+
+TEST(FlatFieldTest, VectorKernelMatchesScalar8bit) {
+  TestVectorKernel<uint8_t>();
+}
+
+TEST(FlatFieldTest, VectorKernelMatchesScalar16bit) {
+  TestVectorKernel<uint16_t>();
+}
+
+TEST(FlatFieldTest, ScalarKernel) {
+  const uint16_t input[] = {100, 100, 50, 0xffff};
+  const uint16_t dark[] = {20, 20, 60, 0};
+  const uint16_t gains[] = {4096, 6144, 8192, 8192};
+  uint16_t output[4];
+  CorrectFlatFieldRowScalar<uint16_t>(input, dark, gains, 4, output);
+  EXPECT_THAT(output, ElementsAreArray({80, 120, 0, 0xffff}));
+}
+
+TEST(FlatFieldTest, CalibrationFlattensImage) {
+  FlatFieldCalibrator calibrator;
+  const cv::Mat dark_frame(kHeight, kWidth, CV_16UC1, cv::Scalar(kDark));
+  const cv::Mat flat_frame = MakeFlatFrame();
+  for (int i = 0; i < 3; i++) {
+    ASSERT_TRUE(calibrator.AddDarkFrame(dark_frame).ok());
+    ASSERT_TRUE(calibrator.AddFlatFrame(flat_frame).ok());
+  }
+  const std::string path = GetTestPath("flat_field.bin");
+  ASSERT_TRUE(calibrator.Save(path).ok());
+
+  std::unique_ptr<FlatField> flat_field;
+  ASSERT_TRUE(FlatField::Load(path, &flat_field).ok());
+  ASSERT_THAT(flat_field->GetWidth(), Eq(kWidth));
+  ASSERT_THAT(flat_field->GetHeight(), Eq(kHeight));
+  ASSERT_THAT(flat_field->GetBytesPerPixel(), Eq(2));
+
+  Debayer debayer;
+  debayer.SetFlatField(std::move(flat_field));
+  cv::Mat rgb;
+  ASSERT_TRUE(debayer.HalfDebayer(flat_frame, true, &rgb).ok());
+  // Every pixel has the mean of its color, which is kept.
+  for (int y = 0; y < rgb.rows; y++) {
+    for (int x = 0; x < rgb.cols; x++) {
+      const cv::Vec3b& pixel = rgb.at<cv::Vec3b>(y, x);
+      const cv::Vec3b& first_pixel = rgb.at<cv::Vec3b>(0, 0);
+      for (int channel = 0; channel < 3; channel++) {
+        EXPECT_NEAR(pixel[channel], first_pixel[channel], 1) << x << "," << y;
+      }
+    }
+  }
+}
+
+TEST(FlatFieldTest, CalibrationIgnoresUnlitCorners) {
+  // Uniform field of view inscribed in a 4:3 sensor, with a few counts of
+  // noise in the corners.
+  constexpr int kSensorWidth = 64;
+  constexpr int kSensorHeight = 48;
+  cv::Mat flat_frame(kSensorHeight, kSensorWidth, CV_16UC1);
+  std::vector<bool> lit(kSensorWidth * kSensorHeight);
+  for (int y = 0; y < kSensorHeight; y++) {
+    for (int x = 0; x < kSensorWidth; x++) {
+      const int dx = 2 * x + 1 - kSensorWidth;
+      const int dy = 2 * y + 1 - kSensorHeight;
+      const bool is_lit = dx * dx + dy * dy <= kSensorHeight * kSensorHeight;
+      lit[y * kSensorWidth + x] = is_lit;
+      const int color = 1000 * (1 + (y & 1) + 2 * (x & 1));
+      flat_frame.at<uint16_t>(y, x) = kDark + (is_lit ? color : (x + y) % 5);
+    }
+  }
+  FlatFieldCalibrator calibrator;
+  ASSERT_TRUE(calibrator
+                  .AddDarkFrame(cv::Mat(kSensorHeight, kSensorWidth, CV_16UC1,
+                                        cv::Scalar(kDark)))
+                  .ok());
+  ASSERT_TRUE(calibrator.AddFlatFrame(flat_frame).ok());
+  const std::string path = GetTestPath("flat_field_corners.bin");
+  ASSERT_TRUE(calibrator.Save(path).ok());
+  std::unique_ptr<FlatField> flat_field;
+  ASSERT_TRUE(FlatField::Load(path, &flat_field).ok());
+
+  // The field of view is already flat, and the corners are not corrected.
+  for (int y = 0; y < kSensorHeight; y++) {
+    for (int x = 0; x < kSensorWidth; x++) {
+      EXPECT_THAT(flat_field->GetGainRow(y)[x], Eq(kUnitGain))
+          << x << "," << y << (lit[y * kSensorWidth + x] ? " lit" : "");
+    }
+  }
+}
+
+TEST(FlatFieldTest, DebayerMatchesCorrectedInput) {
+  FlatFieldCalibrator calibrator;
+  cv::Mat dark_frame(kHeight, kWidth, CV_16UC1);
+  std::mt19937 generator(2);
+  std::uniform_int_distribution<int> distribution(0, 2000);
+  for (int y = 0; y < kHeight; y++) {
+    for (int x = 0; x < kWidth; x++) {
+      dark_frame.at<uint16_t>(y, x) = distribution(generator);
+    }
+  }
+  ASSERT_TRUE(calibrator.AddDarkFrame(dark_frame).ok());
+  ASSERT_TRUE(calibrator.AddFlatFrame(MakeFlatFrame()).ok());
+  const std::string path = GetTestPath("flat_field_random.bin");
+  ASSERT_TRUE(calibrator.Save(path).ok());
+  std::unique_ptr<FlatField> loaded_flat_field;
+  ASSERT_TRUE(FlatField::Load(path, &loaded_flat_field).ok());
+  const std::shared_ptr<const FlatField> flat_field =
+      std::move(loaded_flat_field);
+
+  cv::Mat bayer(kHeight, kWidth, CV_16UC1);
+  cv::Mat corrected(kHeight, kWidth, CV_16UC1);
+  std::uniform_int_distribution<int> pixel_distribution(0, 0xffff);
+  for (int y = 0; y < kHeight; y++) {
+    for (int x = 0; x < kWidth; x++) {
+      bayer.at<uint16_t>(y, x) = pixel_distribution(generator);
+    }
+    CorrectFlatFieldRowScalar<uint16_t>(
+        bayer.ptr<uint16_t>(y), flat_field->GetDarkRow(y),
+        flat_field->GetGainRow(y), kWidth, corrected.ptr<uint16_t>(y));
+  }
+
+  Debayer debayer;
+  for (DebayerMode mode : {DebayerMode::HALF, DebayerMode::BILINEAR,
+                           DebayerMode::MALVAR_HE_CUTLER}) {
+    cv::Mat expected;
+    debayer.SetFlatField(nullptr);
+    ASSERT_TRUE(
+        debayer.Convert(corrected, BayerPattern::GBRG, mode, true, &expected)
+            .ok());
+    cv::Mat rgb;
+    debayer.SetFlatField(flat_field);
+    ASSERT_TRUE(
+        debayer.Convert(bayer, BayerPattern::GBRG, mode, true, &rgb).ok());
+    ASSERT_THAT(std::vector<uint8_t>(rgb.ptr(), rgb.ptr() + rgb.total() * 3),
+                ElementsAreArray(expected.ptr(),
+                                 expected.ptr() + expected.total() * 3));
+  }
+}
+
+TEST(FlatFieldTest, MismatchedDimension) {
+  FlatFieldCalibrator calibrator;
+  const cv::Mat frame = MakeFlatFrame();
+  ASSERT_TRUE(calibrator.AddDarkFrame(frame).ok());
+  ASSERT_TRUE(calibrator.AddFlatFrame(frame).ok());
+  ASSERT_FALSE(calibrator.AddFlatFrame(cv::Mat(4, 4, CV_16UC1)).ok());
+  const std::string path = GetTestPath("flat_field_mismatch.bin");
+  ASSERT_TRUE(calibrator.Save(path).ok());
+  std::unique_ptr<FlatField> flat_field;
+  ASSERT_TRUE(FlatField::Load(path, &flat_field).ok());
+
+  Debayer debayer;
+  debayer.SetFlatField(std::move(flat_field));
+  cv::Mat rgb;
+  EXPECT_FALSE(debayer.HalfDebayer(cv::Mat(kHeight, kWidth, CV_8UC1), &rgb)
+                   .ok());
+  EXPECT_FALSE(debayer.HalfDebayer(cv::Mat(4, 4, CV_16UC1), &rgb).ok());
+}
+
+TEST(FlatFieldTest, CreateFromMaps) {
+  cv::Mat dark_frame(kHeight, kWidth, CV_16UC1);
+  cv::Mat gain_map(kHeight, kWidth, CV_16UC1);
+  for (int y = 0; y < kHeight; y++) {
+    for (int x = 0; x < kWidth; x++) {
+      dark_frame.at<uint16_t>(y, x) = y * kWidth + x;
+      gain_map.at<uint16_t>(y, x) = 4096 + x;
+    }
+  }
+  std::unique_ptr<FlatField> flat_field;
+  ASSERT_TRUE(FlatField::Create(dark_frame, gain_map, 1, &flat_field).ok());
+  ASSERT_THAT(flat_field->GetWidth(), Eq(kWidth));
+  ASSERT_THAT(flat_field->GetHeight(), Eq(kHeight));
+  ASSERT_THAT(flat_field->GetBytesPerPixel(), Eq(1));
+  for (int y = 0; y < kHeight; y++) {
+    EXPECT_THAT(std::vector<uint16_t>(flat_field->GetDarkRow(y),
+                                      flat_field->GetDarkRow(y) + kWidth),
+                ElementsAreArray(dark_frame.ptr<uint16_t>(y), kWidth));
+    EXPECT_THAT(std::vector<uint16_t>(flat_field->GetGainRow(y),
+                                      flat_field->GetGainRow(y) + kWidth),
+                ElementsAreArray(gain_map.ptr<uint16_t>(y), kWidth));
+  }
+  EXPECT_THAT(cv::countNonZero(flat_field->GetDarkFrame() != dark_frame),
+              Eq(0));
+  EXPECT_THAT(cv::countNonZero(flat_field->GetGainMap() != gain_map), Eq(0));
+
+  EXPECT_FALSE(FlatField::Create(dark_frame, cv::Mat(4, 4, CV_16UC1), 2,
+                                 &flat_field)
+                   .ok());
+  EXPECT_FALSE(
+      FlatField::Create(dark_frame, gain_map, 3, &flat_field).ok());
+}
+
+TEST(FlatFieldTest, InvalidFile) {
+  FlatFieldCalibrator calibrator;
+  EXPECT_FALSE(calibrator.Save(GetTestPath("flat_field_empty.bin")).ok());
+  std::unique_ptr<FlatField> flat_field;
+  EXPECT_FALSE(
+      FlatField::Load(GetTestPath("flat_field_missing.bin"), &flat_field)
+          .ok());
+}
+
+}  // namespace
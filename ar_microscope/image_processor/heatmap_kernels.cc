@@ -0,0 +1,256 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_processor/heatmap_kernels.h"
+
+#include <cstdint>
+
+#include "image_processor/cpu_features.h"
+
+namespace image_processor {
+namespace {
+
+#ifdef KERNELS_HAVE_AVX2
+
+// Number of pixels of one iteration of the AVX2 kernels of 2 and 4 classes.
+constexpr int kAvx2Pixels = 32;
+
+// Returns the class mask as maddubs weights, 1 for the summed classes and 0
+// for the others, repeated for each pixel of 4 bytes.
+inline uint32_t GetClassWeights(const uint8_t* class_mask, int num_classes) {
+  uint32_t weights = 0;
+  for (int i = 0; i < 4; i++) {
+    weights |= (class_mask[i % num_classes] & 1u) << (8 * i);
+  }
+  return weights;
+}
+
+// Kernel for 2 classes. maddubs sums the weighted classes of each pixel to 16
+// bits, and the low bytes of the sums are packed.
+KERNELS_TARGET_AVX2 void SumTwoClassesAvx2(const uint8_t* output,
+                                           int num_pixels, int num_classes,
+                                           const uint8_t* class_mask,
+                                           uint8_t* heatmap) {
+  const __m256i weights =
+      _mm256_set1_epi32(GetClassWeights(class_mask, num_classes));
+  const __m256i low_bytes = _mm256_set1_epi16(0xff);
+  const int vector_pixels = num_pixels / kAvx2Pixels * kAvx2Pixels;
+  for (int i = 0; i < vector_pixels; i += kAvx2Pixels) {
+    const __m256i* pixels = reinterpret_cast<const __m256i*>(output + i * 2);
+    const __m256i sums0 = _mm256_and_si256(
+        _mm256_maddubs_epi16(_mm256_loadu_si256(pixels), weights), low_bytes);
+    const __m256i sums1 = _mm256_and_si256(
+        _mm256_maddubs_epi16(_mm256_loadu_si256(pixels + 1), weights),
+        low_bytes);
+    // packus interleaves the 128-bit lanes of its inputs.
+    const __m256i sums = _mm256_permute4x64_epi64(
+        _mm256_packus_epi16(sums0, sums1), _MM_SHUFFLE(3, 1, 2, 0));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(heatmap + i), sums);
+  }
+  SumClassesScalar(output + vector_pixels * 2, num_pixels - vector_pixels,
+                   num_classes, class_mask, heatmap + vector_pixels);
+}
+
+// Kernel for 4 classes. maddubs sums the weighted pairs of classes to 16 bits,
+// madd sums the pairs of each pixel to 32 bits, and the low bytes of the sums
+// are packed.
+KERNELS_TARGET_AVX2 void SumFourClassesAvx2(const uint8_t* output,
+                                            int num_pixels, int num_classes,
+                                            const uint8_t* class_mask,
+                                            uint8_t* heatmap) {
+  const __m256i weights =
+      _mm256_set1_epi32(GetClassWeights(class_mask, num_classes));
+  const __m256i ones = _mm256_set1_epi16(1);
+  const __m256i low_bytes = _mm256_set1_epi16(0xff);
+  // packs and packus interleave the 128-bit lanes of their inputs, so the
+  // groups of 4 pixels are in the order 0, 2, 4, 6, 1, 3, 5, 7.
+  const __m256i pixel_order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  const int vector_pixels = num_pixels / kAvx2Pixels * kAvx2Pixels;
+  for (int i = 0; i < vector_pixels; i += kAvx2Pixels) {
+    const __m256i* pixels = reinterpret_cast<const __m256i*>(output + i * 4);
+    __m256i sums[4];
+    for (int j = 0; j < 4; j++) {
+      sums[j] = _mm256_madd_epi16(
+          _mm256_maddubs_epi16(_mm256_loadu_si256(pixels + j), weights), ones);
+    }
+    const __m256i sums01 =
+        _mm256_and_si256(_mm256_packs_epi32(sums[0], sums[1]), low_bytes);
+    const __m256i sums23 =
+        _mm256_and_si256(_mm256_packs_epi32(sums[2], sums[3]), low_bytes);
+    const __m256i packed = _mm256_permutevar8x32_epi32(
+        _mm256_packus_epi16(sums01, sums23), pixel_order);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(heatmap + i), packed);
+  }
+  SumClassesScalar(output + vector_pixels * 4, num_pixels - vector_pixels,
+                   num_classes, class_mask, heatmap + vector_pixels);
+}
+
+// Number of pixels of one iteration of the AVX2 kernel of 3 classes.
+constexpr int kThreeClassPixels = 16;
+
+// Shuffle controls to gather the values of each class of 16 pixels from the
+// 3 vectors of their 48 bytes. Bytes of the other vectors are zeroed.
+struct ThreeClassShuffles {
+  // Indexed by class, then by vector.
+  alignas(16) int8_t controls[3][3][kThreeClassPixels];
+};
+
+const ThreeClassShuffles& GetThreeClassShuffles() {
+  static const ThreeClassShuffles* shuffles = [] {
+    auto* shuffles = new ThreeClassShuffles;
+    for (int c = 0; c < 3; c++) {
+      for (int v = 0; v < 3; v++) {
+        for (int i = 0; i < kThreeClassPixels; i++) {
+          const int byte = 3 * i + c - kThreeClassPixels * v;
+          shuffles->controls[c][v][i] =
+              byte >= 0 && byte < kThreeClassPixels ? byte : -128;
+        }
+      }
+    }
+    return shuffles;
+  }();
+  return *shuffles;
+}
+
+// Kernel for 3 classes, whose values don't align with pairs of bytes. The
+// classes are gathered into planes, and the masked planes are added.
+KERNELS_TARGET_AVX2 void SumThreeClassesAvx2(const uint8_t* output,
+                                             int num_pixels, int num_classes,
+                                             const uint8_t* class_mask,
+                                             uint8_t* heatmap) {
+  const ThreeClassShuffles& shuffles = GetThreeClassShuffles();
+  __m128i controls[3][3];
+  __m128i masks[3];
+  for (int c = 0; c < 3; c++) {
+    for (int v = 0; v < 3; v++) {
+      controls[c][v] = _mm_load_si128(
+          reinterpret_cast<const __m128i*>(shuffles.controls[c][v]));
+    }
+    masks[c] = _mm_set1_epi8(class_mask[c]);
+  }
+  const int vector_pixels =
+      num_pixels / kThreeClassPixels * kThreeClassPixels;
+  for (int i = 0; i < vector_pixels; i += kThreeClassPixels) {
+    const __m128i* pixels = reinterpret_cast<const __m128i*>(output + i * 3);
+    const __m128i vectors[3] = {_mm_loadu_si128(pixels),
+                                _mm_loadu_si128(pixels + 1),
+                                _mm_loadu_si128(pixels + 2)};
+    __m128i sums = _mm_setzero_si128();
+    for (int c = 0; c < 3; c++) {
+      const __m128i plane = _mm_or_si128(
+          _mm_or_si128(_mm_shuffle_epi8(vectors[0], controls[c][0]),
+                       _mm_shuffle_epi8(vectors[1], controls[c][1])),
+          _mm_shuffle_epi8(vectors[2], controls[c][2]));
+      sums = _mm_add_epi8(sums, _mm_and_si128(plane, masks[c]));
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(heatmap + i), sums);
+  }
+  SumClassesScalar(output + vector_pixels * 3, num_pixels - vector_pixels,
+                   num_classes, class_mask, heatmap + vector_pixels);
+}
+
+#endif  // KERNELS_HAVE_AVX2
+
+#ifdef KERNELS_HAVE_NEON
+
+// Number of pixels of one iteration of the NEON kernels.
+constexpr int kNeonPixels = 16;
+
+// Kernel for 2 to 4 classes. The structured loads gather the values of each
+// class, and the masked classes are added.
+template <int kNumClasses>
+void SumClassesNeon(const uint8_t* output, int num_pixels, int num_classes,
+                    const uint8_t* class_mask, uint8_t* heatmap) {
+  uint8x16_t masks[kNumClasses];
+  for (int c = 0; c < kNumClasses; c++) {
+    masks[c] = vdupq_n_u8(class_mask[c]);
+  }
+  const int vector_pixels = num_pixels / kNeonPixels * kNeonPixels;
+  for (int i = 0; i < vector_pixels; i += kNeonPixels) {
+    const uint8_t* pixels = output + i * kNumClasses;
+    uint8x16_t classes[kNumClasses];
+    if constexpr (kNumClasses == 2) {
+      const uint8x16x2_t values = vld2q_u8(pixels);
+      classes[0] = values.val[0];
+      classes[1] = values.val[1];
+    } else if constexpr (kNumClasses == 3) {
+      const uint8x16x3_t values = vld3q_u8(pixels);
+      classes[0] = values.val[0];
+      classes[1] = values.val[1];
+      classes[2] = values.val[2];
+    } else {
+      const uint8x16x4_t values = vld4q_u8(pixels);
+      classes[0] = values.val[0];
+      classes[1] = values.val[1];
+      classes[2] = values.val[2];
+      classes[3] = values.val[3];
+    }
+    uint8x16_t sums = vandq_u8(classes[0], masks[0]);
+    for (int c = 1; c < kNumClasses; c++) {
+      sums = vaddq_u8(sums, vandq_u8(classes[c], masks[c]));
+    }
+    vst1q_u8(heatmap + i, sums);
+  }
+  SumClassesScalar(output + vector_pixels * kNumClasses,
+                   num_pixels - vector_pixels, num_classes, class_mask,
+                   heatmap + vector_pixels);
+}
+
+#endif  // KERNELS_HAVE_NEON
+
+}  // namespace
+
+void SumClassesScalar(const uint8_t* output, int num_pixels, int num_classes,
+                      const uint8_t* class_mask, uint8_t* heatmap) {
+  for (int i = 0; i < num_pixels; i++) {
+    const uint8_t* classes = output + i * num_classes;
+    uint8_t sum = 0;
+    for (int c = 0; c < num_classes; c++) {
+      sum += classes[c] & class_mask[c];
+    }
+    heatmap[i] = sum;
+  }
+}
+
+SumClassesKernel GetVectorSumClassesKernel(int num_classes) {
+#if defined(KERNELS_HAVE_AVX2)
+  static const bool supports_avx2 = CpuSupportsAvx2();
+  if (!supports_avx2) return nullptr;
+  switch (num_classes) {
+    case 2:
+      return &SumTwoClassesAvx2;
+    case 3:
+      return &SumThreeClassesAvx2;
+    case 4:
+      return &SumFourClassesAvx2;
+    default:
+      return nullptr;
+  }
+#elif defined(KERNELS_HAVE_NEON)
+  switch (num_classes) {
+    case 2:
+      return &SumClassesNeon<2>;
+    case 3:
+      return &SumClassesNeon<3>;
+    case 4:
+      return &SumClassesNeon<4>;
+    default:
+      return nullptr;
+  }
+#else
+  return nullptr;
+#endif
+}
+
+}  // namespace image_processor
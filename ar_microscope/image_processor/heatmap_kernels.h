@@ -0,0 +1,60 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+// Kernels to make the heatmap from the inference output. The scalar kernel is
+// the reference implementation, and the vector kernels (AVX2 on x86, NEON on
+// ARM) must produce bit-exact results with it.
+
+#ifndef AR_MICROSCOPE_IMAGE_PROCESSOR_HEATMAP_KERNELS_H_
+#define AR_MICROSCOPE_IMAGE_PROCESSOR_HEATMAP_KERNELS_H_
+
+#include <cstdint>
+
+namespace image_processor {
+
+// Value of a class in a class mask, if the class is summed into the heatmap.
+// The other classes are 0.
+constexpr uint8_t kSummedClass = 0xff;
+
+// Kernel to sum the classes of the inference output selected by a dense
+// class mask: heatmap[i] is the sum of output[i * num_classes + c] for the
+// classes c whose class_mask[c] is kSummedClass, modulo 256.
+//
+// Args:
+//   output: Inference output, num_classes interleaved values per pixel.
+//   num_pixels: Number of pixels.
+//   num_classes: Number of classes of the output.
+//   class_mask: num_classes values, kSummedClass or 0.
+//   heatmap: num_pixels values.
+using SumClassesKernel = void (*)(const uint8_t* output, int num_pixels,
+                                  int num_classes, const uint8_t* class_mask,
+                                  uint8_t* heatmap);
+
+void SumClassesScalar(const uint8_t* output, int num_pixels, int num_classes,
+                      const uint8_t* class_mask, uint8_t* heatmap);
+
+// Returns the vector kernel for outputs of num_classes classes supported by
+// the running CPU, or nullptr if there is none.
+SumClassesKernel GetVectorSumClassesKernel(int num_classes);
+
+// Returns the fastest kernel for outputs of num_classes classes supported by
+// the running CPU.
+inline SumClassesKernel GetSumClassesKernel(int num_classes) {
+  SumClassesKernel kernel = GetVectorSumClassesKernel(num_classes);
+  return kernel ? kernel : &SumClassesScalar;
+}
+
+}  // namespace image_processor
+
+#endif  // AR_MICROSCOPE_IMAGE_PROCESSOR_HEATMAP_KERNELS_H_
@@ -0,0 +1,80 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_processor/heatmap_kernels.h"
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+using image_processor::GetVectorSumClassesKernel;
+using image_processor::kSummedClass;
+using image_processor::SumClassesKernel;
+using image_processor::SumClassesScalar;
+
+using ::testing::ElementsAre;
+using ::testing::ElementsAreArray;
+
+TEST(HeatmapKernelsTest, ScalarSumsMaskedClasses) {
+  const std::vector<uint8_t> output = {10, 20, 30, 40, 50, 60};
+  const std::vector<uint8_t> class_mask = {0, kSummedClass, kSummedClass};
+  std::vector<uint8_t> heatmap(2);
+  SumClassesScalar(output.data(), 2, 3, class_mask.data(), heatmap.data());
+  EXPECT_THAT(heatmap, ElementsAre(50, 110));
+}
+
+TEST(HeatmapKernelsTest, ScalarSumWrapsAround) {
+  const std::vector<uint8_t> output = {200, 100};
+  const std::vector<uint8_t> class_mask = {kSummedClass, kSummedClass};
+  std::vector<uint8_t> heatmap(1);
+  SumClassesScalar(output.data(), 1, 2, class_mask.data(), heatmap.data());
+  EXPECT_THAT(heatmap, ElementsAre(44));
+}
+
+TEST(HeatmapKernelsTest, VectorKernelsMatchScalar) {
+  std::mt19937 random(1);
+  std::uniform_int_distribution<int> distribution(0, 255);
+  for (int num_classes = 1; num_classes <= 5; num_classes++) {
+    SCOPED_TRACE(num_classes);
+    const SumClassesKernel vector_kernel =
+        GetVectorSumClassesKernel(num_classes);
+    if (!vector_kernel) continue;
+    // Cover every class mask, and sizes with and without a scalar tail.
+    for (int mask_bits = 0; mask_bits < (1 << num_classes); mask_bits++) {
+      std::vector<uint8_t> class_mask(num_classes);
+      for (int c = 0; c < num_classes; c++) {
+        class_mask[c] = (mask_bits >> c) & 1 ? kSummedClass : 0;
+      }
+      for (int num_pixels = 0; num_pixels <= 100; num_pixels++) {
+        std::vector<uint8_t> output(num_pixels * num_classes);
+        for (uint8_t& value : output) value = distribution(random);
+        std::vector<uint8_t> expected(num_pixels);
+        SumClassesScalar(output.data(), num_pixels, num_classes,
+                         class_mask.data(), expected.data());
+        std::vector<uint8_t> actual(num_pixels);
+        vector_kernel(output.data(), num_pixels, num_classes,
+                      class_mask.data(), actual.data());
+        ASSERT_THAT(actual, ElementsAreArray(expected))
+            << "Mask " << mask_bits << ", " << num_pixels << " pixels";
+      }
+    }
+  }
+}
+
+}  // namespace
@@ -16,11 +16,13 @@
 
 #include <memory>
 #include <string>
+#include <utility>
 
 #include "opencv2/imgproc.hpp"
 #include "absl/container/flat_hash_map.h"
 #include "absl/container/flat_hash_set.h"
 #include "absl/memory/memory.h"
+#include "image_processor/heatmap_kernels.h"
 
 namespace image_processor {
 namespace {
@@ -151,16 +153,118 @@ absl::flat_hash_set<int> Inferer::GetOutputClassesForHeatmap(
 void Inferer::SetPositiveGleasonClasses(
     const absl::flat_hash_set<GleasonClasses>& positive_gleason_classes) {
   positive_gleason_classes_ = positive_gleason_classes;
+  positive_classes_version_++;
   LOG(INFO) << "Updated gleason classes.";
 }
 
 void Inferer::SetPositiveCervicalClasses(
     const absl::flat_hash_set<CervicalClasses>& positive_cervical_classes) {
   positive_cervical_classes_ = positive_cervical_classes;
+  positive_classes_version_++;
   LOG(INFO) << "Updated cervical classes.";
 }
 
+PreviewProvider Inferer::GetPreviewProvider() {
+  return [this](std::shared_ptr<const InputOutputBuffers>* frame) {
+    absl::MutexLock unused_lock(&tensor_mutex_);
+    if (!latest_ || !latest_->input_image) {
+      return tensorflow::errors::NotFound("Preview image not yet ready");
+    }
+    *frame = latest_;
+    return tensorflow::Status();
+  };
+}
+
+void Inferer::MaybeTakeBuffers() {
+  if (current_) return;
+  {
+    absl::MutexLock unused_lock(&buffer_pool_->mutex);
+    auto& buffers = buffer_pool_->buffers;
+    while (!current_ && !buffers.empty()) {
+      std::unique_ptr<InputOutputBuffers> pooled_buffers =
+          std::move(buffers.back());
+      buffers.pop_back();
+      if (pooled_buffers->patch_size == patch_size_) {
+        current_ = std::move(pooled_buffers);
+      }
+    }
+  }
+  if (!current_) {
+    current_ = CreateBuffers();
+    current_->CreateTensor(patch_size_);
+  }
+}
+
+void Inferer::UseImageBuffer(cv::Mat* image) {
+  if (current_ && current_->input_image &&
+      current_->input_image->data == image->data) {
+    return;
+  }
+  if (current_) lent_buffers_.push_back(std::move(current_));
+  std::unique_ptr<InputOutputBuffers> returned_buffers;
+  for (auto it = lent_buffers_.begin(); it != lent_buffers_.end(); ++it) {
+    if ((*it)->input_image->data == image->data) {
+      returned_buffers = std::move(*it);
+      lent_buffers_.erase(it);
+      break;
+    }
+  }
+  if (returned_buffers && returned_buffers->patch_size == patch_size_) {
+    current_ = std::move(returned_buffers);
+  } else {
+    // The first images of a capture, and those in buffers of the previous
+    // patch size, are copied to new buffers.
+    cv::Mat input_image = GetImageBuffer(image->cols, image->rows);
+    image->copyTo(input_image);
+  }
+  while (lent_buffers_.size() > kMaxLentBuffers) {
+    lent_buffers_.pop_front();
+  }
+  *image = *current_->input_image;
+}
+
+std::shared_ptr<const InputOutputBuffers> Inferer::PublishCurrentFrame() {
+  std::weak_ptr<InputOutputBufferPool> weak_pool = buffer_pool_;
+  std::shared_ptr<const InputOutputBuffers> frame(
+      current_.release(), [weak_pool](InputOutputBuffers* buffers) {
+        std::unique_ptr<InputOutputBuffers> released_buffers(buffers);
+        if (auto pool = weak_pool.lock()) {
+          absl::MutexLock unused_lock(&pool->mutex);
+          pool->buffers.push_back(std::move(released_buffers));
+        }
+      });
+  VLOG(1) << "Publishing frame";
+  std::shared_ptr<const InputOutputBuffers> previous_frame = frame;
+  {
+    absl::MutexLock unused_lock(&tensor_mutex_);
+    latest_.swap(previous_frame);
+  }
+  // The previous frame is released after the lock.
+  return frame;
+}
+
+void Inferer::MaybeUpdateClassMask(int num_classes) {
+  const int positive_classes_version = positive_classes_version_.load();
+  if (static_cast<int>(class_mask_.size()) == num_classes &&
+      class_mask_model_type_ == model_type_ &&
+      class_mask_version_ == positive_classes_version) {
+    return;
+  }
+  class_mask_.assign(num_classes, 0);
+  for (const int output_class : GetOutputClassesForHeatmap(model_type_)) {
+    if (output_class < num_classes) class_mask_[output_class] = kSummedClass;
+  }
+  class_mask_model_type_ = model_type_;
+  class_mask_version_ = positive_classes_version;
+}
+
+cv::Mat* GetReusableMat(std::unique_ptr<cv::Mat>* mat) {
+  if (!*mat) *mat = std::make_unique<cv::Mat>();
+  return mat->get();
+}
+
 void InputOutputBuffers::CreateTensor(int patch_size) {
+  this->patch_size = patch_size;
   input_as_matrix = std::make_unique<cv::Mat>(patch_size, patch_size, CV_8UC3);
   // This is needed to avoid a dangling pointer to the old input_as_matrix.
   input_image = nullptr;
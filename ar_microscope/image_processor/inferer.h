@@ -17,19 +17,31 @@
 #ifndef AR_MICROSCOPE_IMAGE_PROCESSOR_INFERER_H_
 #define AR_MICROSCOPE_IMAGE_PROCESSOR_INFERER_H_
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
 #include <functional>
 #include <memory>
 #include <unordered_set>
+#include <vector>
 
 #include "opencv2/core.hpp"
 #include "absl/container/flat_hash_set.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "tensorflow/core/lib/core/errors.h"
 #include "tensorflow/core/lib/core/status.h"
 
 namespace image_processor {
 
-using PreviewProvider =
-    std::function<tensorflow::Status(cv::Mat*, cv::Mat*, cv::Mat*)>;
+struct InputOutputBuffers;
+
+// Function to provide the latest inferred frame: the input image, and the
+// heatmap and output tensor inferred from it. Frames are never written once
+// provided, so they are shared with the inferer rather than copied.
+using PreviewProvider = std::function<tensorflow::Status(
+    std::shared_ptr<const InputOutputBuffers>* frame)>;
 
 enum class ObjectiveLensPower {
   UNSPECIFIED_OBJECTIVE_LENS_POWER,
@@ -85,7 +97,8 @@ enum class CervicalClasses : int {
   CIN_2_PLUS = 2,
 };
 
-// Input and output data buffers for inference.
+// Input and output data buffers for inference. Once inferred, the buffers are
+// shared as an immutable frame.
 struct InputOutputBuffers {
   virtual ~InputOutputBuffers() {}
 
@@ -102,6 +115,9 @@ struct InputOutputBuffers {
   // Matrix that represents the whole input_tensor area.
   std::unique_ptr<cv::Mat> input_as_matrix;
 
+  // Patch size of input_as_matrix.
+  int patch_size = 0;
+
   void CreateInputImage(const cv::Rect& roi);
 
   // Helper hook that child classes can use to update temporary buffers
@@ -109,27 +125,60 @@ struct InputOutputBuffers {
   virtual void CreateTensor(int patch_size);
 };
 
+// Buffers of the frames that no reader references anymore, to reuse for the
+// next frames.
+struct InputOutputBufferPool {
+  absl::Mutex mutex;
+  std::vector<std::unique_ptr<InputOutputBuffers>> buffers
+      ABSL_GUARDED_BY(mutex);
+};
+
+// Returns the Mat, created on first use, so that the buffers of the heatmaps
+// are allocated once and reused by the next frames of the same size.
+cv::Mat* GetReusableMat(std::unique_ptr<cv::Mat>* mat);
+
 class Inferer {
  public:
-  Inferer() {}
+  Inferer() : buffer_pool_(std::make_shared<InputOutputBufferPool>()) {}
   virtual ~Inferer() {}
   virtual tensorflow::Status Initialize(ObjectiveLensPower objective,
                                         ModelType model_type) = 0;
 
   virtual cv::Mat GetImageBuffer(int width, int height) = 0;
 
+  // Makes the image the input of the current frame, and points image to the
+  // input. The asynchronous capture returns the image in another buffer than
+  // the one of GetImageBuffer, which it keeps to capture a later image into.
+  // The inferer keeps the buffers of that buffer until the captor returns it
+  // again, so that only the images in buffers of the captor are copied.
+  virtual void UseImageBuffer(cv::Mat* image);
+
   virtual tensorflow::Status ProcessImage(cv::Mat* output) = 0;
+
+  // Takes the output of the last ProcessImage as the output of the current
+  // image, without inference, for images that did not change. The preview
+  // shows the current image with it.
+  virtual tensorflow::Status ReuseLastOutput(cv::Mat* output) {
+    return tensorflow::errors::Unimplemented("Output reuse not supported.");
+  }
   virtual tensorflow::Status LoadModel(ObjectiveLensPower power,
                                        ModelType model_type) = 0;
 
+  // Returns the time spent on the warm-up inferences of the current model,
+  // which run when the model first becomes current, or zero if it was not
+  // warmed up.
+  virtual absl::Duration GetModelWarmUpDuration() const {
+    return absl::ZeroDuration();
+  }
+
   // Returns PreviewProvider function, which returns the latest preview
   // upon request.
-  virtual PreviewProvider GetPreviewProvider() = 0;
+  virtual PreviewProvider GetPreviewProvider();
 
-  void SetPositiveGleasonClasses(
+  virtual void SetPositiveGleasonClasses(
       const absl::flat_hash_set<GleasonClasses>& positive_gleason_classes);
 
-  void SetPositiveCervicalClasses(
+  virtual void SetPositiveCervicalClasses(
       const absl::flat_hash_set<CervicalClasses>& positive_cervical_classes);
 
  protected:
@@ -139,16 +188,49 @@ class Inferer {
   // highlighted in the heatmap.
   absl::flat_hash_set<int> GetOutputClassesForHeatmap(ModelType model_type);
 
-  // Input tensor, cv::Mat of input image as view of the tensor's part,
-  // and output heatmap. We keep 3 sets of these to minimize lock for preview.
-  // We have 2 threads, TensorFlow inference thread and preview thread.
-  // Inference thread swaps "current" with "previous" when the inference is
-  // finished. Preview thread swaps "previous" with "preview" and work on
-  // "preview". In this way, inference thread can work on "current" and preview
-  // thread can work on "preview" concurrently without waiting for the lock.
-  // The only lock we have is for swapping the data sets.
+  // Returns empty buffers of the type the inferer infers from, for
+  // MaybeTakeBuffers to create the tensors of.
+  virtual std::unique_ptr<InputOutputBuffers> CreateBuffers() {
+    return std::make_unique<InputOutputBuffers>();
+  }
+
+  // Takes the buffers of the current frame from the pool, or creates them,
+  // unless the current frame has buffers.
+  void MaybeTakeBuffers();
 
+  // Publishes the current frame as the latest frame, and returns it. The
+  // buffers are returned to the pool when the last reader of the frame
+  // releases it.
+  std::shared_ptr<const InputOutputBuffers> PublishCurrentFrame();
+
+  // Updates class_mask_ for an output of num_classes classes, if the model
+  // type or the positive classes changed.
+  void MaybeUpdateClassMask(int num_classes);
+
+  // Input tensor, cv::Mat of input image as view of the tensor's part,
+  // and output heatmap. We have 2 threads, TensorFlow inference thread and
+  // preview thread. Inference thread fills the buffers of the current frame,
+  // and publishes the frame when the inference is finished. Preview thread
+  // takes a reference to the latest published frame, which is never written
+  // again. In this way, neither thread copies the images, and the only lock we
+  // have is for exchanging the reference to the latest frame.
   absl::Mutex tensor_mutex_;
+  // Buffers of the frame being inferred. GetImageBuffer returns a view of its
+  // input tensor. Patch size changes reset it, and buffers of the old size
+  // are dropped when taken from the pool.
+  std::unique_ptr<InputOutputBuffers> current_;
+  // Buffers whose input the captor writes a later image into, oldest first.
+  // The captor holds at most kMaxLentBuffers of them, and drops them when its
+  // capture stops, so the buffers beyond are no longer used.
+  static constexpr size_t kMaxLentBuffers = 3;
+  std::deque<std::unique_ptr<InputOutputBuffers>> lent_buffers_;
+  // Latest inferred frame, which the preview provider returns.
+  std::shared_ptr<const InputOutputBuffers> latest_
+      ABSL_GUARDED_BY(tensor_mutex_);
+  // The frames only hold the pool weakly, since readers may release them after
+  // the inferer is destroyed. The pool holds about as many buffers as there
+  // are frames referenced at once.
+  std::shared_ptr<InputOutputBufferPool> buffer_pool_;
   int patch_size_;
   ModelType model_type_;
   ObjectiveLensPower objective_;
@@ -162,6 +244,16 @@ class Inferer {
       GleasonClasses::GP_3, GleasonClasses::GP_4, GleasonClasses::GP_5};
   absl::flat_hash_set<CervicalClasses> positive_cervical_classes_ = {
       CervicalClasses::CIN_2_PLUS};
+  // Incremented when the positive classes change, so that inferers can cache
+  // what they derive from GetOutputClassesForHeatmap.
+  std::atomic<int> positive_classes_version_ = {0};
+
+  // Dense mask of the output classes summed into the heatmap, for
+  // SumClassesKernel, and the model type and the version of the positive
+  // classes it was made for.
+  std::vector<uint8_t> class_mask_;
+  ModelType class_mask_model_type_ = ModelType::UNSPECIFIED_MODEL_TYPE;
+  int class_mask_version_ = -1;
 };
 
 }  // namespace image_processor
@@ -0,0 +1,152 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_processor/inferer.h"
+
+#include <deque>
+#include <memory>
+#include <utility>
+
+#include "gtest/gtest.h"
+#include "opencv2/core.hpp"
+#include "tensorflow/core/lib/core/status.h"
+
+namespace {
+
+using image_processor::InputOutputBuffers;
+using image_processor::ModelType;
+using image_processor::ObjectiveLensPower;
+
+constexpr int kWidth = 6;
+constexpr int kHeight = 4;
+
+// Inferer that publishes the input of each frame, without a model.
+class FakeInferer : public image_processor::Inferer {
+ public:
+  FakeInferer() { patch_size_ = 8; }
+
+  tensorflow::Status Initialize(ObjectiveLensPower objective,
+                                ModelType model_type) override {
+    return tensorflow::Status();
+  }
+
+  cv::Mat GetImageBuffer(int width, int height) override {
+    MaybeTakeBuffers();
+    current_->CreateInputImage(cv::Rect((patch_size_ - width) / 2,
+                                        (patch_size_ - height) / 2, width,
+                                        height));
+    return *current_->input_image;
+  }
+
+  tensorflow::Status ProcessImage(cv::Mat* output) override {
+    PublishCurrentFrame();
+    return tensorflow::Status();
+  }
+
+  tensorflow::Status LoadModel(ObjectiveLensPower power,
+                               ModelType model_type) override {
+    return tensorflow::Status();
+  }
+
+  // Changes the patch size, as loading a model of another patch size does.
+  void SetPatchSize(int patch_size) {
+    patch_size_ = patch_size;
+    current_.reset();
+  }
+};
+
+// Captor that returns its frames in the buffers of the caller, as the
+// asynchronous capture of ImageCaptor does, and keeps three buffers.
+class FakeCaptor {
+ public:
+  FakeCaptor() {
+    for (int i = 0; i < 3; i++) {
+      buffers_.emplace_back(kHeight, kWidth, CV_8UC3);
+    }
+  }
+
+  // Writes the value to the oldest buffer, and swaps it with output.
+  void GetImage(uint8_t value, cv::Mat* output) {
+    cv::Mat image = std::move(buffers_.front());
+    buffers_.pop_front();
+    image.setTo(cv::Scalar(value, value, value));
+    std::swap(image, *output);
+    buffers_.push_back(std::move(image));
+  }
+
+ private:
+  std::deque<cv::Mat> buffers_;
+};
+
+// Returns whether all the values of the input of the latest frame are value.
+bool LatestInputIs(image_processor::Inferer* inferer, uint8_t value) {
+  std::shared_ptr<const InputOutputBuffers> frame;
+  if (!inferer->GetPreviewProvider()(&frame).ok()) return false;
+  const cv::Mat& input = *frame->input_image;
+  for (int y = 0; y < input.rows; y++) {
+    for (int x = 0; x < input.cols * 3; x++) {
+      if (input.ptr(y)[x] != value) return false;
+    }
+  }
+  return true;
+}
+
+TEST(InfererTest, UseImageBufferOfCaptor) {
+  FakeInferer inferer;
+  FakeCaptor captor;
+  for (int i = 0; i < 10; i++) {
+    cv::Mat image = inferer.GetImageBuffer(kWidth, kHeight);
+    captor.GetImage(i, &image);
+    const uint8_t* captured_data = image.data;
+    inferer.UseImageBuffer(&image);
+    // Once the captor returns the buffers of the inferer, they are not
+    // copied.
+    if (i >= 3) {
+      EXPECT_EQ(image.data, captured_data) << "Frame " << i;
+    }
+    ASSERT_TRUE(inferer.ProcessImage(nullptr).ok());
+    EXPECT_TRUE(LatestInputIs(&inferer, i)) << "Frame " << i;
+  }
+}
+
+TEST(InfererTest, UseImageBufferAfterPatchSizeChange) {
+  FakeInferer inferer;
+  FakeCaptor captor;
+  for (int i = 0; i < 10; i++) {
+    if (i == 5) inferer.SetPatchSize(10);
+    cv::Mat image = inferer.GetImageBuffer(kWidth, kHeight);
+    captor.GetImage(i, &image);
+    const uint8_t* captured_data = image.data;
+    inferer.UseImageBuffer(&image);
+    // The buffers of the previous patch size are copied once.
+    if (i < 5 || i >= 8) {
+      EXPECT_EQ(image.data == captured_data, i >= 3) << "Frame " << i;
+    }
+    ASSERT_TRUE(inferer.ProcessImage(nullptr).ok());
+    EXPECT_TRUE(LatestInputIs(&inferer, i)) << "Frame " << i;
+  }
+}
+
+TEST(InfererTest, UseImageBufferWithoutCaptorBuffers) {
+  FakeInferer inferer;
+  cv::Mat image = inferer.GetImageBuffer(kWidth, kHeight);
+  image.setTo(cv::Scalar(7, 7, 7));
+  const uint8_t* data = image.data;
+  inferer.UseImageBuffer(&image);
+  EXPECT_EQ(image.data, data);
+  ASSERT_TRUE(inferer.ProcessImage(nullptr).ok());
+  EXPECT_TRUE(LatestInputIs(&inferer, 7));
+}
+
+}  // namespace
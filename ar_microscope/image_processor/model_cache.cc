@@ -0,0 +1,173 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_processor/model_cache.h"
+
+#include <utility>
+
+#include "tensorflow/core/platform/logging.h"
+
+namespace image_processor {
+
+ModelCache::ModelCache(Loader loader, int64_t memory_budget_bytes)
+    : loader_(std::move(loader)), memory_budget_bytes_(memory_budget_bytes) {
+  thread_ = std::thread(&ModelCache::LoadLoop, this);
+}
+
+ModelCache::~ModelCache() {
+  {
+    absl::MutexLock unused_lock(&mutex_);
+    stopping_ = true;
+    cond_.SignalAll();
+  }
+  thread_.join();
+}
+
+void ModelCache::Preload(std::vector<ModelRequest> requests) {
+  absl::MutexLock unused_lock(&mutex_);
+  pending_.clear();
+  preload_keys_.clear();
+  for (auto& request : requests) {
+    preload_keys_.insert(request.key);
+    pending_.push_back(std::move(request));
+  }
+  cond_.SignalAll();
+}
+
+void ModelCache::WaitForPreloads() {
+  absl::MutexLock unused_lock(&mutex_);
+  while (!pending_.empty() || preload_in_progress_) {
+    cond_.Wait(&mutex_);
+  }
+}
+
+tensorflow::Status ModelCache::Get(const ModelRequest& request,
+                                   std::shared_ptr<const CachedModel>* model) {
+  {
+    absl::MutexLock unused_lock(&mutex_);
+    for (auto it = entries_.find(request.key); it != entries_.end();
+         it = entries_.find(request.key)) {
+      if (it->second.model) {
+        it->second.last_use = ++use_counter_;
+        *model = it->second.model;
+        return tensorflow::Status();
+      }
+      // The model is loading. If the load fails, the entry is removed and the
+      // model is loaded below.
+      cond_.Wait(&mutex_);
+    }
+    entries_[request.key];
+  }
+
+  std::unique_ptr<CachedModel> loaded_model;
+  tensorflow::Status status = loader_(request, &loaded_model);
+
+  absl::MutexLock unused_lock(&mutex_);
+  if (status.ok()) {
+    MakeRoom(loaded_model->GetMemoryBytes(), {request.key});
+    Insert(request.key, std::move(loaded_model));
+    *model = entries_[request.key].model;
+  } else {
+    entries_.erase(request.key);
+  }
+  cond_.SignalAll();
+  return status;
+}
+
+bool ModelCache::IsCached(const ModelKey& key) const {
+  absl::MutexLock unused_lock(&mutex_);
+  auto it = entries_.find(key);
+  return it != entries_.end() && it->second.model;
+}
+
+int64_t ModelCache::GetMemoryBytes() const {
+  absl::MutexLock unused_lock(&mutex_);
+  return memory_bytes_;
+}
+
+void ModelCache::SetMemoryBudget(int64_t memory_budget_bytes) {
+  absl::MutexLock unused_lock(&mutex_);
+  memory_budget_bytes_ = memory_budget_bytes;
+  MakeRoom(0, {});
+}
+
+void ModelCache::LoadLoop() {
+  while (true) {
+    ModelRequest request;
+    {
+      absl::MutexLock unused_lock(&mutex_);
+      if (pending_.empty()) cond_.SignalAll();
+      while (!stopping_ && pending_.empty()) {
+        cond_.Wait(&mutex_);
+      }
+      if (stopping_) return;
+      request = std::move(pending_.front());
+      pending_.pop_front();
+      if (entries_.contains(request.key)) continue;
+      entries_[request.key];
+      preload_in_progress_ = true;
+    }
+
+    std::unique_ptr<CachedModel> loaded_model;
+    tensorflow::Status status = loader_(request, &loaded_model);
+
+    absl::MutexLock unused_lock(&mutex_);
+    preload_in_progress_ = false;
+    if (!status.ok()) {
+      LOG(ERROR) << "Failed to preload model " << request.model_directory
+                 << ": " << status;
+      entries_.erase(request.key);
+    } else if (!MakeRoom(loaded_model->GetMemoryBytes(), preload_keys_)) {
+      LOG(INFO) << "Model cache budget reached, stopped preloading at "
+                << request.model_directory;
+      entries_.erase(request.key);
+      pending_.clear();
+    } else {
+      VLOG(1) << "Preloaded model " << request.model_directory;
+      Insert(request.key, std::move(loaded_model));
+    }
+    cond_.SignalAll();
+  }
+}
+
+bool ModelCache::MakeRoom(int64_t bytes,
+                          const absl::flat_hash_set<ModelKey>& keep) {
+  while (memory_bytes_ + bytes > memory_budget_bytes_) {
+    auto least_recently_used = entries_.end();
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+      if (!it->second.model || keep.contains(it->first)) continue;
+      if (least_recently_used == entries_.end() ||
+          it->second.last_use < least_recently_used->second.last_use) {
+        least_recently_used = it;
+      }
+    }
+    if (least_recently_used == entries_.end()) return false;
+    const ModelKey& key = least_recently_used->first;
+    VLOG(1) << "Evicting model " << ModelTypeToString(key.model_type) << " "
+            << ObjectiveToString(key.objective);
+    memory_bytes_ -= least_recently_used->second.model->GetMemoryBytes();
+    entries_.erase(least_recently_used);
+  }
+  return true;
+}
+
+void ModelCache::Insert(const ModelKey& key,
+                        std::shared_ptr<const CachedModel> model) {
+  Entry& entry = entries_[key];
+  memory_bytes_ += model->GetMemoryBytes();
+  entry.model = std::move(model);
+  entry.last_use = ++use_counter_;
+}
+
+}  // namespace image_processor
@@ -0,0 +1,148 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+// Cache of loaded models, keyed by model type and objective lens power, with
+// background preloading so that switching models doesn't wait for the disk.
+
+#ifndef AR_MICROSCOPE_IMAGE_PROCESSOR_MODEL_CACHE_H_
+#define AR_MICROSCOPE_IMAGE_PROCESSOR_MODEL_CACHE_H_
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/synchronization/mutex.h"
+#include "image_processor/inferer.h"
+#include "tensorflow/core/lib/core/status.h"
+
+namespace image_processor {
+
+// Model held by a ModelCache, e.g. a TensorFlow session.
+class CachedModel {
+ public:
+  virtual ~CachedModel() {}
+
+  // Returns the memory taken by the model, counted against the budget.
+  virtual int64_t GetMemoryBytes() const = 0;
+};
+
+// Key of a model in the cache.
+struct ModelKey {
+  ModelType model_type;
+  ObjectiveLensPower objective;
+
+  bool operator==(const ModelKey& other) const {
+    return model_type == other.model_type && objective == other.objective;
+  }
+
+  template <typename H>
+  friend H AbslHashValue(H h, const ModelKey& key) {
+    return H::combine(std::move(h), key.model_type, key.objective);
+  }
+};
+
+// Model to get from the cache, and the directory to load it from.
+struct ModelRequest {
+  ModelKey key;
+  std::string model_directory;
+};
+
+// Cache of loaded models. Models are loaded either on demand by Get, or in the
+// background after Preload, and are only returned once the loader is done, so
+// the loader can also warm them up. When the memory of the models exceeds the
+// budget, the least recently used ones are evicted. Models are shared, so an
+// evicted model stays valid while it is held, e.g. by the inferer running it.
+class ModelCache {
+ public:
+  // Function to load the model of a request.
+  using Loader = std::function<tensorflow::Status(
+      const ModelRequest& request, std::unique_ptr<CachedModel>* model)>;
+
+  ModelCache(Loader loader, int64_t memory_budget_bytes);
+  ~ModelCache();
+
+  // Replaces the models to load in the background, in order of priority.
+  // Models that are cached are skipped. Background loads only evict models
+  // that are not requested, and preloading stops at the first model that
+  // doesn't fit in the budget.
+  void Preload(std::vector<ModelRequest> requests);
+
+  // Waits until the background loads are done.
+  void WaitForPreloads();
+
+  // Gets the requested model. If it is not cached, it is loaded on the calling
+  // thread, or waited for if it is being loaded in the background. A model
+  // loaded on demand is always cached, evicting any other model over budget.
+  tensorflow::Status Get(const ModelRequest& request,
+                         std::shared_ptr<const CachedModel>* model);
+
+  // Returns whether the model is loaded and cached.
+  bool IsCached(const ModelKey& key) const;
+
+  // Returns the memory taken by the cached models.
+  int64_t GetMemoryBytes() const;
+
+  // Changes the memory budget, e.g. once the memory of the device the models
+  // run on is known, and evicts the least recently used models beyond it.
+  void SetMemoryBudget(int64_t memory_budget_bytes);
+
+ private:
+  struct Entry {
+    // Model, or nullptr while it is loading.
+    std::shared_ptr<const CachedModel> model;
+    // Value of use_counter_ on the last use of the model, for the LRU order.
+    int64_t last_use = 0;
+  };
+
+  // Loads the preload requests until stopped.
+  void LoadLoop();
+
+  // Evicts the least recently used models until `bytes` more fit in the
+  // budget, skipping the models whose keys are in `keep`, and models that are
+  // loading. Returns whether they fit.
+  bool MakeRoom(int64_t bytes, const absl::flat_hash_set<ModelKey>& keep)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Adds the loaded model to its entry.
+  void Insert(const ModelKey& key, std::shared_ptr<const CachedModel> model)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  const Loader loader_;
+
+  mutable absl::Mutex mutex_;
+  int64_t memory_budget_bytes_ ABSL_GUARDED_BY(mutex_);
+  // Signaled when a load finishes, and when preloads are requested.
+  absl::CondVar cond_;
+  absl::flat_hash_map<ModelKey, Entry> entries_ ABSL_GUARDED_BY(mutex_);
+  std::deque<ModelRequest> pending_ ABSL_GUARDED_BY(mutex_);
+  absl::flat_hash_set<ModelKey> preload_keys_ ABSL_GUARDED_BY(mutex_);
+  bool preload_in_progress_ ABSL_GUARDED_BY(mutex_) = false;
+  int64_t memory_bytes_ ABSL_GUARDED_BY(mutex_) = 0;
+  int64_t use_counter_ ABSL_GUARDED_BY(mutex_) = 0;
+  bool stopping_ ABSL_GUARDED_BY(mutex_) = false;
+
+  std::thread thread_;
+};
+
+}  // namespace image_processor
+
+#endif  // AR_MICROSCOPE_IMAGE_PROCESSOR_MODEL_CACHE_H_
@@ -0,0 +1,237 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_processor/model_cache.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "image_processor/inferer.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/core/status.h"
+
+namespace {
+
+using image_processor::CachedModel;
+using image_processor::ModelCache;
+using image_processor::ModelKey;
+using image_processor::ModelRequest;
+using image_processor::ModelType;
+using image_processor::ObjectiveLensPower;
+
+constexpr int64_t kModelBytes = 40;
+
+class FakeModel : public CachedModel {
+ public:
+  explicit FakeModel(const std::string& directory) : directory(directory) {}
+
+  int64_t GetMemoryBytes() const override { return kModelBytes; }
+
+  const std::string directory;
+};
+
+// Loader of fake models that counts the loads of each directory. Loads of the
+// blocked directory wait until it is unblocked.
+class FakeLoader {
+ public:
+  ModelCache::Loader GetLoader() {
+    return [this](const ModelRequest& request,
+                  std::unique_ptr<CachedModel>* model) {
+      const std::string& directory = request.model_directory;
+      if (directory == blocked_directory_) unblocked_.WaitForNotification();
+      absl::MutexLock unused_lock(&mutex_);
+      num_loads_[directory]++;
+      if (directory == "missing") {
+        return tensorflow::errors::NotFound("No model");
+      }
+      *model = std::make_unique<FakeModel>(directory);
+      return tensorflow::Status();
+    };
+  }
+
+  int GetNumLoads(const std::string& directory) {
+    absl::MutexLock unused_lock(&mutex_);
+    return num_loads_[directory];
+  }
+
+  void Block(const std::string& directory) { blocked_directory_ = directory; }
+  void Unblock() { unblocked_.Notify(); }
+
+ private:
+  absl::Mutex mutex_;
+  absl::flat_hash_map<std::string, int> num_loads_;
+  std::string blocked_directory_;
+  absl::Notification unblocked_;
+};
+
+const ModelRequest k4x = {{ModelType::LYNA, ObjectiveLensPower::OBJECTIVE_4x},
+                          "lyna_4x"};
+const ModelRequest k10x = {
+    {ModelType::LYNA, ObjectiveLensPower::OBJECTIVE_10x}, "lyna_10x"};
+const ModelRequest k20x = {
+    {ModelType::LYNA, ObjectiveLensPower::OBJECTIVE_20x}, "lyna_20x"};
+const ModelRequest k40x = {
+    {ModelType::LYNA, ObjectiveLensPower::OBJECTIVE_40x}, "lyna_40x"};
+
+TEST(ModelCacheTest, GetLoadsOnce) {
+  FakeLoader loader;
+  ModelCache cache(loader.GetLoader(), 100);
+  std::shared_ptr<const CachedModel> model;
+  ASSERT_TRUE(cache.Get(k10x, &model).ok());
+  ASSERT_TRUE(cache.Get(k10x, &model).ok());
+  EXPECT_EQ(static_cast<const FakeModel*>(model.get())->directory,
+            k10x.model_directory);
+  EXPECT_EQ(loader.GetNumLoads(k10x.model_directory), 1);
+  EXPECT_TRUE(cache.IsCached(k10x.key));
+  EXPECT_EQ(cache.GetMemoryBytes(), kModelBytes);
+}
+
+TEST(ModelCacheTest, EvictsLeastRecentlyUsed) {
+  FakeLoader loader;
+  ModelCache cache(loader.GetLoader(), 2 * kModelBytes);
+  std::shared_ptr<const CachedModel> model;
+  ASSERT_TRUE(cache.Get(k4x, &model).ok());
+  ASSERT_TRUE(cache.Get(k10x, &model).ok());
+  ASSERT_TRUE(cache.Get(k4x, &model).ok());
+  ASSERT_TRUE(cache.Get(k20x, &model).ok());
+  EXPECT_TRUE(cache.IsCached(k4x.key));
+  EXPECT_FALSE(cache.IsCached(k10x.key));
+  EXPECT_TRUE(cache.IsCached(k20x.key));
+  EXPECT_EQ(cache.GetMemoryBytes(), 2 * kModelBytes);
+}
+
+TEST(ModelCacheTest, EvictedModelStaysValidWhileHeld) {
+  FakeLoader loader;
+  ModelCache cache(loader.GetLoader(), kModelBytes);
+  std::shared_ptr<const CachedModel> model_4x;
+  std::shared_ptr<const CachedModel> model_10x;
+  ASSERT_TRUE(cache.Get(k4x, &model_4x).ok());
+  ASSERT_TRUE(cache.Get(k10x, &model_10x).ok());
+  EXPECT_FALSE(cache.IsCached(k4x.key));
+  EXPECT_EQ(static_cast<const FakeModel*>(model_4x.get())->directory,
+            k4x.model_directory);
+}
+
+TEST(ModelCacheTest, SmallerBudgetEvictsLeastRecentlyUsed) {
+  FakeLoader loader;
+  ModelCache cache(loader.GetLoader(), 3 * kModelBytes);
+  std::shared_ptr<const CachedModel> model;
+  ASSERT_TRUE(cache.Get(k4x, &model).ok());
+  ASSERT_TRUE(cache.Get(k10x, &model).ok());
+  ASSERT_TRUE(cache.Get(k20x, &model).ok());
+  cache.SetMemoryBudget(kModelBytes);
+  EXPECT_FALSE(cache.IsCached(k4x.key));
+  EXPECT_FALSE(cache.IsCached(k10x.key));
+  EXPECT_TRUE(cache.IsCached(k20x.key));
+  EXPECT_EQ(cache.GetMemoryBytes(), kModelBytes);
+  // Preloads stop at the new budget.
+  cache.Preload({k20x, k40x});
+  cache.WaitForPreloads();
+  EXPECT_FALSE(cache.IsCached(k40x.key));
+}
+
+TEST(ModelCacheTest, ModelLargerThanBudgetIsStillReturned) {
+  FakeLoader loader;
+  ModelCache cache(loader.GetLoader(), kModelBytes / 2);
+  std::shared_ptr<const CachedModel> model;
+  ASSERT_TRUE(cache.Get(k10x, &model).ok());
+  EXPECT_NE(model, nullptr);
+}
+
+TEST(ModelCacheTest, FailedLoadIsNotCached) {
+  FakeLoader loader;
+  ModelCache cache(loader.GetLoader(), 100);
+  const ModelRequest request = {k10x.key, "missing"};
+  std::shared_ptr<const CachedModel> model;
+  EXPECT_TRUE(tensorflow::errors::IsNotFound(cache.Get(request, &model)));
+  EXPECT_TRUE(tensorflow::errors::IsNotFound(cache.Get(request, &model)));
+  EXPECT_EQ(loader.GetNumLoads("missing"), 2);
+  EXPECT_FALSE(cache.IsCached(k10x.key));
+}
+
+TEST(ModelCacheTest, PreloadsInBackground) {
+  FakeLoader loader;
+  ModelCache cache(loader.GetLoader(), 100);
+  cache.Preload({k4x, k10x});
+  cache.WaitForPreloads();
+  EXPECT_TRUE(cache.IsCached(k4x.key));
+  EXPECT_TRUE(cache.IsCached(k10x.key));
+
+  std::shared_ptr<const CachedModel> model;
+  ASSERT_TRUE(cache.Get(k10x, &model).ok());
+  EXPECT_EQ(loader.GetNumLoads(k10x.model_directory), 1);
+}
+
+TEST(ModelCacheTest, PreloadSkipsCachedModels) {
+  FakeLoader loader;
+  ModelCache cache(loader.GetLoader(), 100);
+  std::shared_ptr<const CachedModel> model;
+  ASSERT_TRUE(cache.Get(k4x, &model).ok());
+  cache.Preload({k4x, k10x});
+  cache.WaitForPreloads();
+  EXPECT_EQ(loader.GetNumLoads(k4x.model_directory), 1);
+  EXPECT_EQ(loader.GetNumLoads(k10x.model_directory), 1);
+}
+
+TEST(ModelCacheTest, PreloadEvictsOnlyUnrequestedModels) {
+  FakeLoader loader;
+  ModelCache cache(loader.GetLoader(), 2 * kModelBytes);
+  std::shared_ptr<const CachedModel> model;
+  ASSERT_TRUE(cache.Get(k40x, &model).ok());
+  cache.Preload({k4x, k10x, k20x});
+  cache.WaitForPreloads();
+  EXPECT_FALSE(cache.IsCached(k40x.key));
+  EXPECT_TRUE(cache.IsCached(k4x.key));
+  EXPECT_TRUE(cache.IsCached(k10x.key));
+  // The budget is full of requested models, so preloading stops.
+  EXPECT_FALSE(cache.IsCached(k20x.key));
+  EXPECT_EQ(cache.GetMemoryBytes(), 2 * kModelBytes);
+}
+
+TEST(ModelCacheTest, GetWaitsForBackgroundLoad) {
+  FakeLoader loader;
+  loader.Block(k10x.model_directory);
+  ModelCache cache(loader.GetLoader(), 100);
+  cache.Preload({k10x});
+
+  std::shared_ptr<const CachedModel> model;
+  tensorflow::Status status;
+  std::thread getter([&] { status = cache.Get(k10x, &model); });
+  loader.Unblock();
+  getter.join();
+  ASSERT_TRUE(status.ok());
+  EXPECT_NE(model, nullptr);
+  EXPECT_EQ(loader.GetNumLoads(k10x.model_directory), 1);
+}
+
+TEST(ModelCacheTest, PreloadReplacesPendingRequests) {
+  FakeLoader loader;
+  loader.Block(k4x.model_directory);
+  ModelCache cache(loader.GetLoader(), 100);
+  cache.Preload({k4x, k10x});
+  cache.Preload({k4x, k20x});
+  loader.Unblock();
+  cache.WaitForPreloads();
+  EXPECT_TRUE(cache.IsCached(k20x.key));
+  EXPECT_EQ(loader.GetNumLoads(k4x.model_directory), 1);
+}
+
+}  // namespace
@@ -0,0 +1,89 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_processor/model_config_util.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "arm_app/arm_config.h"
+
+ABSL_FLAG(bool, preload_models, true,
+          "If true, loads every configured model in the background, so that "
+          "switching objectives or model types doesn't wait for the disk.");
+ABSL_FLAG(int, model_cache_megabytes, 4096,
+          "Memory budget of the loaded models of each backend. The memory of "
+          "a model is an approximation: the size of its files, and for "
+          "TensorFlow Lite also its packed weights and tensors. For models "
+          "on a GPU, the budget is also capped by the GPU memory left after "
+          "the activations. The least recently used models are unloaded "
+          "beyond it.");
+ABSL_FLAG(int, num_warm_up_inferences, 2,
+          "Number of inferences run on a blank image when a model first "
+          "becomes current, on the inference thread, so that the first "
+          "frames don't pay for graph optimization, kernel selection and "
+          "memory pool growth.");
+
+extern absl::Flag<int> FLAGS_image_size;
+
+namespace image_processor {
+
+int GetPatchSize(ModelType model_type, ObjectiveLensPower objective) {
+  const auto& model_config =
+      arm_app::GetArmConfig().GetModelConfig(model_type, objective);
+  const int input_patch_size = model_config.input_patch_size();
+  const int prediction_patch_size = model_config.prediction_patch_size();
+  return input_patch_size - prediction_patch_size +
+         absl::GetFlag(FLAGS_image_size) -
+         (absl::GetFlag(FLAGS_image_size) % prediction_patch_size);
+}
+
+arm_app::ModelConfig::InferenceBackend GetInferenceBackend(
+    ModelType model_type, ObjectiveLensPower objective) {
+  return arm_app::GetArmConfig()
+      .GetModelConfig(model_type, objective)
+      .inference_backend();
+}
+
+std::vector<ModelRequest> GetPreloadRequests(
+    ModelType model_type, arm_app::ModelConfig::InferenceBackend backend) {
+  auto& arm_config = arm_app::GetArmConfig();
+  std::vector<ModelRequest> requests;
+  auto add_requests = [&](ModelType type) {
+    const auto& supported_objectives =
+        arm_config.GetSupportedObjectivesForModelType(type);
+    std::vector<ObjectiveLensPower> objectives(supported_objectives.begin(),
+                                               supported_objectives.end());
+    std::sort(objectives.begin(), objectives.end());
+    for (ObjectiveLensPower objective : objectives) {
+      if (!arm_config.IsModelConfigOverridden(type, objective)) continue;
+      const auto& model_config = arm_config.GetModelConfig(type, objective);
+      if (model_config.inference_backend() != backend) continue;
+      requests.push_back(
+          {{type, objective}, model_config.absolute_model_path()});
+    }
+  };
+  add_requests(model_type);
+  const auto& configured_model_types = arm_config.GetConfiguredModelTypes();
+  std::vector<ModelType> other_model_types(configured_model_types.begin(),
+                                           configured_model_types.end());
+  std::sort(other_model_types.begin(), other_model_types.end());
+  for (ModelType type : other_model_types) {
+    if (type != model_type) add_requests(type);
+  }
+  return requests;
+}
+
+}  // namespace image_processor
@@ -0,0 +1,44 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+// Model settings that the inferers share, and derive from the ARM config. The
+// flags of the model cache and the warm-up are defined here for all backends.
+
+#ifndef AR_MICROSCOPE_IMAGE_PROCESSOR_MODEL_CONFIG_UTIL_H_
+#define AR_MICROSCOPE_IMAGE_PROCESSOR_MODEL_CONFIG_UTIL_H_
+
+#include <vector>
+
+#include "arm_app/arm_config.pb.h"
+#include "image_processor/inferer.h"
+#include "image_processor/model_cache.h"
+
+namespace image_processor {
+
+// Returns the size of the input patch of the model, which holds the image
+// with the margins the model needs.
+int GetPatchSize(ModelType model_type, ObjectiveLensPower objective);
+
+// Returns the backend that runs the model.
+arm_app::ModelConfig::InferenceBackend GetInferenceBackend(
+    ModelType model_type, ObjectiveLensPower objective);
+
+// Returns the requests of the configured models that run on the backend, the
+// ones of model_type first, each model type in order of objective.
+std::vector<ModelRequest> GetPreloadRequests(
+    ModelType model_type, arm_app::ModelConfig::InferenceBackend backend);
+
+}  // namespace image_processor
+
+#endif  // AR_MICROSCOPE_IMAGE_PROCESSOR_MODEL_CONFIG_UTIL_H_
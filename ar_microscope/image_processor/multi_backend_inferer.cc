@@ -0,0 +1,127 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_processor/multi_backend_inferer.h"
+
+#include <memory>
+
+#include "image_processor/model_config_util.h"
+#include "image_processor/tensorflow_inferer.h"
+#include "image_processor/tflite_inferer.h"
+#include "tensorflow/core/lib/core/errors.h"
+
+namespace image_processor {
+namespace {
+
+std::unique_ptr<Inferer> CreateInferer(
+    arm_app::ModelConfig::InferenceBackend backend) {
+  switch (backend) {
+    case arm_app::ModelConfig::TFLITE:
+      return std::make_unique<TfliteInferer>();
+    default:
+      return std::make_unique<TensorflowInferer>();
+  }
+}
+
+}  // namespace
+
+tensorflow::Status MultiBackendInferer::Initialize(
+    ObjectiveLensPower objective, ModelType model_type) {
+  return LoadModel(objective, model_type);
+}
+
+cv::Mat MultiBackendInferer::GetImageBuffer(int width, int height) {
+  return inferer_->GetImageBuffer(width, height);
+}
+
+void MultiBackendInferer::UseImageBuffer(cv::Mat* image) {
+  inferer_->UseImageBuffer(image);
+}
+
+tensorflow::Status MultiBackendInferer::ProcessImage(cv::Mat* output) {
+  return inferer_->ProcessImage(output);
+}
+
+tensorflow::Status MultiBackendInferer::ReuseLastOutput(cv::Mat* output) {
+  return inferer_->ReuseLastOutput(output);
+}
+
+tensorflow::Status MultiBackendInferer::LoadModel(ObjectiveLensPower power,
+                                                  ModelType model_type) {
+  const arm_app::ModelConfig::InferenceBackend backend =
+      GetInferenceBackend(model_type, power);
+  Inferer* inferer = nullptr;
+  bool created = false;
+  {
+    absl::MutexLock unused_lock(&inferers_mutex_);
+    std::unique_ptr<Inferer>& backend_inferer = inferers_[backend];
+    if (!backend_inferer) {
+      backend_inferer = CreateInferer(backend);
+      backend_inferer->SetPositiveGleasonClasses(positive_gleason_classes_);
+      backend_inferer->SetPositiveCervicalClasses(positive_cervical_classes_);
+      created = true;
+    }
+    inferer = backend_inferer.get();
+  }
+  // The inferers initialize with the model, and remain usable without one.
+  const tensorflow::Status status =
+      created ? inferer->Initialize(power, model_type)
+              : inferer->LoadModel(power, model_type);
+  if (inferer != inferer_) {
+    LOG(INFO) << "Switching to the inferer of backend "
+              << arm_app::ModelConfig::InferenceBackend_Name(backend);
+    inferer_ = inferer;
+    absl::MutexLock unused_lock(&tensor_mutex_);
+    preview_provider_ = inferer_->GetPreviewProvider();
+  }
+  return status;
+}
+
+absl::Duration MultiBackendInferer::GetModelWarmUpDuration() const {
+  return inferer_ ? inferer_->GetModelWarmUpDuration() : absl::ZeroDuration();
+}
+
+PreviewProvider MultiBackendInferer::GetPreviewProvider() {
+  return [this](std::shared_ptr<const InputOutputBuffers>* frame) {
+    PreviewProvider preview_provider;
+    {
+      absl::MutexLock unused_lock(&tensor_mutex_);
+      preview_provider = preview_provider_;
+    }
+    if (!preview_provider) {
+      return tensorflow::errors::NotFound("Preview image not yet ready");
+    }
+    return preview_provider(frame);
+  };
+}
+
+void MultiBackendInferer::SetPositiveGleasonClasses(
+    const absl::flat_hash_set<GleasonClasses>& positive_gleason_classes) {
+  absl::MutexLock unused_lock(&inferers_mutex_);
+  Inferer::SetPositiveGleasonClasses(positive_gleason_classes);
+  for (auto& [backend, inferer] : inferers_) {
+    inferer->SetPositiveGleasonClasses(positive_gleason_classes);
+  }
+}
+
+void MultiBackendInferer::SetPositiveCervicalClasses(
+    const absl::flat_hash_set<CervicalClasses>& positive_cervical_classes) {
+  absl::MutexLock unused_lock(&inferers_mutex_);
+  Inferer::SetPositiveCervicalClasses(positive_cervical_classes);
+  for (auto& [backend, inferer] : inferers_) {
+    inferer->SetPositiveCervicalClasses(positive_cervical_classes);
+  }
+}
+
+}  // namespace image_processor
@@ -0,0 +1,82 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+// Inferer that runs each model on the backend of its model config.
+
+#ifndef AR_MICROSCOPE_IMAGE_PROCESSOR_MULTI_BACKEND_INFERER_H_
+#define AR_MICROSCOPE_IMAGE_PROCESSOR_MULTI_BACKEND_INFERER_H_
+
+#include <memory>
+
+#include "opencv2/core.hpp"
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "arm_app/arm_config.pb.h"
+#include "image_processor/inferer.h"
+#include "tensorflow/core/lib/core/status.h"
+
+namespace image_processor {
+
+// Forwards to an inferer per backend, which is created when a model of the
+// backend is first loaded, so that an ARM config of TensorFlow Lite models
+// never starts a TensorFlow session. The inferers keep their loaded models
+// when the backend changes.
+class MultiBackendInferer : public Inferer {
+ public:
+  MultiBackendInferer() {}
+
+  virtual ~MultiBackendInferer() {}
+
+  tensorflow::Status Initialize(ObjectiveLensPower objective,
+                                ModelType model_type) override;
+  cv::Mat GetImageBuffer(int width, int height) override;
+  void UseImageBuffer(cv::Mat* image) override;
+  tensorflow::Status ProcessImage(cv::Mat* output) override;
+  tensorflow::Status ReuseLastOutput(cv::Mat* output) override;
+  tensorflow::Status LoadModel(ObjectiveLensPower power,
+                               ModelType model_type) override;
+  absl::Duration GetModelWarmUpDuration() const override;
+
+  // Returns the latest frame of the inferer of the current model.
+  PreviewProvider GetPreviewProvider() override;
+
+  void SetPositiveGleasonClasses(
+      const absl::flat_hash_set<GleasonClasses>& positive_gleason_classes)
+      override;
+
+  void SetPositiveCervicalClasses(
+      const absl::flat_hash_set<CervicalClasses>& positive_cervical_classes)
+      override;
+
+ private:
+  // Inferers of the backends, guarded for the positive classes, which are set
+  // from the UI thread.
+  absl::Mutex inferers_mutex_;
+  absl::flat_hash_map<arm_app::ModelConfig::InferenceBackend,
+                      std::unique_ptr<Inferer>>
+      inferers_ ABSL_GUARDED_BY(inferers_mutex_);
+
+  // Inferer of the current model, only changed by LoadModel on the inference
+  // thread.
+  Inferer* inferer_ = nullptr;
+  // Preview provider of inferer_, for the preview thread.
+  PreviewProvider preview_provider_ ABSL_GUARDED_BY(tensor_mutex_);
+};
+
+}  // namespace image_processor
+
+#endif  // AR_MICROSCOPE_IMAGE_PROCESSOR_MULTI_BACKEND_INFERER_H_
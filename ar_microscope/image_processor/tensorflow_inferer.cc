@@ -14,9 +14,9 @@
 // =============================================================================
 #include "image_processor/tensorflow_inferer.h"
 
-#include <algorithm>
 #include <cstdint>
 #include <memory>
+#include <string>
 #include <utility>
 #include <vector>
 
@@ -24,11 +24,19 @@
 #include "absl/flags/flag.h"
 #include "absl/memory/memory.h"
 #include "absl/strings/str_format.h"
-#include "arm_app/arm_config.h"
+#include "image_processor/backend_inferer.h"
 #include "image_processor/inferer.h"
+#include "image_processor/model_cache.h"
+#include "image_processor/model_config_util.h"
 #include "tensorflow/cc/saved_model/loader.h"
 #include "tensorflow/cc/saved_model/signature_constants.h"
+#include "tensorflow/core/common_runtime/device.h"
+#include "tensorflow/core/common_runtime/device_mgr.h"
+#include "tensorflow/core/framework/allocator.h"
+#include "tensorflow/core/framework/types.h"
 #include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/path.h"
 #include "tensorflow/core/protobuf/meta_graph.pb.h"
 #include "tensorflow/core/public/session_options.h"
 
@@ -40,14 +48,34 @@ ABSL_FLAG(int, patch_size, 2575, "Inference patch size.");
 ABSL_FLAG(std::string, output_tensor_name, "ArmOutputTensor",
           "Output heatmap tensor name.");
 
-extern absl::Flag<int> FLAGS_image_size;
-
 namespace image_processor {
 
 constexpr char kTagName[] = "serve";
 // Model output index that corresponds to the benign prediction.
 
+namespace {
+
+// Returns the size of the graph and the variables of a SavedModel, as an
+// estimate of the memory taken by the loaded model.
+int64_t GetSavedModelBytes(const std::string& model_directory) {
+  tensorflow::Env* env = tensorflow::Env::Default();
+  std::vector<std::string> files;
+  env->GetMatchingPaths(
+         tensorflow::io::JoinPath(model_directory, "variables", "*"), &files)
+      .IgnoreError();
+  files.push_back(tensorflow::io::JoinPath(model_directory, "saved_model.pb"));
+  int64_t total_bytes = 0;
+  for (const auto& file : files) {
+    tensorflow::uint64 file_bytes = 0;
+    if (env->GetFileSize(file, &file_bytes).ok()) total_bytes += file_bytes;
+  }
+  return total_bytes;
+}
+
+}  // namespace
+
 void InputOutputBuffersWithTensor::CreateTensor(int patch_size) {
+  this->patch_size = patch_size;
   input_tensor = absl::WrapUnique(new tensorflow::Tensor(
       tensorflow::DT_UINT8, {1, patch_size, patch_size, 3}));
   input_tensor->flat<uint8_t>().setZero();
@@ -59,137 +87,79 @@ void InputOutputBuffersWithTensor::CreateTensor(int patch_size) {
 
 tensorflow::Status TensorflowInferer::Initialize(ObjectiveLensPower objective,
                                                  ModelType model_type) {
-  MaybeCreateInputTensors();
   SetModelOptions();
-  return LoadModel(objective, model_type);
-}
-
-cv::Mat TensorflowInferer::GetImageBuffer(int width, int height) {
-  MaybeCreateInputTensors();
-  CHECK(width < patch_size_)
-      << "Width: " << width << "  patch size: " << patch_size_;
-  CHECK(height < patch_size_)
-      << "Height: " << height << "  patch size: " << patch_size_;
-  int left_padding = (patch_size_ - width) / 2;
-  int top_padding = (patch_size_ - height) / 2;
-
-  cv::Rect roi(left_padding, top_padding, width, height);
-  current_->CreateInputImage(roi);
-  return *current_->input_image;
+  return BackendInferer::Initialize(objective, model_type);
 }
 
-void TensorflowInferer::ProcessImageWithoutInference(cv::Mat* output) {
-  auto trivial_output = cv::Mat(1, 1, CV_8UC1);
-  *trivial_output.ptr(0, 0) = 0;
-
-  current_->heatmap = std::make_unique<cv::Mat>(trivial_output.clone());
-  current_->output_tensor = std::make_unique<cv::Mat>(trivial_output.clone());
-  *output = trivial_output.clone();
-
-  {
-    VLOG(1) << "SWAP: input <--> previous";
-    absl::MutexLock unused_lock(&tensor_mutex_);
-    std::swap(current_, previous_);
-  }
-}
-
-tensorflow::Status TensorflowInferer::ProcessImage(cv::Mat* output) {
-  if (model_directory_.empty()) {
-    ProcessImageWithoutInference(output);
-    return tensorflow::Status();
-  }
-
-  CHECK(saved_model_bundle_.session) << "TensorFlow model not initialized";
-
+tensorflow::Status TensorflowInferer::RunModel() {
+  CHECK(model().bundle.session) << "TensorFlow model not initialized";
   std::vector<std::pair<std::string, tensorflow::Tensor>> inputs;
-  inputs.emplace_back(input_tensor_name_, *current_->input_tensor);
-  std::vector<std::string> output_tensor_names{output_tensor_name_};
+  inputs.emplace_back(model().input_tensor_name,
+                      *current_buffers()->input_tensor);
+  std::vector<std::string> output_tensor_names{model().output_tensor_name};
   std::vector<tensorflow::Tensor> outputs;
 
   // Run TensorFlow inference.
-  TF_RETURN_IF_ERROR(saved_model_bundle_.session->Run(
+  TF_RETURN_IF_ERROR(model().bundle.session->Run(
       inputs, output_tensor_names, {}, &outputs));
   CHECK(outputs.size() == output_tensor_names.size())
       << "Invalid inference output size: " << outputs.size();
 
   // Get the first slice of the first result. Note we are supposed to have
-  // only one output Tensor.
-  const tensorflow::Tensor& output_tensor = outputs[0].SubSlice(0);
+  // only one output Tensor. The slice shares the buffer of the result.
+  tensorflow::Tensor output_tensor = outputs[0].SubSlice(0);
 
   // output_tensor has 3 dimensions, 1st and 2nd for y and x of the result
   // heatmap image, and 3rd for output category.
   CHECK(output_tensor.dims() == 3)
       << "Unexpected output tensor dimension: " << output_tensor.dims();
 
-  // Copy the requested output class values to output Mat.
-  int height = output_tensor.dim_size(0);
-  int width = output_tensor.dim_size(1);
-  int depth = output_tensor.dim_size(2);  // Number of classes.
-  auto output_tensor_shape = std::vector<int>({height, width, depth});
-  current_->heatmap = std::make_unique<cv::Mat>(height, width, CV_8UC1);
-  current_->output_tensor =
-      std::make_unique<cv::Mat>(output_tensor_shape, CV_8UC1);
-  auto output_eigen_tensor = output_tensor.tensor<uint8_t, 3>();
-  const auto positive_classes = GetOutputClassesForHeatmap(model_type_);
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      int total_positive_pixel_value = 0;
-      for (const auto positive_class : positive_classes) {
-        total_positive_pixel_value += output_eigen_tensor(y, x, positive_class);
-      }
-      *current_->heatmap->ptr(y, x) = total_positive_pixel_value;
-      for (int z = 0; z < depth; z++) {
-        *current_->output_tensor->ptr(y, x, z) = output_eigen_tensor(y, x, z);
-      }
-    }
-  }
-  current_->heatmap->copyTo(*output);
-
-  {
-    VLOG(1) << "SWAP: input <--> previous";
-    absl::MutexLock unused_lock(&tensor_mutex_);
-    std::swap(current_, previous_);
-  }
-
+  // The output tensor is a view of the inference output, which is kept alive
+  // with the buffers.
+  const int output_tensor_shape[] = {
+      static_cast<int>(output_tensor.dim_size(0)),
+      static_cast<int>(output_tensor.dim_size(1)),
+      static_cast<int>(output_tensor.dim_size(2))};
+  current_buffers()->output = output_tensor;
+  *GetReusableMat(&current_->output_tensor) =
+      cv::Mat(3, output_tensor_shape, CV_8UC1,
+              output_tensor.flat<uint8_t>().data());
   return tensorflow::Status();
 }
 
-tensorflow::Status TensorflowInferer::LoadModel(ObjectiveLensPower power,
-                                                ModelType model_type) {
-  if (arm_app::GetArmConfig().IsModelConfigOverridden(model_type, power)) {
-    std::string folder = arm_app::GetArmConfig()
-                             .GetModelConfig(model_type, power)
-                             .absolute_model_path();
-    model_type_ = model_type;
-    objective_ = power;
-    new_input_tensors_needed_ = true;
-    return SetTensorflowModel(folder);
-  } else {
-    model_directory_ = "";
-    return tensorflow::errors::Unavailable(absl::StrFormat(
-        "No model for objective lens power and model type: %s, %s",
-        ObjectiveToString(power), ModelTypeToString(model_type)));
-  }
+tensorflow::Status TensorflowInferer::RunWarmUpInference(
+    const BackendModel& model) {
+  const TensorflowModel& tensorflow_model =
+      static_cast<const TensorflowModel&>(model);
+  tensorflow::Tensor input_tensor(
+      tensorflow::DT_UINT8, {1, model.patch_size, model.patch_size, 3});
+  input_tensor.flat<uint8_t>().setZero();
+  std::vector<tensorflow::Tensor> outputs;
+  return tensorflow_model.bundle.session->Run(
+      {{tensorflow_model.input_tensor_name, input_tensor}},
+      {tensorflow_model.output_tensor_name}, {}, &outputs);
 }
 
-PreviewProvider TensorflowInferer::GetPreviewProvider() {
-  return [this](cv::Mat* preview, cv::Mat* heatmap, cv::Mat* output_tensor) {
-    {
-      VLOG(1) << "SWAP: previous <--> preview";
-      absl::MutexLock unused_lock(&tensor_mutex_);
-      std::swap(previous_, preview_);
-    }
-
-    if (!preview_->input_image) {
-      return tensorflow::errors::NotFound("Preview image not yet ready");
-    }
-
-    preview_->input_image->copyTo(*preview);
-    preview_->heatmap->copyTo(*heatmap);
-    preview_->output_tensor->copyTo(*output_tensor);
-
-    return tensorflow::Status();
-  };
+int64_t TensorflowInferer::GetDeviceMemoryBudget(
+    const BackendModel& model) const {
+  const tensorflow::DeviceMgr* device_mgr = nullptr;
+  if (!static_cast<const TensorflowModel&>(model)
+           .bundle.session->LocalDeviceManager(&device_mgr)
+           .ok()) {
+    return -1;
+  }
+  for (tensorflow::Device* device : device_mgr->ListDevices()) {
+    if (device->device_type() != tensorflow::DEVICE_GPU) continue;
+    const auto stats =
+        device->GetAllocator(tensorflow::AllocatorAttributes())->GetStats();
+    if (!stats || !stats->bytes_limit) return -1;
+    // The sessions share the allocator of the GPU, whose memory in use is
+    // mostly the weights of the loaded models. The peak also has the
+    // activations of the inferences, which are left out of the budget.
+    return *stats->bytes_limit -
+           (stats->peak_bytes_in_use - stats->bytes_in_use);
+  }
+  return -1;
 }
 
 void TensorflowInferer::SetModelOptions() {
@@ -210,43 +180,31 @@ void TensorflowInferer::SetModelOptions() {
   tags_ = {kTagName};
 }
 
-tensorflow::Status TensorflowInferer::SetTensorflowModel(
-    const std::string& model_directory) {
-  TF_RETURN_IF_ERROR(tensorflow::LoadSavedModel(*session_options_, run_options_,
-                                                model_directory, tags_,
-                                                &saved_model_bundle_));
+tensorflow::Status TensorflowInferer::LoadBackendModel(
+    const ModelRequest& request, std::unique_ptr<CachedModel>* model) {
+  auto tensorflow_model = std::make_unique<TensorflowModel>();
+  TF_RETURN_IF_ERROR(tensorflow::LoadSavedModel(
+      *session_options_, run_options_, request.model_directory, tags_,
+      &tensorflow_model->bundle));
 
   // Get input and output tensor names from graph signature.
   const tensorflow::SignatureDef& signature_def =
-      saved_model_bundle_.meta_graph_def.signature_def().at(
+      tensorflow_model->bundle.meta_graph_def.signature_def().at(
           tensorflow::kDefaultServingSignatureDefKey);
-  input_tensor_name_ =
+  tensorflow_model->input_tensor_name =
       signature_def.inputs().at(tensorflow::kPredictInputs).name();
-  output_tensor_name_ = signature_def.outputs()
-                            .at(absl::GetFlag(FLAGS_output_tensor_name))
-                            .name();
-  model_directory_ = model_directory;
+  tensorflow_model->output_tensor_name =
+      signature_def.outputs()
+          .at(absl::GetFlag(FLAGS_output_tensor_name))
+          .name();
+  tensorflow_model->memory_bytes =
+      GetSavedModelBytes(request.model_directory);
+  tensorflow_model->patch_size =
+      GetPatchSize(request.key.model_type, request.key.objective);
+
+  LOG(INFO) << "Loaded " << request.model_directory;
+  *model = std::move(tensorflow_model);
   return tensorflow::Status();
 }
 
-void TensorflowInferer::MaybeCreateInputTensors() {
-  if (!new_input_tensors_needed_) return;
-  const auto& model_config =
-      arm_app::GetArmConfig().GetModelConfig(model_type_, objective_);
-  const int input_patch_size = model_config.input_patch_size();
-  const int prediction_patch_size = model_config.prediction_patch_size();
-  int new_patch_size =
-      input_patch_size - prediction_patch_size +
-      absl::GetFlag(FLAGS_image_size) -
-      (absl::GetFlag(FLAGS_image_size) % prediction_patch_size);
-  if (new_patch_size != patch_size_) {
-    absl::MutexLock unused_lock(&tensor_mutex_);
-    patch_size_ = new_patch_size;
-    current_->CreateTensor(patch_size_);
-    previous_->CreateTensor(patch_size_);
-    preview_->CreateTensor(patch_size_);
-  }
-  new_input_tensors_needed_ = false;
-}
-
 }  // namespace image_processor
@@ -19,13 +19,19 @@
 
 #ifndef NO_TENSORFLOW
 
+#include <cstdint>
 #include <functional>
 #include <memory>
+#include <string>
 #include <unordered_set>
+#include <vector>
 
 #include "opencv2/core.hpp"
 #include "absl/synchronization/mutex.h"
+#include "arm_app/arm_config.pb.h"
+#include "image_processor/backend_inferer.h"
 #include "image_processor/inferer.h"
+#include "image_processor/model_cache.h"
 #include "microdisplay_server/heatmap_util.h"
 #include "tensorflow/cc/saved_model/loader.h"
 #include "tensorflow/core/framework/tensor.h"
@@ -43,63 +49,64 @@ struct InputOutputBuffersWithTensor : public InputOutputBuffers {
   // Tensor as input of TensorFlow inference.
   std::unique_ptr<tensorflow::Tensor> input_tensor;
 
+  // Output of TensorFlow inference, which output_tensor is a view of.
+  tensorflow::Tensor output;
+
   void CreateTensor(int patch_size) override;
 };
 
-class TensorflowInferer : public Inferer {
+// SavedModel loaded in a session, with the names of its serving signature
+// tensors.
+struct TensorflowModel : public BackendModel {
+  int64_t GetMemoryBytes() const override { return memory_bytes; }
+
+  tensorflow::SavedModelBundle bundle;
+  std::string input_tensor_name;
+  std::string output_tensor_name;
+  // Size of the graph and the variables of the model on disk, about the
+  // memory the weights take on the device.
+  int64_t memory_bytes = 0;
+};
+
+class TensorflowInferer : public BackendInferer {
  public:
-  TensorflowInferer() {
-    current_ = &buffers[0];
-    previous_ = &buffers[1];
-    preview_ = &buffers[2];
-  }
+  TensorflowInferer() : BackendInferer(arm_app::ModelConfig::TENSORFLOW) {}
 
-  virtual ~TensorflowInferer() {}
+  ~TensorflowInferer() override { StopModelCache(); }
 
-  virtual tensorflow::Status Initialize(ObjectiveLensPower objective,
-                                        ModelType model_type);
-  virtual cv::Mat GetImageBuffer(int width, int height);
-  virtual tensorflow::Status ProcessImage(cv::Mat* output);
-  virtual tensorflow::Status LoadModel(ObjectiveLensPower power,
-                                       ModelType model_type);
+  tensorflow::Status Initialize(ObjectiveLensPower objective,
+                                ModelType model_type) override;
 
-  // Returns PreviewProvider function, which returns the latest preview
-  // upon request.
-  PreviewProvider GetPreviewProvider() override;
+ protected:
+  tensorflow::Status LoadBackendModel(
+      const ModelRequest& request,
+      std::unique_ptr<CachedModel>* model) override;
+  tensorflow::Status RunModel() override;
+  tensorflow::Status RunWarmUpInference(const BackendModel& model) override;
+  int64_t GetDeviceMemoryBudget(const BackendModel& model) const override;
 
  private:
   void SetModelOptions();
-  tensorflow::Status SetTensorflowModel(const std::string& model_directory);
-  void MaybeCreateInputTensors();
 
-  void ProcessImageWithoutInference(cv::Mat* output);
+  std::unique_ptr<InputOutputBuffers> CreateBuffers() override {
+    return std::make_unique<InputOutputBuffersWithTensor>();
+  }
+
+  // Returns the buffers of the current frame, which CreateBuffers made.
+  InputOutputBuffersWithTensor* current_buffers() {
+    return static_cast<InputOutputBuffersWithTensor*>(current_.get());
+  }
+
+  // Returns the current model, which LoadBackendModel loaded.
+  const TensorflowModel& model() const {
+    return static_cast<const TensorflowModel&>(*model_);
+  }
 
+  // Options of the models, which the model cache loads them with until it is
+  // stopped.
   std::unordered_set<std::string> tags_;
   std::unique_ptr<tensorflow::SessionOptions> session_options_;
   tensorflow::RunOptions run_options_;
-
-  tensorflow::SavedModelBundle saved_model_bundle_;
-  std::string input_tensor_name_;
-  std::string output_tensor_name_;
-
- private:
-  // Input tensor, cv::Mat of input image as view of the tensor's part,
-  // and output heatmap. We keep 3 sets of these to minimize lock for preview.
-  // We have 2 threads, TensorFlow inference thread and preview thread.
-  // Inference thread swaps "current" with "previous" when the inference is
-  // finished. Preview thread swaps "previous" with "preview" and work on
-  // "preview". In this way, inference thread can work on "current" and preview
-  // thread can work on "preview" concurrently without waiting for the lock.
-  // The only lock we have is for swapping the data sets.
-  InputOutputBuffersWithTensor buffers[3];
-
-  InputOutputBuffersWithTensor* current_;
-  InputOutputBuffersWithTensor* previous_;
-  InputOutputBuffersWithTensor* preview_;
-
-  // Boolean for deciding whether to possibly create new input tensors for a
-  // newly loaded model.
-  bool new_input_tensors_needed_ = true;
 };
 
 }  // namespace image_processor
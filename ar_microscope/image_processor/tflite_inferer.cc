@@ -0,0 +1,270 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_processor/tflite_inferer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/flags/flag.h"
+#include "absl/strings/str_format.h"
+#include "image_processor/backend_inferer.h"
+#include "image_processor/inferer.h"
+#include "image_processor/model_cache.h"
+#include "image_processor/model_config_util.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/path.h"
+#include "tensorflow/lite/kernels/register.h"
+#include "tensorflow/lite/util.h"
+
+ABSL_FLAG(int, tflite_num_threads, 4,
+          "Number of threads that run the TensorFlow Lite models.");
+
+namespace image_processor {
+
+constexpr char kModelFilename[] = "model.tflite";
+
+namespace {
+
+// Bytes of the input buffers past the last pixel, which the XNNPACK kernels
+// may read with vector loads.
+constexpr int kInputPaddingBytes = 64;
+
+tensorflow::Status FromTfliteStatus(TfLiteStatus status,
+                                    const std::string& operation) {
+  if (status == kTfLiteOk) return tensorflow::Status();
+  return tensorflow::errors::Internal("TensorFlow Lite failed to ", operation);
+}
+
+// Returns an error unless the tensor holds uint8 values, or quantized int8
+// values.
+tensorflow::Status CheckTensorType(const TfLiteTensor& tensor) {
+  if (tensor.type == kTfLiteUInt8 ||
+      (tensor.type == kTfLiteInt8 && tensor.params.scale > 0)) {
+    return tensorflow::Status();
+  }
+  return tensorflow::errors::InvalidArgument(
+      absl::StrFormat("Unsupported type of tensor %s: %s", tensor.name,
+                      TfLiteTypeGetName(tensor.type)));
+}
+
+// Fills the tables that quantize the image for int8 inputs, and that convert
+// int8 outputs to the uint8 values the heatmaps are made of.
+tensorflow::Status CreateQuantizationTables(TfliteModel* model) {
+  const TfLiteTensor& input = *model->interpreter->input_tensor(0);
+  TF_RETURN_IF_ERROR(CheckTensorType(input));
+  if (input.type == kTfLiteInt8) {
+    model->input_table.resize(256);
+    for (int value = 0; value < 256; value++) {
+      const int quantized =
+          static_cast<int>(std::lround(value / input.params.scale)) +
+          input.params.zero_point;
+      model->input_table[value] = std::clamp(quantized, -128, 127);
+    }
+  }
+  const TfLiteTensor& output = *model->interpreter->output_tensor(0);
+  TF_RETURN_IF_ERROR(CheckTensorType(output));
+  if (output.type == kTfLiteInt8) {
+    model->output_table.resize(256);
+    for (int quantized = -128; quantized < 128; quantized++) {
+      const int value = static_cast<int>(std::lround(
+          output.params.scale * (quantized - output.params.zero_point)));
+      model->output_table[quantized + 128] = std::clamp(value, 0, 255);
+    }
+  }
+  return tensorflow::Status();
+}
+
+// Returns an estimate of the memory taken by the loaded model: the mapped model
+// file, the weights XNNPACK packs, which take about as much again, and the
+// tensors that are not mapped from the file. The tensors are an upper bound,
+// since the interpreter and XNNPACK plan the activations to share memory.
+int64_t GetTfliteModelBytes(const std::string& model_path,
+                            const tflite::Interpreter& interpreter) {
+  tensorflow::uint64 file_bytes = 0;
+  tensorflow::Env::Default()
+      ->GetFileSize(model_path, &file_bytes)
+      .IgnoreError();
+  int64_t tensor_bytes = 0;
+  const int num_tensors = static_cast<int>(interpreter.tensors_size());
+  for (int i = 0; i < num_tensors; i++) {
+    const TfLiteTensor* tensor = interpreter.tensor(i);
+    if (tensor->allocation_type != kTfLiteMmapRo) {
+      tensor_bytes += tensor->bytes;
+    }
+  }
+  return 2 * static_cast<int64_t>(file_bytes) + tensor_bytes;
+}
+
+}  // namespace
+
+void TfliteInputOutputBuffers::CreateTensor(int patch_size) {
+  this->patch_size = patch_size;
+  const int input_bytes = patch_size * patch_size * 3;
+  input_data.create(
+      1, input_bytes + tflite::kDefaultTensorAlignment + kInputPaddingBytes,
+      CV_8UC1);
+  input_data.setTo(0);
+  input_as_matrix = std::make_unique<cv::Mat>(
+      patch_size, patch_size, CV_8UC3,
+      cv::alignPtr(input_data.ptr(), tflite::kDefaultTensorAlignment));
+  // This is needed to avoid a dangling pointer to the old input_as_matrix.
+  input_image = nullptr;
+}
+
+tensorflow::Status TfliteInferer::RunModel() {
+  const TfliteModel& model = this->model();
+  CHECK(model.interpreter) << "TensorFlow Lite model not initialized";
+  CHECK(current_->patch_size == model.patch_size)
+      << "Patch size: " << current_->patch_size
+      << "  model patch size: " << model.patch_size;
+
+  tflite::Interpreter& interpreter = *model.interpreter;
+  const int input_index = interpreter.inputs()[0];
+  const cv::Mat& input_as_matrix = *current_->input_as_matrix;
+  const size_t input_bytes = input_as_matrix.total() * 3;
+  if (model.input_table.empty()) {
+    // The interpreter reads the image in place. Only the first buffer needs
+    // AllocateTensors to validate it; the buffers taken from the pool later
+    // only replace the pointer of the tensor, which XNNPACK reads on Invoke.
+    if (input_as_matrix.data != model.input_buffer) {
+      TF_RETURN_IF_ERROR(FromTfliteStatus(
+          interpreter.SetCustomAllocationForTensor(
+              input_index, {input_as_matrix.data, input_bytes}),
+          "assign the input buffer"));
+      if (model.input_buffer == nullptr) {
+        TF_RETURN_IF_ERROR(FromTfliteStatus(interpreter.AllocateTensors(),
+                                            "allocate tensors"));
+      }
+      model.input_buffer = input_as_matrix.data;
+    }
+  } else {
+    const uint8_t* image = input_as_matrix.ptr();
+    int8_t* input = interpreter.typed_tensor<int8_t>(input_index);
+    for (size_t i = 0; i < input_bytes; i++) {
+      input[i] = model.input_table[image[i]];
+    }
+  }
+
+  // Run TensorFlow Lite inference.
+  TF_RETURN_IF_ERROR(
+      FromTfliteStatus(interpreter.Invoke(), "run the model"));
+
+  // The output tensor has 4 dimensions, the batch of one image, y and x of
+  // the result heatmap image, and output category. The interpreter writes it
+  // again on the next inference, so it's copied to the buffers.
+  const TfLiteTensor& output_tensor = *interpreter.output_tensor(0);
+  const int height = output_tensor.dims->data[1];
+  const int width = output_tensor.dims->data[2];
+  const int depth = output_tensor.dims->data[3];  // Number of classes.
+  const int output_tensor_shape[] = {height, width, depth};
+  cv::Mat* output_values = GetReusableMat(&current_->output_tensor);
+  output_values->create(3, output_tensor_shape, CV_8UC1);
+  uint8_t* output_data = output_values->ptr();
+  const int num_values = height * width * depth;
+  if (model.output_table.empty()) {
+    std::memcpy(output_data, output_tensor.data.uint8, num_values);
+  } else {
+    const int8_t* quantized = output_tensor.data.int8;
+    for (int i = 0; i < num_values; i++) {
+      output_data[i] = model.output_table[quantized[i] + 128];
+    }
+  }
+  return tensorflow::Status();
+}
+
+tensorflow::Status TfliteInferer::RunWarmUpInference(
+    const BackendModel& model) {
+  const TfliteModel& tflite_model = static_cast<const TfliteModel&>(model);
+  // The warm-up runs before the input is assigned a frame buffer, so it
+  // writes the input tensor the interpreter allocated.
+  CHECK(tflite_model.input_buffer == nullptr);
+  TfLiteTensor* input = tflite_model.interpreter->input_tensor(0);
+  std::memset(input->data.raw,
+              tflite_model.input_table.empty() ? 0
+                                               : tflite_model.input_table[0],
+              input->bytes);
+  return FromTfliteStatus(tflite_model.interpreter->Invoke(),
+                          "run the model");
+}
+
+tensorflow::Status TfliteInferer::LoadBackendModel(
+    const ModelRequest& request, std::unique_ptr<CachedModel>* model) {
+  const std::string model_path =
+      tensorflow::io::JoinPath(request.model_directory, kModelFilename);
+  auto tflite_model = std::make_unique<TfliteModel>();
+  tflite_model->model =
+      tflite::FlatBufferModel::BuildFromFile(model_path.c_str());
+  if (!tflite_model->model) {
+    return tensorflow::errors::InvalidArgument("Failed to read ", model_path);
+  }
+  // The XNNPACK delegate is applied below, with the configured threads.
+  tflite::ops::builtin::BuiltinOpResolverWithoutDefaultDelegates resolver;
+  tflite::InterpreterBuilder(*tflite_model->model,
+                             resolver)(&tflite_model->interpreter);
+  if (!tflite_model->interpreter) {
+    return tensorflow::errors::InvalidArgument(
+        "Failed to create the interpreter of ", model_path);
+  }
+  tflite::Interpreter& interpreter = *tflite_model->interpreter;
+  if (interpreter.inputs().size() != 1 || interpreter.outputs().size() != 1) {
+    return tensorflow::errors::InvalidArgument(
+        "Expected a single input and output tensor: ", model_path);
+  }
+
+  // The input is resized to the patch size of the model before the delegate
+  // is applied, so that XNNPACK plans the graph for it once.
+  const int num_threads = absl::GetFlag(FLAGS_tflite_num_threads);
+  TF_RETURN_IF_ERROR(FromTfliteStatus(interpreter.SetNumThreads(num_threads),
+                                      "set the number of threads"));
+  tflite_model->patch_size =
+      GetPatchSize(request.key.model_type, request.key.objective);
+  TF_RETURN_IF_ERROR(FromTfliteStatus(
+      interpreter.ResizeInputTensor(
+          interpreter.inputs()[0],
+          {1, tflite_model->patch_size, tflite_model->patch_size, 3}),
+      "resize the input"));
+  TfLiteXNNPackDelegateOptions options = TfLiteXNNPackDelegateOptionsDefault();
+  options.num_threads = num_threads;
+  options.flags |=
+      TFLITE_XNNPACK_DELEGATE_FLAG_QS8 | TFLITE_XNNPACK_DELEGATE_FLAG_QU8;
+  tflite_model->delegate.reset(TfLiteXNNPackDelegateCreate(&options));
+  TF_RETURN_IF_ERROR(FromTfliteStatus(
+      interpreter.ModifyGraphWithDelegate(tflite_model->delegate.get()),
+      "apply the XNNPACK delegate"));
+  TF_RETURN_IF_ERROR(
+      FromTfliteStatus(interpreter.AllocateTensors(), "allocate tensors"));
+  const TfLiteIntArray* output_dims = interpreter.output_tensor(0)->dims;
+  if (output_dims->size != 4 || output_dims->data[0] != 1) {
+    return tensorflow::errors::InvalidArgument(
+        "Expected an output tensor of shape [1, height, width, classes]: ",
+        model_path);
+  }
+  TF_RETURN_IF_ERROR(CreateQuantizationTables(tflite_model.get()));
+
+  tflite_model->memory_bytes = GetTfliteModelBytes(model_path, interpreter);
+
+  LOG(INFO) << "Loaded " << model_path << " with " << num_threads
+            << " threads";
+  *model = std::move(tflite_model);
+  return tensorflow::Status();
+}
+
+}  // namespace image_processor
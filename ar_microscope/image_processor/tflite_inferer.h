@@ -0,0 +1,105 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+// Class to run TensorFlow Lite inference against the given image, on the CPU
+// with the XNNPACK delegate.
+
+#ifndef AR_MICROSCOPE_IMAGE_PROCESSOR_TFLITE_INFERER_H_
+#define AR_MICROSCOPE_IMAGE_PROCESSOR_TFLITE_INFERER_H_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "opencv2/core.hpp"
+#include "arm_app/arm_config.pb.h"
+#include "image_processor/backend_inferer.h"
+#include "image_processor/inferer.h"
+#include "image_processor/model_cache.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/lite/c/common.h"
+#include "tensorflow/lite/delegates/xnnpack/xnnpack_delegate.h"
+#include "tensorflow/lite/interpreter.h"
+#include "tensorflow/lite/model.h"
+
+namespace image_processor {
+
+// Input and output buffers for TensorFlow Lite inference. The interpreter
+// reads the input image of uint8 models in place, from the buffer of
+// input_as_matrix.
+struct TfliteInputOutputBuffers : public InputOutputBuffers {
+  virtual ~TfliteInputOutputBuffers() {}
+
+  // Buffer of input_as_matrix, which starts at an aligned address within it,
+  // and is padded for the vector loads that read past the last pixel.
+  cv::Mat input_data;
+
+  void CreateTensor(int patch_size) override;
+};
+
+// TensorFlow Lite model with its interpreter, which runs on XNNPACK for the
+// patch size of the model.
+struct TfliteModel : public BackendModel {
+  int64_t GetMemoryBytes() const override { return memory_bytes; }
+
+  // Declared in the order the interpreter needs them destroyed.
+  std::unique_ptr<tflite::FlatBufferModel> model;
+  std::unique_ptr<TfLiteDelegate, void (*)(TfLiteDelegate*)> delegate = {
+      nullptr, TfLiteXNNPackDelegateDelete};
+  std::unique_ptr<tflite::Interpreter> interpreter;
+  // For int8 inputs, the quantized value of each image value. Empty for uint8
+  // inputs.
+  std::vector<int8_t> input_table;
+  // For int8 outputs, the uint8 value of each quantized value + 128, as the
+  // SavedModels output it. Empty for uint8 outputs.
+  std::vector<uint8_t> output_table;
+  // Estimated memory of the model, see GetTfliteModelBytes.
+  int64_t memory_bytes = 0;
+  // Image buffer the interpreter reads uint8 inputs from, or nullptr before
+  // the first inference. Only the inference thread uses it.
+  mutable const void* input_buffer = nullptr;
+};
+
+class TfliteInferer : public BackendInferer {
+ public:
+  TfliteInferer() : BackendInferer(arm_app::ModelConfig::TFLITE) {}
+
+  ~TfliteInferer() override { StopModelCache(); }
+
+ protected:
+  tensorflow::Status LoadBackendModel(
+      const ModelRequest& request,
+      std::unique_ptr<CachedModel>* model) override;
+  tensorflow::Status RunModel() override;
+  tensorflow::Status RunWarmUpInference(const BackendModel& model) override;
+
+ private:
+  std::unique_ptr<InputOutputBuffers> CreateBuffers() override {
+    return std::make_unique<TfliteInputOutputBuffers>();
+  }
+
+  // Returns the buffers of the current frame, which CreateBuffers made.
+  TfliteInputOutputBuffers* current_buffers() {
+    return static_cast<TfliteInputOutputBuffers*>(current_.get());
+  }
+
+  // Returns the current model, which LoadBackendModel loaded.
+  const TfliteModel& model() const {
+    return static_cast<const TfliteModel&>(*model_);
+  }
+};
+
+}  // namespace image_processor
+
+#endif  // AR_MICROSCOPE_IMAGE_PROCESSOR_TFLITE_INFERER_H_
@@ -0,0 +1,110 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_processor/worker_pool.h"
+
+#include <algorithm>
+#include <memory>
+#include <thread>  // NOLINT
+
+#include "absl/synchronization/mutex.h"
+
+namespace image_processor {
+
+WorkerPool::WorkerPool(int num_threads) {
+  for (int i = 1; i < num_threads; i++) {
+    workers_.push_back(
+        std::make_unique<std::thread>([this]() { WorkerLoop(); }));
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    absl::MutexLock unused_lock(&mutex_);
+    to_exit_ = true;
+    job_available_.SignalAll();
+  }
+  for (auto& worker : workers_) {
+    worker->join();
+  }
+}
+
+void WorkerPool::ParallelFor(int total, int band_size,
+                             const BandFunction& band_function) {
+  if (total <= 0) return;
+  band_size = std::max(band_size, 1);
+  if (workers_.empty() || total <= band_size) {
+    band_function(0, total);
+    return;
+  }
+
+  absl::MutexLock unused_job_lock(&job_mutex_);
+  {
+    absl::MutexLock unused_lock(&mutex_);
+    band_function_ = &band_function;
+    total_ = total;
+    band_size_ = band_size;
+    next_band_.store(0);
+    job_id_++;
+    job_available_.SignalAll();
+  }
+
+  RunBands(band_function, total, band_size);
+
+  // All bands are taken at this point, but workers may still be processing
+  // theirs. Workers that wake up after this see no job.
+  absl::MutexLock unused_lock(&mutex_);
+  band_function_ = nullptr;
+  while (busy_workers_ > 0) {
+    job_finished_.Wait(&mutex_);
+  }
+}
+
+void WorkerPool::WorkerLoop() {
+  int64_t last_job_id = 0;
+  absl::MutexLock unused_lock(&mutex_);
+  while (true) {
+    while (!to_exit_ && job_id_ == last_job_id) {
+      job_available_.Wait(&mutex_);
+    }
+    if (to_exit_) return;
+    last_job_id = job_id_;
+    if (band_function_ == nullptr) {
+      // The job finished before this worker woke up.
+      continue;
+    }
+
+    const BandFunction* band_function = band_function_;
+    const int total = total_;
+    const int band_size = band_size_;
+    busy_workers_++;
+    mutex_.Unlock();
+    RunBands(*band_function, total, band_size);
+    mutex_.Lock();
+    if (--busy_workers_ == 0) {
+      job_finished_.SignalAll();
+    }
+  }
+}
+
+void WorkerPool::RunBands(const BandFunction& band_function, int total,
+                          int band_size) {
+  while (true) {
+    const int begin = next_band_.fetch_add(1) * band_size;
+    if (begin >= total) return;
+    band_function(begin, std::min(begin + band_size, total));
+  }
+}
+
+}  // namespace image_processor
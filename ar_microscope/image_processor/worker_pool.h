@@ -0,0 +1,85 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#ifndef AR_MICROSCOPE_IMAGE_PROCESSOR_WORKER_POOL_H_
+#define AR_MICROSCOPE_IMAGE_PROCESSOR_WORKER_POOL_H_
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "absl/synchronization/mutex.h"
+
+namespace image_processor {
+
+// Function to process the range [begin, end) of a parallel-for.
+using BandFunction = std::function<void(int begin, int end)>;
+
+// Pool of long-lived worker threads for per-frame image kernels. Workers are
+// parked between jobs, so that running a job doesn't pay for thread creation.
+// The work is split into bands that idle workers take one at a time, so
+// uneven bands and slow workers don't leave the other workers waiting.
+class WorkerPool {
+ public:
+  // Creates the pool. num_threads is the number of threads that run a job,
+  // including the calling thread, so num_threads - 1 workers are started.
+  explicit WorkerPool(int num_threads);
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  // Returns the number of threads that run a job, including the caller.
+  int GetNumThreads() const { return workers_.size() + 1; }
+
+  // Splits [0, total) into bands of band_size, and calls band_function once
+  // for each band. The calling thread processes bands as well, and this
+  // returns after all bands are processed. Jobs from multiple callers run one
+  // after another.
+  void ParallelFor(int total, int band_size,
+                   const BandFunction& band_function);
+
+ private:
+  void WorkerLoop();
+
+  // Processes bands of the current job until none is left.
+  void RunBands(const BandFunction& band_function, int total, int band_size);
+
+  std::vector<std::unique_ptr<std::thread>> workers_;
+
+  // Held by ParallelFor for the whole job.
+  absl::Mutex job_mutex_;
+
+  // Protects the job description and the worker states below.
+  absl::Mutex mutex_;
+  absl::CondVar job_available_;
+  absl::CondVar job_finished_;
+  const BandFunction* band_function_ = nullptr;
+  int total_ = 0;
+  int band_size_ = 0;
+  // Incremented for each job, so that parked workers notice a new job.
+  int64_t job_id_ = 0;
+  // Number of workers processing bands of the current job.
+  int busy_workers_ = 0;
+  bool to_exit_ = false;
+
+  // Index of the next band to process in the current job.
+  std::atomic_int next_band_{0};
+};
+
+}  // namespace image_processor
+
+#endif  // AR_MICROSCOPE_IMAGE_PROCESSOR_WORKER_POOL_H_
@@ -0,0 +1,75 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "image_processor/worker_pool.h"
+
+#include <atomic>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+using image_processor::WorkerPool;
+
+using ::testing::Each;
+using ::testing::Eq;
+
+TEST(WorkerPoolTest, CoversEveryIndexOnce) {
+  WorkerPool pool(4);
+  // Total is not divisible by the band size nor the number of threads.
+  std::vector<std::atomic_int> visits(1003);
+  pool.ParallelFor(visits.size(), 7, [&visits](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      visits[i]++;
+    }
+  });
+  for (const auto& visit : visits) {
+    ASSERT_THAT(visit.load(), Eq(1));
+  }
+}
+
+TEST(WorkerPoolTest, ReusedForManyJobs) {
+  WorkerPool pool(3);
+  std::vector<int> sums;
+  for (int job = 0; job < 100; job++) {
+    std::atomic_int sum{0};
+    pool.ParallelFor(job, 2, [&sum](int begin, int end) {
+      for (int i = begin; i < end; i++) {
+        sum += i;
+      }
+    });
+    sums.push_back(sum.load() - job * (job - 1) / 2);
+  }
+  ASSERT_THAT(sums, Each(Eq(0)));
+}
+
+TEST(WorkerPoolTest, SingleThread) {
+  WorkerPool pool(1);
+  ASSERT_THAT(pool.GetNumThreads(), Eq(1));
+  int calls = 0;
+  pool.ParallelFor(10, 3, [&calls](int begin, int end) { calls++; });
+  // Without workers the caller processes the whole range at once.
+  ASSERT_THAT(calls, Eq(1));
+}
+
+TEST(WorkerPoolTest, EmptyRange) {
+  WorkerPool pool(2);
+  int calls = 0;
+  pool.ParallelFor(0, 3, [&calls](int begin, int end) { calls++; });
+  ASSERT_THAT(calls, Eq(0));
+}
+
+}  // namespace
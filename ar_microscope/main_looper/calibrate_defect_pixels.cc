@@ -0,0 +1,115 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+// Finds the hot and dead pixels of the sensor, and writes the defect pixel map
+// to --defect_pixel_map, where the app loads it at startup. The operator is
+// prompted to move to a blank area of a slide, and then to block the light
+// path.
+
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "opencv2/core.hpp"
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/str_format.h"
+#include "image_captor/image_captor_factory.h"
+#include "image_processor/defect_map.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/core/status.h"
+
+ABSL_FLAG(int, num_defect_calibration_frames, 16,
+          "Number of frames averaged for each of the flat frame and the dark "
+          "frame.");
+ABSL_FLAG(double, hot_pixel_threshold, 0.05,
+          "Minimum excess of a hot pixel over its neighbours in the dark "
+          "frame, as a fraction of the full scale.");
+ABSL_FLAG(double, dead_pixel_threshold, 0.5,
+          "Maximum ratio of the response to light of a dead pixel to that of "
+          "its neighbours. Pixels above the inverse ratio are stuck.");
+
+extern absl::Flag<std::string> FLAGS_defect_pixel_map;
+
+namespace main_looper {
+namespace {
+
+void WaitForOperator(const std::string& instruction) {
+  std::cout << instruction << " Press Enter to continue." << std::endl;
+  std::string line;
+  std::getline(std::cin, line);
+}
+
+tensorflow::Status CaptureFrames(
+    image_captor::ImageCaptor* captor, bool dark,
+    image_processor::DefectMapCalibrator* calibrator) {
+  cv::Mat bayer_image;
+  for (int i = 0; i < absl::GetFlag(FLAGS_num_defect_calibration_frames);
+       i++) {
+    TF_RETURN_IF_ERROR(captor->GetBayerImage(&bayer_image));
+    TF_RETURN_IF_ERROR(dark ? calibrator->AddDarkFrame(bayer_image)
+                            : calibrator->AddFlatFrame(bayer_image));
+  }
+  return tensorflow::Status();
+}
+
+tensorflow::Status CalibrateDefectPixels() {
+  const std::string path = absl::GetFlag(FLAGS_defect_pixel_map);
+  if (path.empty()) {
+    return tensorflow::errors::InvalidArgument(
+        "--defect_pixel_map is not set.");
+  }
+
+  // The map is in the coordinates of the full readout of the sensor.
+  auto captor = absl::WrapUnique(image_captor::ImageCaptorFactory::Create());
+  TF_RETURN_IF_ERROR(captor->Initialize());
+  image_processor::DefectMapCalibrator calibrator(
+      absl::GetFlag(FLAGS_hot_pixel_threshold),
+      absl::GetFlag(FLAGS_dead_pixel_threshold));
+
+  WaitForOperator("Move the slide to a blank area in focus.");
+  TF_RETURN_IF_ERROR(CaptureFrames(captor.get(), /*dark=*/false, &calibrator));
+
+  // Hot pixels grow with the exposure time, so the dark frame is captured
+  // with the exposure of the flat frame, with auto-exposure off.
+  const int exposure_time = captor->GetExposureTimeInMicroseconds();
+  if (exposure_time > 0) {
+    TF_RETURN_IF_ERROR(captor->SetExposureTime(exposure_time));
+  }
+  WaitForOperator("Block the light path of the microscope.");
+  TF_RETURN_IF_ERROR(CaptureFrames(captor.get(), /*dark=*/true, &calibrator));
+  TF_RETURN_IF_ERROR(captor->Finalize());
+
+  std::unique_ptr<image_processor::DefectMap> defect_map;
+  TF_RETURN_IF_ERROR(calibrator.Detect(&defect_map));
+  TF_RETURN_IF_ERROR(defect_map->Save(path));
+  LOG(INFO) << "Wrote " << defect_map->GetNumDefects() << " defect pixels to "
+            << path;
+  return tensorflow::Status();
+}
+
+}  // namespace
+}  // namespace main_looper
+
+int main(int argc, char* argv[]) {
+  absl::ParseCommandLine(argc, argv);
+  const tensorflow::Status status = main_looper::CalibrateDefectPixels();
+  if (!status.ok()) {
+    LOG(ERROR) << status;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
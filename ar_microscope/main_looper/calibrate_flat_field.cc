@@ -0,0 +1,114 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+// Captures the flat-field and dark-frame calibration of an objective, and
+// writes it to --flat_field_dir, where the app loads it at startup. The
+// operator is prompted to move to a blank area of a slide, and then to block
+// the light path.
+
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "opencv2/core.hpp"
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/str_format.h"
+#include "image_captor/image_captor_factory.h"
+#include "image_processor/flat_field.h"
+#include "image_processor/inferer.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/core/status.h"
+
+ABSL_FLAG(std::string, objective, "",
+          "Objective to calibrate: 2x, 4x, 10x, 20x or 40x.");
+ABSL_FLAG(int, num_calibration_frames, 16,
+          "Number of frames averaged for each of the flat field and the dark "
+          "frame.");
+
+extern absl::Flag<std::string> FLAGS_flat_field_dir;
+
+namespace main_looper {
+namespace {
+
+void WaitForOperator(const std::string& instruction) {
+  std::cout << instruction << " Press Enter to continue." << std::endl;
+  std::string line;
+  std::getline(std::cin, line);
+}
+
+tensorflow::Status CaptureFrames(
+    image_captor::ImageCaptor* captor, bool dark,
+    image_processor::FlatFieldCalibrator* calibrator) {
+  cv::Mat bayer_image;
+  for (int i = 0; i < absl::GetFlag(FLAGS_num_calibration_frames); i++) {
+    TF_RETURN_IF_ERROR(captor->GetBayerImage(&bayer_image));
+    TF_RETURN_IF_ERROR(dark ? calibrator->AddDarkFrame(bayer_image)
+                            : calibrator->AddFlatFrame(bayer_image));
+  }
+  return tensorflow::Status();
+}
+
+tensorflow::Status CalibrateFlatField() {
+  const std::string objective = absl::GetFlag(FLAGS_objective);
+  if (image_processor::StringToObjective(objective) ==
+      image_processor::ObjectiveLensPower::UNSPECIFIED_OBJECTIVE_LENS_POWER) {
+    return tensorflow::errors::InvalidArgument(
+        absl::StrFormat("Invalid --objective: %s", objective));
+  }
+  const std::string directory = absl::GetFlag(FLAGS_flat_field_dir);
+  if (directory.empty()) {
+    return tensorflow::errors::InvalidArgument("--flat_field_dir is not set.");
+  }
+
+  auto captor = absl::WrapUnique(image_captor::ImageCaptorFactory::Create());
+  TF_RETURN_IF_ERROR(captor->Initialize());
+  image_processor::FlatFieldCalibrator calibrator;
+
+  WaitForOperator(absl::StrFormat(
+      "Move the slide to a blank area in focus with the %s objective.",
+      objective));
+  TF_RETURN_IF_ERROR(CaptureFrames(captor.get(), /*dark=*/false, &calibrator));
+
+  // The dark current depends on the exposure time, so the dark frame is
+  // captured with the exposure of the flat field, with auto-exposure off.
+  const int exposure_time = captor->GetExposureTimeInMicroseconds();
+  if (exposure_time > 0) {
+    TF_RETURN_IF_ERROR(captor->SetExposureTime(exposure_time));
+  }
+  WaitForOperator("Block the light path of the microscope.");
+  TF_RETURN_IF_ERROR(CaptureFrames(captor.get(), /*dark=*/true, &calibrator));
+  TF_RETURN_IF_ERROR(captor->Finalize());
+
+  const std::string path =
+      image_processor::GetFlatFieldPath(directory, objective);
+  TF_RETURN_IF_ERROR(calibrator.Save(path));
+  LOG(INFO) << "Wrote flat-field calibration " << path;
+  return tensorflow::Status();
+}
+
+}  // namespace
+}  // namespace main_looper
+
+int main(int argc, char* argv[]) {
+  absl::ParseCommandLine(argc, argv);
+  const tensorflow::Status status = main_looper::CalibrateFlatField();
+  if (!status.ok()) {
+    LOG(ERROR) << status;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
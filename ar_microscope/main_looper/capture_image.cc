@@ -20,21 +20,48 @@
 #include <QMessageBox>
 #include <QPainter>
 #include <QStandardPaths>
+#include <algorithm>
 #include <atomic>
 #include <chrono>  // NOLINT
+#include <cmath>
 #include <cstdio>
+#include <fstream>
+#include <iostream>
 #include <memory>
+#include <string>
 #include <thread>  // NOLINT
+#include <vector>
 
 #include "opencv2/imgcodecs.hpp"
 #include "opencv2/imgproc.hpp"
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 #include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_join.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
 #include "image_captor/image_captor_factory.h"
 #include "tensorflow/core/lib/core/errors.h"
 #include "tensorflow/core/lib/core/status.h"
 
+ABSL_FLAG(int, benchmark_frames, 0,
+          "Runs the headless capture benchmark for this number of frames, "
+          "instead of the viewer.");
+ABSL_FLAG(double, benchmark_seconds, 0,
+          "Runs the headless capture benchmark for this duration, instead of "
+          "the viewer. With --benchmark_frames, whichever ends first.");
+ABSL_FLAG(int, benchmark_warmup_frames, 10,
+          "Frames captured before the benchmark measures, which are not "
+          "counted.");
+ABSL_FLAG(bool, benchmark_async_capture, false,
+          "Captures the benchmark frames on a dedicated thread, as "
+          "--async_capture.");
+ABSL_FLAG(std::string, benchmark_output, "",
+          "File the JSON results of the benchmark are written to, or stdout "
+          "if empty.");
+
 namespace main_looper {
 
 void ImageViewer::SetImage(cv::Mat* image) {
@@ -115,7 +142,6 @@ class ImageCaptureLooper {
  private:
   tensorflow::Status CaptureSingleImage() {
     auto image = std::make_unique<cv::Mat>();
-    auto bayer_image = std::make_unique<cv::Mat>();
     VLOG(1) << "Capturing Image";
     TF_RETURN_IF_ERROR(captor_->GetImage(true, image.get()));
     image_viewer_->SetImage(image.release());
@@ -135,6 +161,166 @@ class ImageCaptureLooper {
   std::unique_ptr<std::thread> thread_;
 };
 
+// Percentiles of the durations of a stage of the capture.
+struct StageSummary {
+  absl::Duration mean = absl::ZeroDuration();
+  absl::Duration p50 = absl::ZeroDuration();
+  absl::Duration p90 = absl::ZeroDuration();
+  absl::Duration p99 = absl::ZeroDuration();
+  absl::Duration max = absl::ZeroDuration();
+};
+
+StageSummary SummarizeStage(std::vector<absl::Duration> durations) {
+  StageSummary summary;
+  if (durations.empty()) return summary;
+  std::sort(durations.begin(), durations.end());
+  absl::Duration total = absl::ZeroDuration();
+  for (const absl::Duration duration : durations) {
+    total += duration;
+  }
+  const size_t last = durations.size() - 1;
+  summary.mean = total / durations.size();
+  summary.p50 = durations[last * 50 / 100];
+  summary.p90 = durations[last * 90 / 100];
+  summary.p99 = durations[last * 99 / 100];
+  summary.max = durations.back();
+  return summary;
+}
+
+std::string StageSummaryToJson(const StageSummary& summary) {
+  return absl::StrFormat(
+      "{\"mean_ms\": %.3f, \"p50_ms\": %.3f, \"p90_ms\": %.3f, "
+      "\"p99_ms\": %.3f, \"max_ms\": %.3f}",
+      absl::ToDoubleMilliseconds(summary.mean),
+      absl::ToDoubleMilliseconds(summary.p50),
+      absl::ToDoubleMilliseconds(summary.p90),
+      absl::ToDoubleMilliseconds(summary.p99),
+      absl::ToDoubleMilliseconds(summary.max));
+}
+
+// Standard deviation of the durations, in milliseconds.
+double GetJitterMilliseconds(const std::vector<absl::Duration>& durations) {
+  if (durations.size() < 2) return 0;
+  double sum = 0;
+  double sum_of_squares = 0;
+  for (const absl::Duration duration : durations) {
+    const double milliseconds = absl::ToDoubleMilliseconds(duration);
+    sum += milliseconds;
+    sum_of_squares += milliseconds * milliseconds;
+  }
+  const double mean = sum / durations.size();
+  return std::sqrt(
+      std::max(0.0, sum_of_squares / durations.size() - mean * mean));
+}
+
+// Captures and debayers images as fast as the captor allows, into a single
+// reused image, and writes the throughput and the durations of the stages as
+// JSON, so that cameras and hosts can be qualified, and the capture tracked
+// on replayed recordings.
+tensorflow::Status RunCaptureBenchmark() {
+  auto captor = absl::WrapUnique(image_captor::ImageCaptorFactory::Create());
+  TF_RETURN_IF_ERROR(captor->Initialize());
+  const bool async_capture = absl::GetFlag(FLAGS_benchmark_async_capture);
+  if (async_capture) {
+    TF_RETURN_IF_ERROR(captor->StartAsyncCapture(/*is_rgb=*/true));
+  }
+  cv::Mat image;
+  for (int i = 0; i < absl::GetFlag(FLAGS_benchmark_warmup_frames); i++) {
+    TF_RETURN_IF_ERROR(captor->GetImage(/*is_rgb=*/true, &image));
+  }
+
+  const int max_frames = absl::GetFlag(FLAGS_benchmark_frames);
+  const double max_seconds = absl::GetFlag(FLAGS_benchmark_seconds);
+  const absl::Time end_time =
+      max_seconds > 0 ? absl::Now() + absl::Seconds(max_seconds)
+                      : absl::InfiniteFuture();
+  std::vector<absl::Duration> capture_waits;
+  std::vector<absl::Duration> debayer_durations;
+  std::vector<absl::Duration> frame_durations;
+  std::vector<absl::Duration> frame_intervals;
+  if (max_frames > 0) {
+    capture_waits.reserve(max_frames);
+    debayer_durations.reserve(max_frames);
+    frame_durations.reserve(max_frames);
+    frame_intervals.reserve(max_frames);
+  }
+  const int64_t first_frame_id = captor->GetLastFrameInfo().id;
+  const int64_t first_dropped_frames =
+      async_capture ? 0 : captor->GetNumDroppedFrames();
+  absl::Time last_capture_time = captor->GetLastFrameInfo().capture_time;
+  const absl::Time start_time = absl::Now();
+  absl::Time now = start_time;
+  int num_frames = 0;
+  while ((max_frames <= 0 || num_frames < max_frames) && now < end_time) {
+    TF_RETURN_IF_ERROR(captor->GetImage(/*is_rgb=*/true, &image));
+    const absl::Time frame_start_time = now;
+    now = absl::Now();
+    const image_captor::FrameInfo& frame_info = captor->GetLastFrameInfo();
+    capture_waits.push_back(frame_info.capture_wait);
+    debayer_durations.push_back(frame_info.debayer_duration);
+    frame_durations.push_back(now - frame_start_time);
+    if (last_capture_time != absl::InfinitePast()) {
+      frame_intervals.push_back(frame_info.capture_time - last_capture_time);
+    }
+    last_capture_time = frame_info.capture_time;
+    num_frames++;
+  }
+  const absl::Duration elapsed = now - start_time;
+  // Frames captured but replaced by newer ones before GetImage.
+  const int64_t skipped_frames =
+      captor->GetLastFrameInfo().id - first_frame_id - num_frames;
+  captor->StopAsyncCapture();
+  // The count of the device is from the start with the asynchronous capture,
+  // as it can't be read while the capture thread runs.
+  const int64_t device_dropped_frames =
+      captor->GetNumDroppedFrames() - first_dropped_frames;
+  absl::Duration total_capture_wait = absl::ZeroDuration();
+  for (const absl::Duration capture_wait : capture_waits) {
+    total_capture_wait += capture_wait;
+  }
+
+  const std::vector<std::string> fields = {
+      absl::StrFormat("\"frames\": %d", num_frames),
+      absl::StrFormat("\"seconds\": %.3f", absl::ToDoubleSeconds(elapsed)),
+      absl::StrFormat("\"frames_per_second\": %.3f",
+                      elapsed > absl::ZeroDuration()
+                          ? num_frames / absl::ToDoubleSeconds(elapsed)
+                          : 0.0),
+      absl::StrFormat("\"async_capture\": %s",
+                      async_capture ? "true" : "false"),
+      absl::StrFormat("\"image_width\": %d", image.cols),
+      absl::StrFormat("\"image_height\": %d", image.rows),
+      absl::StrFormat("\"skipped_frames\": %d", skipped_frames),
+      absl::StrFormat("\"device_dropped_frames\": %d", device_dropped_frames),
+      absl::StrFormat("\"total_capture_wait_seconds\": %.3f",
+                      absl::ToDoubleSeconds(total_capture_wait)),
+      absl::StrFormat("\"frame_interval_jitter_ms\": %.3f",
+                      GetJitterMilliseconds(frame_intervals)),
+      absl::StrFormat("\"capture_wait\": %s",
+                      StageSummaryToJson(SummarizeStage(capture_waits))),
+      absl::StrFormat("\"debayer\": %s",
+                      StageSummaryToJson(SummarizeStage(debayer_durations))),
+      absl::StrFormat("\"frame\": %s",
+                      StageSummaryToJson(SummarizeStage(frame_durations))),
+      absl::StrFormat("\"frame_interval\": %s",
+                      StageSummaryToJson(SummarizeStage(frame_intervals))),
+  };
+  const std::string json =
+      absl::StrCat("{\n  ", absl::StrJoin(fields, ",\n  "), "\n}\n");
+  const std::string output_path = absl::GetFlag(FLAGS_benchmark_output);
+  if (output_path.empty()) {
+    std::cout << json;
+  } else {
+    std::ofstream output(output_path);
+    output << json;
+    if (!output) {
+      return tensorflow::errors::Internal(
+          absl::StrFormat("Failed to write %s.", output_path));
+    }
+  }
+  return captor->Finalize();
+}
+
 int CaptureImages(int argc, char* argv[]) {
   QApplication application(argc, argv);
   ImageViewerMainWindow window;
@@ -155,5 +341,14 @@ int CaptureImages(int argc, char* argv[]) {
 
 int main(int argc, char* argv[]) {
   absl::ParseCommandLine(argc, argv);
+  if (absl::GetFlag(FLAGS_benchmark_frames) > 0 ||
+      absl::GetFlag(FLAGS_benchmark_seconds) > 0) {
+    const tensorflow::Status status = main_looper::RunCaptureBenchmark();
+    if (!status.ok()) {
+      LOG(ERROR) << status;
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+  }
   return main_looper::CaptureImages(argc, argv);
 }
@@ -0,0 +1,186 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+// Measures the latency of the pipeline from the sensor to the display, without
+// a camera or a display. The light pulse of --capture_device=replay with
+// --replay_pulse_period stands in for a light source switched on and off in
+// front of the sensor, and a headless display stands in for a photodiode on
+// the microdisplay: it detects the pulse in the images it is given where the
+// app paints their heatmaps. With --latency_config_file, the images go through
+// the inference of the model, as in the app.
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "opencv2/core.hpp"
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/str_format.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "arm_app/arm_config.h"
+#include "image_captor/image_captor_factory.h"
+#include "image_captor/replay_captor.h"
+#include "image_processor/inferer.h"
+#include "image_processor/multi_backend_inferer.h"
+#include "microdisplay_server/inference_timings.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/core/status.h"
+
+ABSL_FLAG(int, latency_frames, 600, "Number of images to display.");
+ABSL_FLAG(bool, latency_async_capture, true,
+          "Captures the images on a dedicated thread, as --async_capture.");
+ABSL_FLAG(std::string, latency_config_file, "",
+          "ArmConfigProto textproto file with the model configs. Images are "
+          "displayed without inference if empty.");
+ABSL_FLAG(std::string, latency_objective, "10x",
+          "Objective of the model: 2x, 4x, 10x, 20x or 40x.");
+ABSL_FLAG(std::string, latency_model_type, "lymph",
+          "Model type: lymph, prostate, mitotic or cervical.");
+
+namespace main_looper {
+namespace {
+
+using microdisplay_server::FrameLatencies;
+
+// Display without a screen, which detects the light pulse in the images it
+// shows.
+class HeadlessDisplay {
+ public:
+  void Show(const cv::Mat& image, const image_captor::FrameInfo& frame_info) {
+    const absl::Time present_time = absl::Now();
+    frame_latencies_.AddPresentedFrame(frame_info.id, frame_info.capture_time,
+                                       present_time);
+    // The pulse saturates the whole image, so a pixel tells its state.
+    const bool pulse_on =
+        image.at<cv::Vec3b>(image.rows / 2, image.cols / 2)[1] > 0x7f;
+    if (pulse_on != pulse_on_) {
+      pulse_on_ = pulse_on;
+      pulse_edges_.push_back(present_time);
+    }
+  }
+
+  const FrameLatencies& GetFrameLatencies() const { return frame_latencies_; }
+
+  // Returns the times the pulse was seen switching, alternately from off.
+  const std::vector<absl::Time>& GetPulseEdges() const { return pulse_edges_; }
+
+ private:
+  bool pulse_on_ = false;
+  std::vector<absl::Time> pulse_edges_;
+  FrameLatencies frame_latencies_{/*log_stats=*/false};
+};
+
+void PrintSummary(const std::string& name,
+                  const FrameLatencies::Summary& summary) {
+  std::cout << absl::StrFormat(
+                   "%s: %d samples, mean %.2f ms, median %.2f ms, 99th "
+                   "percentile %.2f ms, max %.2f ms",
+                   name, summary.num_frames,
+                   absl::ToDoubleMilliseconds(summary.mean),
+                   absl::ToDoubleMilliseconds(summary.median),
+                   absl::ToDoubleMilliseconds(summary.p99),
+                   absl::ToDoubleMilliseconds(summary.max))
+            << std::endl;
+}
+
+tensorflow::Status RunLatencyBenchmark() {
+  // Destroyed after the captor, whose asynchronous capture writes into the
+  // input buffers of the inferer.
+  std::unique_ptr<image_processor::Inferer> inferer;
+  auto captor = absl::WrapUnique(image_captor::ImageCaptorFactory::Create());
+  auto* replay_captor = dynamic_cast<image_captor::ReplayCaptor*>(captor.get());
+  if (!replay_captor) {
+    return tensorflow::errors::InvalidArgument(
+        "The benchmark requires --capture_device=replay.");
+  }
+  TF_RETURN_IF_ERROR(captor->Initialize());
+
+  const std::string config_file = absl::GetFlag(FLAGS_latency_config_file);
+  if (!config_file.empty()) {
+    TF_RETURN_IF_ERROR(arm_app::GetArmConfig().Initialize(
+        config_file, /*custom_config_filepath=*/""));
+    inferer = std::make_unique<image_processor::MultiBackendInferer>();
+    TF_RETURN_IF_ERROR(inferer->Initialize(
+        image_processor::StringToObjective(
+            absl::GetFlag(FLAGS_latency_objective)),
+        image_processor::StringToModelType(
+            absl::GetFlag(FLAGS_latency_model_type))));
+    std::cout << "Model warm-up: "
+              << absl::FormatDuration(inferer->GetModelWarmUpDuration())
+              << std::endl;
+  }
+
+  if (absl::GetFlag(FLAGS_latency_async_capture)) {
+    TF_RETURN_IF_ERROR(captor->StartAsyncCapture(/*is_rgb=*/true));
+  }
+  HeadlessDisplay display;
+  cv::Mat image;
+  cv::Mat heatmap;
+  for (int i = 0; i < absl::GetFlag(FLAGS_latency_frames); i++) {
+    if (inferer) {
+      image = inferer->GetImageBuffer(captor->GetImageWidth(),
+                                      captor->GetImageHeight());
+    }
+    TF_RETURN_IF_ERROR(captor->GetImage(/*is_rgb=*/true, &image));
+    if (inferer) {
+      inferer->UseImageBuffer(&image);
+      TF_RETURN_IF_ERROR(inferer->ProcessImage(&heatmap));
+    }
+    display.Show(image, captor->GetLastFrameInfo());
+  }
+  captor->StopAsyncCapture();
+
+  // The edges are paired in order, which holds as long as half of the pulse
+  // period is longer than the latency.
+  const std::vector<absl::Time> sensor_edges = replay_captor->GetPulseEdges();
+  const std::vector<absl::Time>& display_edges = display.GetPulseEdges();
+  FrameLatencies pulse_latencies(/*log_stats=*/false);
+  const int num_edges = std::min(static_cast<int>(sensor_edges.size()),
+                                 static_cast<int>(display_edges.size()));
+  for (int i = 0; i < num_edges; i++) {
+    pulse_latencies.AddPresentedFrame(i + 1, sensor_edges[i], display_edges[i]);
+  }
+  const FrameLatencies::Summary frame_summary =
+      display.GetFrameLatencies().Summarize();
+  PrintSummary("Capture to display", frame_summary);
+  std::cout << absl::StrFormat("Frames captured but not displayed: %d",
+                               frame_summary.num_skipped_frames)
+            << std::endl;
+  if (pulse_latencies.Summarize().num_frames == 0) {
+    std::cout << "No light pulse detected. Set --replay_pulse_period."
+              << std::endl;
+  } else {
+    PrintSummary("Light pulse to display", pulse_latencies.Summarize());
+  }
+  return captor->Finalize();
+}
+
+}  // namespace
+}  // namespace main_looper
+
+int main(int argc, char* argv[]) {
+  absl::ParseCommandLine(argc, argv);
+  const tensorflow::Status status = main_looper::RunLatencyBenchmark();
+  if (!status.ok()) {
+    LOG(ERROR) << status;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
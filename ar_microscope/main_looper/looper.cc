@@ -14,21 +14,32 @@
 // =============================================================================
 #include "main_looper/looper.h"
 
+#include <algorithm>
 #include <chrono>  // NOLINT
 #include <cmath>
 #include <cstdlib>
 #include <memory>
 #include <thread>  // NOLINT
+#include <vector>
 
 #include "opencv2/core.hpp"
 #include "absl/flags/flag.h"
 #include "absl/memory/memory.h"
 #include "absl/strings/str_format.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "arm_app/arm_config.h"
+#include "arm_app/arm_config.pb.h"
 #include "arm_app/microdisplay.h"
 #include "arm_app/previewer.h"
 #include "image_captor/image_captor_factory.h"
+#include "image_captor/readout_mode.h"
+#include "image_processor/debayer.h"
+#include "image_processor/defect_map.h"
+#include "image_processor/flat_field.h"
 #include "image_processor/inferer.h"
-#include "image_processor/tensorflow_inferer.h"
+#include "image_processor/model_config_util.h"
+#include "image_processor/multi_backend_inferer.h"
 #include "microdisplay_server/inference_timings.h"
 #include "tensorflow/core/lib/core/errors.h"
 
@@ -38,18 +49,126 @@ ABSL_FLAG(
     int, initial_brightness, 50,
     "Initial target auto-exposure brightness as a percentage in [0, 100]. ");
 
+ABSL_FLAG(bool, debayer_field_of_view, true,
+          "Only debayer the pixels inside the circular field of view of "
+          "--image_size, which the heatmap is masked to, and pad the rest. "
+          "The padded corners are also in the test snapshots.");
+ABSL_FLAG(bool, readout_field_of_view, true,
+          "Only read out the window of the sensor of the predicted area of "
+          "--image_size. The test snapshots, and the recordings of cameras "
+          "that window in hardware, are cropped to it. The full resolution "
+          "debayer modes always window the readout.");
+
+ABSL_FLAG(bool, async_capture, true,
+          "Captures and debayers the images on a dedicated thread, so that "
+          "capture overlaps with inference, which starts on the newest image.");
+
+ABSL_FLAG(double, change_threshold, 2.0,
+          "Largest mean luma difference of a 16x16 pixel cell, in [0, 255], "
+          "of the images below which the field of view has not changed since "
+          "the last inference, and its heatmap is reused. Inference runs on "
+          "every image if 0.");
+ABSL_FLAG(int32_t, max_heatmap_staleness, 1000,
+          "Maximum age in milliseconds of a reused heatmap.");
+
+ABSL_FLAG(std::string, record_file, "",
+          "Records the raw Bayer frames to the file, for replay with "
+          "--capture_device=replay. Frames are not recorded if empty.");
+ABSL_FLAG(int64_t, record_max_frames, 1000,
+          "Number of frames the recording is preallocated for. Frames after "
+          "these are dropped.");
+ABSL_FLAG(int, record_buffers, 8,
+          "Number of frames that may wait to be written to the recording. "
+          "Frames are dropped while all of them are waiting.");
+
+extern absl::Flag<std::string> FLAGS_flat_field_dir;
+extern absl::Flag<std::string> FLAGS_defect_pixel_map;
+extern absl::Flag<int> FLAGS_image_size;
 extern absl::Flag<std::string> FLAGS_server_socket_name;
 extern absl::Flag<bool> FLAGS_test_mode;
-extern absl::Flag<int32_t> FLAGS_preview_delay;
+extern absl::Flag<std::string> FLAGS_log_directory;
 
 namespace main_looper {
 namespace {
 
+using image_captor::ReadoutMode;
+using image_captor::Subsampling;
 using image_processor::ModelType;
 using image_processor::ObjectiveLensPower;
 
-// Preview cycles to wait for new settings to take effect.
-constexpr int kPreviewWaitCycles = 2;
+// Directory of the snapshots in --log_directory.
+constexpr char kSnapshotDir[] = "snapshots";
+
+// Number of test snapshots that may wait to be written.
+constexpr int kMaxQueuedSnapshots = 16;
+
+image_processor::DebayerMode ToDebayerMode(
+    arm_app::ModelConfig::DebayerMode debayer_mode) {
+  switch (debayer_mode) {
+    case arm_app::ModelConfig::BILINEAR:
+      return image_processor::DebayerMode::BILINEAR;
+    case arm_app::ModelConfig::MALVAR_HE_CUTLER:
+      return image_processor::DebayerMode::MALVAR_HE_CUTLER;
+    default:
+      return image_processor::DebayerMode::HALF;
+  }
+}
+
+// Logs the channel means and the fraction of saturated pixels of the image
+// captured with the exposure time.
+void LogChannelStatistics(
+    int exposure_time, const image_processor::ChannelStatistics& statistics) {
+  if (statistics.num_pixels == 0) {
+    return;
+  }
+  double saturated[3];
+  for (int channel = 0; channel < 3; channel++) {
+    saturated[channel] =
+        static_cast<double>(statistics.histograms[channel].back()) /
+        statistics.num_pixels;
+  }
+  LOG(INFO) << absl::StrFormat(
+      "Exposure time %d us: mean RGB (%.1f, %.1f, %.1f), saturated RGB "
+      "(%.4f, %.4f, %.4f)",
+      exposure_time, statistics.means[0], statistics.means[1],
+      statistics.means[2], saturated[0], saturated[1], saturated[2]);
+}
+
+// Derives the calibration of the readout mode from the flat field of the
+// whole sensor, which is captured at full readout. The gains of binned pixels
+// are averaged, which approximates the gain of their mean.
+tensorflow::Status ReadOutFlatField(
+    const image_processor::FlatField& flat_field, const ReadoutMode& mode,
+    std::unique_ptr<image_processor::FlatField>* output) {
+  cv::Mat dark_frame;
+  TF_RETURN_IF_ERROR(image_captor::ApplyReadoutMode(flat_field.GetDarkFrame(),
+                                                    mode, &dark_frame));
+  cv::Mat gain_map;
+  TF_RETURN_IF_ERROR(image_captor::ApplyReadoutMode(flat_field.GetGainMap(),
+                                                    mode, &gain_map));
+  return image_processor::FlatField::Create(
+      dark_frame, gain_map, flat_field.GetBytesPerPixel(), output);
+}
+
+// Maps the defects of the whole sensor to the Bayer image of the readout mode.
+// Binned pixels that average a defect are defects too.
+tensorflow::Status ReadOutDefectMap(
+    const image_processor::DefectMap& defect_map, const ReadoutMode& mode,
+    std::unique_ptr<image_processor::DefectMap>* output) {
+  TF_RETURN_IF_ERROR(image_captor::CheckReadoutMode(
+      mode, defect_map.GetWidth(), defect_map.GetHeight()));
+  const cv::Size size = image_captor::GetReadoutSize(
+      mode, defect_map.GetWidth(), defect_map.GetHeight());
+  std::vector<cv::Point> defects;
+  for (const cv::Point& defect : defect_map.GetDefects()) {
+    cv::Point pixel;
+    if (image_captor::MapSensorPixel(mode, defect, &pixel)) {
+      defects.push_back(pixel);
+    }
+  }
+  return image_processor::DefectMap::Create(size.width, size.height,
+                                            std::move(defects), output);
+}
 
 }  // namespace
 
@@ -63,10 +182,11 @@ Looper::Looper(ObjectiveLensPower objective, ModelType model_type,
       microdisplay_(microdisplay),
       display_warning_callback_(display_warning_callback) {
   UpdateModelDisplayConfigs();
-  inferer_ = std::make_unique<image_processor::TensorflowInferer>();
+  inferer_ = std::make_unique<image_processor::MultiBackendInferer>();
   const auto inferer_init_status = inferer_->Initialize(objective, model_type);
   if (inferer_init_status.ok()) {
     LOG(INFO) << "Initialized inferer.";
+    timings_.SetModelWarmUp(inferer_->GetModelWarmUpDuration());
   } else {
     LOG(WARNING) << inferer_init_status;
   }
@@ -79,7 +199,27 @@ Looper::Looper(ObjectiveLensPower objective, ModelType model_type,
         absl::GetFlag(FLAGS_initial_brightness)))
         << "Image captor could not set initial auto exposure brightness.";
   }
+  UpdateDebayerMode();
+  LoadFlatFields();
+  UpdateFlatField();
+  LoadDefectMap();
+  UpdateDefectMap();
+  // The channel statistics are logged with the test snapshots.
+  image_captor_->SetCollectStatistics(absl::GetFlag(FLAGS_test_mode));
+  const std::string record_file = absl::GetFlag(FLAGS_record_file);
+  if (!record_file.empty()) {
+    const auto record_status = image_captor_->StartRecording(
+        record_file, absl::GetFlag(FLAGS_record_max_frames),
+        absl::GetFlag(FLAGS_record_buffers));
+    if (record_status.ok()) {
+      LOG(INFO) << "Recording raw frames to " << record_file;
+    } else {
+      LOG(ERROR) << "Failed to start recording: " << record_status;
+    }
+  }
+  StartAsyncCapture();
   LOG(INFO) << "Initialized image captor.";
+  snapshot_writer_ = std::make_unique<SnapshotWriter>(kMaxQueuedSnapshots);
 
   previewer_->SetProvider(inferer_->GetPreviewProvider());
   previewer_->Start();
@@ -106,6 +246,7 @@ void Looper::Stop() {
   to_exit_.store(true);
   thread_->join();
   thread_.reset();
+  image_captor_->StopAsyncCapture();
 }
 
 void Looper::SetObjectiveAndModelType(ObjectiveLensPower objective,
@@ -116,6 +257,203 @@ void Looper::SetObjectiveAndModelType(ObjectiveLensPower objective,
   current_model_type_ = model_type;
 }
 
+void Looper::UpdateDebayerMode() {
+  const arm_app::ModelConfig& model_config =
+      arm_app::GetArmConfig().GetModelConfig(current_model_type_,
+                                             current_objective_);
+  image_processor::DebayerMode debayer_mode =
+      ToDebayerMode(model_config.debayer_mode());
+  image_captor_->SetDebayerMode(debayer_mode);
+  UpdateReadoutMode(model_config, debayer_mode);
+  // The image is padded into the input patch of the model, which the full
+  // resolution image does not fit in if the readout could not be windowed.
+  const int patch_size =
+      image_processor::GetPatchSize(current_model_type_, current_objective_);
+  if (debayer_mode != image_processor::DebayerMode::HALF &&
+      (image_captor_->GetImageWidth() >= patch_size ||
+       image_captor_->GetImageHeight() >= patch_size)) {
+    LOG(WARNING) << "Full resolution image of "
+                 << image_captor_->GetImageWidth() << "x"
+                 << image_captor_->GetImageHeight()
+                 << " does not fit in the patch size " << patch_size
+                 << ", falling back to the half debayer.";
+    debayer_mode = image_processor::DebayerMode::HALF;
+    image_captor_->SetDebayerMode(debayer_mode);
+    UpdateReadoutMode(model_config, debayer_mode);
+  }
+  UpdateFieldOfView();
+}
+
+void Looper::UpdateReadoutMode(const arm_app::ModelConfig& model_config,
+                               image_processor::DebayerMode debayer_mode) {
+  image_captor::ReadoutMode mode;
+  const int factor = std::max<int>(model_config.readout_downsampling(), 1);
+  if (factor > 1) {
+    const image_captor::ReadoutCapabilities capabilities =
+        image_captor_->GetReadoutCapabilities();
+    // Binning keeps more signal than decimation, and is emulated when the
+    // camera does neither.
+    mode.subsampling = Subsampling::BINNING;
+    if (!capabilities.SupportsSubsampling(Subsampling::BINNING, factor) &&
+        capabilities.SupportsSubsampling(Subsampling::DECIMATION, factor)) {
+      mode.subsampling = Subsampling::DECIMATION;
+    }
+    mode.factor = factor;
+  }
+  // Only the predicted area of --image_size, centered in the image, is
+  // debayered, so the rest of the sensor is not read out. The full resolution
+  // image of the whole sensor does not fit in the input patch, so it is always
+  // windowed.
+  if (absl::GetFlag(FLAGS_readout_field_of_view) ||
+      debayer_mode != image_processor::DebayerMode::HALF) {
+    const int alignment = 2 * factor;
+    const int sensor_pixels_per_image_pixel =
+        factor * (debayer_mode == image_processor::DebayerMode::HALF ? 2 : 1);
+    const int size = (absl::GetFlag(FLAGS_image_size) *
+                          sensor_pixels_per_image_pixel +
+                      alignment - 1) /
+                     alignment * alignment;
+    const int sensor_width = image_captor_->GetSensorWidth();
+    const int sensor_height = image_captor_->GetSensorHeight();
+    const int width = std::min(size, sensor_width / alignment * alignment);
+    const int height = std::min(size, sensor_height / alignment * alignment);
+    if (width < sensor_width || height < sensor_height) {
+      mode.roi = cv::Rect((sensor_width - width) / 2 / alignment * alignment,
+                          (sensor_height - height) / 2 / alignment * alignment,
+                          width, height);
+    }
+  }
+  const tensorflow::Status status = image_captor_->SetReadoutMode(mode);
+  if (!status.ok()) {
+    LOG(WARNING) << "Failed to set the readout mode: " << status;
+  }
+}
+
+void Looper::UpdateFieldOfView() {
+  if (!absl::GetFlag(FLAGS_debayer_field_of_view)) {
+    return;
+  }
+  // The image is centered in the inference input, and the heatmap mask is the
+  // circle inscribed in the predicted area of --image_size.
+  image_captor_->SetFieldOfView(
+      std::make_shared<image_processor::FieldOfView>(
+          image_captor_->GetImageWidth(), image_captor_->GetImageHeight(),
+          absl::GetFlag(FLAGS_image_size)));
+}
+
+void Looper::LoadFlatFields() {
+  const std::string directory = absl::GetFlag(FLAGS_flat_field_dir);
+  if (directory.empty()) {
+    return;
+  }
+  for (ObjectiveLensPower objective :
+       {ObjectiveLensPower::OBJECTIVE_2x, ObjectiveLensPower::OBJECTIVE_4x,
+        ObjectiveLensPower::OBJECTIVE_10x, ObjectiveLensPower::OBJECTIVE_20x,
+        ObjectiveLensPower::OBJECTIVE_40x}) {
+    const std::string path = image_processor::GetFlatFieldPath(
+        directory, image_processor::ObjectiveToString(objective));
+    std::unique_ptr<image_processor::FlatField> flat_field;
+    const tensorflow::Status status =
+        image_processor::FlatField::Load(path, &flat_field);
+    if (!status.ok()) {
+      LOG(INFO) << "No flat field for "
+                << image_processor::ObjectiveToString(objective) << ": "
+                << status;
+      continue;
+    }
+    flat_fields_[objective] = std::move(flat_field);
+  }
+}
+
+void Looper::StartAsyncCapture() {
+  if (!absl::GetFlag(FLAGS_async_capture)) {
+    return;
+  }
+  const auto status = image_captor_->StartAsyncCapture(/*is_rgb=*/true);
+  if (!status.ok()) {
+    LOG(ERROR) << "Failed to start asynchronous capture: " << status;
+  }
+}
+
+void Looper::UpdateFlatField() {
+  const auto it = flat_fields_.find(current_objective_);
+  if (it == flat_fields_.end()) {
+    image_captor_->SetFlatField(nullptr);
+    return;
+  }
+  if (it->second->GetWidth() != image_captor_->GetSensorWidth() ||
+      it->second->GetHeight() != image_captor_->GetSensorHeight()) {
+    LOG(WARNING) << "Flat field of "
+                 << image_processor::ObjectiveToString(current_objective_)
+                 << " does not match the sensor, ignoring.";
+    image_captor_->SetFlatField(nullptr);
+    return;
+  }
+  // The flat field is calibrated at full readout, and derived for the others.
+  const ReadoutMode& mode = image_captor_->GetReadoutMode();
+  if (mode == ReadoutMode()) {
+    image_captor_->SetFlatField(it->second);
+    return;
+  }
+  std::unique_ptr<image_processor::FlatField> flat_field;
+  const tensorflow::Status status =
+      ReadOutFlatField(*it->second, mode, &flat_field);
+  if (!status.ok()) {
+    LOG(WARNING) << "Flat field of "
+                 << image_processor::ObjectiveToString(current_objective_)
+                 << " could not be derived for the readout mode, ignoring: "
+                 << status;
+    image_captor_->SetFlatField(nullptr);
+    return;
+  }
+  image_captor_->SetFlatField(std::move(flat_field));
+}
+
+void Looper::LoadDefectMap() {
+  const std::string path = absl::GetFlag(FLAGS_defect_pixel_map);
+  if (path.empty()) {
+    return;
+  }
+  std::unique_ptr<image_processor::DefectMap> defect_map;
+  const tensorflow::Status status =
+      image_processor::DefectMap::Load(path, &defect_map);
+  if (!status.ok()) {
+    LOG(ERROR) << "Failed to load the defect pixel map: " << status;
+    return;
+  }
+  if (defect_map->GetWidth() != image_captor_->GetSensorWidth() ||
+      defect_map->GetHeight() != image_captor_->GetSensorHeight()) {
+    LOG(ERROR) << "Defect pixel map of " << defect_map->GetWidth() << "x"
+               << defect_map->GetHeight()
+               << " does not match the sensor, ignoring.";
+    return;
+  }
+  LOG(INFO) << "Loaded " << defect_map->GetNumDefects()
+            << " defect pixels from " << path;
+  defect_map_ = std::move(defect_map);
+}
+
+void Looper::UpdateDefectMap() {
+  // The defects are mapped on the whole sensor, and derived for the other
+  // readout modes.
+  const ReadoutMode& mode = image_captor_->GetReadoutMode();
+  if (!defect_map_ || mode == ReadoutMode()) {
+    image_captor_->SetDefectMap(defect_map_);
+    return;
+  }
+  std::unique_ptr<image_processor::DefectMap> defect_map;
+  const tensorflow::Status status =
+      ReadOutDefectMap(*defect_map_, mode, &defect_map);
+  if (!status.ok()) {
+    LOG(WARNING) << "Defect pixel map could not be derived for the readout "
+                    "mode, ignoring: "
+                 << status;
+    image_captor_->SetDefectMap(nullptr);
+    return;
+  }
+  image_captor_->SetDefectMap(std::move(defect_map));
+}
+
 void Looper::UpdateModelDisplayConfigs() {
   previewer_->UpdateHeatmapConfigForModel(current_model_type_,
                                           current_objective_);
@@ -124,6 +462,7 @@ void Looper::UpdateModelDisplayConfigs() {
 }
 
 tensorflow::Status Looper::LoopOnce() {
+  StartPendingBracket();
   heatmap_ = std::make_unique<microdisplay_server::Heatmap>();
   microdisplay_server::InferenceTimings::SetTimingCheckpoint(
       microdisplay_server::InferenceCheckpoint::PREPARE, heatmap_.get());
@@ -136,11 +475,25 @@ tensorflow::Status Looper::LoopOnce() {
         microdisplay_server::InferenceTimings::SetTimingCheckpoint(
             microdisplay_server::InferenceCheckpoint::DEBAYER, heatmap_.get());
       }));
+  inferer_->UseImageBuffer(&debayered_image);
+  const image_captor::FrameInfo& frame_info =
+      image_captor_->GetLastFrameInfo();
+  heatmap_->set_frame_id(frame_info.id);
+  heatmap_->set_capture_timestamp_microseconds(
+      absl::ToUnixMicros(frame_info.capture_time));
+  heatmap_->set_exposure_time_microseconds(
+      frame_info.exposure_time_microseconds);
   microdisplay_server::InferenceTimings::SetTimingCheckpoint(
       microdisplay_server::InferenceCheckpoint::INFERENCE, heatmap_.get());
 
   cv::Mat heatmap_image;
-  TF_RETURN_IF_ERROR(inferer_->ProcessImage(&heatmap_image));
+  // The snapshots of the exposure bracket are always inferred.
+  if (!IsFieldUnchanged(debayered_image) || frame_info.bracket_step >= 0 ||
+      !inferer_->ReuseLastOutput(&heatmap_image).ok()) {
+    TF_RETURN_IF_ERROR(inferer_->ProcessImage(&heatmap_image));
+    change_detector_.UpdateReference();
+    last_inference_time_ = absl::Now();
+  }
   microdisplay_server::InferenceTimings::SetTimingCheckpoint(
       microdisplay_server::InferenceCheckpoint::DISPLAY_HEATMAP,
       heatmap_.get());
@@ -154,29 +507,63 @@ tensorflow::Status Looper::LoopOnce() {
       microdisplay_server::InferenceCheckpoint::END, heatmap_.get());
   timings_.AddTiming(*heatmap_);
 
+  if (bracket_) {
+    if (frame_info.bracket_step >= 0) {
+      WriteBracketSnapshot(frame_info, debayered_image, heatmap_image);
+    } else if (!image_captor_->IsBracketingExposure()) {
+      LOG(WARNING) << "Test snapshots interrupted.";
+      FinishBracket();
+    }
+  }
+
   if (should_update_model_.load()) {
     absl::MutexLock model_lock(&model_lock_);
     should_update_model_.store(false);
     const auto load_model_status =
         inferer_->LoadModel(current_objective_, current_model_type_);
+    change_detector_.Reset();
+    // The captor settings only change while the captor is idle.
+    image_captor_->StopAsyncCapture();
     if (load_model_status.ok()) {
+      timings_.SetModelWarmUp(inferer_->GetModelWarmUpDuration());
       UpdateModelDisplayConfigs();
+      UpdateDebayerMode();
     } else {
       display_warning_callback_(load_model_status.ToString());
     }
+    // The calibration follows the objective, even without a model for it.
+    UpdateFlatField();
+    UpdateDefectMap();
+    StartAsyncCapture();
     return load_model_status;
   }
   return tensorflow::Status();
 }
 
+bool Looper::IsFieldUnchanged(const cv::Mat& image) {
+  const double threshold = absl::GetFlag(FLAGS_change_threshold);
+  if (threshold <= 0) {
+    return false;
+  }
+  const double difference = change_detector_.ComputeDifference(image);
+  return difference < threshold &&
+         absl::Now() - last_inference_time_ <
+             absl::Milliseconds(absl::GetFlag(FLAGS_max_heatmap_staleness));
+}
+
 void Looper::TakeTestSnapshots(ObjectiveLensPower objective,
                                ModelType model_type, int target_brightness,
                                const std::string& comment) {
   LOG(INFO) << "Taking test snapshots for ev_min, ev_max, ev_steps: " << ev_min_
             << ", " << ev_max_ << ", " << ev_steps_per_unit_;
 
+  auto bracket = std::make_unique<SnapshotBracket>();
+  bracket->objective = objective;
+  bracket->model_type = model_type;
+  bracket->target_brightness = target_brightness;
+  bracket->comment = comment;
   const auto now = std::chrono::system_clock::now().time_since_epoch();
-  const int epoch_seconds =
+  bracket->epoch_seconds =
       std::chrono::duration_cast<std::chrono::seconds>(now).count();
 
   int target_exposure_time = image_captor_->GetExposureTimeInMicroseconds();
@@ -187,8 +574,6 @@ void Looper::TakeTestSnapshots(ObjectiveLensPower objective,
   int total_ev_steps = (ev_max_ - ev_min_) * ev_steps_per_unit_ + 1;
   float ev_step_size = 1.0 / ev_steps_per_unit_;
   for (int i = 0; i < total_ev_steps; ++i) {
-    const auto snapshot_prefix =
-        absl::StrFormat("%d_%s_%02d", epoch_seconds, "te", i);
     float ev_delta = ev_step_size * i + ev_min_;
     // EV = AV + TV
     //   where EV is exposure value, AV is aperture number, and TV is log2(1 /
@@ -198,34 +583,72 @@ void Looper::TakeTestSnapshots(ObjectiveLensPower objective,
     // log2(1 / new_exposure_time) - log2(1 / target_exposure_time)
     //   and
     // new_exposure_time = target_exposure_time / 2^ev_delta
-    int sample_exposure_time =
-        static_cast<int>(target_exposure_time / std::exp2(ev_delta));
-    auto status = image_captor_->SetExposureTime(sample_exposure_time);
-    if (status.ok()) {
-      int preview_counter = previewer_->GetCounter();
-      while (previewer_->GetCounter() - preview_counter < kPreviewWaitCycles) {
-        // Wait for new preview.
-        std::this_thread::sleep_for(
-            std::chrono::milliseconds(absl::GetFlag(FLAGS_preview_delay)));
-      }
-      previewer_->TakeSnapshot(objective, model_type, sample_exposure_time,
-                               comment, snapshot_prefix);
-      preview_counter = previewer_->GetCounter();
-      while (previewer_->GetCounter() - preview_counter < kPreviewWaitCycles) {
-        // Wait for snapshot to be taken by previewer before moving to next
-        // exposure time.
-        std::this_thread::sleep_for(
-            std::chrono::milliseconds(absl::GetFlag(FLAGS_preview_delay)));
-      }
-    } else {
-      LOG(ERROR) << "Error setting exposure time: " << status;
-      continue;
-    }
+    bracket->exposure_times.push_back(
+        static_cast<int>(target_exposure_time / std::exp2(ev_delta)));
   }
-  auto ae_status = image_captor_->SetAutoExposureBrightness(target_brightness);
+  // The loop captures the bracket, one frame per exposure time.
+  absl::MutexLock unused_lock(&bracket_mutex_);
+  pending_bracket_ = std::move(bracket);
+}
+
+void Looper::StartPendingBracket() {
+  if (bracket_) {
+    return;
+  }
+  {
+    absl::MutexLock unused_lock(&bracket_mutex_);
+    bracket_ = std::move(pending_bracket_);
+  }
+  if (!bracket_) {
+    return;
+  }
+  const auto status =
+      image_captor_->StartExposureBracket(bracket_->exposure_times);
+  if (!status.ok()) {
+    LOG(ERROR) << "Error starting the exposure bracket: " << status;
+    FinishBracket();
+  }
+}
+
+void Looper::WriteBracketSnapshot(const image_captor::FrameInfo& frame_info,
+                                  const cv::Mat& image,
+                                  const cv::Mat& heatmap) {
+  const int exposure_time = frame_info.exposure_time_microseconds;
+  LogChannelStatistics(exposure_time, frame_info.channel_statistics);
+  SnapshotWriter::Snapshot snapshot;
+  snapshot.file_prefix = absl::StrFormat(
+      "%s/%s/%d_te_%02d_%s_%s", absl::GetFlag(FLAGS_log_directory),
+      kSnapshotDir, bracket_->epoch_seconds, frame_info.bracket_step,
+      image_processor::ModelTypeToString(bracket_->model_type),
+      image_processor::ObjectiveToString(bracket_->objective));
+  // The buffers are reused by the next loop.
+  snapshot.image = image.clone();
+  snapshot.heatmap = heatmap.clone();
+  snapshot.comment = bracket_->comment;
+  snapshot.metadata = absl::StrFormat(
+      "{model_version: %s, model_type: %s, objective: %s, target_brightness: "
+      "%d, timestamp: %d, exposure_time: %d, frame_id: %d}",
+      arm_app::GetArmConfig()
+          .GetModelConfig(bracket_->model_type, bracket_->objective)
+          .model_version(),
+      image_processor::ModelTypeToString(bracket_->model_type),
+      image_processor::ObjectiveToString(bracket_->objective),
+      bracket_->target_brightness, bracket_->epoch_seconds, exposure_time,
+      frame_info.id);
+  snapshot_writer_->Write(std::move(snapshot));
+  if (frame_info.bracket_step + 1 ==
+      static_cast<int>(bracket_->exposure_times.size())) {
+    FinishBracket();
+  }
+}
+
+void Looper::FinishBracket() {
+  auto ae_status =
+      image_captor_->SetAutoExposureBrightness(bracket_->target_brightness);
   if (!ae_status.ok()) {
     LOG(ERROR) << "Auto-exposure not reset correctly: " << ae_status;
   }
+  bracket_.reset();
 }
 
 void Looper::SetPositiveGleasonClasses(
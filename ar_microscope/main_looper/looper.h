@@ -21,13 +21,24 @@
 
 #include <atomic>
 #include <memory>
+#include <string>
 #include <thread>  // NOLINT
+#include <vector>
 
+#include "absl/container/flat_hash_map.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "arm_app/arm_config.pb.h"
 #include "arm_app/microdisplay.h"
 #include "arm_app/previewer.h"
 #include "image_captor/image_captor.h"
+#include "image_processor/change_detector.h"
+#include "image_processor/debayer.h"
+#include "image_processor/field_of_view.h"
+#include "image_processor/defect_map.h"
+#include "image_processor/flat_field.h"
 #include "image_processor/inferer.h"
+#include "main_looper/snapshot_writer.h"
 #include "microdisplay_server/heatmap.pb.h"
 #include "microdisplay_server/inference_timings.h"
 #include "tensorflow/core/lib/core/status.h"
@@ -60,7 +71,8 @@ class Looper {
   }
 
   // Takes multiple snapshots at different brightness settings. This is used for
-  // test snapshot collection.
+  // test snapshot collection. The loop captures one frame per exposure time,
+  // and the snapshots are written in the background.
   void TakeTestSnapshots(image_processor::ObjectiveLensPower objective,
                          image_processor::ModelType model_type,
                          int target_brightness, const std::string& comment);
@@ -83,13 +95,62 @@ class Looper {
 
  private:
   tensorflow::Status LoopOnce();
+  // Returns whether the field of view of the image has not changed since the
+  // last inference, which is recent enough for its heatmap to be reused.
+  bool IsFieldUnchanged(const cv::Mat& image);
+  // Starts the exposure bracket requested by TakeTestSnapshots, if any.
+  void StartPendingBracket();
+  // Queues the snapshot of a frame of the exposure bracket.
+  void WriteBracketSnapshot(const image_captor::FrameInfo& frame_info,
+                            const cv::Mat& image, const cv::Mat& heatmap);
+  // Restores auto-exposure after the exposure bracket.
+  void FinishBracket();
   void UpdateModelDisplayConfigs();
-
-  std::unique_ptr<image_captor::ImageCaptor> image_captor_;
+  // Sets the debayer and readout modes of the current model config to the
+  // image captor, falling back to the half debayer if the full resolution
+  // image does not fit in the input patch of the model.
+  void UpdateDebayerMode();
+  // Sets the cheapest readout mode of the model config and the debayer mode
+  // to the image captor.
+  void UpdateReadoutMode(const arm_app::ModelConfig& model_config,
+                         image_processor::DebayerMode debayer_mode);
+  // Sets the field of view of the image of the debayer mode to the image
+  // captor.
+  void UpdateFieldOfView();
+  // Loads the flat-field calibration files of the objectives that have one.
+  void LoadFlatFields();
+  // Sets the flat-field calibration of the current objective, derived for the
+  // readout mode, to the image captor.
+  void UpdateFlatField();
+  // Loads the defect pixel map of the sensor from --defect_pixel_map, if it
+  // matches the sensor.
+  void LoadDefectMap();
+  // Sets the defect pixel map, derived for the readout mode, to the image
+  // captor.
+  void UpdateDefectMap();
+  // Starts the asynchronous capture of the image captor, with
+  // --async_capture.
+  void StartAsyncCapture();
+
+  // The inferer outlives the captor, whose asynchronous capture writes into
+  // the input buffers of the inferer until it stops.
   std::unique_ptr<image_processor::Inferer> inferer_;
+  std::unique_ptr<image_captor::ImageCaptor> image_captor_;
   std::unique_ptr<microdisplay_server::Heatmap> heatmap_;
   microdisplay_server::InferenceTimings timings_;
 
+  // Thumbnail of the image of the last inference.
+  image_processor::ChangeDetector change_detector_;
+  absl::Time last_inference_time_ = absl::InfinitePast();
+
+  // Flat-field calibrations, mapped once at startup.
+  absl::flat_hash_map<image_processor::ObjectiveLensPower,
+                      std::shared_ptr<const image_processor::FlatField>>
+      flat_fields_;
+
+  // Defect pixel map of the sensor, or nullptr if there is none.
+  std::shared_ptr<const image_processor::DefectMap> defect_map_;
+
   // A flag indicating whether the model should be updated.
   std::atomic_bool should_update_model_ = {false};
   absl::Mutex model_lock_;
@@ -107,6 +168,23 @@ class Looper {
 
   DisplayWarningCallback display_warning_callback_;
 
+  // Exposure bracket of test snapshots.
+  struct SnapshotBracket {
+    image_processor::ObjectiveLensPower objective;
+    image_processor::ModelType model_type;
+    int target_brightness;
+    std::string comment;
+    int epoch_seconds;
+    std::vector<int> exposure_times;
+  };
+  // Bracket requested by TakeTestSnapshots, and the bracket the loop
+  // captures.
+  absl::Mutex bracket_mutex_;
+  std::unique_ptr<SnapshotBracket> pending_bracket_
+      ABSL_GUARDED_BY(bracket_mutex_);
+  std::unique_ptr<SnapshotBracket> bracket_;
+  std::unique_ptr<SnapshotWriter> snapshot_writer_;
+
   // Snapshot parameters for testing mode. These should match the initial values
   // in main_window.
   int ev_min_ = -3;
@@ -0,0 +1,100 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "main_looper/snapshot_writer.h"
+
+#include <fstream>
+#include <utility>
+
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/imgproc.hpp"
+#include "absl/strings/str_cat.h"
+#include "tensorflow/core/platform/logging.h"
+
+namespace main_looper {
+namespace {
+
+constexpr char kInputFilename[] = "input.png";
+constexpr char kHeatmapFilename[] = "heatmap.png";
+constexpr char kCommentFilename[] = "comment.txt";
+constexpr char kMetadataFilename[] = "metadata.txt";
+
+void StoreTextFile(const std::string& filename, const std::string& text) {
+  std::ofstream text_file(filename);
+  text_file << text << "\n";
+}
+
+void StoreSnapshot(const SnapshotWriter::Snapshot& snapshot) {
+  const std::string& prefix = snapshot.file_prefix;
+  StoreTextFile(absl::StrCat(prefix, "_", kCommentFilename), snapshot.comment);
+  StoreTextFile(absl::StrCat(prefix, "_", kMetadataFilename),
+                snapshot.metadata);
+  // OpenCV writes BGR images.
+  cv::Mat image_bgr;
+  cv::cvtColor(snapshot.image, image_bgr, cv::COLOR_RGB2BGR);
+  if (!cv::imwrite(absl::StrCat(prefix, "_", kInputFilename), image_bgr) ||
+      !cv::imwrite(absl::StrCat(prefix, "_", kHeatmapFilename),
+                   snapshot.heatmap)) {
+    LOG(ERROR) << "Failed to write the snapshot " << prefix;
+    return;
+  }
+  LOG(INFO) << "Stored a snapshot at " << prefix;
+}
+
+}  // namespace
+
+SnapshotWriter::SnapshotWriter(int max_queued) : max_queued_(max_queued) {
+  writer_ = std::make_unique<std::thread>([this]() { WriterLoop(); });
+}
+
+SnapshotWriter::~SnapshotWriter() {
+  {
+    absl::MutexLock unused_lock(&mutex_);
+    closing_ = true;
+    snapshot_queued_.Signal();
+  }
+  writer_->join();
+}
+
+bool SnapshotWriter::Write(Snapshot snapshot) {
+  absl::MutexLock unused_lock(&mutex_);
+  if (static_cast<int>(queued_snapshots_.size()) >= max_queued_) {
+    LOG(WARNING) << "Dropped the snapshot " << snapshot.file_prefix
+                 << ", the disk is too slow.";
+    return false;
+  }
+  queued_snapshots_.push_back(std::move(snapshot));
+  snapshot_queued_.Signal();
+  return true;
+}
+
+void SnapshotWriter::WriterLoop() {
+  while (true) {
+    Snapshot snapshot;
+    {
+      absl::MutexLock unused_lock(&mutex_);
+      while (queued_snapshots_.empty() && !closing_) {
+        snapshot_queued_.Wait(&mutex_);
+      }
+      if (queued_snapshots_.empty()) {
+        return;
+      }
+      snapshot = std::move(queued_snapshots_.front());
+      queued_snapshots_.pop_front();
+    }
+    StoreSnapshot(snapshot);
+  }
+}
+
+}  // namespace main_looper
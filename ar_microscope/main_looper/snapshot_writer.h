@@ -0,0 +1,72 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#ifndef AR_MICROSCOPE_MAIN_LOOPER_SNAPSHOT_WRITER_H_
+#define AR_MICROSCOPE_MAIN_LOOPER_SNAPSHOT_WRITER_H_
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT
+
+#include "opencv2/core.hpp"
+#include "absl/synchronization/mutex.h"
+
+namespace main_looper {
+
+// Writes snapshots of the loop on a dedicated thread, so that the capture and
+// the inference do not wait for the image encoding and the disk. The files
+// follow the naming of the snapshots of the previewer. Queuing a snapshot
+// never waits: when max_queued snapshots wait to be written, it is dropped.
+class SnapshotWriter {
+ public:
+  struct Snapshot {
+    // Path of the files of the snapshot, without the file name suffixes.
+    std::string file_prefix;
+    // Input image, in RGB.
+    cv::Mat image;
+    cv::Mat heatmap;
+    std::string comment;
+    std::string metadata;
+  };
+
+  explicit SnapshotWriter(int max_queued);
+
+  // Writes the queued snapshots before returning.
+  ~SnapshotWriter();
+
+  SnapshotWriter(const SnapshotWriter&) = delete;
+  SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+  // Queues the snapshot for writing. Its images must not be written by the
+  // caller afterwards. Returns false if the snapshot is dropped.
+  bool Write(Snapshot snapshot);
+
+ private:
+  // Writes the queued snapshots until the writer is destroyed.
+  void WriterLoop();
+
+  const int max_queued_;
+
+  std::unique_ptr<std::thread> writer_;
+
+  absl::Mutex mutex_;
+  absl::CondVar snapshot_queued_;
+  std::deque<Snapshot> queued_snapshots_ ABSL_GUARDED_BY(mutex_);
+  bool closing_ ABSL_GUARDED_BY(mutex_) = false;
+};
+
+}  // namespace main_looper
+
+#endif  // AR_MICROSCOPE_MAIN_LOOPER_SNAPSHOT_WRITER_H_
@@ -19,6 +19,7 @@
 #include "opencv2/imgproc.hpp"
 #include "absl/flags/flag.h"
 #include "arm_app/arm_config.h"
+#include "image_processor/field_of_view.h"
 #include "image_processor/inferer.h"
 
 ABSL_FLAG(int, relative_threshold, 96,
@@ -93,18 +94,15 @@ void HeatmapUtil::MaybePrepareMask(int width, int height) {
     return;
   }
 
-  mask_.reserve(width * height);
-  mask_.resize(0);
-  const double radius = std::max(width, height) / 2.0;
-  const double radius_square = radius * radius;
-  const double center_x = width / 2.0 - 0.5;
-  const double center_y = height / 2.0 - 0.5;
-
-  for (int x = 0; x < width; x++) {
-    for (int y = 0; y < height; y++) {
-      mask_.push_back(
-          DistanceSquare(x, y, center_x, center_y) > radius_square ? 0 : 0xff);
-    }
+  // The same circle as the field of view of the debayer, inscribed in the
+  // heatmap.
+  const image_processor::FieldOfView field_of_view(width, height,
+                                                   std::max(width, height));
+  mask_.assign(width * height, 0);
+  for (int y = 0; y < height; y++) {
+    const image_processor::RowSpan& span = field_of_view.GetSpan(y);
+    std::fill(mask_.begin() + y * width + span.begin,
+              mask_.begin() + y * width + span.end, 0xff);
   }
   CHECK(mask_.size() == width * height) << "Invalid mask generation";
   heatmap_width_ = width;
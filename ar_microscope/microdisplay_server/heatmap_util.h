@@ -82,11 +82,6 @@ class HeatmapUtil {
       std::vector<std::vector<cv::Point>>* contours,
       std::vector<cv::Vec4i>* hierarchy);
 
-  inline static double DistanceSquare(double x1, double y1, double x2,
-                                      double y2) {
-    return (x1 - x2) * (x1 - x2) + (y1 - y2) * (y1 - y2);
-  }
-
   // Cache of the mask to avoid repeated creation of heatmap mask. Note
   // heatmap size is constant as long as the model is the same.
   std::vector<uint8_t> mask_;
@@ -14,6 +14,7 @@
 // =============================================================================
 #include "microdisplay_server/inference_timings.h"
 
+#include <algorithm>
 
 #include "absl/flags/flag.h"
 #include "absl/strings/str_format.h"
@@ -56,6 +57,10 @@ void InferenceTimings::AddTiming(const Heatmap& heatmap) {
               << GetAverageDurationTime(InferenceCheckpoint::INFERENCE);
     LOG(INFO) << "    Display heatmap: "
               << GetAverageDurationTime(InferenceCheckpoint::DISPLAY_HEATMAP);
+    if (model_warm_up_ > absl::ZeroDuration()) {
+      LOG(INFO) << "  Model warm-up (once per load): "
+                << absl::ToInt64Milliseconds(model_warm_up_) << " ms";
+    }
     Clear();
   }
 }
@@ -93,4 +98,51 @@ std::string InferenceTimings::GetAverageDurationTime(
   }
 }
 
+void FrameLatencies::AddPresentedFrame(int64_t frame_id,
+                                       absl::Time capture_time,
+                                       absl::Time present_time) {
+  if (last_frame_id_ > 0 && frame_id > last_frame_id_ + 1) {
+    num_skipped_frames_ += frame_id - last_frame_id_ - 1;
+  }
+  last_frame_id_ = frame_id;
+  latencies_.push_back(present_time - capture_time);
+  if (!log_stats_ || static_cast<int>(latencies_.size()) <
+                         absl::GetFlag(FLAGS_show_stats_every_n)) {
+    return;
+  }
+  const Summary summary = Summarize();
+  LOG(INFO) << "Capture to display latency for " << summary.num_frames
+            << " frames, " << summary.num_skipped_frames << " skipped";
+  LOG(INFO) << "  Mean: " << absl::FormatDuration(summary.mean)
+            << ", median: " << absl::FormatDuration(summary.median)
+            << ", 99th percentile: " << absl::FormatDuration(summary.p99)
+            << ", max: " << absl::FormatDuration(summary.max);
+  Clear();
+}
+
+FrameLatencies::Summary FrameLatencies::Summarize() const {
+  Summary summary;
+  summary.num_frames = latencies_.size();
+  summary.num_skipped_frames = num_skipped_frames_;
+  if (latencies_.empty()) {
+    return summary;
+  }
+  std::vector<absl::Duration> sorted = latencies_;
+  std::sort(sorted.begin(), sorted.end());
+  absl::Duration total = absl::ZeroDuration();
+  for (const absl::Duration latency : sorted) {
+    total += latency;
+  }
+  summary.mean = total / summary.num_frames;
+  summary.median = sorted[sorted.size() / 2];
+  summary.p99 = sorted[(sorted.size() - 1) * 99 / 100];
+  summary.max = sorted.back();
+  return summary;
+}
+
+void FrameLatencies::Clear() {
+  num_skipped_frames_ = 0;
+  latencies_.clear();
+}
+
 }  // namespace microdisplay_server
@@ -15,6 +15,7 @@
 #ifndef AR_MICROSCOPE_MICRODISPLAY_SERVER_INFERENCE_TIMINGS_H_
 #define AR_MICROSCOPE_MICRODISPLAY_SERVER_INFERENCE_TIMINGS_H_
 
+#include <cstdint>
 #include <vector>
 
 #include "absl/time/time.h"
@@ -28,6 +29,9 @@ class InferenceTimings {
 
   void AddTiming(const Heatmap& heatmap);
 
+  // Sets the warm-up duration of the current model, shown with the stats.
+  void SetModelWarmUp(absl::Duration warm_up) { model_warm_up_ = warm_up; }
+
   static void SetTimingCheckpoint(InferenceCheckpoint::Type type,
                                   Heatmap* heatmap);
 
@@ -46,6 +50,45 @@ class InferenceTimings {
   // Therefore, steps_[0] is empty, since there's no timing for
   // UNSPECIFIED_CHECKPOINT.
   std::vector<absl::Duration> steps_;
+
+  // Warm-up duration of the current model. Not cleared with the stats.
+  absl::Duration model_warm_up_ = absl::ZeroDuration();
+};
+
+// Latencies from the capture of the frames to the presentation of their
+// heatmaps on the display. Unlike InferenceTimings, this includes the time the
+// frames wait before and after the loop.
+class FrameLatencies {
+ public:
+  struct Summary {
+    int64_t num_frames = 0;
+    // Frames captured between the presented frames, but never presented.
+    int64_t num_skipped_frames = 0;
+    absl::Duration mean = absl::ZeroDuration();
+    absl::Duration median = absl::ZeroDuration();
+    absl::Duration p99 = absl::ZeroDuration();
+    absl::Duration max = absl::ZeroDuration();
+  };
+
+  // If log_stats, the summary is logged and cleared every
+  // --show_stats_every_n frames.
+  explicit FrameLatencies(bool log_stats = true) : log_stats_(log_stats) {}
+
+  // Adds a frame presented at present_time. Frames must be presented in the
+  // order of their identifiers.
+  void AddPresentedFrame(int64_t frame_id, absl::Time capture_time,
+                         absl::Time present_time);
+
+  // Returns the summary of the frames since the last clear.
+  Summary Summarize() const;
+
+  void Clear();
+
+ private:
+  const bool log_stats_;
+  int64_t last_frame_id_ = 0;
+  int64_t num_skipped_frames_ = 0;
+  std::vector<absl::Duration> latencies_;
 };
 
 }  // namespace microdisplay_server
@@ -0,0 +1,64 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+#include "microdisplay_server/inference_timings.h"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/time/time.h"
+
+namespace {
+
+using microdisplay_server::FrameLatencies;
+
+using ::testing::DoubleNear;
+using ::testing::Eq;
+
+TEST(FrameLatenciesTest, Empty) {
+  FrameLatencies latencies(/*log_stats=*/false);
+  const FrameLatencies::Summary summary = latencies.Summarize();
+  EXPECT_THAT(summary.num_frames, Eq(0));
+  EXPECT_THAT(summary.max, Eq(absl::ZeroDuration()));
+}
+
+TEST(FrameLatenciesTest, Summarize) {
+  FrameLatencies latencies(/*log_stats=*/false);
+  const absl::Time start = absl::FromUnixSeconds(1000);
+  // Frames 1 to 100, with latencies of 1 to 100 ms, of which frames 11 to 20
+  // are not presented.
+  for (int frame = 1; frame <= 100; frame++) {
+    if (frame > 10 && frame <= 20) continue;
+    const absl::Time capture_time = start + absl::Milliseconds(10 * frame);
+    latencies.AddPresentedFrame(frame, capture_time,
+                                capture_time + absl::Milliseconds(frame));
+  }
+  FrameLatencies::Summary summary = latencies.Summarize();
+  EXPECT_THAT(summary.num_frames, Eq(90));
+  EXPECT_THAT(summary.num_skipped_frames, Eq(10));
+  EXPECT_THAT(absl::ToDoubleMilliseconds(summary.mean),
+              DoubleNear(4895.0 / 90, 1e-6));
+  EXPECT_THAT(summary.median, Eq(absl::Milliseconds(56)));
+  EXPECT_THAT(summary.p99, Eq(absl::Milliseconds(99)));
+  EXPECT_THAT(summary.max, Eq(absl::Milliseconds(100)));
+
+  // Skipped frames are counted from the last presented frame after a clear.
+  latencies.Clear();
+  latencies.AddPresentedFrame(103, start, start + absl::Milliseconds(5));
+  summary = latencies.Summarize();
+  EXPECT_THAT(summary.num_frames, Eq(1));
+  EXPECT_THAT(summary.num_skipped_frames, Eq(2));
+  EXPECT_THAT(summary.median, Eq(absl::Milliseconds(5)));
+}
+
+}  // namespace